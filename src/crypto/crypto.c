@@ -4,12 +4,14 @@
 
 #include <wolfssl/options.h>
 #include <wolfssl/ssl.h>
+#include <wolfssl/wolfcrypt/aes.h>
 #include <wolfssl/wolfcrypt/asn.h>
 #include <wolfssl/wolfcrypt/coding.h>
 #include <wolfssl/wolfcrypt/ecc.h>
 #include <wolfssl/wolfcrypt/ed25519.h>
 #include <wolfssl/wolfcrypt/error-crypt.h>
 #include <wolfssl/wolfcrypt/hash.h>
+#include <wolfssl/wolfcrypt/random.h>
 #include <wolfssl/wolfcrypt/settings.h>
 #include <wolfssl/wolfcrypt/sha256.h>
 #include <wolfssl/wolfcrypt/signature.h>
@@ -95,6 +97,96 @@ int lua_hmac(lua_State *L) {
     return 1;
 }
 
+#define GCM_IV_SIZE 12
+#define GCM_TAG_SIZE 16
+
+/* Encrypts the message with AES-GCM, the key must be 16, 24 or 32 bytes long.
+   Returns `iv .. tag .. ciphertext`, with a random IV. */
+int lua_aes_gcm_encrypt(lua_State *L) {
+    size_t key_size, msg_size, aad_size = 0;
+    const char *key = luaL_checklstring(L, 1, &key_size);
+    const char *msg = luaL_checklstring(L, 2, &msg_size);
+    const char *aad = luaL_optlstring(L, 3, NULL, &aad_size);
+    if (key_size != 16 && key_size != 24 && key_size != 32) {
+        RETURN_CUSTOM_ERR(L, "invalid key size");
+    }
+
+    byte *out = (byte *)malloc(GCM_IV_SIZE + GCM_TAG_SIZE + msg_size + 1);
+    if (out == NULL) {
+        RETURN_CUSTOM_ERR(L, "memory allocation failed");
+    }
+    byte *iv  = out;
+    byte *tag = out + GCM_IV_SIZE;
+
+    WC_RNG rng;
+    if (wc_InitRng(&rng) != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to initialize RNG");
+    }
+    int ret = wc_RNG_GenerateBlock(&rng, iv, GCM_IV_SIZE);
+    wc_FreeRng(&rng);
+    if (ret != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to generate IV");
+    }
+
+    Aes aes;
+    if (wc_AesInit(&aes, NULL, INVALID_DEVID) != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to init AES");
+    }
+    ret = wc_AesGcmSetKey(&aes, (byte *)key, key_size);
+    if (ret == 0) {
+        ret = wc_AesGcmEncrypt(&aes, out + GCM_IV_SIZE + GCM_TAG_SIZE, (byte *)msg, msg_size, iv, GCM_IV_SIZE, tag,
+                               GCM_TAG_SIZE, (byte *)aad, aad_size);
+    }
+    wc_AesFree(&aes);
+    if (ret != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to encrypt");
+    }
+    lua_pushlstring(L, (char *)out, GCM_IV_SIZE + GCM_TAG_SIZE + msg_size);
+    free(out);
+    return 1;
+}
+
+int lua_aes_gcm_decrypt(lua_State *L) {
+    size_t key_size, blob_size, aad_size = 0;
+    const char *key  = luaL_checklstring(L, 1, &key_size);
+    const char *blob = luaL_checklstring(L, 2, &blob_size);
+    const char *aad  = luaL_optlstring(L, 3, NULL, &aad_size);
+    if (key_size != 16 && key_size != 24 && key_size != 32) {
+        RETURN_CUSTOM_ERR(L, "invalid key size");
+    }
+    if (blob_size < GCM_IV_SIZE + GCM_TAG_SIZE) {
+        RETURN_CUSTOM_ERR(L, "message is too short");
+    }
+    size_t msg_size = blob_size - GCM_IV_SIZE - GCM_TAG_SIZE;
+    byte *out       = (byte *)malloc(msg_size + 1);
+    if (out == NULL) {
+        RETURN_CUSTOM_ERR(L, "memory allocation failed");
+    }
+
+    Aes aes;
+    if (wc_AesInit(&aes, NULL, INVALID_DEVID) != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to init AES");
+    }
+    int ret = wc_AesGcmSetKey(&aes, (byte *)key, key_size);
+    if (ret == 0) {
+        ret = wc_AesGcmDecrypt(&aes, out, (byte *)blob + GCM_IV_SIZE + GCM_TAG_SIZE, msg_size, (byte *)blob,
+                               GCM_IV_SIZE, (byte *)blob + GCM_IV_SIZE, GCM_TAG_SIZE, (byte *)aad, aad_size);
+    }
+    wc_AesFree(&aes);
+    if (ret != 0) {
+        free(out);
+        RETURN_CUSTOM_ERR(L, "failed to decrypt");
+    }
+    lua_pushlstring(L, (char *)out, msg_size);
+    free(out);
+    return 1;
+}
+
 #define POINT_SIZE 32
 
 int lua_ecc_generate_key(lua_State *L) {
@@ -625,6 +717,8 @@ int lua_parse_x509_cert(lua_State *L) {
 static luaL_Reg funcs[] = {
     {"sha256",               lua_sha256              },
     {"hmac",                 lua_hmac                },
+    {"aes_gcm_encrypt",      lua_aes_gcm_encrypt     },
+    {"aes_gcm_decrypt",      lua_aes_gcm_decrypt     },
     {"base64_decode",        lua_base64_decode       },
     {"base64_encode",        lua_base64_encode       },
     {"ecc_generate_key",     lua_ecc_generate_key    },
@@ -28,6 +28,15 @@ local hmac = function(secret, msg)
 	return core.hmac(secret, msg)
 end
 
+-- Returns `iv .. tag .. ciphertext`, `key` must be 16, 24 or 32 bytes long
+local aes_gcm_encrypt = function(key, msg, aad)
+	return core.aes_gcm_encrypt(key, msg, aad)
+end
+
+local aes_gcm_decrypt = function(key, blob, aad)
+	return core.aes_gcm_decrypt(key, blob, aad)
+end
+
 local b64_encode = function(str)
 	return core.base64_encode(str)
 end
@@ -166,6 +175,8 @@ _M.b64url_decode = b64url_decode
 _M.b64url_encode_json = b64url_encode_json
 _M.sha256 = sha256
 _M.hmac = hmac
+_M.aes_gcm_encrypt = aes_gcm_encrypt
+_M.aes_gcm_decrypt = aes_gcm_decrypt
 _M.ecc_generate_key = ecc_generate_key
 _M.ecc_load_key = load_ecc_key
 _M.ecc_save_key = save_ecc_key
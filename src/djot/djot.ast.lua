@@ -1005,4 +1005,5 @@ return {
 	new_node = new_node,
 	add_child = add_child,
 	has_children = has_children,
+	get_list_start = get_list_start,
 }
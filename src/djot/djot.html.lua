@@ -6,6 +6,7 @@ local unpack = unpack or table.unpack
 local insert_attribute, copy_attributes = ast.insert_attribute, ast.copy_attributes
 local format = string.format
 local find, gsub = string.find, string.gsub
+local codec = require("std.codec")
 
 -- Produce a copy of a table.
 local function copy(tbl)
@@ -59,19 +60,11 @@ end
 Renderer.html_escapes = { ["<"] = "&lt;", [">"] = "&gt;", ["&"] = "&amp;", ['"'] = "&quot;" }
 
 function Renderer:escape_html(s)
-	if find(s, "[<>&]") then
-		return (gsub(s, "[<>&]", self.html_escapes))
-	else
-		return s
-	end
+	return codec.html_escape(s, "<>&")
 end
 
 function Renderer:escape_html_attribute(s)
-	if find(s, '[<>&"]') then
-		return (gsub(s, '[<>&"]', self.html_escapes))
-	else
-		return s
-	end
+	return codec.html_escape(s, '<>&"')
 end
 
 function Renderer:render(doc, handle)
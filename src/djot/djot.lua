@@ -21,6 +21,9 @@
 --- local filter = djot.filter.load_filter(src)
 --- djot.filter.apply_filter(doc, filter)
 ---
+--- -- or render as HTML right away, without building the AST:
+--- print(djot.to_html(input))
+---
 --- -- streaming parser:
 --- for startpos, endpos, annotation in djot.parse_events("*hello there*") do
 ---   print(startpos, endpos, annotation)
@@ -30,6 +33,7 @@ local unpack = unpack or table.unpack
 local Parser = require("djot.block").Parser
 local ast = require("djot.ast")
 local html = require("djot.html")
+local stream = require("djot.stream")
 local json = require("cjson.safe")
 local filter = require("djot.filter")
 
@@ -103,6 +107,18 @@ local function render_html(doc)
 	return handle:flush()
 end
 
+--- Parse a djot text and render it as HTML, straight from the parser's
+--- events (see `djot.stream`), which is faster and needs much less memory
+--- than `render_html(parse(input))`. Documents with references or footnotes
+--- still go through the AST.
+--- @param input input string
+--- @param warn function that processes a warning, accepting a warning
+--- object with `pos` and `message` fields.
+--- @return rendered document (HTML string)
+local function to_html(input, warn)
+	return stream.render_html(input, warn) or render_html(parse(input, false, warn))
+end
+
 --- Render an event as a JSON array.
 --- @param startpos starting byte position
 --- @param endpos ending byte position
@@ -142,6 +158,7 @@ local G = {
 	parse_events = parse_events,
 	parse_and_render_events = parse_and_render_events,
 	render_html = render_html,
+	to_html = to_html,
 	render_ast_pretty = render_ast_pretty,
 	render_ast_json = render_ast_json,
 	render_event = render_event,
@@ -0,0 +1,862 @@
+--- @module djot.stream
+--- Render djot to HTML straight from the parser's events, without building the AST.
+---
+--- The events are kept in three flat arrays (start, end, annotation), with the
+--- matching open/close indexes in a fourth one, and rendered in a single pass into
+--- one `string.buffer`. Whatever `djot.ast` figures out from the nodes it has built
+--- so far (tight lists, list styles, table headers and alignments, captions,
+--- heading identifiers, attributes that follow an element) is found by looking
+--- ahead in the arrays instead.
+---
+--- References and footnotes can be defined anywhere in the document, so for
+--- documents with any of them `render_html` returns nil, and the caller should
+--- go the AST way, see `djot.to_html`. The output is the same as `djot.html`'s.
+
+local Parser = require("djot.block").Parser
+local get_list_start = require("djot.ast").get_list_start
+local codec = require("std.codec")
+local buffer = require("string.buffer")
+
+local byte, find, sub, gsub, match, gmatch = string.byte, string.find, string.sub, string.gsub, string.match, string.gmatch
+local concat, sort = table.concat, table.sort
+
+local PLUS, MINUS = byte("+"), byte("-")
+
+-- Events that need the whole document to be rendered
+local needs_ast = {
+	["+reference_definition"] = true,
+	["+footnote"] = true,
+	["footnote_reference"] = true,
+	["+reference"] = true,
+}
+
+local ignorable = {
+	image_marker = true,
+	escape = true,
+	blankline = true,
+}
+
+local simple_inline = {
+	emph = "em",
+	strong = "strong",
+	mark = "mark",
+	insert = "ins",
+	delete = "del",
+	subscript = "sub",
+	superscript = "sup",
+	span = "span",
+}
+
+local leaf_html = {
+	softbreak = "\n",
+	hardbreak = "<br>\n",
+	nbsp = "&nbsp;",
+	left_double_quote = "&ldquo;",
+	right_double_quote = "&rdquo;",
+	left_single_quote = "&lsquo;",
+	right_single_quote = "&rsquo;",
+	ellipses = "&hellip;",
+	em_dash = "&mdash;",
+	en_dash = "&ndash;",
+}
+
+local escape_html = function(s)
+	return codec.html_escape(s, "<>&")
+end
+
+local escape_attribute = function(s)
+	return codec.html_escape(s, '<>&"')
+end
+
+-- annotation -> tag, e.g. "+list_item|1.|a." -> "list_item"
+local tags = setmetatable({}, {
+	__index = function(t, annot)
+		local tag = match(annot, "^[+-]?([^|]+)")
+		t[annot] = tag
+		return tag
+	end,
+})
+
+local insert_attribute = function(attr, key, val)
+	val = gsub(val, "%s+", " ")
+	if key == "class" and attr.class then
+		attr.class = attr.class .. " " .. val
+	else
+		attr[key] = val
+	end
+end
+
+local put_attributes = function(buf, attr)
+	if not attr then
+		return
+	end
+	local keys = {}
+	for k in pairs(attr) do
+		keys[#keys + 1] = k
+	end
+	sort(keys)
+	for _, k in ipairs(keys) do
+		buf:put(" ", k, '="', escape_attribute(attr[k]), '"')
+	end
+end
+
+--- Renders `input` as HTML, or returns nil if the document
+--- has references or footnotes.
+--- @param input djot document (string)
+--- @param warn function that processes warnings
+--- @return rendered document (HTML string) or nil
+local function render_html(input, warn)
+	local S, E, A, M = {}, {}, {}, {}
+	local n = 0
+	local open = {}
+	local parser = Parser:new(input, warn)
+	-- with a newline added at the end, if there was none
+	input = parser.subject
+	for sp, ep, annot in parser:events() do
+		if needs_ast[annot] then
+			return nil
+		end
+		n = n + 1
+		S[n], E[n], A[n] = sp, ep, annot
+		local c = byte(annot)
+		if c == PLUS then
+			open[#open + 1] = n
+		elseif c == MINUS then
+			local o = table.remove(open)
+			if not o or tags[A[o]] ~= tags[annot] then
+				-- Not balanced, leave it to the AST builder to complain
+				return nil
+			end
+			M[o], M[n] = n, o
+		end
+	end
+	if #open > 0 then
+		return nil
+	end
+
+	local slice = function(i)
+		return sub(input, S[i], E[i])
+	end
+
+	-- Adds the attributes of the `+attributes` or `+block_attributes` group at `i` to `attr`
+	local add_attributes = function(attr, i)
+		local k = i + 1
+		while k < M[i] do
+			local a = A[k]
+			if a == "id" or a == "class" then
+				insert_attribute(attr, a, slice(k))
+			elseif a == "key" then
+				local val = {}
+				while A[k + 1] == "value" do
+					val[#val + 1] = gsub(slice(k + 1), "\\(%p)", "%1")
+					k = k + 1
+				end
+				insert_attribute(attr, slice(k - #val), concat(val, "\n"))
+			end
+			k = k + 1
+		end
+	end
+
+	-- Attributes of the groups right after the event `j`, which ends an inline element
+	local trailing_attributes = function(j, attr)
+		local k = j + 1
+		while A[k] == "+attributes" do
+			if M[k] > k + 1 then
+				attr = attr or {}
+				add_attributes(attr, k)
+			end
+			k = M[k] + 1
+		end
+		return attr
+	end
+
+	-- String content of the nodes made of the events from `i` to `j`, see `djot.ast`
+	local content
+	local verbatim_content = function(i)
+		local parts = {}
+		content(i + 1, M[i] - 1, parts)
+		local s = concat(parts)
+		if find(s, "^ +`") then
+			s = sub(s, 2)
+		end
+		if find(s, "` +$") then
+			s = sub(s, 1, #s - 1)
+		end
+		return s
+	end
+	content = function(i, j, parts)
+		local k = i
+		while k <= j do
+			local a = A[k]
+			local c = byte(a)
+			if c == PLUS then
+				local tag = tags[a]
+				if tag == "destination" or tag == "reference" or tag == "attributes" or tag == "block_attributes" then
+					k = M[k]
+				elseif tag == "verbatim" or tag == "inline_math" or tag == "display_math" then
+					parts[#parts + 1] = verbatim_content(k)
+					k = M[k]
+				end
+			elseif c ~= MINUS then
+				if a == "softbreak" then
+					parts[#parts + 1] = "\n"
+				elseif a == "raw_format" then
+					if A[k - 1] ~= "-verbatim" then
+						parts[#parts + 1] = slice(k)
+					end
+				elseif not ignorable[a] and a ~= "symbol" then
+					parts[#parts + 1] = slice(k)
+				end
+			end
+			k = k + 1
+		end
+		return parts
+	end
+
+	-- Alt text of images, see `to_text` in `djot.html`
+	local alt_text = function(i, j)
+		local parts = {}
+		local k = i
+		while k <= j do
+			local a = A[k]
+			local c = byte(a)
+			if c == PLUS then
+				local tag = tags[a]
+				if
+					tag == "verbatim"
+					or tag == "inline_math"
+					or tag == "display_math"
+					or tag == "destination"
+					or tag == "attributes"
+				then
+					k = M[k]
+				end
+			elseif a == "str" then
+				parts[#parts + 1] = slice(k)
+			elseif a == "nbsp" then
+				parts[#parts + 1] = "\160"
+			elseif a == "softbreak" then
+				parts[#parts + 1] = " "
+			end
+			k = k + 1
+		end
+		return concat(parts)
+	end
+
+	local identifiers = {}
+	local get_identifier = function(s)
+		local base = s:gsub("[][~!@#$%^&*(){}`,.<>\\|=+/?]", ""):gsub("^%s+", ""):gsub("%s+$", ""):gsub("%s+", "-")
+		local i = 0
+		local ident = base
+		while ident == "" or identifiers[ident] do
+			i = i + 1
+			if base == "" then
+				base = "s"
+			end
+			ident = base .. "-" .. tostring(i)
+		end
+		identifiers[ident] = true
+		return ident
+	end
+
+	-- Skips the events that don't make nodes of their own
+	local next_node = function(k)
+		while k <= n do
+			local a = A[k]
+			if a == "+block_attributes" or a == "+caption" then
+				k = M[k] + 1
+			elseif ignorable[a] then
+				k = k + 1
+			else
+				return k
+			end
+		end
+		return k
+	end
+
+	-- Lists have no events of their own: consecutive items with a style
+	-- in common make a list. Finds them all, and works out the style
+	-- and tightness of the list, like `djot.ast` does once it's closed.
+	local lists = {}
+	local item_styles = function(annot)
+		local styles, marker = {}, match(annot, "(%|.*)")
+		local i = 1
+		if marker then
+			for sty in gmatch(marker, "%|([^%|%]]*)") do
+				styles[sty] = i
+				i = i + 1
+			end
+		end
+		return styles, marker
+	end
+	local is_tight = function(startidx, endidx, is_last_item)
+		local blanklines = 0
+		if is_last_item then
+			while A[endidx] == "blankline" or A[endidx] == "-list_item" do
+				endidx = endidx - 1
+			end
+		end
+		for i = startidx, endidx do
+			if A[i] == "blankline" then
+				local nxt, after = A[i + 1] or "", A[i + 2] or ""
+				if
+					not (
+						find(nxt, "%+list_item")
+						or (find(nxt, "%-list_item") and (is_last_item or find(after, "%-list_item")))
+					)
+				then
+					blanklines = blanklines + 1
+				end
+			end
+		end
+		return blanklines == 0
+	end
+	local find_list = function(first)
+		local list = { first = first }
+		local styles = item_styles(A[first])
+		local items = {}
+		local k = first
+		while true do
+			items[#items + 1] = k
+			lists[k] = list
+			local nxt = next_node(M[k] + 1)
+			if nxt > n or not find(A[nxt], "^%+list_item") then
+				break
+			end
+			local matched, has_match = {}, false
+			for sty, priority in pairs(item_styles(A[nxt])) do
+				if styles[sty] then
+					matched[sty] = priority
+					has_match = true
+				end
+			end
+			if not has_match then
+				break
+			end
+			styles = matched
+			k = nxt
+		end
+		list.last = M[items[#items]]
+		local style
+		for sty, priority in pairs(styles) do
+			if not style or priority < style.priority then
+				style = { name = sty, priority = priority }
+			end
+		end
+		list.style = style.name
+		list.start = get_list_start(match(input, "^%S+", S[first]), list.style)
+		local tight = true
+		for i, item in ipairs(items) do
+			tight = tight and is_tight(item, M[item], i == #items)
+		end
+		list.tight = tight
+		return list
+	end
+
+	-- Works out which rows of a table are headers and the alignment of cells,
+	-- like `djot.ast` does once the table is closed
+	local cell_head, cell_align, separator_rows = {}, {}, {}
+	local analyze_table = function(t)
+		local rows = {}
+		local aligns = {}
+		local k = t + 1
+		while k < M[t] do
+			if A[k] == "+row" then
+				local children = {}
+				local c = k + 1
+				while c < M[k] do
+					children[#children + 1] = c
+					c = A[c] == "+cell" and M[c] + 1 or c + 1
+				end
+				local found, align
+				for j, child in ipairs(children) do
+					found, align = match(A[child], "^(separator_)(.*)")
+					if not found then
+						break
+					end
+					aligns[j] = align
+				end
+				if found and #aligns > 0 then
+					separator_rows[k] = true
+					local prevrow = rows[#rows]
+					if prevrow then
+						for j, cell in ipairs(prevrow) do
+							cell_head[cell] = true
+							if aligns[j] ~= "default" then
+								cell_align[cell] = aligns[j]
+							end
+						end
+					end
+				else
+					if #aligns > 0 then
+						for j, cell in ipairs(children) do
+							if aligns[j] ~= "default" then
+								cell_align[cell] = aligns[j]
+							end
+						end
+					end
+					rows[#rows + 1] = children
+				end
+				k = M[k] + 1
+			else
+				k = k + 1
+			end
+		end
+	end
+
+	local buf = buffer.new(#input + #input / 4)
+	local block_attributes
+	local tight = false
+	local tights = {}
+	-- Open block containers: event indexes, and list tables
+	local blocks, depth = {}, 0
+	-- State of definition list items: children count, term and definition
+	local definitions = {}
+	local sections = {}
+	local render
+
+	local take_block_attributes = function()
+		if not block_attributes then
+			return nil
+		end
+		local attr = {}
+		for _, group in ipairs(block_attributes) do
+			add_attributes(attr, group)
+		end
+		block_attributes = nil
+		if attr.id then
+			identifiers[attr.id] = true
+		end
+		return attr
+	end
+
+	-- Called for every block node: definition list items put the first
+	-- paragraph into <dt>, and the rest of their children into <dd>.
+	local open_block = function(k, is_para)
+		local parent = blocks[depth]
+		local def = parent and definitions[parent]
+		if def then
+			def.children = def.children + 1
+			if def.children == 1 then
+				if is_para then
+					def.term = k
+				else
+					buf:put("<dt></dt>\n<dd>\n")
+					def.dd = true
+				end
+			elseif not def.dd then
+				buf:put("<dd>\n")
+				def.dd = true
+			end
+		end
+		depth = depth + 1
+		blocks[depth] = k
+	end
+
+	local close_block = function()
+		blocks[depth] = nil
+		depth = depth - 1
+	end
+
+	local open_list = function(list, attr)
+		local sty = list.style
+		if sty == "*" or sty == "+" or sty == "-" then
+			buf:put("<ul")
+			put_attributes(buf, attr)
+			buf:put(">\n")
+			list.close = "</ul>\n"
+		elseif sty == "X" then
+			attr = attr or {}
+			attr.class = attr.class and "task-list " .. attr.class or "task-list"
+			buf:put("<ul")
+			put_attributes(buf, attr)
+			buf:put(">\n")
+			list.close = "</ul>\n"
+		elseif sty == ":" then
+			buf:put("<dl")
+			put_attributes(buf, attr)
+			buf:put(">\n")
+			list.close = "</dl>\n"
+		else
+			buf:put("<ol")
+			if list.start and list.start > 1 then
+				buf:put(' start="', list.start, '"')
+			end
+			local list_type = gsub(sty, "%p", "")
+			if list_type ~= "1" then
+				buf:put(' type="', list_type, '"')
+			end
+			put_attributes(buf, attr)
+			buf:put(">\n")
+			list.close = "</ol>\n"
+		end
+		tights[#tights + 1] = tight
+		tight = list.tight
+	end
+
+	local open_item = function(k)
+		local attr = take_block_attributes()
+		local list = lists[k] or find_list(k)
+		if list.first == k then
+			open_block(list)
+			open_list(list, attr)
+			attr = nil
+		end
+		local marker = match(A[k], "(%|.*)")
+		depth = depth + 1
+		blocks[depth] = k
+		if marker == "|:" then
+			definitions[k] = { children = 0 }
+			return k + 1
+		end
+		if marker == "|X" then
+			local first = next_node(k + 1)
+			if A[first] == "checkbox_checked" then
+				buf:put('<li class="checked">\n')
+				return first + 1
+			elseif A[first] == "checkbox_unchecked" then
+				buf:put('<li class="unchecked">\n')
+				return first + 1
+			end
+		end
+		buf:put("<li")
+		put_attributes(buf, attr)
+		buf:put(">\n")
+		return k + 1
+	end
+
+	local close_item = function(k)
+		local o = M[k]
+		local def = definitions[o]
+		if def then
+			if def.children == 0 then
+				buf:put("<dt></dt>\n")
+			end
+			if def.dd then
+				buf:put("</dd>\n")
+			end
+			definitions[o] = nil
+		else
+			buf:put("</li>\n")
+		end
+		close_block()
+		local list = lists[o]
+		if list.last == k then
+			buf:put(list.close)
+			close_block()
+			tight = table.remove(tights)
+		end
+	end
+
+	local open_heading = function(k)
+		local attr = take_block_attributes() or {}
+		local level = E[k] - S[k] + 1
+		if not attr.id then
+			local text = concat(content(k + 1, M[k] - 1, {})):gsub("^%s+", ""):gsub("%s+$", "")
+			attr.id = get_identifier(text)
+		end
+		if depth == 0 then
+			while #sections > 0 and sections[#sections] >= level do
+				buf:put("</section>\n")
+				sections[#sections] = nil
+			end
+			buf:put('<section id="', escape_attribute(attr.id), '">\n')
+			sections[#sections + 1] = level
+			attr.id = nil
+		end
+		open_block(k)
+		buf:put("<h", level)
+		put_attributes(buf, attr)
+		buf:put(">")
+	end
+
+	local code_block = function(k)
+		local attr = take_block_attributes()
+		open_block(k)
+		close_block()
+		local first, lang, format = k + 1, nil, nil
+		if A[first] == "code_language" then
+			lang = slice(first)
+			first = first + 1
+		elseif A[first] == "raw_format" then
+			format = sub(slice(first), 2)
+			first = first + 1
+		end
+		local code = concat(content(first, M[k] - 1, {}))
+		if format then
+			if format == "html" then
+				buf:put(code)
+			end
+			return
+		end
+		buf:put("<pre")
+		put_attributes(buf, attr)
+		buf:put("><code")
+		if lang and #lang > 0 then
+			buf:put(' class="language-', lang, '"')
+		end
+		buf:put(">", escape_html(code), "</code></pre>\n")
+	end
+
+	local open_table = function(k)
+		local attr = take_block_attributes()
+		open_block(k)
+		analyze_table(k)
+		buf:put("<table")
+		put_attributes(buf, attr)
+		buf:put(">\n")
+		-- Captions come after the table, but are rendered first, the last one on top
+		local captions = {}
+		local after = M[k] + 1
+		while after <= n do
+			local a = A[after]
+			if a == "+caption" then
+				table.insert(captions, 1, after)
+				after = M[after] + 1
+			elseif a == "+block_attributes" then
+				after = M[after] + 1
+			elseif ignorable[a] then
+				after = after + 1
+			else
+				break
+			end
+		end
+		for _, caption in ipairs(captions) do
+			buf:put("<caption>")
+			render(caption + 1, M[caption] - 1)
+			buf:put("</caption>\n")
+		end
+	end
+
+	local link = function(k, image)
+		local close = M[k]
+		local last, dest = close, nil
+		if A[close + 1] == "+destination" then
+			last = M[close + 1]
+			dest = concat(content(close + 2, last - 1, {})):gsub("\r?\n", "")
+		end
+		local attr = {}
+		if image then
+			local alt = alt_text(k + 1, close - 1)
+			if #alt > 0 then
+				insert_attribute(attr, "alt", alt)
+			end
+			if dest then
+				insert_attribute(attr, "src", dest)
+			end
+		elseif dest then
+			insert_attribute(attr, "href", dest)
+		end
+		attr = trailing_attributes(last, attr)
+		buf:put(image and "<img" or "<a")
+		put_attributes(buf, attr)
+		buf:put(">")
+		if image then
+			return last + 1
+		end
+		return k + 1
+	end
+
+	local autolink = function(k, prefix)
+		local attr = { href = prefix .. concat(content(k + 1, M[k] - 1, {})) }
+		attr = trailing_attributes(M[k], attr)
+		buf:put("<a")
+		put_attributes(buf, attr)
+		buf:put(">")
+	end
+
+	local verbatim = function(k)
+		local close = M[k]
+		local s = verbatim_content(k)
+		if A[close + 1] == "raw_format" then
+			if sub(input, S[close + 1] + 2, E[close + 1] - 1) == "html" then
+				buf:put(s)
+			end
+			return close + 2
+		end
+		local tag = tags[A[k]]
+		if tag == "verbatim" then
+			buf:put("<code")
+			put_attributes(buf, trailing_attributes(close))
+			buf:put(">", escape_html(s), "</code>")
+		else
+			local display = tag == "display_math"
+			local attr = { class = display and "math display" or "math inline" }
+			buf:put("<span")
+			put_attributes(buf, trailing_attributes(close, attr))
+			buf:put(display and ">\\[" or ">\\(", escape_html(s), display and "\\]</span>" or "\\)</span>")
+		end
+		return close + 1
+	end
+
+	local str = function(k)
+		local s = slice(k)
+		local attr = A[k + 1] == "+attributes" and trailing_attributes(k)
+		if not attr then
+			buf:put(escape_html(s))
+			return
+		end
+		local lastword = find(s, "[^%s]+$")
+		if not lastword then
+			buf:put(escape_html(s))
+			return
+		end
+		if lastword > 1 then
+			buf:put(escape_html(sub(s, 1, lastword - 1)))
+		end
+		buf:put("<span")
+		put_attributes(buf, attr)
+		buf:put(">", escape_html(sub(s, lastword)), "</span>")
+	end
+
+	render = function(i, j)
+		local k = i
+		while k <= j do
+			local a = A[k]
+			local c = byte(a)
+			local tag = tags[a]
+			local nxt = k + 1
+			if c == PLUS then
+				local inline = simple_inline[tag]
+				if inline then
+					buf:put("<", inline)
+					put_attributes(buf, trailing_attributes(M[k]))
+					buf:put(">")
+				elseif tag == "para" then
+					local attr = take_block_attributes()
+					open_block(k, true)
+					local def = definitions[blocks[depth - 1]]
+					if def and def.term == k then
+						buf:put("<dt")
+						put_attributes(buf, attr)
+						buf:put(">")
+					elseif not tight then
+						buf:put("<p")
+						put_attributes(buf, attr)
+						buf:put(">")
+					end
+				elseif tag == "list_item" then
+					nxt = open_item(k)
+				elseif tag == "heading" then
+					open_heading(k)
+				elseif tag == "blockquote" then
+					local attr = take_block_attributes()
+					open_block(k)
+					buf:put("<blockquote")
+					put_attributes(buf, attr)
+					buf:put(">\n")
+				elseif tag == "div" then
+					local attr = take_block_attributes()
+					if A[k + 1] == "class" then
+						attr = attr or {}
+						insert_attribute(attr, "class", slice(k + 1))
+					end
+					open_block(k)
+					buf:put("<div")
+					put_attributes(buf, attr)
+					buf:put(">\n")
+				elseif tag == "code_block" then
+					code_block(k)
+					nxt = M[k] + 1
+				elseif tag == "table" then
+					open_table(k)
+				elseif tag == "row" then
+					if separator_rows[k] then
+						nxt = M[k] + 1
+					else
+						buf:put("<tr>\n")
+					end
+				elseif tag == "cell" then
+					buf:put(cell_head[k] and "<th" or "<td")
+					if cell_align[k] then
+						buf:put(' style="text-align: ', escape_attribute(cell_align[k]), ';"')
+					end
+					buf:put(">")
+				elseif tag == "linktext" then
+					nxt = link(k, false)
+				elseif tag == "imagetext" then
+					nxt = link(k, true)
+				elseif tag == "url" then
+					autolink(k, "")
+				elseif tag == "email" then
+					autolink(k, "mailto:")
+				elseif tag == "verbatim" or tag == "inline_math" or tag == "display_math" then
+					nxt = verbatim(k)
+				elseif tag == "double_quoted" then
+					buf:put("&ldquo;")
+				elseif tag == "single_quoted" then
+					buf:put("&lsquo;")
+				elseif tag == "block_attributes" then
+					block_attributes = block_attributes or {}
+					block_attributes[#block_attributes + 1] = k
+					nxt = M[k] + 1
+				else
+					-- attributes, destinations, captions: taken care of by the preceding node
+					nxt = M[k] + 1
+				end
+			elseif c == MINUS then
+				local inline = simple_inline[tag]
+				if inline then
+					buf:put("</", inline, ">")
+				elseif tag == "para" then
+					close_block()
+					local def = definitions[blocks[depth]]
+					if def and def.term == M[k] then
+						buf:put("</dt>\n")
+					elseif tight then
+						buf:put("\n")
+					else
+						buf:put("</p>\n")
+					end
+				elseif tag == "list_item" then
+					close_item(k)
+				elseif tag == "heading" then
+					close_block()
+					buf:put("</h", E[M[k]] - S[M[k]] + 1, ">\n")
+				elseif tag == "blockquote" then
+					close_block()
+					buf:put("</blockquote>\n")
+				elseif tag == "div" then
+					close_block()
+					buf:put("</div>\n")
+				elseif tag == "table" then
+					close_block()
+					buf:put("</table>\n")
+				elseif tag == "row" then
+					buf:put("</tr>\n")
+				elseif tag == "cell" then
+					buf:put(cell_head[M[k]] and "</th>\n" or "</td>\n")
+				elseif tag == "linktext" or tag == "url" or tag == "email" then
+					buf:put("</a>")
+				elseif tag == "double_quoted" then
+					buf:put("&rdquo;")
+				elseif tag == "single_quoted" then
+					buf:put("&rsquo;")
+				end
+			elseif a == "str" then
+				str(k)
+			elseif leaf_html[a] then
+				buf:put(leaf_html[a])
+			elseif a == "symbol" then
+				buf:put(":", sub(input, S[k] + 1, E[k] - 1), ":")
+			elseif a == "thematic_break" then
+				local attr = take_block_attributes()
+				open_block(k)
+				close_block()
+				buf:put("<hr")
+				put_attributes(buf, attr)
+				buf:put(">\n")
+			end
+			k = nxt
+		end
+	end
+
+	render(1, n)
+	for _ = 1, #sections do
+		buf:put("</section>\n")
+	end
+	return buf:tostring()
+end
+
+--- @export
+return { render_html = render_html }
@@ -18,12 +18,15 @@ typedef struct mod_lua {
 #include "../build/luasocket/mod_lua_url.h"
 #include "../build/luasocket/mod_lua_web.h"
 #include "../build/luasocket/mod_lua_web_server.h"
+#include "../build/luasocket/mod_lua_web_server.body.h"
+#include "../build/luasocket/mod_lua_web_server.h2.h"
 // Std
 #include "../build/std/mod_lua_std.conv.h"
 #include "../build/std/mod_lua_std.fs.h"
 #include "../build/std/mod_lua_std.h"
 #include "../build/std/mod_lua_std.logger.h"
 #include "../build/std/mod_lua_std.mime.h"
+#include "../build/std/mod_lua_std.profile.h"
 #include "../build/std/mod_lua_std.ps.h"
 #include "../build/std/mod_lua_std.tbl.h"
 #include "../build/std/mod_lua_std.txt.h"
@@ -61,6 +64,7 @@ typedef struct mod_lua {
 #include "../build/djot/mod_lua_djot.h"
 #include "../build/djot/mod_lua_djot.html.h"
 #include "../build/djot/mod_lua_djot.inline.h"
+#include "../build/djot/mod_lua_djot.stream.h"
 // Redis
 #include "../build/redis/mod_lua_redis.h"
 // Shell
@@ -89,10 +93,13 @@ const mod_lua__t lua_preload[] = {
     {"ssl.https",                        mod_lua_https,                            &mod_lua_https_SIZE                       },
     {"web",                              mod_lua_web,                              &mod_lua_web_SIZE                         },
     {"web_server",                       mod_lua_web_server,                       &mod_lua_web_server_SIZE                  },
+    {"web_server.body",                  mod_lua_web_server_body,                  &mod_lua_web_server_body_SIZE             },
+    {"web_server.h2",                    mod_lua_web_server_h2,                    &mod_lua_web_server_h2_SIZE               },
     {"ltn12",                            mod_lua_ltn12,                            &mod_lua_ltn12_SIZE                       },
     {"mime",                             mod_lua_mime,                             &mod_lua_mime_SIZE                        },
     {"std",                              mod_lua_std,                              &mod_lua_std_SIZE                         },
     {"std.fs",                           mod_lua_std_fs,                           &mod_lua_std_fs_SIZE                      },
+    {"std.profile",                      mod_lua_std_profile,                      &mod_lua_std_profile_SIZE                 },
     {"std.ps",                           mod_lua_std_ps,                           &mod_lua_std_ps_SIZE                      },
     {"std.txt",                          mod_lua_std_txt,                          &mod_lua_std_txt_SIZE                     },
     {"std.tbl",                          mod_lua_std_tbl,                          &mod_lua_std_tbl_SIZE                     },
@@ -126,6 +133,7 @@ const mod_lua__t lua_preload[] = {
     {"djot.filter",                      mod_lua_djot_filter,                      &mod_lua_djot_filter_SIZE                 },
     {"djot.html",                        mod_lua_djot_html,                        &mod_lua_djot_html_SIZE                   },
     {"djot.inline",                      mod_lua_djot_inline,                      &mod_lua_djot_inline_SIZE                 },
+    {"djot.stream",                      mod_lua_djot_stream,                      &mod_lua_djot_stream_SIZE                 },
     {"redis",                            mod_lua_redis,                            &mod_lua_redis_SIZE                       },
     {"shell",                            mod_lua_shell,                            &mod_lua_shell_SIZE                       },
     {"shell.theme",                      mod_lua_shell_theme,                      &mod_lua_shell_theme_SIZE                 },
@@ -158,23 +166,39 @@ extern int luaopen_cjson(lua_State *L);
 extern int luaopen_cjson_safe(lua_State *L);
 extern int luaopen_ssl_context(lua_State *L);
 extern int luaopen_ssl_core(lua_State *L);
+extern int luaopen_hpack_core(lua_State *L);
+extern int luaopen_multipart_core(lua_State *L);
 extern int luaopen_deviant_core(lua_State *L);
+extern int luaopen_std_shm(lua_State *L);
+extern int luaopen_std_codec(lua_State *L);
+extern int luaopen_std_layout(lua_State *L);
+extern int luaopen_std_watch(lua_State *L);
+extern int luaopen_std_uring(lua_State *L);
 extern int luaopen_crypto_core(lua_State *L);
 extern int luaopen_term_core(lua_State *L);
+extern int luaopen_term_fuzzy(lua_State *L);
 extern int luaopen_wireguard(lua_State *L);
 
 const luaL_Reg c_preload[] = {
-    {"socket.core",   luaopen_socket_core  },
-    {"socket.unix",   luaopen_socket_unix  },
-    {"socket.serial", luaopen_socket_serial},
-    {"mime.core",     luaopen_mime_core    },
-    {"cjson",         luaopen_cjson        },
-    {"cjson.safe",    luaopen_cjson_safe   },
-    {"ssl.context",   luaopen_ssl_context  },
-    {"ssl.core",      luaopen_ssl_core     },
-    {"std.core",      luaopen_deviant_core },
-    {"crypto.core",   luaopen_crypto_core  },
-    {"term.core",     luaopen_term_core    },
-    {"wireguard",     luaopen_wireguard    },
-    {NULL,            NULL                 }
+    {"socket.core",    luaopen_socket_core   },
+    {"socket.unix",    luaopen_socket_unix   },
+    {"socket.serial",  luaopen_socket_serial },
+    {"mime.core",      luaopen_mime_core     },
+    {"cjson",          luaopen_cjson         },
+    {"cjson.safe",     luaopen_cjson_safe    },
+    {"ssl.context",    luaopen_ssl_context   },
+    {"ssl.core",       luaopen_ssl_core      },
+    {"hpack.core",     luaopen_hpack_core    },
+    {"multipart.core", luaopen_multipart_core},
+    {"std.core",       luaopen_deviant_core  },
+    {"std.shm",        luaopen_std_shm       },
+    {"std.codec",      luaopen_std_codec     },
+    {"std.layout",     luaopen_std_layout    },
+    {"std.watch",      luaopen_std_watch     },
+    {"std.uring",      luaopen_std_uring     },
+    {"crypto.core",    luaopen_crypto_core   },
+    {"term.core",      luaopen_term_core     },
+    {"term.fuzzy",     luaopen_term_fuzzy    },
+    {"wireguard",      luaopen_wireguard     },
+    {NULL,             NULL                  }
 };
@@ -112,6 +112,28 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    if (strcmp(argv[1], "--profile") == 0) {
+        error = luaL_dostring(L, PRELOAD_INIT);
+        if (error) {
+            fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+            return 1;
+        }
+        int args = argc - 2;
+        lua_createtable(L, args, args);
+        int i;
+        for (i = 2; i < argc; i++) {
+            lua_pushstring(L, argv[i]);
+            lua_rawseti(L, -2, i - 1);
+        }
+        lua_setglobal(L, "arg");
+        error = luaL_dostring(L, PROFILE_SCRIPT);
+        if (error) {
+            fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+            return 1;
+        }
+        return 0;
+    }
+
     if (!(access(argv[1], F_OK) == 0)) {
         fprintf(stderr, "File %s does not exist!\n", argv[1]);
         fprintf(stderr, "Usage: %s /path/to/a/script.lua\n", argv[0]);
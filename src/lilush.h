@@ -16,6 +16,9 @@ static const char START_SHELL[] = "local sh = require('shell')\n"
 static const char RUN_SHELL_CMD[] = "local sh = require('shell')\n"
                                     "local shell = sh.new_mini() shell:run()";
 
+static const char PROFILE_SCRIPT[] = "local builtins = require('shell.builtins')\n"
+                                     "os.exit(builtins.get('profile').func('profile', arg))";
+
 static const char PRELOAD_INIT[] = "local std = require('std')\n"
                                    "local home = os.getenv('HOME') or '/tmp'\n"
                                    "local lilush_modules_path = './?.lua;' .. home .. "
@@ -7,6 +7,7 @@
  *
  *--------------------------------------------------------------------------*/
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <lauxlib.h>
@@ -93,6 +94,25 @@ static int set_sni(lua_State *L) {
     lua_pushboolean(L, 1);
     return 1;
 }
+/**
+ * Set the ALPN protocols list (comma separated, in order of preference).
+ * It's applied to every connection created from the context.
+ */
+static int set_alpn(lua_State *L) {
+    p_context ctx    = checkctx(L, 1);
+    const char *alpn = luaL_checkstring(L, 2);
+    char *copy       = strdup(alpn);
+    if (!copy) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    free(ctx->alpn);
+    ctx->alpn = copy;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /**
  * Load the trusting certificates.
  */
@@ -161,6 +181,7 @@ static luaL_Reg funcs[] = {
     {"setmode",        set_mode      },
     {"sni",            set_sni       },
     {"no_verify_mode", no_verify_mode},
+    {"alpn",           set_alpn      },
     {NULL,             NULL          }
 };
 
@@ -175,6 +196,8 @@ static int meth_destroy(lua_State *L) {
         wolfSSL_CTX_free(ctx->context);
         ctx->context = NULL;
     }
+    free(ctx->alpn);
+    ctx->alpn = NULL;
     return 0;
 }
 
@@ -233,6 +256,14 @@ int lsec_getmode(lua_State *L, int idx) {
     return ctx->mode;
 }
 
+/**
+ * Retrieve the ALPN protocols list from the context in the Lua stack.
+ */
+const char *lsec_getalpn(lua_State *L, int idx) {
+    p_context ctx = checkctx(L, idx);
+    return ctx->alpn;
+}
+
 /*------------------------------ Initialization ------------------------------*/
 
 /**
@@ -24,6 +24,7 @@ typedef struct t_context_ {
     WOLFSSL_CTX *context;
     lua_State *L;
     int mode;
+    char *alpn; // comma separated ALPN protocol list, NULL if not set
 } t_context;
 typedef t_context *p_context;
 
@@ -34,5 +35,8 @@ WOLFSSL_CTX *lsec_testcontext(lua_State *L, int idx);
 /* Retrieve the mode from the context in the Lua stack */
 int lsec_getmode(lua_State *L, int idx);
 
+/* Retrieve the ALPN protocol list from the context in the Lua stack */
+const char *lsec_getalpn(lua_State *L, int idx);
+
 /* Registre the module. */
 LSEC_API int luaopen_ssl_context(lua_State *L);
\ No newline at end of file
@@ -0,0 +1,564 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ HPACK (RFC 7541) header compression for the HTTP/2 support in `web_server`.
+
+ The decoder implements the full spec: static & dynamic tables,
+ Huffman coded strings, table size updates.
+
+ The encoder is stateless: it only uses the static table and literals
+ without indexing, and never Huffman codes strings. This is perfectly
+ valid HPACK, and saves us from tracking the peer's table size.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define HPACK_DECODER_MT   "HPACK:Decoder"
+#define HPACK_STATIC_COUNT 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    const char *name;
+    const char *value;
+} hpack_static_entry;
+
+/* Canonical Huffman code from RFC 7541 Appendix B:
+   symbols sorted by code length, first code, number of codes
+   and offset into `huff_syms` for each code length. */
+static const uint16_t huff_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+static const uint32_t huff_first[31] = {
+    0, 0, 0, 0, 0, 0, 20, 92,
+    248, 0, 1016, 2042, 4090, 8184, 16380, 32764,
+    0, 0, 0, 524272, 1048550, 2097116, 4194258, 8388568,
+    16777194, 33554412, 67108832, 134217694, 268435426, 0, 1073741820,
+};
+
+static const uint16_t huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3,
+    2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29,
+    12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huff_offset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79,
+    82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145,
+    174, 186, 190, 205, 224, 0, 253,
+};
+
+static const hpack_static_entry static_table[61] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+typedef struct {
+    char *data; // name immediately followed by value
+    size_t name_len;
+    size_t value_len;
+} hpack_entry;
+
+typedef struct {
+    hpack_entry *entries; // ring buffer, `head` is the newest entry
+    size_t cap;
+    size_t count;
+    size_t head;
+    size_t size;
+    size_t max_size;      // current size limit, set by the encoder with size updates
+    size_t settings_size; // upper bound for `max_size`, our SETTINGS_HEADER_TABLE_SIZE
+    size_t max_list_size; // our SETTINGS_MAX_HEADER_LIST_SIZE, 0 means no limit
+} hpack_table;
+
+static int decode_int(const uint8_t **pos, const uint8_t *end, int prefix, uint64_t *out) {
+    const uint8_t *p = *pos;
+    if (p >= end) {
+        return -1;
+    }
+    uint64_t max = (1 << prefix) - 1;
+    uint64_t value = *p++ & max;
+    if (value == max) {
+        int shift = 0;
+        uint8_t b;
+        do {
+            if (p >= end || shift > 56) {
+                return -1;
+            }
+            b = *p++;
+            value += (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *out = value;
+    *pos = p;
+    return 0;
+}
+
+/* Returns the length of the decoded string in `out`, or -1 on error.
+   `out` must have room for at least `len * 8 / 5` bytes */
+static long huff_decode(const uint8_t *src, size_t len, char *out) {
+    size_t n = 0;
+    uint32_t code = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int j = 7; j >= 0; j--) {
+            code = (code << 1) | ((src[i] >> j) & 1);
+            bits++;
+            if (bits >= 5 && code - huff_first[bits] < huff_count[bits]) {
+                uint16_t sym = huff_syms[huff_offset[bits] + code - huff_first[bits]];
+                if (sym == 256) {
+                    return -1; // EOS in the string is an error
+                }
+                out[n++] = (char)sym;
+                code = 0;
+                bits = 0;
+            } else if (bits >= 30) {
+                return -1;
+            }
+        }
+    }
+    // Padding must be shorter than 8 bits and consist of ones (EOS prefix)
+    if (bits > 7 || code != (uint32_t)((1 << bits) - 1)) {
+        return -1;
+    }
+    return n;
+}
+
+/* Decodes a string literal. If it was Huffman coded, `*out` is malloc'ed
+   and must be freed by the caller, `*allocated` is set in that case. */
+static int decode_string(const uint8_t **pos, const uint8_t *end, const char **out, size_t *out_len,
+                         int *allocated) {
+    if (*pos >= end) {
+        return -1;
+    }
+    int huffman = **pos & 0x80;
+    uint64_t len;
+    if (decode_int(pos, end, 7, &len) != 0 || len > (uint64_t)(end - *pos)) {
+        return -1;
+    }
+    *allocated = 0;
+    if (!huffman) {
+        *out = (const char *)*pos;
+        *out_len = len;
+    } else {
+        char *buf = malloc(len * 8 / 5 + 1);
+        if (!buf) {
+            return -1;
+        }
+        long n = huff_decode(*pos, len, buf);
+        if (n < 0) {
+            free(buf);
+            return -1;
+        }
+        *out = buf;
+        *out_len = n;
+        *allocated = 1;
+    }
+    *pos += len;
+    return 0;
+}
+
+static hpack_entry *table_entry(hpack_table *t, size_t idx) {
+    // idx is 0 based, 0 is the newest entry
+    return &t->entries[(t->head + idx) % t->cap];
+}
+
+static void table_evict(hpack_table *t, size_t max_size) {
+    while (t->count > 0 && t->size > max_size) {
+        hpack_entry *e = table_entry(t, t->count - 1);
+        t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+        free(e->data);
+        e->data = NULL;
+        t->count--;
+    }
+}
+
+static int table_add(hpack_table *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t entry_size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (entry_size > t->max_size) {
+        // Not an error: the table just gets emptied
+        table_evict(t, 0);
+        return 0;
+    }
+    // Copy first, the name might reference an entry that is about to be evicted
+    char *data = malloc(name_len + value_len + 1);
+    if (!data) {
+        return -1;
+    }
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+    table_evict(t, t->max_size - entry_size);
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 16;
+        hpack_entry *entries = malloc(cap * sizeof(hpack_entry));
+        if (!entries) {
+            free(data);
+            return -1;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            entries[i] = *table_entry(t, i);
+        }
+        free(t->entries);
+        t->entries = entries;
+        t->cap = cap;
+        t->head = 0;
+    }
+    t->head = (t->head + t->cap - 1) % t->cap;
+    hpack_entry *e = table_entry(t, 0);
+    e->data = data;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    t->count++;
+    t->size += entry_size;
+    return 0;
+}
+
+static int table_get(hpack_table *t, uint64_t idx, const char **name, size_t *name_len, const char **value,
+                     size_t *value_len) {
+    if (idx == 0) {
+        return -1;
+    }
+    if (idx <= HPACK_STATIC_COUNT) {
+        *name = static_table[idx - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[idx - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    idx -= HPACK_STATIC_COUNT + 1;
+    if (idx >= t->count) {
+        return -1;
+    }
+    hpack_entry *e = table_entry(t, idx);
+    *name = e->data;
+    *name_len = e->name_len;
+    *value = e->data + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+static void table_free(hpack_table *t) {
+    table_evict(t, 0);
+    free(t->entries);
+    t->entries = NULL;
+    t->cap = 0;
+}
+
+typedef void (*hpack_emit)(void *ud, const char *name, size_t name_len, const char *value, size_t value_len);
+
+static const char hpack_list_too_large[] = "header list too large";
+
+/* Decodes a complete header block, calling `emit` for each header field.
+   Returns NULL on success, or an error message.
+
+   Indexed fields make a small block decode into a huge header list, so its size
+   (name + value + 32 for each field, as in RFC 7541) is limited by `max_list_size`.
+   Past the limit fields are no longer emitted, but the block is still decoded
+   to the end to keep the dynamic table in sync, and `hpack_list_too_large` is returned. */
+static const char *hpack_decode(hpack_table *t, const uint8_t *p, size_t len, hpack_emit emit, void *ud) {
+    const uint8_t *end = p + len;
+    int fields = 0;
+    size_t list_size = 0;
+    int too_large = 0;
+    while (p < end) {
+        uint8_t b = *p;
+        uint64_t idx;
+        const char *name, *value;
+        size_t name_len, value_len;
+        int name_allocated = 0, value_allocated = 0;
+        int indexing = 0;
+
+        if (b & 0x80) {
+            // Indexed header field
+            if (decode_int(&p, end, 7, &idx) != 0 || table_get(t, idx, &name, &name_len, &value, &value_len) != 0) {
+                return "invalid header index";
+            }
+            list_size += name_len + value_len + HPACK_ENTRY_OVERHEAD;
+            too_large = too_large || (t->max_list_size > 0 && list_size > t->max_list_size);
+            if (!too_large) {
+                emit(ud, name, name_len, value, value_len);
+            }
+            fields++;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before any header fields
+            if (fields > 0 || decode_int(&p, end, 5, &idx) != 0 || idx > t->settings_size) {
+                return "invalid table size update";
+            }
+            t->max_size = idx;
+            table_evict(t, t->max_size);
+            continue;
+        }
+        int prefix = 4;
+        if ((b & 0xc0) == 0x40) {
+            // Literal with incremental indexing
+            prefix = 6;
+            indexing = 1;
+        }
+        // Literal without indexing (0000xxxx) or never indexed (0001xxxx)
+        if (decode_int(&p, end, prefix, &idx) != 0) {
+            return "invalid literal";
+        }
+        if (idx > 0) {
+            if (table_get(t, idx, &name, &name_len, &value, &value_len) != 0) {
+                return "invalid header name index";
+            }
+        } else if (decode_string(&p, end, &name, &name_len, &name_allocated) != 0) {
+            return "invalid header name";
+        }
+        if (decode_string(&p, end, &value, &value_len, &value_allocated) != 0) {
+            if (name_allocated) {
+                free((void *)name);
+            }
+            return "invalid header value";
+        }
+        list_size += name_len + value_len + HPACK_ENTRY_OVERHEAD;
+        too_large = too_large || (t->max_list_size > 0 && list_size > t->max_list_size);
+        if (!too_large) {
+            emit(ud, name, name_len, value, value_len);
+        }
+        fields++;
+        int err = 0;
+        if (indexing) {
+            err = table_add(t, name, name_len, value, value_len);
+        }
+        if (name_allocated) {
+            free((void *)name);
+        }
+        if (value_allocated) {
+            free((void *)value);
+        }
+        if (err) {
+            return "out of memory";
+        }
+    }
+    return too_large ? hpack_list_too_large : NULL;
+}
+
+static void encode_int(luaL_Buffer *b, uint8_t first, int prefix, uint64_t value) {
+    uint64_t max = (1 << prefix) - 1;
+    if (value < max) {
+        luaL_addchar(b, first | value);
+        return;
+    }
+    luaL_addchar(b, first | max);
+    value -= max;
+    while (value >= 0x80) {
+        luaL_addchar(b, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    luaL_addchar(b, value);
+}
+
+static void encode_string(luaL_Buffer *b, const char *str, size_t len) {
+    encode_int(b, 0, 7, len);
+    luaL_addlstring(b, str, len);
+}
+
+/*-------------------------------- Lua API ---------------------------------*/
+
+static void emit_to_table(void *ud, const char *name, size_t name_len, const char *value, size_t value_len) {
+    lua_State *L = (lua_State *)ud;
+    int n = lua_objlen(L, -1);
+    lua_pushlstring(L, name, name_len);
+    lua_rawseti(L, -2, n + 1);
+    lua_pushlstring(L, value, value_len);
+    lua_rawseti(L, -2, n + 2);
+}
+
+/* Creates a new decoder, the optional arguments are the max size of the dynamic table
+   and the max size of a decoded header list, as we advertise them in our SETTINGS. */
+static int hpack_decoder_new(lua_State *L) {
+    size_t max_size      = luaL_optinteger(L, 1, HPACK_DEFAULT_TABLE_SIZE);
+    size_t max_list_size = luaL_optinteger(L, 2, 0);
+    hpack_table *t = (hpack_table *)lua_newuserdata(L, sizeof(hpack_table));
+    memset(t, 0, sizeof(hpack_table));
+    t->max_size = max_size;
+    t->settings_size = max_size;
+    t->max_list_size = max_list_size;
+    luaL_getmetatable(L, HPACK_DECODER_MT);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/* Decodes a header block into a flat list of names and values:
+   { name1, value1, name2, value2, ... }
+   When the header list is too large, returns nil, the error and `true`:
+   the decoder is still in sync, so only the stream has to be refused. */
+static int hpack_decoder_decode(lua_State *L) {
+    hpack_table *t = (hpack_table *)luaL_checkudata(L, 1, HPACK_DECODER_MT);
+    size_t len;
+    const char *block = luaL_checklstring(L, 2, &len);
+    lua_newtable(L);
+    const char *err = hpack_decode(t, (const uint8_t *)block, len, emit_to_table, L);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        lua_pushboolean(L, err == hpack_list_too_large);
+        return 3;
+    }
+    return 1;
+}
+
+static int hpack_decoder_gc(lua_State *L) {
+    hpack_table *t = (hpack_table *)luaL_checkudata(L, 1, HPACK_DECODER_MT);
+    table_free(t);
+    return 0;
+}
+
+/* Encodes a flat list of names and values into a header block.
+   Names must be lowercase, as HTTP/2 requires. */
+static int hpack_encode(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = lua_objlen(L, 1);
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 1; i + 1 <= n; i += 2) {
+        size_t name_len, value_len;
+        lua_rawgeti(L, 1, i);
+        const char *name = lua_tolstring(L, -1, &name_len);
+        lua_pop(L, 1);
+        lua_rawgeti(L, 1, i + 1);
+        const char *value = lua_tolstring(L, -1, &value_len);
+        lua_pop(L, 1);
+        if (!name || !value) {
+            return luaL_error(L, "header names and values must be strings");
+        }
+        int name_idx = 0, full_idx = 0;
+        for (int j = 0; j < HPACK_STATIC_COUNT; j++) {
+            if (strlen(static_table[j].name) == name_len && memcmp(static_table[j].name, name, name_len) == 0) {
+                if (!name_idx) {
+                    name_idx = j + 1;
+                }
+                if (strlen(static_table[j].value) == value_len &&
+                    memcmp(static_table[j].value, value, value_len) == 0) {
+                    full_idx = j + 1;
+                    break;
+                }
+            }
+        }
+        if (full_idx) {
+            encode_int(&b, 0x80, 7, full_idx);
+            continue;
+        }
+        // Literal header field without indexing
+        encode_int(&b, 0, 4, name_idx);
+        if (!name_idx) {
+            encode_string(&b, name, name_len);
+        }
+        encode_string(&b, value, value_len);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static luaL_Reg decoder_methods[] = {
+    {"decode", hpack_decoder_decode},
+    {NULL,     NULL                }
+};
+
+static luaL_Reg funcs[] = {
+    {"decoder", hpack_decoder_new},
+    {"encode",  hpack_encode     },
+    {NULL,      NULL             }
+};
+
+int luaopen_hpack_core(lua_State *L) {
+    luaL_newmetatable(L, HPACK_DECODER_MT);
+    lua_pushcfunction(L, hpack_decoder_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, decoder_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
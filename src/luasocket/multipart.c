@@ -0,0 +1,343 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Incremental multipart/form-data (RFC 7578, RFC 2046) parser for `web.parse_form_data`.
+
+ The body is fed in pieces of any size, as they come from the socket,
+ and each `feed` returns the events it has produced, as a flat list:
+
+     { "headers", { ["content-disposition"] = "...", ... },
+       "data", "...", "data", "...",
+       "end",
+       "headers", { ... }, ... }
+
+ Part content is never buffered: it's handed out as it comes, only the few bytes at
+ the end of a piece that might be the beginning of a boundary are held back till
+ the next one. Boundaries are searched for with Boyer-Moore-Horspool, which skips
+ most of the content without looking at it.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define MULTIPART_PARSER_MT     "MULTIPART:Parser"
+#define MULTIPART_MAX_BOUNDARY  70 /* RFC 2046 */
+#define MULTIPART_DELIM_SIZE    (MULTIPART_MAX_BOUNDARY + 4)
+#define MULTIPART_HEADERS_LIMIT (16 * 1024)
+
+enum {
+    S_PREAMBLE,    /* before the first boundary, the content is dropped */
+    S_BODY,        /* part content */
+    S_AFTER_DELIM, /* right after a boundary: either "--" or optional whitespace and CRLF */
+    S_AFTER_DASH,
+    S_AFTER_CR,
+    S_HEADERS,
+    S_DONE, /* after the closing boundary, the epilogue is dropped */
+};
+
+typedef struct {
+    int state;
+    /* "\r\n--boundary", the CRLF before a boundary belongs to it, not to the content */
+    unsigned char delim[MULTIPART_DELIM_SIZE];
+    size_t dlen;
+    size_t skip[256];
+    /* the tail of the previous piece which is a prefix of the delimiter */
+    unsigned char held[MULTIPART_DELIM_SIZE];
+    size_t held_len;
+    char *headers;
+    size_t headers_len;
+    size_t headers_limit;
+} multipart_parser;
+
+static void push_event(lua_State *L, const char *name) {
+    int n = lua_objlen(L, -1);
+    lua_pushstring(L, name);
+    lua_rawseti(L, -2, n + 1);
+}
+
+/* Pushes a "data" event, only for part content, the preamble is dropped */
+static void push_data(lua_State *L, multipart_parser *p, const unsigned char *data, size_t len) {
+    if (p->state != S_BODY || len == 0) {
+        return;
+    }
+    int n = lua_objlen(L, -1);
+    lua_pushliteral(L, "data");
+    lua_rawseti(L, -2, n + 1);
+    lua_pushlstring(L, (const char *)data, len);
+    lua_rawseti(L, -2, n + 2);
+}
+
+static void delimiter_found(lua_State *L, multipart_parser *p) {
+    if (p->state == S_BODY) {
+        push_event(L, "end");
+    }
+    p->state = S_AFTER_DELIM;
+}
+
+/*
+ Scans `data` for the delimiter, taking the held back bytes of the
+ previous piece into account. Content before the delimiter is pushed,
+ returns the number of bytes of `data` consumed.
+*/
+static size_t scan_content(lua_State *L, multipart_parser *p, const unsigned char *data, size_t len) {
+    const unsigned char *delim = p->delim;
+    size_t dlen                = p->dlen;
+
+    /* A delimiter might start in the held back bytes and end in `data` */
+    for (size_t i = 0; i < p->held_len; i++) {
+        size_t in_held = p->held_len - i;
+        if (memcmp(p->held + i, delim, in_held) != 0) {
+            continue;
+        }
+        size_t need = dlen - in_held;
+        size_t have = len < need ? len : need;
+        if (memcmp(data, delim + in_held, have) != 0) {
+            continue;
+        }
+        push_data(L, p, p->held, i);
+        if (have < need) {
+            /* Still can't tell, hold on to all of it */
+            memmove(p->held, p->held + i, in_held);
+            memcpy(p->held + in_held, data, have);
+            p->held_len = in_held + have;
+            return len;
+        }
+        p->held_len = 0;
+        delimiter_found(L, p);
+        return need;
+    }
+    push_data(L, p, p->held, p->held_len);
+    p->held_len = 0;
+
+    size_t pos = 0;
+    while (pos + dlen <= len) {
+        unsigned char last = data[pos + dlen - 1];
+        if (last == delim[dlen - 1] && memcmp(data + pos, delim, dlen - 1) == 0) {
+            push_data(L, p, data, pos);
+            delimiter_found(L, p);
+            return pos + dlen;
+        }
+        pos += p->skip[last];
+    }
+
+    /* No delimiter, but the end of the piece might be the beginning of one */
+    size_t tail = len >= dlen ? len - dlen + 1 : 0;
+    while (tail < len) {
+        const unsigned char *cr = memchr(data + tail, delim[0], len - tail);
+        if (cr == NULL) {
+            tail = len;
+            break;
+        }
+        tail = cr - data;
+        if (memcmp(cr, delim, len - tail) == 0) {
+            break;
+        }
+        tail++;
+    }
+    push_data(L, p, data, tail);
+    memcpy(p->held, data + tail, len - tail);
+    p->held_len = len - tail;
+    return len;
+}
+
+/* Pushes the table of the part headers, names are lowercased */
+static void push_headers(lua_State *L, multipart_parser *p) {
+    int n = lua_objlen(L, -1);
+    lua_pushliteral(L, "headers");
+    lua_rawseti(L, -2, n + 1);
+    lua_newtable(L);
+    /* Without the terminating empty line */
+    const char *pos = p->headers;
+    const char *end = p->headers + p->headers_len - 2;
+    while (pos < end) {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *line_end = eol;
+        if (line_end > pos && line_end[-1] == '\r') {
+            line_end--;
+        }
+        const char *colon = memchr(pos, ':', line_end - pos);
+        if (colon != NULL && colon > pos) {
+            luaL_Buffer name;
+            luaL_buffinit(L, &name);
+            for (const char *c = pos; c < colon; c++) {
+                luaL_addchar(&name, (*c >= 'A' && *c <= 'Z') ? *c + 32 : *c);
+            }
+            luaL_pushresult(&name);
+            const char *value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char *value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            lua_pushlstring(L, value, value_end - value);
+            lua_rawset(L, -3);
+        }
+        pos = eol + 1;
+    }
+    lua_rawseti(L, -2, n + 2);
+}
+
+/*
+ Collects the part headers up to the empty line. Returns the number of bytes
+ of `data` consumed, or -1 if the headers are over the limit.
+*/
+static ssize_t scan_headers(lua_State *L, multipart_parser *p, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p->headers_len == p->headers_limit) {
+            return -1;
+        }
+        p->headers[p->headers_len++] = data[i];
+        size_t hl = p->headers_len;
+        /* No headers at all is just an empty line */
+        if ((hl == 2 && memcmp(p->headers, "\r\n", 2) == 0) ||
+            (hl >= 4 && memcmp(p->headers + hl - 4, "\r\n\r\n", 4) == 0)) {
+            push_headers(L, p);
+            p->headers_len = 0;
+            p->state       = S_BODY;
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+/* new(boundary, headers_limit) -- `headers_limit` is the max size of a part's headers */
+static int multipart_parser_new(lua_State *L) {
+    size_t blen;
+    const char *boundary = luaL_checklstring(L, 1, &blen);
+    size_t limit         = luaL_optinteger(L, 2, MULTIPART_HEADERS_LIMIT);
+    if (blen == 0 || blen > MULTIPART_MAX_BOUNDARY) {
+        return luaL_argerror(L, 1, "boundary must be 1 to 70 characters long");
+    }
+    if (limit < 4) {
+        return luaL_argerror(L, 2, "headers limit is too small");
+    }
+    multipart_parser *p = (multipart_parser *)lua_newuserdata(L, sizeof(multipart_parser));
+    memset(p, 0, sizeof(multipart_parser));
+    luaL_getmetatable(L, MULTIPART_PARSER_MT);
+    lua_setmetatable(L, -2);
+    p->headers = malloc(limit);
+    if (p->headers == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+    p->headers_limit = limit;
+    memcpy(p->delim, "\r\n--", 4);
+    memcpy(p->delim + 4, boundary, blen);
+    p->dlen = blen + 4;
+    for (int i = 0; i < 256; i++) {
+        p->skip[i] = p->dlen;
+    }
+    for (size_t i = 0; i < p->dlen - 1; i++) {
+        p->skip[p->delim[i]] = p->dlen - 1 - i;
+    }
+    /* The first boundary might come right at the start, with no CRLF before it */
+    memcpy(p->held, "\r\n", 2);
+    p->held_len = 2;
+    p->state    = S_PREAMBLE;
+    return 1;
+}
+
+/* parser:feed(data) -- returns the list of events, or nil and an error message */
+static int multipart_parser_feed(lua_State *L) {
+    multipart_parser *p = (multipart_parser *)luaL_checkudata(L, 1, MULTIPART_PARSER_MT);
+    size_t len;
+    const unsigned char *data = (const unsigned char *)luaL_checklstring(L, 2, &len);
+    lua_newtable(L);
+    size_t pos = 0;
+    while (pos < len && p->state != S_DONE) {
+        unsigned char c = data[pos];
+        switch (p->state) {
+        case S_PREAMBLE:
+        case S_BODY:
+            pos += scan_content(L, p, data + pos, len - pos);
+            break;
+        case S_AFTER_DELIM:
+            if (c == '-') {
+                p->state = S_AFTER_DASH;
+            } else if (c == '\r') {
+                p->state = S_AFTER_CR;
+            } else if (c != ' ' && c != '\t') {
+                goto invalid;
+            }
+            pos++;
+            break;
+        case S_AFTER_DASH:
+            if (c != '-') {
+                goto invalid;
+            }
+            p->state = S_DONE;
+            pos++;
+            break;
+        case S_AFTER_CR:
+            if (c != '\n') {
+                goto invalid;
+            }
+            p->state = S_HEADERS;
+            pos++;
+            break;
+        case S_HEADERS: {
+            ssize_t used = scan_headers(L, p, data + pos, len - pos);
+            if (used < 0) {
+                lua_pushnil(L);
+                lua_pushliteral(L, "part headers are too long");
+                return 2;
+            }
+            pos += used;
+            break;
+        }
+        }
+    }
+    return 1;
+
+invalid:
+    lua_pushnil(L);
+    lua_pushliteral(L, "invalid multipart boundary");
+    return 2;
+}
+
+/* parser:done() -- true once the closing boundary has been seen */
+static int multipart_parser_done(lua_State *L) {
+    multipart_parser *p = (multipart_parser *)luaL_checkudata(L, 1, MULTIPART_PARSER_MT);
+    lua_pushboolean(L, p->state == S_DONE);
+    return 1;
+}
+
+static int multipart_parser_gc(lua_State *L) {
+    multipart_parser *p = (multipart_parser *)luaL_checkudata(L, 1, MULTIPART_PARSER_MT);
+    free(p->headers);
+    p->headers = NULL;
+    return 0;
+}
+
+static luaL_Reg parser_methods[] = {
+    {"feed", multipart_parser_feed},
+    {"done", multipart_parser_done},
+    {NULL,   NULL                 }
+};
+
+static luaL_Reg funcs[] = {
+    {"new", multipart_parser_new},
+    {NULL,  NULL                }
+};
+
+int luaopen_multipart_core(lua_State *L) {
+    luaL_newmetatable(L, MULTIPART_PARSER_MT);
+    lua_pushcfunction(L, multipart_parser_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, parser_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
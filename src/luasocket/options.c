@@ -186,6 +186,20 @@ int opt_set_tcp_defer_accept(lua_State *L, p_socket ps) {
 }
 #endif
 
+/*------------------------------------------------------*/
+
+#ifdef SO_INCOMING_CPU
+/* On a listening socket in a reuseport group, prefer it for connections
+   processed by this CPU (Linux 6.2+) */
+int opt_set_incoming_cpu(lua_State *L, p_socket ps) {
+    return opt_setint(L, ps, SOL_SOCKET, SO_INCOMING_CPU);
+}
+
+int opt_get_incoming_cpu(lua_State *L, p_socket ps) {
+    return opt_getint(L, ps, SOL_SOCKET, SO_INCOMING_CPU);
+}
+#endif
+
 /*------------------------------------------------------*/
 int opt_set_ip6_unicast_hops(lua_State *L, p_socket ps) {
     return opt_setint(L, ps, IPPROTO_IPV6, IPV6_UNICAST_HOPS);
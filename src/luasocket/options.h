@@ -50,6 +50,11 @@ int opt_get_tcp_keepintvl(lua_State *L, p_socket ps);
 int opt_set_tcp_defer_accept(lua_State *L, p_socket ps);
 #endif
 
+#ifdef SO_INCOMING_CPU
+int opt_set_incoming_cpu(lua_State *L, p_socket ps);
+int opt_get_incoming_cpu(lua_State *L, p_socket ps);
+#endif
+
 int opt_set_keepalive(lua_State *L, p_socket ps);
 int opt_get_keepalive(lua_State *L, p_socket ps);
 
@@ -336,6 +336,21 @@ static int meth_create(lua_State *L) {
       return 2;
     }
     ssl->mode = mode;
+#ifdef HAVE_ALPN
+    const char *alpn = lsec_getalpn(L, 1);
+    if (alpn) {
+      char protocols[256];
+      strncpy(protocols, alpn, sizeof(protocols) - 1);
+      protocols[sizeof(protocols) - 1] = '\0';
+      if (wolfSSL_UseALPN(ssl->ssl, protocols, strlen(protocols),
+                          WOLFSSL_ALPN_CONTINUE_ON_MISMATCH) != WOLFSSL_SUCCESS) {
+        wolfSSL_free(ssl->ssl);
+        lua_pushnil(L);
+        lua_pushstring(L, "error setting ALPN protocols");
+        return 2;
+      }
+    }
+#endif
   } else {
     return luaL_argerror(L, 1, "invalid context");
   }
@@ -499,6 +514,27 @@ static int meth_dirty(lua_State *L) {
   return 1;
 }
 
+/**
+ * Return the protocol negotiated via ALPN, or nil.
+ */
+static int meth_getalpn(lua_State *L) {
+  p_ssl ssl = (p_ssl)luaL_checkudata(L, 1, "SSL:Connection");
+#ifdef HAVE_ALPN
+  char *name = NULL;
+  unsigned short size = 0;
+  if (ssl->state == LSEC_STATE_CONNECTED &&
+      wolfSSL_ALPN_GetProtocol(ssl->ssl, &name, &size) == WOLFSSL_SUCCESS &&
+      name) {
+    lua_pushlstring(L, name, size);
+    return 1;
+  }
+#else
+  (void)ssl;
+#endif
+  lua_pushnil(L);
+  return 1;
+}
+
 /**
  * Return the state information about the SSL object.
  */
@@ -547,6 +583,7 @@ static luaL_Reg methods[] = {{"close", meth_close},
                              {"add_sni_context", meth_add_sni_context},
                              {"settimeout", meth_settimeout},
                              {"want", meth_want},
+                             {"getalpn", meth_getalpn},
                              {NULL, NULL}};
 
 /**
@@ -44,6 +44,16 @@ local function newcontext(cfg)
 	if config.no_verify_mode then
 		context.no_verify_mode(ctx, config.no_verify_mode)
 	end
+	if config.alpn then
+		local alpn = config.alpn
+		if type(alpn) == "table" then
+			alpn = table.concat(alpn, ",")
+		end
+		succ, msg = context.alpn(ctx, alpn)
+		if not succ then
+			return nil, msg
+		end
+	end
 	return ctx
 end
 
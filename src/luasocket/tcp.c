@@ -88,6 +88,9 @@ static t_opt optget[] = {
     {"error",            opt_get_error        },
     {"recv-buffer-size", opt_get_recv_buf_size},
     {"send-buffer-size", opt_get_send_buf_size},
+#ifdef SO_INCOMING_CPU
+    {"incoming-cpu",     opt_get_incoming_cpu },
+#endif
     {NULL,               NULL                 }
 };
 
@@ -117,6 +120,9 @@ static t_opt optset[] = {
 #endif
 #ifdef TCP_FASTOPEN_CONNECT
     {"tcp-fastopen-connect", opt_set_tcp_fastopen_connect},
+#endif
+#ifdef SO_INCOMING_CPU
+    {"incoming-cpu",         opt_set_incoming_cpu        },
 #endif
     {NULL,                   NULL                        }
 };
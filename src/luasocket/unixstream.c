@@ -9,6 +9,7 @@
 #include "socket.h"
 #include "unixstream.h"
 
+#include <stddef.h>
 #include <string.h>
 #include <sys/un.h>
 
@@ -177,24 +178,41 @@ static int meth_accept(lua_State *L) {
 }
 
 /*-------------------------------------------------------------------------*\
-* Binds an object to an address
+* Fills in an address. A leading '@' stands for the abstract namespace,
+* where the name is not NUL terminated and has no file behind it.
 \*-------------------------------------------------------------------------*/
-static const char *unixstream_trybind(p_unix un, const char *path) {
-    struct sockaddr_un local;
+static const char *unixstream_address(struct sockaddr_un *addr, socklen_t *addr_len, const char *path) {
     size_t len = strlen(path);
-    int err;
-    if (len >= sizeof(local.sun_path))
+    if (len >= sizeof(addr->sun_path))
         return "path too long";
-    memset(&local, 0, sizeof(local));
-    strcpy(local.sun_path, path);
-    local.sun_family = AF_UNIX;
+    memset(addr, 0, sizeof(*addr));
+    strcpy(addr->sun_path, path);
+    addr->sun_family = AF_UNIX;
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        *addr_len         = offsetof(struct sockaddr_un, sun_path) + len;
+        return NULL;
+    }
 #ifdef UNIX_HAS_SUN_LEN
-    local.sun_len = sizeof(local.sun_family) + sizeof(local.sun_len) + len + 1;
-    err           = socket_bind(&un->sock, (SA *)&local, local.sun_len);
-
+    addr->sun_len = sizeof(addr->sun_family) + sizeof(addr->sun_len) + len + 1;
+    *addr_len     = addr->sun_len;
 #else
-    err = socket_bind(&un->sock, (SA *)&local, sizeof(local.sun_family) + len);
+    *addr_len = sizeof(addr->sun_family) + len;
 #endif
+    return NULL;
+}
+
+/*-------------------------------------------------------------------------*\
+* Binds an object to an address
+\*-------------------------------------------------------------------------*/
+static const char *unixstream_trybind(p_unix un, const char *path) {
+    struct sockaddr_un local;
+    socklen_t len;
+    int err;
+    const char *msg = unixstream_address(&local, &len, path);
+    if (msg)
+        return msg;
+    err = socket_bind(&un->sock, (SA *)&local, len);
     if (err != IO_DONE)
         socket_destroy(&un->sock);
     return socket_strerror(err);
@@ -224,6 +242,12 @@ static int meth_getsockname(lua_State *L) {
         return 2;
     }
 
+    if (peer_len > offsetof(struct sockaddr_un, sun_path) && peer.sun_path[0] == '\0') {
+        /* abstract namespace, shown with the leading '@' */
+        peer.sun_path[0] = '@';
+        lua_pushlstring(L, peer.sun_path, peer_len - offsetof(struct sockaddr_un, sun_path));
+        return 1;
+    }
     lua_pushstring(L, peer.sun_path);
     return 1;
 }
@@ -233,20 +257,13 @@ static int meth_getsockname(lua_State *L) {
 \*-------------------------------------------------------------------------*/
 static const char *unixstream_tryconnect(p_unix un, const char *path) {
     struct sockaddr_un remote;
+    socklen_t len;
     int err;
-    size_t len = strlen(path);
-    if (len >= sizeof(remote.sun_path))
-        return "path too long";
-    memset(&remote, 0, sizeof(remote));
-    strcpy(remote.sun_path, path);
-    remote.sun_family = AF_UNIX;
+    const char *msg = unixstream_address(&remote, &len, path);
+    if (msg)
+        return msg;
     timeout_markstart(&un->tm);
-#ifdef UNIX_HAS_SUN_LEN
-    remote.sun_len = sizeof(remote.sun_family) + sizeof(remote.sun_len) + len + 1;
-    err            = socket_connect(&un->sock, (SA *)&remote, remote.sun_len, &un->tm);
-#else
-    err = socket_connect(&un->sock, (SA *)&remote, sizeof(remote.sun_family) + len, &un->tm);
-#endif
+    err = socket_connect(&un->sock, (SA *)&remote, len, &un->tm);
     if (err != IO_DONE)
         socket_destroy(&un->sock);
     return socket_strerror(err);
@@ -11,6 +11,7 @@ local string = require("string")
 local base = _G
 local table = require("table")
 local socket = require("socket")
+local codec = require("std.codec")
 
 socket.url = {}
 local _M = socket.url
@@ -71,9 +72,7 @@ end
 --   unescaped binary representation of escaped hexadecimal  binary
 -----------------------------------------------------------------------------
 function _M.unescape(s)
-    return (string.gsub(s, "%%(%x%x)", function(hex)
-        return string.char(base.tonumber(hex, 16))
-    end))
+    return codec.url_decode(s)
 end
 
 -----------------------------------------------------------------------------
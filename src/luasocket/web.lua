@@ -6,50 +6,28 @@ local http = require("socket.http")
 local ltn12 = require("ltn12")
 local socket = require("socket")
 local json = require("cjson")
+local buffer = require("string.buffer")
+local multipart = require("multipart.core")
+local codec = require("std.codec")
 
 local debug_mode = os.getenv("LILUSH_DEBUG")
 
+-- application/x-www-form-urlencoded encoding, see `std.codec`
 local url_escape = function(str)
 	if str then
-		str = string.gsub(str, "\n", "\r\n")
-		str = string.gsub(str, "([^%w %-%_%.%~%%])", function(c)
-			return string.format("%%%02X", string.byte(c))
-		end)
-		str = string.gsub(str, " ", "+")
+		return codec.url_encode(str)
 	end
 	return str
 end
 
+-- Decodes numeric character references and the common named entities
 local html_unescape = function(str)
-	str = string.gsub(str, "&amp;", "&")
-	local entities = {
-		["&lt;"] = "<",
-		["&gt;"] = ">",
-		["&quot;"] = '"',
-		["&apos;"] = "’",
-	}
-	str = string.gsub(str, "&%a+;", entities)
-	str = string.gsub(str, "&#(%d+);", function(n)
-		local num = tonumber(n)
-		if num <= 255 then
-			return string.char(num)
-		end
-		return std.utf.char(num)
-	end)
-	str = string.gsub(str, "&#x(%x+);", function(n)
-		local num = tonumber(n, 16)
-		if num <= 255 then
-			return string.char(num)
-		end
-		return std.utf.char(num)
-	end)
-	return str
+	return codec.html_unescape(str)
 end
 
+-- Only `<` and `>` are escaped, values of forms are passed through it
 local html_escape = function(str)
-	local str = str:gsub("<", "&lt;")
-	str = str:gsub(">", "&gt;")
-	return str
+	return codec.html_escape(str, "<>")
 end
 
 local html_to_djot = function(html)
@@ -135,32 +113,148 @@ local request = function(uri, options, timeout)
 end
 
 -- HTTP Server related stuff below
+-- Parses a query string or a form body, values are unescaped and HTML escaped
 local parse_args = function(body)
-	local args = {}
-	for k, v in body:gmatch("([^=]+)=([^&]+)&?") do
-		local value = v:gsub("%+", " ") -- Bring back spaces!
-		value = url.unescape(value)
-		args[k] = html_escape(value)
+	return codec.parse_query(body, "<>")
+end
+
+-- Counter for the names of the temp files `parse_form_data` writes uploads to
+local uploads = 0
+
+local parse_disposition = function(headers)
+	local disposition = headers["content-disposition"] or ""
+	-- `[;%s]` keeps `name` from matching the tail of `filename`
+	local name = disposition:match([=[[;%s]name="([^"]*)"]=])
+	local filename = disposition:match([=[[;%s]filename="([^"]*)"]=])
+	if filename == "" then
+		-- That's what browsers send for a file input with no file chosen
+		filename = nil
 	end
-	return args
+	return name, filename
 end
 
-local parse_form_data = function(boundary, body)
+--[[
+    Parses a multipart/form-data request body. `body` is either the whole body string,
+    or a body reader (`ctx.body` with web_server's `streaming.request_body` enabled),
+    which is then read and parsed piece by piece, so uploads don't have to fit in memory.
+
+    Returns a table of the form fields: values of plain fields are unescaped & HTML escaped
+    strings, file fields are tables `{ filename = "...", content_type = "...", content = "..." }`.
+
+        opts.dir = "/path"     -- write file contents to new files in `dir` (which better be private to the server)
+                               -- instead of keeping them in memory, `content` is replaced with `path` and `size`.
+                               -- Removing the files is up to the caller.
+        opts.sink = function(part)
+                               -- or decide where the content of each file goes: `part` has `name`, `filename`,
+                               -- `content_type` and `headers`, the function returns anything with the `write`
+                               -- and `close` methods (an io file will do), or nil to keep the content in memory
+        opts.max_field_size    -- limit for values kept in memory, 1Mb by default
+        opts.headers_limit     -- limit for the headers of a part, 16Kb by default
+
+    Returns nil and an error message if the body is malformed or can't be read.
+]]
+local parse_form_data = function(boundary, body, opts)
+	local opts = opts or {}
+	local max_field_size = opts.max_field_size or 1024 * 1024
+	local ok, parser = pcall(multipart.new, boundary, opts.headers_limit)
+	if not ok then
+		return nil, "invalid boundary"
+	end
+	local next_piece
+	if type(body) == "string" then
+		next_piece = function()
+			local piece = body
+			body = nil
+			return piece
+		end
+	else
+		next_piece = function()
+			return body:read()
+		end
+	end
+
 	local args = {}
-	local pattern = string.format("(.-)--%s", boundary)
-	for part in body:gmatch(pattern) do
-		local name = part:match([[^.-name="([^"]+)"]])
-		local filename = part:match([[^.-filename="([^"]-)"]])
-		if name then
-			if filename and #filename > 0 then
-				local s, e, cap = part:find("^.-Content%-Type:%s*([^\r\n%s]+)")
-				args[name] = { filename = filename, content = part:sub(e + 5):sub(1, -3), content_type = cap }
+	local created = {}
+	local part, sink, buf
+	local fail = function(err)
+		if sink then
+			sink:close()
+		end
+		for _, path in ipairs(created) do
+			os.remove(path)
+		end
+		return nil, err
+	end
+	local open_sink = function()
+		if opts.sink then
+			return opts.sink(part)
+		end
+		if opts.dir then
+			uploads = uploads + 1
+			local path = string.format("%s/upload-%d-%d-%d", opts.dir, std.ps.getpid(), os.time(), uploads)
+			local file, err = io.open(path, "wb")
+			if not file then
+				return nil, err
+			end
+			table.insert(created, path)
+			part.path = path
+			return file
+		end
+	end
+
+	while not parser:done() do
+		local data, err = next_piece()
+		if not data then
+			return fail(err or "unexpected end of multipart body")
+		end
+		local events, err = parser:feed(data)
+		if not events then
+			return fail(err)
+		end
+		local i = 1
+		while i <= #events do
+			local event = events[i]
+			if event == "headers" then
+				local headers = events[i + 1]
+				local name, filename = parse_disposition(headers)
+				part = { name = name, filename = filename, content_type = headers["content-type"], headers = headers }
+				part.size = 0
+				buf = buffer.new()
+				sink = nil
+				if name and filename then
+					sink, err = open_sink()
+					if err then
+						return fail("failed to store " .. filename .. ": " .. tostring(err))
+					end
+				end
+				i = i + 2
+			elseif event == "data" then
+				local chunk = events[i + 1]
+				part.size = part.size + #chunk
+				if sink then
+					local ok, err = sink:write(chunk)
+					if not ok then
+						return fail("failed to store " .. part.filename .. ": " .. tostring(err))
+					end
+				elseif part.name then
+					if part.size > max_field_size then
+						return fail("form field " .. part.name .. " is too big")
+					end
+					buf:put(chunk)
+				end
+				i = i + 2
 			else
-				local s, e = part:find([[^.-name="[^"]+"%s-]])
-				local value = part:sub(e + 5):sub(1, -3)
-				value = value:gsub("%+", " ")
-				value = url.unescape(value)
-				args[name] = html_escape(value)
+				if sink then
+					sink:close()
+					sink = nil
+					args[part.name] =
+						{ filename = part.filename, content_type = part.content_type, path = part.path, size = part.size }
+				elseif part.name and part.filename then
+					args[part.name] = { filename = part.filename, content = buf:get(), content_type = part.content_type }
+				elseif part.name then
+					args[part.name] = html_escape(codec.url_decode(buf:get(), true))
+				end
+				i = i + 1
 			end
 		end
 	end
@@ -0,0 +1,142 @@
+-- SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+-- SPDX-License-Identifier: GPL-3.0-or-later
+local buffer = require("string.buffer")
+
+-- Request body readers and response producers, shared by `web_server` and `web_server.h2`.
+
+--[[
+    With `streaming.request_body` enabled handlers get a body reader as `ctx.body`
+    instead of the body string, and read the body at their own pace:
+
+        ctx.body:read(max)  -- next piece of the body, at most `max` bytes (`streaming.chunk_size` by default),
+                            -- nil when the body is exhausted, or nil and an error message
+        ctx.body:iter()     -- iterator over the pieces, for `for chunk in ctx.body:iter() do ... end`
+        ctx.body:all()      -- the rest of the body as a string
+
+    Chunked request bodies are decoded on the fly.
+]]
+local new_reader = function(client, content_length, chunked, max_size, chunk_size)
+	local reader = {
+		received = 0,
+		remaining = content_length,
+		chunk_left = 0,
+		done = not chunked and content_length == 0,
+	}
+	local count = function(self, data)
+		self.received = self.received + #data
+		if max_size > 0 and self.received > max_size then
+			self.done = true
+			return nil, "max body size exceeded"
+		end
+		return data
+	end
+	reader.read = function(self, max)
+		if self.done then
+			return nil
+		end
+		local max = max or chunk_size
+		if chunked then
+			if self.chunk_left == 0 then
+				local size_line, err = client:receive()
+				if not size_line then
+					self.done = true
+					return nil, err
+				end
+				local size = tonumber(size_line:match("^%x+"), 16)
+				if not size then
+					self.done = true
+					return nil, "invalid chunk size"
+				end
+				if size == 0 then
+					-- Skip trailers, if any
+					repeat
+						local line = client:receive()
+					until not line or line == ""
+					self.done = true
+					return nil
+				end
+				self.chunk_left = size
+			end
+			local data, err = client:receive(math.min(max, self.chunk_left))
+			if not data then
+				self.done = true
+				return nil, err
+			end
+			self.chunk_left = self.chunk_left - #data
+			if self.chunk_left == 0 then
+				-- Trailing CRLF of the chunk
+				client:receive()
+			end
+			return count(self, data)
+		end
+		local data, err = client:receive(math.min(max, self.remaining))
+		if not data then
+			self.done = true
+			return nil, err
+		end
+		self.remaining = self.remaining - #data
+		self.done = self.remaining == 0
+		return count(self, data)
+	end
+	reader.iter = function(self)
+		return function()
+			return self:read()
+		end
+	end
+	reader.all = function(self)
+		local buf = buffer.new()
+		while true do
+			local data, err = self:read()
+			if not data then
+				if err then
+					return nil, err
+				end
+				break
+			end
+			buf:put(data)
+		end
+		return buf:get()
+	end
+	return reader
+end
+
+--[[
+    Handlers may return a function or a coroutine instead of the content string,
+    to produce the response body piece by piece. A function is called until it returns nil,
+    a coroutine is resumed until it's dead, each yielded value being a chunk.
+    Chunks are sent as soon as they are produced, with `Transfer-Encoding: chunked`,
+    unless the handler sets the `content-length` header itself.
+]]
+local next_chunk = function(producer)
+	if type(producer) == "thread" then
+		if coroutine.status(producer) == "dead" then
+			return nil
+		end
+		local ok, chunk = coroutine.resume(producer)
+		if not ok then
+			return nil, chunk
+		end
+		return chunk
+	end
+	local ok, chunk = pcall(producer)
+	if not ok then
+		return nil, chunk
+	end
+	return chunk
+end
+
+-- HTTP/2 request bodies are buffered by the time the handler is called,
+-- handlers still get them via a reader with the same interface.
+local new_string_reader = function(body, chunk_size)
+	local pos = 1
+	local source = {
+		receive = function(_, n)
+			local data = body:sub(pos, pos + n - 1)
+			pos = pos + #data
+			return data
+		end,
+	}
+	return new_reader(source, #body, false, 0, chunk_size)
+end
+
+return { new_reader = new_reader, new_string_reader = new_string_reader, next_chunk = next_chunk }
@@ -0,0 +1,791 @@
+-- SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+-- SPDX-License-Identifier: GPL-3.0-or-later
+
+--[[
+    HTTP/2 (RFC 9113) support for `web_server`.
+
+    A connection is served in the request processing fork, just like
+    an HTTP/1.1 keep-alive connection. Streams are multiplexed on the wire,
+    but the handler is synchronous, so requests are handled one at a time,
+    in the order their END_STREAM arrives. Response bodies, on the other hand,
+    are interleaved according to the flow control windows, so a big response
+    on a slow stream does not block the others once they are handled.
+
+    There is no server push, no priorities, and no h2c upgrade from HTTP/1.1
+    (only prior knowledge h2c and ALPN negotiated h2 over TLS).
+]]
+
+local bit = require("bit")
+local hpack = require("hpack.core")
+local buffer = require("string.buffer")
+local std = require("std")
+local body_io = require("web_server.body")
+
+local PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+local DATA = 0x0
+local HEADERS = 0x1
+local PRIORITY = 0x2
+local RST_STREAM = 0x3
+local SETTINGS = 0x4
+local PUSH_PROMISE = 0x5
+local PING = 0x6
+local GOAWAY = 0x7
+local WINDOW_UPDATE = 0x8
+local CONTINUATION = 0x9
+
+local END_STREAM = 0x1
+local ACK = 0x1
+local END_HEADERS = 0x4
+local PADDED = 0x8
+local PRIORITY_FLAG = 0x20
+
+local NO_ERROR = 0x0
+local PROTOCOL_ERROR = 0x1
+local INTERNAL_ERROR = 0x2
+local FLOW_CONTROL_ERROR = 0x3
+local STREAM_CLOSED = 0x5
+local FRAME_SIZE_ERROR = 0x6
+local REFUSED_STREAM = 0x7
+local COMPRESSION_ERROR = 0x9
+
+local SETTINGS_HEADER_TABLE_SIZE = 0x1
+local SETTINGS_MAX_CONCURRENT_STREAMS = 0x3
+local SETTINGS_INITIAL_WINDOW_SIZE = 0x4
+local SETTINGS_MAX_FRAME_SIZE = 0x5
+local SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+
+local DEFAULT_WINDOW = 65535
+local DEFAULT_FRAME_SIZE = 16384
+local MAX_WINDOW = 2147483647
+
+-- Connection specific headers are not allowed in HTTP/2 responses
+local connection_headers = {
+	["connection"] = true,
+	["keep-alive"] = true,
+	["proxy-connection"] = true,
+	["transfer-encoding"] = true,
+	["upgrade"] = true,
+}
+
+local u32 = function(n)
+	return string.char(
+		bit.band(bit.rshift(n, 24), 0xff),
+		bit.band(bit.rshift(n, 16), 0xff),
+		bit.band(bit.rshift(n, 8), 0xff),
+		bit.band(n, 0xff)
+	)
+end
+
+local read_u32 = function(s, pos)
+	local a, b, c, d = s:byte(pos, pos + 3)
+	return a * 16777216 + b * 65536 + c * 256 + d
+end
+
+local send_frame = function(conn, ftype, flags, id, payload)
+	local payload = payload or ""
+	local len = #payload
+	conn.out:put(
+		string.char(bit.band(bit.rshift(len, 16), 0xff), bit.band(bit.rshift(len, 8), 0xff), bit.band(len, 0xff)),
+		string.char(ftype, flags),
+		u32(id),
+		payload
+	)
+end
+
+-- Frames are buffered, and written out in one go with `flush_output`
+local flush_output = function(conn)
+	if #conn.out == 0 then
+		return true
+	end
+	local _, err = conn.client:send(conn.out:get())
+	if err then
+		return nil, "failed to send frames: " .. err
+	end
+	return true
+end
+
+local read_frame = function(conn)
+	local header, err = conn.client:receive(9)
+	if not header then
+		return nil, err
+	end
+	local b1, b2, b3, ftype, flags = header:byte(1, 5)
+	local len = b1 * 65536 + b2 * 256 + b3
+	local id = bit.band(read_u32(header, 6), 0x7fffffff)
+	if len > DEFAULT_FRAME_SIZE then
+		return nil, "frame too large", FRAME_SIZE_ERROR
+	end
+	local payload = ""
+	if len > 0 then
+		payload, err = conn.client:receive(len)
+		if not payload then
+			return nil, err
+		end
+	end
+	return ftype, flags, id, payload
+end
+
+local goaway = function(conn, code, msg)
+	send_frame(conn, GOAWAY, 0, 0, u32(conn.last_stream) .. u32(code) .. (msg or ""))
+	conn.goaway_sent = true
+	flush_output(conn)
+end
+
+local reset_stream = function(conn, id, code)
+	send_frame(conn, RST_STREAM, 0, id, u32(code))
+	local stream = conn.streams[id]
+	if stream then
+		conn.streams[id] = nil
+		conn.open_streams = conn.open_streams - 1
+	end
+end
+
+-- Strips padding (and priority info for HEADERS) from a frame payload
+local unpad = function(ftype, flags, payload)
+	local pos, pad = 1, 0
+	if bit.band(flags, PADDED) ~= 0 then
+		if #payload < 1 then
+			return nil
+		end
+		pad = payload:byte(1)
+		pos = 2
+	end
+	if ftype == HEADERS and bit.band(flags, PRIORITY_FLAG) ~= 0 then
+		pos = pos + 5
+	end
+	if pos - 1 + pad > #payload then
+		return nil
+	end
+	return payload:sub(pos, #payload - pad)
+end
+
+local send_headers = function(conn, id, block, end_stream)
+	local max = conn.peer_max_frame_size
+	local flags = end_stream and END_STREAM or 0
+	if #block <= max then
+		send_frame(conn, HEADERS, bit.bor(flags, END_HEADERS), id, block)
+		return
+	end
+	send_frame(conn, HEADERS, flags, id, block:sub(1, max))
+	local pos = max + 1
+	while pos <= #block do
+		local last = pos + max > #block
+		send_frame(conn, CONTINUATION, last and END_HEADERS or 0, id, block:sub(pos, pos + max - 1))
+		pos = pos + max
+	end
+end
+
+local respond = function(conn, id, method, status, response_headers, content)
+	local stream = conn.streams[id]
+	local producer
+	local response_headers = response_headers or {}
+	if type(content) == "function" or type(content) == "thread" then
+		producer = content
+		content = nil
+	elseif type(content) == "table" and content.file then
+		-- files are read piece by piece, there is no splicing into frames
+		local size
+		producer, size = std.fs.file_chunks(content.file)
+		content = nil
+		if producer then
+			response_headers["content-length"] = size
+		else
+			status = 404
+		end
+	end
+	local content = content or ""
+	if not response_headers["content-type"] then
+		response_headers["content-type"] = "text/html"
+	end
+	local fields = { ":status", tostring(status) }
+	for h, v in pairs(response_headers) do
+		local name = h:lower()
+		if not connection_headers[name] and name ~= "content-length" then
+			if type(v) == "table" then
+				for _, item in ipairs(v) do
+					table.insert(fields, name)
+					table.insert(fields, tostring(item))
+				end
+			else
+				table.insert(fields, name)
+				table.insert(fields, tostring(v))
+			end
+		end
+	end
+	if producer then
+		if response_headers["content-length"] then
+			table.insert(fields, "content-length")
+			table.insert(fields, tostring(response_headers["content-length"]))
+		end
+	else
+		table.insert(fields, "content-length")
+		table.insert(fields, tostring(#content))
+	end
+
+	local end_stream = (#content == 0 and not producer) or method == "HEAD"
+	send_headers(conn, id, hpack.encode(fields), end_stream)
+	stream.responded = true
+	if end_stream then
+		if stream.remote_open then
+			-- We are not interested in the rest of the request body
+			reset_stream(conn, id, NO_ERROR)
+		else
+			conn.streams[id] = nil
+			conn.open_streams = conn.open_streams - 1
+		end
+		return
+	end
+	stream.data = content
+	stream.pos = 1
+	stream.producer = producer
+	table.insert(conn.pending, stream)
+end
+
+-- Takes the next chunk from the stream's producer, if everything before it has been sent,
+-- and frames as much of the buffered data as the flow control windows allow.
+-- Returns true when it made progress, or nil and an error when the producer failed.
+local send_pending = function(conn, stream)
+	local progress = false
+	if stream.pos > #stream.data then
+		if not stream.producer then
+			return false
+		end
+		-- Streamed responses are ended with an empty DATA frame
+		local chunk, err = body_io.next_chunk(stream.producer)
+		if not chunk then
+			stream.producer = nil
+			if err then
+				return nil, err
+			end
+			send_frame(conn, DATA, END_STREAM, stream.id)
+			return true
+		end
+		stream.data, stream.pos = chunk, 1
+		progress = true
+	end
+	local size = #stream.data
+	while stream.pos <= size do
+		local n = math.min(size - stream.pos + 1, conn.send_window, stream.send_window, conn.peer_max_frame_size)
+		if n <= 0 then
+			break
+		end
+		local last = not stream.producer and stream.pos + n > size
+		send_frame(conn, DATA, last and END_STREAM or 0, stream.id, stream.data:sub(stream.pos, stream.pos + n - 1))
+		stream.pos = stream.pos + n
+		conn.send_window = conn.send_window - n
+		stream.send_window = stream.send_window - n
+		progress = true
+	end
+	return progress
+end
+
+--[[
+    Sends as much of the pending response bodies as the flow control
+    windows allow. Streams take turns, one producer chunk each, and the
+    frames are written out after every round, so streamed responses go out
+    as they are produced, and one stream's producer doesn't hold back the others.
+]]
+local flush = function(conn)
+	repeat
+		local progress = false
+		local i = 1
+		while i <= #conn.pending do
+			local stream = conn.pending[i]
+			local ok, err = send_pending(conn, stream)
+			progress = progress or ok
+			if ok == nil then
+				conn.srv.logger:log("response producer failed: " .. tostring(err), "error")
+				table.remove(conn.pending, i)
+				reset_stream(conn, stream.id, INTERNAL_ERROR)
+			elseif stream.pos > #stream.data and not stream.producer then
+				table.remove(conn.pending, i)
+				if conn.streams[stream.id] then
+					if stream.remote_open then
+						reset_stream(conn, stream.id, NO_ERROR)
+					else
+						conn.streams[stream.id] = nil
+						conn.open_streams = conn.open_streams - 1
+					end
+				end
+			else
+				i = i + 1
+			end
+		end
+		local ok, err = flush_output(conn)
+		if not ok then
+			return nil, err
+		end
+	until not progress
+	return true
+end
+
+local dispatch = function(conn, id)
+	local srv = conn.srv
+	local cfg = srv.__config
+	local stream = conn.streams[id]
+	local start_time = os.clock()
+	local mem_start = collectgarbage("count")
+	local headers = stream.headers
+	local method, path = headers[":method"], headers[":path"]
+	if not method or not path or (method ~= "CONNECT" and not headers[":scheme"]) then
+		reset_stream(conn, id, PROTOCOL_ERROR)
+		return
+	end
+	local query, args = path:match("^([^?]*)%??(.*)$")
+	if query == "" then
+		query = "/"
+	end
+	headers.host = headers.host or headers[":authority"]
+	for _, pseudo in ipairs({ ":method", ":path", ":scheme", ":authority" }) do
+		headers[pseudo] = nil
+	end
+	if not headers.host then
+		respond(conn, id, method, 400, nil, "No Host header\n")
+		return
+	end
+	if not (conn.srv.__unix and headers["x-real-ip"]) then
+		headers["x-real-ip"] = conn.client_ip
+	end
+	local body = stream.body and stream.body:get() or nil
+	stream.body = nil
+	local body_reader
+	if cfg.streaming.request_body then
+		body_reader = body_io.new_string_reader(body or "", cfg.streaming.chunk_size)
+		body = nil
+	end
+
+	local content, status, response_headers = srv.handle(method, query, args, headers, body, {
+		logger = srv.logger,
+		client = conn.client,
+		cfg = cfg,
+		http2 = true,
+		body = body_reader,
+	})
+	if content == nil and status == nil and response_headers == nil then
+		-- Handlers that write the response straight to the client socket
+		-- can't be used with HTTP/2, the socket carries frames here.
+		srv.logger:log({ msg = "handler did not return a response", process = cfg.process, query = query }, "error")
+		content, status, response_headers = "Bad Gateway\n", 502, {}
+	end
+	respond(conn, id, method, status, response_headers, content)
+
+	-- Streams are interleaved, so unlike HTTP/1 connections, the GC is not stepped between them
+	local alloc = srv:account_request(mem_start)
+	if srv.logger:level() <= 10 then
+		local elapsed_time = os.clock() - start_time
+		local log_msg = {
+			vhost = headers.host,
+			method = method,
+			query = query,
+			status = status,
+			process = cfg.process,
+			size = type(content) == "string" and #content or 0,
+			time = string.format("%.4f", elapsed_time),
+			alloc_kb = string.format("%.1f", alloc),
+			proto = "h2",
+		}
+		for _, h in ipairs(cfg.log_headers) do
+			if headers[h] then
+				log_msg[h] = headers[h]
+			end
+		end
+		srv.logger:log(log_msg, 10)
+	end
+end
+
+-- Decodes a complete header block, and either dispatches the
+-- request, or waits for the body. Trailers are decoded and dropped.
+local process_header_block = function(conn, id, end_stream)
+	local fields, err, too_large = conn.decoder:decode(conn.header_block:get())
+	local stream = conn.streams[id]
+	if not fields then
+		if not too_large then
+			return nil, COMPRESSION_ERROR, err
+		end
+		-- The decoder is still in sync, only this request is refused
+		if stream and not stream.headers then
+			respond(conn, id, "GET", 431, {}, "")
+		elseif stream then
+			reset_stream(conn, id, PROTOCOL_ERROR)
+		end
+		return true
+	end
+	if not stream then
+		-- The stream was reset while we were waiting for CONTINUATION frames
+		return true
+	end
+	if not stream.headers then
+		local headers, repeated = {}, nil
+		for i = 1, #fields, 2 do
+			local name, value = fields[i], fields[i + 1]
+			if name:match("[A-Z]") then
+				reset_stream(conn, id, PROTOCOL_ERROR)
+				return true
+			end
+			if headers[name] then
+				repeated = repeated or {}
+				if not repeated[name] then
+					repeated[name] = { headers[name] }
+				end
+				table.insert(repeated[name], value)
+			else
+				headers[name] = value
+			end
+		end
+		if repeated then
+			for name, values in pairs(repeated) do
+				-- Cookies can be split into several fields in HTTP/2
+				headers[name] = table.concat(values, name == "cookie" and "; " or ", ")
+			end
+		end
+		stream.headers = headers
+	elseif not end_stream then
+		return nil, PROTOCOL_ERROR, "trailers without END_STREAM"
+	end
+	if end_stream then
+		stream.remote_open = false
+		conn.requests = conn.requests + 1
+		dispatch(conn, id)
+	end
+	return true
+end
+
+local open_stream = function(conn, id)
+	if id % 2 == 0 or id <= conn.last_stream then
+		return nil, PROTOCOL_ERROR, "invalid stream id"
+	end
+	conn.last_stream = id
+	local stream = {
+		id = id,
+		remote_open = true,
+		send_window = conn.peer_initial_window,
+		body_size = 0,
+	}
+	if conn.goaway_sent or conn.open_streams >= conn.max_streams then
+		-- The header block must still be decoded to keep the HPACK state in sync
+		conn.refused = id
+		return stream
+	end
+	conn.streams[id] = stream
+	conn.open_streams = conn.open_streams + 1
+	return stream
+end
+
+local handlers = {}
+
+handlers[HEADERS] = function(conn, flags, id, payload)
+	if id == 0 then
+		return nil, PROTOCOL_ERROR, "HEADERS on stream 0"
+	end
+	local fragment = unpad(HEADERS, flags, payload)
+	if not fragment then
+		return nil, PROTOCOL_ERROR, "invalid padding"
+	end
+	local stream = conn.streams[id]
+	if not stream then
+		local err, msg
+		stream, err, msg = open_stream(conn, id)
+		if not stream then
+			return nil, err, msg
+		end
+	elseif not stream.remote_open then
+		return nil, STREAM_CLOSED, "HEADERS on a half closed stream"
+	end
+	conn.header_block:reset()
+	conn.header_block:put(fragment)
+	local end_stream = bit.band(flags, END_STREAM) ~= 0
+	if bit.band(flags, END_HEADERS) == 0 then
+		conn.continuation = { id = id, end_stream = end_stream }
+		return true
+	end
+	local ok, code, msg = process_header_block(conn, id, end_stream)
+	if conn.refused then
+		send_frame(conn, RST_STREAM, 0, conn.refused, u32(REFUSED_STREAM))
+		conn.refused = nil
+	end
+	return ok, code, msg
+end
+
+handlers[CONTINUATION] = function(conn, flags, id, payload)
+	local cont = conn.continuation
+	if not cont or cont.id ~= id then
+		return nil, PROTOCOL_ERROR, "unexpected CONTINUATION"
+	end
+	conn.header_block:put(payload)
+	if #conn.header_block > conn.srv.__config.request_line_limit * 8 then
+		return nil, PROTOCOL_ERROR, "header block too large"
+	end
+	if bit.band(flags, END_HEADERS) == 0 then
+		return true
+	end
+	conn.continuation = nil
+	local ok, code, msg = process_header_block(conn, id, cont.end_stream)
+	if conn.refused then
+		send_frame(conn, RST_STREAM, 0, conn.refused, u32(REFUSED_STREAM))
+		conn.refused = nil
+	end
+	return ok, code, msg
+end
+
+handlers[DATA] = function(conn, flags, id, payload)
+	if id == 0 then
+		return nil, PROTOCOL_ERROR, "DATA on stream 0"
+	end
+	local data = unpad(DATA, flags, payload)
+	if not data then
+		return nil, PROTOCOL_ERROR, "invalid padding"
+	end
+	-- Flow controlled size includes padding, we give it back right away
+	if #payload > 0 then
+		send_frame(conn, WINDOW_UPDATE, 0, 0, u32(#payload))
+	end
+	local stream = conn.streams[id]
+	if not stream or not stream.remote_open then
+		if id > conn.last_stream then
+			return nil, PROTOCOL_ERROR, "DATA on an idle stream"
+		end
+		-- Stream was reset or already responded to, ignore
+		return true
+	end
+	local end_stream = bit.band(flags, END_STREAM) ~= 0
+	if not stream.headers then
+		return nil, PROTOCOL_ERROR, "DATA before HEADERS"
+	end
+	if stream.responded then
+		-- We've already rejected the request, and are sending the response
+		stream.remote_open = not end_stream
+		return true
+	end
+	stream.body_size = stream.body_size + #data
+	if stream.body_size > conn.srv.__config.max_body_size then
+		respond(conn, id, "POST", 413, {}, "A body too fat\n")
+		return true
+	end
+	stream.body = stream.body or buffer.new()
+	stream.body:put(data)
+	if end_stream then
+		stream.remote_open = false
+		conn.requests = conn.requests + 1
+		dispatch(conn, id)
+	elseif #payload > 0 then
+		send_frame(conn, WINDOW_UPDATE, 0, id, u32(#payload))
+	end
+	return true
+end
+
+handlers[SETTINGS] = function(conn, flags, id, payload)
+	if id ~= 0 then
+		return nil, PROTOCOL_ERROR, "SETTINGS on a stream"
+	end
+	if bit.band(flags, ACK) ~= 0 then
+		return true
+	end
+	if #payload % 6 ~= 0 then
+		return nil, FRAME_SIZE_ERROR, "invalid SETTINGS length"
+	end
+	for pos = 1, #payload, 6 do
+		local a, b = payload:byte(pos, pos + 1)
+		local setting = a * 256 + b
+		local value = read_u32(payload, pos + 2)
+		if setting == SETTINGS_INITIAL_WINDOW_SIZE then
+			if value > MAX_WINDOW then
+				return nil, FLOW_CONTROL_ERROR, "invalid initial window size"
+			end
+			local delta = value - conn.peer_initial_window
+			for _, stream in pairs(conn.streams) do
+				stream.send_window = stream.send_window + delta
+			end
+			conn.peer_initial_window = value
+		elseif setting == SETTINGS_MAX_FRAME_SIZE then
+			if value < DEFAULT_FRAME_SIZE or value > 16777215 then
+				return nil, PROTOCOL_ERROR, "invalid max frame size"
+			end
+			conn.peer_max_frame_size = value
+		end
+		-- SETTINGS_HEADER_TABLE_SIZE is irrelevant for us, as the encoder does not use
+		-- the dynamic table, and the rest are about things we don't do.
+	end
+	send_frame(conn, SETTINGS, ACK, 0)
+	return true
+end
+
+handlers[PING] = function(conn, flags, id, payload)
+	if id ~= 0 then
+		return nil, PROTOCOL_ERROR, "PING on a stream"
+	end
+	if #payload ~= 8 then
+		return nil, FRAME_SIZE_ERROR, "invalid PING length"
+	end
+	if bit.band(flags, ACK) == 0 then
+		send_frame(conn, PING, ACK, 0, payload)
+	end
+	return true
+end
+
+handlers[WINDOW_UPDATE] = function(conn, flags, id, payload)
+	if #payload ~= 4 then
+		return nil, FRAME_SIZE_ERROR, "invalid WINDOW_UPDATE length"
+	end
+	local increment = bit.band(read_u32(payload, 1), 0x7fffffff)
+	if id == 0 then
+		if increment == 0 then
+			return nil, PROTOCOL_ERROR, "zero window increment"
+		end
+		conn.send_window = conn.send_window + increment
+		if conn.send_window > MAX_WINDOW then
+			return nil, FLOW_CONTROL_ERROR, "connection window overflow"
+		end
+		return true
+	end
+	local stream = conn.streams[id]
+	if stream then
+		if increment == 0 then
+			reset_stream(conn, id, PROTOCOL_ERROR)
+			return true
+		end
+		stream.send_window = stream.send_window + increment
+		if stream.send_window > MAX_WINDOW then
+			reset_stream(conn, id, FLOW_CONTROL_ERROR)
+		end
+	end
+	return true
+end
+
+handlers[RST_STREAM] = function(conn, flags, id, payload)
+	if id == 0 then
+		return nil, PROTOCOL_ERROR, "RST_STREAM on stream 0"
+	end
+	if #payload ~= 4 then
+		return nil, FRAME_SIZE_ERROR, "invalid RST_STREAM length"
+	end
+	local stream = conn.streams[id]
+	if stream then
+		conn.streams[id] = nil
+		conn.open_streams = conn.open_streams - 1
+		for i, pending in ipairs(conn.pending) do
+			if pending == stream then
+				table.remove(conn.pending, i)
+				break
+			end
+		end
+	end
+	return true
+end
+
+handlers[GOAWAY] = function(conn, flags, id, payload)
+	conn.goaway_received = true
+	return true
+end
+
+handlers[PRIORITY] = function(conn, flags, id, payload)
+	if #payload ~= 5 then
+		return nil, FRAME_SIZE_ERROR, "invalid PRIORITY length"
+	end
+	return true
+end
+
+handlers[PUSH_PROMISE] = function(conn, flags, id, payload)
+	return nil, PROTOCOL_ERROR, "PUSH_PROMISE from a client"
+end
+
+--[[
+    Serves an HTTP/2 connection till the client goes away, `requests_per_fork`
+    requests are served, or the connection is idle for `http2.idle_timeout` seconds.
+    `preface_read` should be set when the caller has already consumed the
+    client connection preface (that's the case for prior knowledge h2c).
+]]
+local serve = function(srv, client, client_ip, preface_read)
+	local cfg = srv.__config
+	client:settimeout(cfg.http2.idle_timeout)
+	if not preface_read then
+		local preface, err = client:receive(#PREFACE)
+		if preface ~= PREFACE then
+			return nil, "invalid HTTP/2 connection preface: " .. tostring(err)
+		end
+	end
+
+	local conn = {
+		srv = srv,
+		client = client,
+		client_ip = client_ip or "n/a",
+		decoder = hpack.decoder(4096, cfg.http2.max_header_list_size),
+		out = buffer.new(),
+		header_block = buffer.new(),
+		streams = {},
+		open_streams = 0,
+		pending = {},
+		last_stream = 0,
+		requests = 0,
+		max_streams = cfg.http2.max_concurrent_streams,
+		send_window = DEFAULT_WINDOW,
+		peer_initial_window = DEFAULT_WINDOW,
+		peer_max_frame_size = DEFAULT_FRAME_SIZE,
+	}
+	send_frame(
+		conn,
+		SETTINGS,
+		0,
+		0,
+		string.char(0, SETTINGS_MAX_CONCURRENT_STREAMS)
+			.. u32(conn.max_streams)
+			.. string.char(0, SETTINGS_HEADER_TABLE_SIZE)
+			.. u32(4096)
+			.. string.char(0, SETTINGS_MAX_HEADER_LIST_SIZE)
+			.. u32(cfg.http2.max_header_list_size)
+	)
+	local ok, err = flush_output(conn)
+	if not ok then
+		return nil, err
+	end
+
+	while true do
+		if
+			(conn.goaway_sent or conn.goaway_received)
+			and conn.open_streams == 0
+			and #conn.pending == 0
+			and not conn.continuation
+		then
+			break
+		end
+		local ftype, flags, id, payload = read_frame(conn)
+		if not ftype then
+			local err, code = flags, id
+			if code then
+				goaway(conn, code, err)
+			elseif err == "timeout" then
+				goaway(conn, NO_ERROR)
+			end
+			return nil, err
+		end
+		if conn.continuation and ftype ~= CONTINUATION then
+			goaway(conn, PROTOCOL_ERROR)
+			return nil, "expected CONTINUATION frame"
+		end
+		local handler = handlers[ftype]
+		-- Unknown frame types must be ignored
+		if handler then
+			local ok, code, msg = handler(conn, flags, id, payload)
+			if not ok then
+				goaway(conn, code, msg)
+				return nil, msg
+			end
+		end
+		if not conn.goaway_sent and conn.requests >= cfg.requests_per_fork then
+			-- Let the client know it should open a new connection for further requests,
+			-- the streams we've already got are still served.
+			send_frame(conn, GOAWAY, 0, 0, u32(conn.last_stream) .. u32(NO_ERROR))
+			conn.goaway_sent = true
+		end
+		local ok, err = flush(conn)
+		if not ok then
+			return nil, err
+		end
+	end
+	return true
+end
+
+return {
+	PREFACE = PREFACE,
+	serve = serve,
+}
@@ -2,8 +2,12 @@
 -- SPDX-License-Identifier: GPL-3.0-or-later
 local std = require("std")
 local socket = require("socket")
+local unix = require("socket.unix")
 local buffer = require("string.buffer")
 local ssl = require("ssl")
+local uring = require("std.uring")
+local h2 = require("web_server.h2")
+local body_io = require("web_server.body")
 
 local premature_error = function(client, status, msg)
 	local resp = "HTTP/1.1 "
@@ -52,6 +56,103 @@ local read_chunked_body = function(client)
 	return table.concat(body)
 end
 
+local send_streamed = function(client, producer, chunked)
+	local sent = 0
+	while true do
+		local chunk, err = body_io.next_chunk(producer)
+		if not chunk then
+			if err then
+				return nil, "response producer failed: " .. tostring(err)
+			end
+			break
+		end
+		if #chunk > 0 then
+			local _, err
+			if chunked then
+				_, err = client:send(string.format("%x\r\n", #chunk) .. chunk .. "\r\n")
+			else
+				_, err = client:send(chunk)
+			end
+			if err then
+				return nil, "failed to send response: " .. err
+			end
+			sent = sent + #chunk
+		end
+	end
+	if chunked then
+		local _, err = client:send("0\r\n\r\n")
+		if err then
+			return nil, "failed to send response: " .. err
+		end
+	end
+	return sent
+end
+
+-- Upper bounds (in KB) of the buckets of the per request allocation histogram
+local alloc_buckets = { 16, 64, 256, 1024, 4096 }
+
+--[[
+    Per request memory accounting, done in request processing forks.
+    Allocation is measured as the growth of the Lua heap while a request
+    is processed (`mem_start` is `collectgarbage("count")` at its start),
+    so it's a lower bound: whatever the collector frees meanwhile is not counted.
+    With `gc.step` on, the collector mostly runs between requests, so that's seldom much.
+    Returns the allocated KB.
+]]
+local server_account_request = function(self, mem_start)
+	local kb = math.max(collectgarbage("count") - mem_start, 0)
+	local alloc = self.__alloc
+	if alloc then
+		alloc.requests = alloc.requests + 1
+		alloc.kb = alloc.kb + kb
+		alloc.last = kb
+		local bucket = #alloc_buckets + 1
+		for i, le in ipairs(alloc_buckets) do
+			if kb <= le then
+				bucket = i
+				break
+			end
+		end
+		alloc.buckets[bucket] = alloc.buckets[bucket] + 1
+	end
+	return kb
+end
+
+-- Does the GC work for what the last request allocated, while the client is
+-- busy with the response, so that it's not done in the middle of the next request.
+local gc_step = function(self)
+	local alloc = self.__alloc
+	if self.__config.gc.step and alloc and alloc.last > 0 then
+		collectgarbage("step", math.ceil(alloc.last))
+		alloc.last = 0
+	end
+end
+
+--[[
+    Handlers may also return `{ file = path }` as the content to send a file.
+    With the `io_uring` option, files are spliced to plain TCP connections
+    (see `send_file` in uring.c), so their content never gets to the user space.
+    Otherwise, and over TLS, they are read and sent piece by piece.
+]]
+local send_file = function(self, client, path)
+	-- TLS is done in the user space, there is nothing to splice into
+	if self.__config.io_uring and not client.dohandshake then
+		local ring = uring.shared()
+		if ring then
+			local sent, err = ring:send_file(client:getfd(), path, nil, nil, self.__config.send_timeout)
+			if not sent then
+				return nil, "failed to send file: " .. err
+			end
+			return sent
+		end
+	end
+	local producer, err = std.fs.file_chunks(path)
+	if not producer then
+		return nil, "failed to open file: " .. err
+	end
+	return send_streamed(client, producer, false)
+end
+
 --[[ 
         This is a very naive implementation of HTTP request parsing.
 
@@ -73,6 +174,7 @@ end
 
 local server_process_request = function(self, client, client_ip, count)
 	local start_time = os.clock()
+	local mem_start = collectgarbage("count")
 	local lines = {}
 	local client_ip = client_ip or "n/a"
 	local line = ""
@@ -96,7 +198,20 @@ local server_process_request = function(self, client, client_ip, count)
 	end
 
 	local request = table.remove(lines, 1)
-	local method, query, args = request:match("([A-Z]+) ([^?]*)%?-(.-) HTTP/1%.[01]$")
+	if request == "PRI * HTTP/2.0" and self.__config.http2.enabled and count == 1 then
+		-- Prior knowledge h2c: the rest of the connection preface is "SM\r\n\r\n"
+		local sm = client:receive()
+		local empty = client:receive()
+		if sm ~= "SM" or empty ~= "" then
+			return nil, "invalid HTTP/2 connection preface"
+		end
+		local ok, err = h2.serve(self, client, client_ip, true)
+		if not ok then
+			return nil, err
+		end
+		return "close"
+	end
+	local method, query, args, minor_version = request:match("([A-Z]+) ([^?]*)%?-(.-) HTTP/1%.([01])$")
 	if not method then
 		premature_error(client, 400, "Unsupported protocol\n")
 		return nil, "Unsupported protocol"
@@ -117,7 +232,8 @@ local server_process_request = function(self, client, client_ip, count)
 			content_length = tonumber(value)
 		end
 	end
-	if headers["transfer-encoding"] then
+	local streaming = self.__config.streaming.request_body
+	if headers["transfer-encoding"] and not streaming then
 		body, err = read_chunked_body(client)
 		if err then
 			premature_error(client, 501, "handle transfer-encoding failed\n")
@@ -129,7 +245,21 @@ local server_process_request = function(self, client, client_ip, count)
 		return nil, "no Host header"
 	end
 	local host = headers.host
-	if content_length > 0 then
+	local body_reader
+	if streaming then
+		local max_size = self.__config.streaming.max_body_size
+		if max_size > 0 and content_length > max_size then
+			premature_error(client, 413, "A body too fat\n")
+			return nil, "max_body_size limit violation: " .. tostring(content_length)
+		end
+		body_reader = body_io.new_reader(
+			client,
+			content_length,
+			headers["transfer-encoding"] ~= nil,
+			max_size,
+			self.__config.streaming.chunk_size
+		)
+	elseif content_length > 0 then
 		if content_length > self.__config.max_body_size then
 			premature_error(client, 413, "A body too fat\n")
 			return nil, "max_body_size limit violation: " .. tostring(content_length)
@@ -148,22 +278,42 @@ local server_process_request = function(self, client, client_ip, count)
 	then
 		compress_output = true
 	end
-	headers["x-real-ip"] = client_ip
+	if not (self.__unix and headers["x-real-ip"]) then
+		headers["x-real-ip"] = client_ip
+	end
 
 	local content, status, response_headers = self.handle(method, query, args, headers, body, {
 		logger = self.logger,
 		client = client,
 		cfg = self.__config,
+		body = body_reader,
 	})
 	if content == nil and status == nil and response_headers == nil then
 		-- request was proxied, so we just return the connection state...
 		return "keep-alive"
 	end
+	local producer
+	if type(content) == "function" or type(content) == "thread" then
+		producer = content
+		content = nil
+	end
 
 	response_headers = response_headers or {}
 	if not response_headers["content-type"] then
 		response_headers["content-type"] = "text/html"
 	end
+	local file
+	if type(content) == "table" and content.file then
+		local st = std.fs.stat(content.file)
+		if st and st.mode == "f" then
+			file = content.file
+			content = nil
+			response_headers["content-length"] = tostring(st.size)
+		else
+			self.logger:log("file to send not found: " .. tostring(content.file), "error")
+			status, content = 404, "Not found\n"
+		end
+	end
 	if content and #content > 0 then
 		if
 			compress_output
@@ -184,6 +334,20 @@ local server_process_request = function(self, client, client_ip, count)
 	if (headers["connection"] and headers["connection"] == "close") or count == self.__config.requests_per_fork then
 		response_headers["connection"] = "close"
 	end
+	if body_reader and not body_reader.done then
+		-- The handler did not read the whole body, so we can't reuse the connection
+		response_headers["connection"] = "close"
+	end
+	local chunked = false
+	if producer and not response_headers["content-length"] then
+		if minor_version == "1" then
+			chunked = true
+			response_headers["transfer-encoding"] = "chunked"
+		else
+			-- HTTP/1.0 clients get the body delimited by closing the connection
+			response_headers["connection"] = "close"
+		end
+	end
 
 	local buf = buffer.new()
 	buf:put("HTTP/1.1 ", tostring(status), " \n")
@@ -202,7 +366,21 @@ local server_process_request = function(self, client, client_ip, count)
 	if err then
 		return nil, "failed to send response: " .. err
 	end
+	local size = #(content or "")
+	if file and method ~= "HEAD" then
+		size, err = send_file(self, client, file)
+		if not size then
+			return nil, err
+		end
+	end
+	if producer and method ~= "HEAD" then
+		size, err = send_streamed(client, producer, chunked)
+		if not size then
+			return nil, err
+		end
+	end
 
+	local alloc = self:account_request(mem_start)
 	if self.logger:level() <= 10 then
 		local elapsed_time = os.clock() - start_time
 		local log_msg = {
@@ -211,8 +389,9 @@ local server_process_request = function(self, client, client_ip, count)
 			query = query,
 			status = status,
 			process = self.__config.process,
-			size = #content,
+			size = size,
 			time = string.format("%.4f", elapsed_time),
+			alloc_kb = string.format("%.1f", alloc),
 		}
 		for _, h in ipairs(self.__config.log_headers) do
 			if headers[h] then
@@ -224,114 +403,470 @@ local server_process_request = function(self, client, client_ip, count)
 	return response_headers["connection"]
 end
 
-local server_serve = function(self)
-	local server_forks = {}
-	local server_fork_count = 0
+local SIGHUP = 1
+local SIGCHLD = 17
+
+-- Rejects a connection right in the manager process, without forking.
+-- For SSL servers we can't talk HTTP before the handshake, and doing
+-- the handshake here would defeat the purpose, so we just close the connection.
+local shed_connection = function(self, client, status, msg)
+	if not self.__config.ssl then
+		client:settimeout(0)
+		client:send(
+			"HTTP/1.1 "
+				.. tostring(status)
+				.. " \n"
+				.. "Connection: close\n"
+				.. "Retry-After: "
+				.. tostring(self.__config.overload.retry_after)
+				.. "\n"
+				.. "Content-Length: "
+				.. tostring(#msg)
+				.. "\n\n"
+				.. msg
+		)
+	end
+	client:close()
+end
 
-	local server = assert(socket.tcp())
+local report_overload = function(self, stats, fork_count)
+	local cfg = self.__config
+	local now = os.time()
+	if now - stats.last_report < cfg.overload.report_interval then
+		return
+	end
+	stats.last_report = now
+	local shed = stats.shed_fork_limit + stats.shed_per_ip
+	if shed == stats.last_shed then
+		return
+	end
+	stats.last_shed = shed
+	self.logger:log({
+		msg = "overload stats",
+		process = cfg.process,
+		forks = fork_count,
+		peak_forks = stats.peak_forks,
+		accepted = stats.accepted,
+		shed_fork_limit = stats.shed_fork_limit,
+		shed_per_ip = stats.shed_per_ip,
+	}, "warn")
+	if self.report_overload then
+		self.report_overload(cfg.process, stats)
+	end
+end
+
+--[[
+    Creates the listening socket. Besides an IP address, `ip` can be
+
+        unix:/path/to/socket  -- a Unix domain socket, a stale socket file is removed first,
+                                 `unix_mode` (e.g. "0660") is applied to the new one
+        unix:@name            -- a Unix domain socket in the abstract namespace, no file involved
+        fd:3                  -- an already listening TCP or Unix domain socket inherited
+                                 from the parent, i.e. socket activation
+
+    `port` is ignored for all of these. Returns the socket and
+    its family, "inet" or "unix", or nil and an error message.
+
+    TCP listeners are bound with SO_REUSEPORT, so several servers can share
+    a port. With `incoming_cpu` set, the kernel (6.2+) prefers the listener for
+    connections processed by that CPU, which, with the server pinned to it,
+    keeps a connection on one CPU all the way.
+]]
+local listen = function(cfg)
+	local ip = tostring(cfg.ip)
+	local fd = tonumber(ip:match("^fd:(%d+)$"))
+	if fd then
+		-- There is no way to tell the family of the socket to luasocket,
+		-- but only TCP sockets have an IP address.
+		local server = socket.tcp()
+		server:close()
+		server:setfd(fd)
+		local family = "inet"
+		if not server:getsockname() then
+			server:setfd(-1) -- so that it's not closed with the garbage
+			server = unix.stream()
+			server:close()
+			server:setfd(fd)
+			family = "unix"
+		end
+		-- listen on a listening socket only updates the backlog
+		local ok, err = server:listen(cfg.backlog)
+		if not ok then
+			return nil, "inherited fd " .. fd .. " is not a socket: " .. tostring(err)
+		end
+		server:settimeout(0)
+		return server, family
+	end
+
+	local path = ip:match("^unix:(.+)$")
+	if path then
+		if path:sub(1, 1) ~= "@" and std.fs.stat(path) then
+			-- The file might still be in use by another server,
+			-- only remove it when nobody's listening.
+			local probe = unix.stream()
+			if probe:connect(path) then
+				probe:close()
+				return nil, path .. " is in use"
+			end
+			probe:close()
+			os.remove(path)
+		end
+		local server = unix.stream()
+		local ok, err = server:bind(path)
+		if not ok then
+			return nil, "failed to bind " .. path .. ": " .. tostring(err)
+		end
+		if cfg.unix_mode and path:sub(1, 1) ~= "@" then
+			std.fs.chmod(path, cfg.unix_mode)
+		end
+		ok, err = server:listen(cfg.backlog)
+		if not ok then
+			return nil, err
+		end
+		server:settimeout(0)
+		return server, "unix"
+	end
+
+	-- The socket must exist before the options are set, `socket.tcp()`
+	-- would only create it on bind. IPv6 servers don't take IPv4 connections,
+	-- there is a separate server for them.
+	local server
+	if ip:find(":", 1, true) then
+		server = assert(socket.tcp6())
+		server:setoption("ipv6-v6only", true)
+	else
+		server = assert(socket.tcp4())
+	end
 	server:setoption("reuseaddr", true)
 	server:setoption("reuseport", true)
-	assert(server:bind(self.__config.ip, self.__config.port))
-	server:listen(self.__config.backlog)
+	if cfg.incoming_cpu then
+		server:setoption("incoming-cpu", cfg.incoming_cpu)
+	end
+	local ok, err = server:bind(cfg.ip, cfg.port)
+	if not ok then
+		return nil, err
+	end
+	server:listen(cfg.backlog)
 	server:settimeout(0)
+	return server, "inet"
+end
+
+-- Hands the allocation stats of a request processing fork to
+-- the `report_alloc` hook, if there is one, when the fork is done.
+local report_alloc = function(self)
+	if self.report_alloc and self.__alloc.requests > 0 then
+		self.report_alloc(self.__config.process, self.__alloc)
+	end
+end
+
+-- Runs the hooks of a request processing fork that's about to exit
+local fork_done = function(self)
+	if self.on_exit then
+		self:on_exit()
+	end
+	report_alloc(self)
+end
+
+local server_serve = function(self)
+	local server_forks = {}
+	local server_fork_count = 0
+	local forks_per_ip = {}
+	local cfg = self.__config
+	local stats = {
+		accepted = 0,
+		shed_fork_limit = 0,
+		shed_per_ip = 0,
+		peak_forks = 0,
+		last_report = os.time(),
+		last_shed = 0,
+	}
+
+	local server, family = assert(listen(cfg))
+	-- Connections to a Unix domain socket come from a reverse proxy
+	-- on the same host, so they are all alike: there is no client IP
+	-- to limit connections by, and the proxy's X-Real-IP header is kept.
+	self.__unix = family == "unix"
+	-- Children are reaped only when we get SIGCHLD, which
+	-- we wait for with `select` together with the listening socket.
+	local sigchld = assert(std.ps.signalfd(SIGCHLD))
+	-- SIGHUP makes the server reload its config and SSL contexts,
+	-- without closing the listening socket.
+	local sighup = assert(std.ps.signalfd(SIGHUP))
 	local ip, port = server:getsockname()
+	if self.__unix then
+		ip, port = "unix:" .. tostring(ip), nil
+	end
 	self.logger:log({
 		msg = "Started HTTP server",
 		ip = ip,
 		port = tonumber(port),
-		backlog = self.__config.backlog,
-		fork_limit = self.__config.fork_limit,
-		requests_per_fork = self.__config.requests_per_fork,
+		backlog = cfg.backlog,
+		fork_limit = cfg.fork_limit,
+		requests_per_fork = cfg.requests_per_fork,
+		max_per_ip = cfg.overload.max_per_ip,
 		log_level = self.logger:level(),
 		log_level_str = self.logger:level_str(),
-		process = self.__config.process,
+		process = cfg.process,
 	})
 
-	while true do
-		-- Do house keeping
-		for i = 1, server_fork_count do
-			local id = std.ps.waitpid(-1)
-			if server_forks[id] then
+	local reap = function()
+		sigchld:read()
+		for _, pid in ipairs(std.ps.reap()) do
+			local client_ip = server_forks[pid]
+			if client_ip then
+				server_forks[pid] = nil
 				server_fork_count = server_fork_count - 1
-				server_forks[id] = nil
+				forks_per_ip[client_ip] = forks_per_ip[client_ip] - 1
+				if forks_per_ip[client_ip] == 0 then
+					forks_per_ip[client_ip] = nil
+				end
 			end
 		end
-		local _, _, timeout = socket.select({ server }, nil, 1)
-		if not timeout then
-			if server_fork_count < self.__config.fork_limit then
-				local client, err = server:accept()
-				local pid = 1
-				pid = std.ps.fork()
-				if pid < 0 then
-					self.logger:log("failed to fork for request processing", "error")
-				end
+	end
 
-				if pid > 0 then
-					server_forks[pid] = os.time()
-					server_fork_count = server_fork_count + 1
-				end
+	local watchers = {}
+	for _, setup in ipairs(self.__watchers) do
+		local sock, handler = setup()
+		if sock then
+			watchers[sock] = handler
+		end
+	end
+	local watched, not_accepting
+	local update_watched = function()
+		watched = { sigchld, sighup, server }
+		not_accepting = { sigchld, sighup }
+		for sock, _ in pairs(watchers) do
+			table.insert(watched, sock)
+			table.insert(not_accepting, sock)
+		end
+	end
+	update_watched()
+	while true do
+		-- The config may be replaced on SIGHUP, see `server_reload`
+		cfg = self.__config
+		-- When we are at the fork limit and shedding is disabled,
+		-- new connections wait in the listen backlog until a child exits.
+		local at_limit = server_fork_count >= cfg.fork_limit
+		local wait_for = watched
+		if at_limit and not cfg.overload.shed then
+			wait_for = not_accepting
+		end
+		local ready = socket.select(wait_for, nil, 1)
+		if ready[sigchld] then
+			reap()
+		end
+		if ready[sighup] then
+			sighup:read()
+			self:reload()
+			cfg = self.__config
+		end
+		for sock, handler in pairs(watchers) do
+			if (ready[sock] or sock:getfd() < 0) and handler(sock) == false then
+				watchers[sock] = nil
+				update_watched()
+			end
+		end
+		if ready[server] then
+			local client, err = server:accept()
+			if client then
+				local client_ip = self.__unix and "unix" or client:getpeername() or "n/a"
+				local per_ip = forks_per_ip[client_ip] or 0
+				if server_fork_count >= cfg.fork_limit then
+					stats.shed_fork_limit = stats.shed_fork_limit + 1
+					shed_connection(self, client, 503, "Server is overloaded\n")
+				elseif not self.__unix and cfg.overload.max_per_ip > 0 and per_ip >= cfg.overload.max_per_ip then
+					stats.shed_per_ip = stats.shed_per_ip + 1
+					shed_connection(self, client, 429, "Too many connections\n")
+				else
+					stats.accepted = stats.accepted + 1
+					local pid = std.ps.fork()
+					if pid < 0 then
+						self.logger:log("failed to fork for request processing", "error")
+						client:close()
+					end
 
-				if pid == 0 and client then
-					local client_ip = client:getpeername()
-					local count = 1
-					local ssl_client, err
-
-					if self.__config.ssl then
-						-- Use the pre-loaded default context
-						ssl_client, err = ssl.wrap(client, {
-							mode = "server",
-							ctx = self.__ssl_contexts.default,
-						})
-
-						if not ssl_client then
-							self.logger:log("failed to wrap client with SSL: " .. err, "error")
-							client:close()
-							os.exit(1)
+					if pid > 0 then
+						server_forks[pid] = client_ip
+						forks_per_ip[client_ip] = per_ip + 1
+						server_fork_count = server_fork_count + 1
+						if server_fork_count > stats.peak_forks then
+							stats.peak_forks = server_fork_count
 						end
+						client:close()
+					end
 
-						-- Add pre-loaded SNI contexts
-						if self.__ssl_contexts.hosts then
-							for hostname, ctx in pairs(self.__ssl_contexts.hosts) do
-								ssl_client:add_sni_context(hostname, ctx)
-							end
+					if pid == 0 then
+						sigchld:close()
+						sighup:close()
+						server:close()
+						collectgarbage("setpause", cfg.gc.pause)
+						collectgarbage("setstepmul", cfg.gc.stepmul)
+						self.__alloc = { requests = 0, kb = 0, last = 0, buckets = { 0, 0, 0, 0, 0, 0 } }
+						if self.on_fork then
+							self:on_fork()
 						end
+						local count = 1
+						local ssl_client, err
+
+						if cfg.ssl then
+							-- Use the pre-loaded default context
+							ssl_client, err = ssl.wrap(client, {
+								mode = "server",
+								ctx = self.__ssl_contexts.default,
+							})
+
+							if not ssl_client then
+								self.logger:log("failed to wrap client with SSL: " .. err, "error")
+								client:close()
+								os.exit(1)
+							end
 
-						local status, err = ssl_client:dohandshake()
-						if not status then
-							self.logger:log("SSL handshake failed: " .. err, "debug")
-							ssl_client:close()
-							os.exit(1)
+							-- Add pre-loaded SNI contexts
+							if self.__ssl_contexts.hosts then
+								for hostname, ctx in pairs(self.__ssl_contexts.hosts) do
+									ssl_client:add_sni_context(hostname, ctx)
+								end
+							end
+
+							local status, err = ssl_client:dohandshake()
+							if not status then
+								self.logger:log("SSL handshake failed: " .. err, "debug")
+								ssl_client:close()
+								os.exit(1)
+							end
+							if ssl_client:getalpn() == "h2" then
+								local ok, err = h2.serve(self, ssl_client, client_ip)
+								if not ok and err ~= "closed" then
+									self.logger:log(err, "debug")
+								end
+								if self.after_request then
+									self:after_request()
+								end
+								ssl_client:close()
+								fork_done(self)
+								os.exit(0)
+							end
 						end
-					end
-					repeat
-						local state, err = self:process_request(ssl_client or client, client_ip, count)
-						if err then
-							if err == "closed" then
-								self.logger:log("client closed connection", "debug")
-							else
-								self.logger:log(err, "debug")
+						repeat
+							local state, err = self:process_request(ssl_client or client, client_ip, count)
+							if err then
+								if err == "closed" then
+									self.logger:log("client closed connection", "debug")
+								else
+									self.logger:log(err, "debug")
+								end
+								state = "close"
+							end
+							if self.after_request then
+								self:after_request()
 							end
-							state = "close"
+							count = count + 1
+							if state ~= "close" and count <= cfg.requests_per_fork then
+								gc_step(self)
+							end
+						until state == "close" or count > cfg.requests_per_fork
+						if ssl_client then
+							ssl_client:close()
 						end
-						count = count + 1
-					until state == "close" or count > self.__config.requests_per_fork
-					if ssl_client then
-						ssl_client:close()
+						client:close()
+						fork_done(self)
+						os.exit(0)
 					end
-					client:close()
-					os.exit(0)
 				end
-			else
-				self.logger:log("fork limit reached", "error")
 			end
 		end
+		report_overload(self, stats, server_fork_count)
 	end
 end
 
+--[[
+    Besides `watch`, there are a few hooks a server can be extended with,
+    all of them are optional fields of the server object:
+
+        reload_config()        -- returns a fresh config on SIGHUP, see `server_reload`
+        report_overload(process, stats)
+                               -- called with the overload counters when there was shedding
+        on_fork(self)          -- called in each request processing fork, before it serves the connection
+        after_request(self)    -- called in the fork after each request (after the whole connection for HTTP/2)
+        on_exit(self)          -- called in the fork when it's done serving the connection, before it exits
+        report_alloc(process, alloc)
+                               -- called when a fork is done, with its allocation stats: number of `requests`,
+                               -- `kb` allocated in total, and `buckets`, request counts by allocated KB,
+                               -- see `alloc_buckets` (the last one counts the bigger ones)
+]]
+
+--[[
+    Registers an extra socket to be watched by the server's main loop.
+    `setup` is called once in the server process, when it starts serving,
+    and must return a socket (anything with the `getfd` method) and a handler,
+    which is called with the socket whenever it becomes readable.
+    If the handler returns `false`, the socket is no longer watched.
+    While `getfd` returns -1 (e.g. the connection behind it is down), the handler
+    is called on each pass of the loop instead, so that it can reconnect.
+
+    Handlers run in the server process, so any state they change is
+    inherited by the request processing forks spawned afterwards.
+]]
+local server_watch = function(self, setup)
+	table.insert(self.__watchers, setup)
+end
+
 local sample_handle = function()
 	return "Hi there!", 200, {}
 end
 
+-- A fresh copy of the defaults, which configs given to `new` and `reload_config` are merged into.
+local default_config = function()
+	return {
+		ip = "127.0.0.1",
+		port = 8080,
+		backlog = 256,
+		fork_limit = 64,
+		requests_per_fork = 512,
+		max_body_size = 1024 * 1024 * 5, -- 5 megabytes is plenty.
+		request_line_limit = 1024 * 8, -- 8Kb for the request line or a single header is HUGE! I'm too generous here.
+		compression = {
+			enabled = true,
+			min_size = 4096, -- Do not compress files smaller than 4Kb
+			types = { -- MIME types that are eligible for compression
+				["text/html"] = true,
+				["text/plain"] = true,
+				["text/css"] = true,
+				["text/javascript"] = true,
+				["image/svg+xml"] = true,
+				["application/json"] = true,
+				["application/rss+xml"] = true,
+			},
+		},
+		overload = {
+			shed = true, -- reply with 503 right away when at the fork limit, otherwise connections wait in the backlog
+			retry_after = 5, -- value of the Retry-After header for shed connections
+			max_per_ip = 0, -- max concurrent connections from a single client IP, 0 means no limit
+			report_interval = 60, -- how often (in seconds) to report overload stats, if there was any shedding
+		},
+		http2 = {
+			enabled = false, -- negotiate h2 via ALPN for SSL servers, accept prior knowledge h2c otherwise
+			max_concurrent_streams = 100,
+			idle_timeout = 60, -- close idle HTTP/2 connections after this many seconds
+			max_header_list_size = 64 * 1024, -- decoded size of a request's headers, as counted by RFC 7541
+		},
+		streaming = {
+			request_body = false, -- pass a body reader to handlers as `ctx.body`, instead of the body string
+			max_body_size = 0, -- limit for streamed request bodies, 0 means no limit
+			chunk_size = 64 * 1024, -- default size of the pieces returned by the body reader
+		},
+		gc = { -- collector settings of request processing forks
+			pause = 200, -- collectgarbage("setpause"), LuaJIT's default
+			stepmul = 200, -- collectgarbage("setstepmul"), LuaJIT's default
+			step = true, -- between keep-alive requests, do the GC work for what the last one allocated
+		},
+		io_uring = false, -- splice files returned as `{ file = path }` to plain connections with io_uring, if available
+		send_timeout = 60, -- fail a spliced file when the client doesn't take any of it for this many seconds
+		log_level = "access",
+		log_headers = { "referer", "x-real-ip", "user-agent" }, -- request headers to include in the access log.
+	}
+end
+
 --[[
 
     Format of the config.ssl section:
@@ -347,34 +882,43 @@ end
 
 local server_configure = function(self, config)
 	local config = config or {}
-	self.__config = std.tbl.merge(self.__config, config)
-	self.logger:set_level(self.__config.log_level)
-	if self.__config.ssl then
+	-- Everything is prepared first, and only then swapped in,
+	-- so a failed (re)configuration leaves the server as it was.
+	-- The config is built from the defaults every time, so that settings
+	-- removed from a reloaded config don't linger.
+	local new_config = std.tbl.merge(default_config(), config)
+	local ssl_contexts = {}
+	if new_config.ssl then
+		local alpn
+		if new_config.http2.enabled then
+			alpn = { "h2", "http/1.1" }
+		end
 		-- Create default context
-		if self.__config.ssl.default then
+		if new_config.ssl.default then
 			if
-				not std.fs.file_exists(self.__config.ssl.default.cert)
-				or not std.fs.file_exists(self.__config.ssl.default.key)
+				not std.fs.file_exists(new_config.ssl.default.cert)
+				or not std.fs.file_exists(new_config.ssl.default.key)
 			then
 				return nil, "can't find default SSL cert/key"
 			end
 
 			local cfg = {
 				mode = "server",
-				keyfile = self.__config.ssl.default.key,
-				certfile = self.__config.ssl.default.cert,
+				keyfile = new_config.ssl.default.key,
+				certfile = new_config.ssl.default.cert,
+				alpn = alpn,
 			}
 			local ctx, err = ssl.newcontext(cfg)
 			if not ctx then
 				return nil, "failed to create default SSL context: " .. err
 			end
-			self.__ssl_contexts.default = ctx
+			ssl_contexts.default = ctx
 		end
 
 		-- Create contexts for additional hosts
-		if self.__config.ssl.hosts then
-			self.__ssl_contexts.hosts = {}
-			for domain, ssl_config in pairs(self.__config.ssl.hosts) do
+		if new_config.ssl.hosts then
+			ssl_contexts.hosts = {}
+			for domain, ssl_config in pairs(new_config.ssl.hosts) do
 				if not std.fs.file_exists(ssl_config.cert) or not std.fs.file_exists(ssl_config.key) then
 					return nil, "Can't find SSL cert for the " .. domain .. " domain"
 				end
@@ -383,15 +927,47 @@ local server_configure = function(self, config)
 					mode = "server",
 					keyfile = ssl_config.key,
 					certfile = ssl_config.cert,
+					alpn = alpn,
 				}
 				local ctx, err = ssl.newcontext(cfg)
 				if not ctx then
 					return nil, "failed to create SSL context for " .. domain .. ": " .. err
 				end
-				self.__ssl_contexts.hosts[domain] = ctx
+				ssl_contexts.hosts[domain] = ctx
 			end
 		end
 	end
+	self.__config = new_config
+	self.__ssl_contexts = ssl_contexts
+	self.logger:set_level(self.__config.log_level)
+	return true
+end
+
+--[[
+    Reloads the server config with the `reload_config` hook, if there is one.
+    The hook should return a fresh config table. The listening socket is kept
+    as is, so changes of the address, port and backlog are ignored.
+
+    Connections that are being served at the moment are not affected,
+    their forks keep the old config and SSL contexts till they exit,
+    all new connections are served with the new ones.
+]]
+local server_reload = function(self)
+	if not self.reload_config then
+		return nil, "no reload_config hook"
+	end
+	local config, err = self.reload_config()
+	if config then
+		for _, key in ipairs({ "ip", "port", "backlog", "process" }) do
+			config[key] = self.__config[key]
+		end
+		config, err = self:configure(config)
+	end
+	if not config then
+		self.logger:log({ msg = "config reload failed", process = self.__config.process, err = err }, "error")
+		return nil, err
+	end
+	self.logger:log({ msg = "config reloaded", process = self.__config.process })
 	return true
 end
 
@@ -400,36 +976,17 @@ local server_new = function(config, handle)
 	local handle = handle or sample_handle
 
 	local srv = {
-		__config = {
-			ip = "127.0.0.1",
-			port = 8080,
-			backlog = 256,
-			fork_limit = 64,
-			requests_per_fork = 512,
-			max_body_size = 1024 * 1024 * 5, -- 5 megabytes is plenty.
-			request_line_limit = 1024 * 8, -- 8Kb for the request line or a single header is HUGE! I'm too generous here.
-			compression = {
-				enabled = true,
-				min_size = 4096, -- Do not compress files smaller than 4Kb
-				types = { -- MIME types that are eligible for compression
-					["text/html"] = true,
-					["text/plain"] = true,
-					["text/css"] = true,
-					["text/javascript"] = true,
-					["image/svg+xml"] = true,
-					["application/json"] = true,
-					["application/rss+xml"] = true,
-				},
-			},
-			log_level = "access",
-			log_headers = { "referer", "x-real-ip", "user-agent" }, -- request headers to include in the access log.
-		},
+		__config = default_config(),
 		__ssl_contexts = {},
+		__watchers = {},
 		handle = handle,
 		logger = std.logger.new("access"),
 		process_request = server_process_request,
+		account_request = server_account_request,
 		configure = server_configure,
+		reload = server_reload,
 		serve = server_serve,
+		watch = server_watch,
 	}
 	local ok, err = srv:configure(config)
 	if not ok then
@@ -438,4 +995,4 @@ local server_new = function(config, handle)
 	return srv
 end
 
-return { new = server_new }
+return { new = server_new, alloc_buckets = alloc_buckets }
@@ -6,10 +6,21 @@
 
 local std = require("std")
 local socket = require("socket")
+local unix = require("socket.unix")
 local ssl = require("ssl")
 
+-- Besides `host:port/db`, the URL can be `unix:/path/to/redis.sock/db`,
+-- or `unix:@name/db` for a socket in the abstract namespace.
 local config_from_string = function(url)
 	local url = url or "127.0.0.1:6379"
+	local path = url:match("^unix:(.+)$")
+	if path then
+		local db = tonumber(path:match("/(%d%d?)$"))
+		if db then
+			path = path:gsub("/%d%d?$", "")
+		end
+		return { socket = path, db = db }
+	end
 	return {
 		host = url:match("^[^:]+"),
 		port = tonumber(url:match("^[^:]+:(%d+)")) or 6379,
@@ -41,7 +52,7 @@ local read_simple_type = function(client)
 			return { value = err_msg, type = "error" }
 		end
 		if line:match("^:") then
-			local num = line:match("^:([%d]+)")
+			local num = line:match("^:(%-?[%d]+)")
 			return { type = "int", value = tonumber(num) }
 		end
 		if line:match("^%+") then
@@ -69,40 +80,166 @@ local read_simple_type = function(client)
 			end
 			return { type = "arr", size = size, value = value }
 		end
+		-- RESP3 only types
+		if line:match("^_") then
+			return { type = "null", value = "NULL" }
+		end
+		if line:match("^#") then
+			return { type = "bool", value = line == "#t" }
+		end
+		if line:match("^,") then
+			local num = line:sub(2)
+			local value = tonumber(num)
+			if not value then
+				value = (num == "inf" and math.huge) or (num == "-inf" and -math.huge) or 0 / 0
+			end
+			return { type = "double", value = value }
+		end
+		if line:match("^%(") then
+			local num = line:sub(2)
+			return { type = "bignum", value = tonumber(num) or num }
+		end
+		if line:match("^[!=]") then
+			local size = tonumber(line:sub(2))
+			local str = client:receive(size)
+			client:receive()
+			if line:match("^!") then
+				return { type = "error", value = str }
+			end
+			-- verbatim strings start with the format, e.g. `txt:`
+			return { type = "bstr", value = str:sub(5) }
+		end
+		local aggregates = { ["%"] = "map", ["~"] = "set", ["|"] = "attr", [">"] = "push" }
+		if aggregates[line:sub(1, 1)] then
+			return { type = aggregates[line:sub(1, 1)], size = tonumber(line:sub(2)), value = {} }
+		end
+		return nil, "unknown reply type: " .. line
 	end
 	return nil, err
 end
 
-local read_array
+local read_reply
 
-read_array = function(client, size)
-	local value = {}
-	for i = 1, size do
-		local resp, err = read_simple_type(client)
+local read_elements = function(client, count)
+	local elements = {}
+	for i = 1, count do
+		local resp, err = read_reply(client)
+		if not resp then
+			return nil, err
+		end
+		elements[i] = resp.value
+	end
+	return elements
+end
+
+-- Reads a complete reply, including all the elements of arrays, maps & co.
+-- Maps become Lua tables with the map's keys, all other aggregates are arrays.
+read_reply = function(client)
+	local resp, err = read_simple_type(client)
+	if not resp then
+		return nil, err
+	end
+	if resp.type == "attr" then
+		-- Attributes are auxiliary data sent before the actual reply, we don't use them
+		local _, err = read_elements(client, resp.size * 2)
 		if err then
 			return nil, err
 		end
-		if resp.type == "arr" and resp.size > 0 then
-			table.insert(value, read_array(client, resp.size))
+		return read_reply(client)
+	end
+	if resp.size and resp.size > 0 then
+		local count = resp.size
+		if resp.type == "map" then
+			count = count * 2
+		end
+		local elements, err = read_elements(client, count)
+		if not elements then
+			return nil, err
+		end
+		if resp.type == "map" then
+			for i = 1, count, 2 do
+				resp.value[elements[i]] = elements[i + 1]
+			end
 		else
-			table.insert(value, resp.value)
+			resp.value = elements
 		end
 	end
-	return value
+	return resp
 end
 
-local read_response = function(client)
-	local resp, err = read_simple_type(client)
-	if err then
-		return nil, err
+--[[
+    Client side caching.
+
+    With `tracking` set in the config, the connection switches to RESP3
+    and enables `CLIENT TRACKING`: Redis remembers the keys we've read,
+    and sends an invalidation push message on the same connection whenever
+    one of them is changed. So `redis:cached` can serve repeated reads
+    of a key from memory until Redis tells us it's no longer valid.
+
+    Caches are indexed by the socket, since that's what goes into the pool,
+    and the tracking state belongs to the connection on the Redis side too.
+]]
+local client_caches = setmetatable({}, { __mode = "k" })
+local default_tracking_max_keys = 10000
+
+local invalidate = function(client, keys)
+	local cache = client_caches[client]
+	if not cache then
+		return
+	end
+	-- NULL instead of keys means that Redis has flushed its tracking table
+	if type(keys) ~= "table" then
+		cache.keys, cache.count = {}, 0
+		return
 	end
-	if resp.value == "NULL" then
-		return nil, "not found"
+	for _, key in ipairs(keys) do
+		if cache.keys[key] then
+			cache.keys[key] = nil
+			cache.count = cache.count - 1
+		end
 	end
-	if resp.type == "arr" and resp.size > 0 then
-		resp.value, err = read_array(client, resp.size)
+end
+
+local is_invalidation = function(resp)
+	return resp.type == "push" and type(resp.value) == "table" and resp.value[1] == "invalidate"
+end
+
+-- Reads the reply to a command, handling any push messages that come before it.
+-- Pub/Sub messages and invalidations are returned only with `pushes` set,
+-- i.e. when we are waiting for them.
+local read_response = function(client, pushes)
+	while true do
+		local resp, err = read_reply(client)
+		if not resp then
+			return nil, err
+		end
+		if is_invalidation(resp) then
+			invalidate(client, resp.value[2])
+			if pushes then
+				return resp
+			end
+		elseif resp.type ~= "push" or pushes then
+			if resp.value == "NULL" then
+				return nil, "not found"
+			end
+			return resp
+		end
+	end
+end
+
+-- Handles the messages Redis has pushed since the last command,
+-- without waiting for more.
+local process_pushed = function(client)
+	while client:dirty() or #socket.select({ client }, nil, 0) > 0 do
+		local resp, err = read_reply(client)
+		if not resp then
+			return nil, err
+		end
+		if is_invalidation(resp) then
+			invalidate(client, resp.value[2])
+		end
 	end
-	return resp, err
+	return true
 end
 
 local redis_command = function(self, ...)
@@ -122,12 +259,102 @@ local redis_command = function(self, ...)
 	return nil, err
 end
 
+-- Sends all the `cmds` (each one is a table with a command and its args)
+-- in one go, and then reads all the replies, so there is only one roundtrip
+-- per batch. Returns a table with a reply per command, failed commands
+-- get `false` as the reply and their errors are returned in the second table.
+local pipeline = function(self, cmds)
+	if not cmds or #cmds == 0 then
+		return nil, "no commands provided"
+	end
+	local buf = {}
+	for i, cmd in ipairs(cmds) do
+		buf[i] = "*" .. tostring(#cmd) .. "\r\n" .. bulk_strings_array(unpack(cmd))
+	end
+	local ok, err = self.s:send(table.concat(buf))
+	if not ok then
+		return nil, err
+	end
+	local replies, errors = {}, {}
+	for i = 1, #cmds do
+		local resp, err = read_response(self.s)
+		if not resp then
+			if err ~= "not found" then
+				if err == "closed" or err == "timeout" then
+					return nil, err
+				end
+				errors[i] = err
+			end
+			replies[i] = false
+		elseif resp.type == "error" then
+			replies[i] = false
+			errors[i] = resp.value
+		else
+			replies[i] = resp.value
+		end
+	end
+	return replies, errors
+end
+
+-- Like `redis:cmd`, but for read only commands with the key as the first argument,
+-- e.g. `red:cached("HGET", key, field)`. Replies (including "not found") are kept
+-- until Redis invalidates the key, so they must not be modified by the caller.
+-- Without tracking it's just `redis:cmd`.
+local cached = function(self, cmd, key, ...)
+	local cache = client_caches[self.s]
+	if not cache then
+		return self:cmd(cmd, key, ...)
+	end
+	local ok, err = process_pushed(self.s)
+	if not ok then
+		client_caches[self.s] = nil
+		return nil, err
+	end
+	local id = table.concat({ cmd, ... }, "\0")
+	local replies = cache.keys[key]
+	if replies and replies[id] ~= nil then
+		cache.hits = cache.hits + 1
+		if replies[id] == false then
+			return nil, "not found"
+		end
+		return replies[id]
+	end
+	cache.misses = cache.misses + 1
+	local value, err = self:cmd(cmd, key, ...)
+	if value ~= nil or err == "not found" then
+		if not cache.keys[key] then
+			if cache.count >= cache.max_keys then
+				cache.keys, cache.count = {}, 0
+			end
+			cache.keys[key] = {}
+			cache.count = cache.count + 1
+		end
+		if value == nil then
+			value = false
+		end
+		cache.keys[key][id] = value
+		if not value then
+			return nil, err
+		end
+	end
+	return value, err
+end
+
+local cache_stats = function(self)
+	local cache = client_caches[self.s]
+	if not cache then
+		return nil, "client side caching is not enabled"
+	end
+	return { keys = cache.count, hits = cache.hits, misses = cache.misses }
+end
+
 local read = function(self)
-	return read_response(self.s)
+	return read_response(self.s, true)
 end
 
 local close = function(self, no_keepalive)
 	if no_keepalive or #socket_pool[self.idx] > socket_pool_size then
+		client_caches[self.s] = nil
 		self.s:close()
 		if self.tcp then
 			self.tcp:close()
@@ -144,15 +371,28 @@ local connect = function(config)
 		conf = config_from_string(config)
 	end
 	local db = conf.db or "0"
-	local conf_str_key = conf.host .. ":" .. conf.port .. "/" .. db
+	local conf_str_key = (conf.socket or (conf.host .. ":" .. conf.port)) .. "/" .. db
+	if conf.tracking then
+		-- RESP3 replies differ, so tracking connections have their own pool
+		conf_str_key = conf_str_key .. "/tracking"
+	end
 
 	if socket_pool[conf_str_key] then
 		if #socket_pool[conf_str_key] > 0 then
 			local client = table.remove(socket_pool[conf_str_key], 1)
 			if client:send("PING\r\n") then
-				local r = client:receive()
-				if r and r == "+PONG" then
-					return { s = client, cmd = redis_command, close = close, read = read, idx = conf_str_key }
+				local r = read_response(client)
+				if r and r.value == "PONG" then
+					return {
+						s = client,
+						cmd = redis_command,
+						pipeline = pipeline,
+						cached = cached,
+						cache_stats = cache_stats,
+						close = close,
+						read = read,
+						idx = conf_str_key,
+					}
 				end
 			end
 			client:close()
@@ -161,16 +401,25 @@ local connect = function(config)
 		socket_pool[conf_str_key] = {}
 	end
 
-	local tcp = socket.tcp()
+	-- With `socket` set we connect to a Unix domain socket instead,
+	-- which saves the TCP loopback overhead when Redis runs on the same host.
+	local tcp = conf.socket and unix.stream() or socket.tcp()
 	if conf.timeout then
 		tcp:settimeout(conf.timeout)
 	end
-	local ok, err = tcp:connect(conf.host, conf.port)
+	local ok, err
+	if conf.socket then
+		ok, err = tcp:connect(conf.socket)
+	else
+		ok, err = tcp:connect(conf.host, conf.port)
+	end
 	if not ok then
 		return nil, err
 	end
 	local client = tcp
-	client:setoption("tcp-nodelay", true)
+	if not conf.socket then
+		client:setoption("tcp-nodelay", true)
+	end
 	if conf.ssl then
 		local conn, err = ssl.wrap(tcp)
 		if err then
@@ -183,10 +432,38 @@ local connect = function(config)
 		end
 		client = conn
 	end
-	local obj = { s = client, tcp = tcp, cmd = redis_command, close = close, read = read, idx = conf_str_key }
+	local obj = {
+		s = client,
+		tcp = tcp,
+		cmd = redis_command,
+		pipeline = pipeline,
+		cached = cached,
+		cache_stats = cache_stats,
+		close = close,
+		read = read,
+		idx = conf_str_key,
+	}
 	if conf.auth then
 		obj:cmd("AUTH", conf.auth.user, conf.auth.pass)
 	end
+	if conf.tracking then
+		-- Redis before 6.0 supports neither RESP3 nor tracking,
+		-- then the connection just works without the cache.
+		if obj:cmd("HELLO", "3") then
+			if obj:cmd("CLIENT", "TRACKING", "ON") then
+				local max_keys = type(conf.tracking) == "table" and conf.tracking.max_keys
+				client_caches[client] = {
+					keys = {},
+					count = 0,
+					hits = 0,
+					misses = 0,
+					max_keys = max_keys or default_tracking_max_keys,
+				}
+			else
+				obj:cmd("HELLO", "2")
+			end
+		end
+	end
 	if conf.db then
 		obj:cmd("select", conf.db)
 	end
@@ -68,6 +68,20 @@ int main(int argc, char **argv) {
             fprintf(stdout, "version %s\n", RELIW_VERSION);
             return 0;
         }
+        if (strcmp(argv[1], "ingest") == 0) {
+            error = luaL_loadstring(L, INGEST_RELIW);
+            if (!error) {
+                for (int i = 2; i < argc; i++) {
+                    lua_pushstring(L, argv[i]);
+                }
+                error = lua_pcall(L, argc - 2, 0, 0);
+            }
+            if (error) {
+                fprintf(stderr, "Error: %s\n", lua_tostring(L, -1));
+                return 1;
+            }
+            return 0;
+        }
         fprintf(stderr, "Uknown argument\n");
         return 1;
     }
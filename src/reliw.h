@@ -9,6 +9,12 @@ static const char START_RELIW[] = "local reliw = require('reliw')\n"
                                   "RELIW: ' .. tostring(err)) os.exit(-1) end\n"
                                   "reliw_srv:run()\n";
 
+static const char INGEST_RELIW[] = "local cfg, err = require('reliw').config()\n"
+                                   "if not cfg then print('failed to get RELIW config: ' .. tostring(err)) "
+                                   "os.exit(-1) end\n"
+                                   "local ok, err = require('reliw.ingest').cli(cfg, ...)\n"
+                                   "if not ok then print('ingest failed: ' .. tostring(err)) os.exit(-1) end\n";
+
 typedef struct mod_lua {
     const char *const name;
     const char *const code;
@@ -26,12 +32,15 @@ typedef struct mod_lua {
 #include "../build/luasocket/mod_lua_url.h"
 #include "../build/luasocket/mod_lua_web.h"
 #include "../build/luasocket/mod_lua_web_server.h"
+#include "../build/luasocket/mod_lua_web_server.body.h"
+#include "../build/luasocket/mod_lua_web_server.h2.h"
 // Std
 #include "../build/std/mod_lua_std.conv.h"
 #include "../build/std/mod_lua_std.fs.h"
 #include "../build/std/mod_lua_std.h"
 #include "../build/std/mod_lua_std.logger.h"
 #include "../build/std/mod_lua_std.mime.h"
+#include "../build/std/mod_lua_std.profile.h"
 #include "../build/std/mod_lua_std.ps.h"
 #include "../build/std/mod_lua_std.tbl.h"
 #include "../build/std/mod_lua_std.txt.h"
@@ -51,15 +60,19 @@ typedef struct mod_lua {
 #include "../build/djot/mod_lua_djot.h"
 #include "../build/djot/mod_lua_djot.html.h"
 #include "../build/djot/mod_lua_djot.inline.h"
+#include "../build/djot/mod_lua_djot.stream.h"
 // Redis
 #include "../build/redis/mod_lua_redis.h"
 // Reliw
 #include "../build/reliw/mod_lua_reliw.acme.h"
 #include "../build/reliw/mod_lua_reliw.api.h"
 #include "../build/reliw/mod_lua_reliw.auth.h"
+#include "../build/reliw/mod_lua_reliw.cache.h"
 #include "../build/reliw/mod_lua_reliw.h"
 #include "../build/reliw/mod_lua_reliw.handle.h"
+#include "../build/reliw/mod_lua_reliw.ingest.h"
 #include "../build/reliw/mod_lua_reliw.metrics.h"
+#include "../build/reliw/mod_lua_reliw.profile.h"
 #include "../build/reliw/mod_lua_reliw.proxy.h"
 #include "../build/reliw/mod_lua_reliw.store.h"
 #include "../build/reliw/mod_lua_reliw.templates.h"
@@ -73,10 +86,13 @@ const mod_lua__t lua_preload[] = {
     {"ssl.https",       mod_lua_https,           &mod_lua_https_SIZE          },
     {"web",             mod_lua_web,             &mod_lua_web_SIZE            },
     {"web_server",      mod_lua_web_server,      &mod_lua_web_server_SIZE     },
+    {"web_server.body", mod_lua_web_server_body, &mod_lua_web_server_body_SIZE},
+    {"web_server.h2",   mod_lua_web_server_h2,   &mod_lua_web_server_h2_SIZE  },
     {"ltn12",           mod_lua_ltn12,           &mod_lua_ltn12_SIZE          },
     {"mime",            mod_lua_mime,            &mod_lua_mime_SIZE           },
     {"std",             mod_lua_std,             &mod_lua_std_SIZE            },
     {"std.fs",          mod_lua_std_fs,          &mod_lua_std_fs_SIZE         },
+    {"std.profile",     mod_lua_std_profile,     &mod_lua_std_profile_SIZE    },
     {"std.ps",          mod_lua_std_ps,          &mod_lua_std_ps_SIZE         },
     {"std.txt",         mod_lua_std_txt,         &mod_lua_std_txt_SIZE        },
     {"std.tbl",         mod_lua_std_tbl,         &mod_lua_std_tbl_SIZE        },
@@ -96,13 +112,17 @@ const mod_lua__t lua_preload[] = {
     {"djot.filter",     mod_lua_djot_filter,     &mod_lua_djot_filter_SIZE    },
     {"djot.html",       mod_lua_djot_html,       &mod_lua_djot_html_SIZE      },
     {"djot.inline",     mod_lua_djot_inline,     &mod_lua_djot_inline_SIZE    },
+    {"djot.stream",     mod_lua_djot_stream,     &mod_lua_djot_stream_SIZE    },
     {"redis",           mod_lua_redis,           &mod_lua_redis_SIZE          },
     {"reliw",           mod_lua_reliw,           &mod_lua_reliw_SIZE          },
     {"reliw.api",       mod_lua_reliw_api,       &mod_lua_reliw_api_SIZE      },
     {"reliw.auth",      mod_lua_reliw_auth,      &mod_lua_reliw_auth_SIZE     },
+    {"reliw.cache",     mod_lua_reliw_cache,     &mod_lua_reliw_cache_SIZE    },
     {"reliw.acme",      mod_lua_reliw_acme,      &mod_lua_reliw_acme_SIZE     },
     {"reliw.handle",    mod_lua_reliw_handle,    &mod_lua_reliw_handle_SIZE   },
+    {"reliw.ingest",    mod_lua_reliw_ingest,    &mod_lua_reliw_ingest_SIZE   },
     {"reliw.metrics",   mod_lua_reliw_metrics,   &mod_lua_reliw_metrics_SIZE  },
+    {"reliw.profile",   mod_lua_reliw_profile,   &mod_lua_reliw_profile_SIZE  },
     {"reliw.store",     mod_lua_reliw_store,     &mod_lua_reliw_store_SIZE    },
     {"reliw.proxy",     mod_lua_reliw_proxy,     &mod_lua_reliw_proxy_SIZE    },
     {"reliw.templates", mod_lua_reliw_templates, &mod_lua_reliw_templates_SIZE},
@@ -122,19 +142,33 @@ extern int luaopen_cjson(lua_State *L);
 extern int luaopen_cjson_safe(lua_State *L);
 extern int luaopen_ssl_context(lua_State *L);
 extern int luaopen_ssl_core(lua_State *L);
+extern int luaopen_hpack_core(lua_State *L);
+extern int luaopen_multipart_core(lua_State *L);
 extern int luaopen_deviant_core(lua_State *L);
+extern int luaopen_std_shm(lua_State *L);
+extern int luaopen_std_codec(lua_State *L);
+extern int luaopen_std_layout(lua_State *L);
+extern int luaopen_std_watch(lua_State *L);
+extern int luaopen_std_uring(lua_State *L);
 extern int luaopen_crypto_core(lua_State *L);
 
 const luaL_Reg c_preload[] = {
-    {"socket.core",   luaopen_socket_core  },
-    {"socket.unix",   luaopen_socket_unix  },
-    {"socket.serial", luaopen_socket_serial},
-    {"mime.core",     luaopen_mime_core    },
-    {"cjson",         luaopen_cjson        },
-    {"cjson.safe",    luaopen_cjson_safe   },
-    {"ssl.context",   luaopen_ssl_context  },
-    {"ssl.core",      luaopen_ssl_core     },
-    {"std.core",      luaopen_deviant_core },
-    {"crypto.core",   luaopen_crypto_core  },
-    {NULL,            NULL                 }
+    {"socket.core",    luaopen_socket_core   },
+    {"socket.unix",    luaopen_socket_unix   },
+    {"socket.serial",  luaopen_socket_serial },
+    {"mime.core",      luaopen_mime_core     },
+    {"cjson",          luaopen_cjson         },
+    {"cjson.safe",     luaopen_cjson_safe    },
+    {"ssl.context",    luaopen_ssl_context   },
+    {"ssl.core",       luaopen_ssl_core      },
+    {"hpack.core",     luaopen_hpack_core    },
+    {"multipart.core", luaopen_multipart_core},
+    {"std.core",       luaopen_deviant_core  },
+    {"std.shm",        luaopen_std_shm       },
+    {"std.codec",      luaopen_std_codec     },
+    {"std.layout",     luaopen_std_layout    },
+    {"std.watch",      luaopen_std_watch     },
+    {"std.uring",      luaopen_std_uring     },
+    {"crypto.core",    luaopen_crypto_core   },
+    {NULL,             NULL                  }
 };
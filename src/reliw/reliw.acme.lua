@@ -3,16 +3,25 @@ local acme = require("acme")
 local crypto = require("crypto")
 
 --[[
+ Each order is an independent state machine, all authorizations
+ of an order are processed at the same time. Nothing ever sleeps
+ in the middle of an order: instead, orders and challenges have timers,
+ and the main loop only sleeps till the earliest of them is due.
+ This way DNS propagation waits and authorization polls of all orders overlap.
+
  State format for each order:
 
  state[primary_domain] = {
      domains = {domain1, domain2, ...},     -- All domains in this order
-     count = n,                             -- Total number of domains
-     idx = 1,                               -- Current authorization index being processed
+     next_at = ts,                          -- When the order should be processed next
      challenges = {                         -- Challenge status for each domain
          [domain1] = "new|solved|marked|validated",
          [domain2] = "new|solved|marked|validated",
          ...
+     },
+     timers = {                             -- When each challenge should be advanced next
+         [domain1] = ts,
+         ...
      }
  }
 ]]
@@ -87,18 +96,23 @@ local place_order = function(self, domain_names)
 		return true
 	end
 
-	self.state[primary_domain] = {
-		idx = 1,
-		count = #domain_names,
-		challenges = {},
-		domains = {},
-	}
+	local retry_at = self.backoff[primary_domain]
+	if retry_at and retry_at > os.time() then
+		return nil
+	end
+	self.backoff[primary_domain] = nil
 
 	local order, err = self.client:new_order(domain_names)
 	if not order then
 		self.logger:log({ process = "acme", msg = "order placing failed", domain = primary_domain, err = err }, "error")
 		return nil
 	end
+	self.state[primary_domain] = {
+		next_at = 0,
+		challenges = {},
+		timers = {},
+		domains = {},
+	}
 	for _, identifier in ipairs(order.identifiers) do
 		table.insert(self.state[primary_domain].domains, identifier.value)
 	end
@@ -111,9 +125,8 @@ local place_order = function(self, domain_names)
 	return true
 end
 
-local solve_challenge = function(self, primary_domain)
+local solve_challenge = function(self, primary_domain, domain)
 	local state = self.state[primary_domain]
-	local domain = self.state[primary_domain].domains[state.idx]
 
 	local auth = self.client:get_authorization(primary_domain, domain)
 	if not auth then
@@ -169,9 +182,8 @@ local solve_challenge = function(self, primary_domain)
 	return true
 end
 
-local mark_challenge_as_ready = function(self, primary_domain)
+local mark_challenge_as_ready = function(self, primary_domain, domain)
 	local state = self.state[primary_domain]
-	local domain = self.state[primary_domain].domains[state.idx]
 
 	local _, err = self.client:mark_challenge_as_ready(primary_domain, domain)
 	if err then
@@ -195,9 +207,8 @@ local mark_challenge_as_ready = function(self, primary_domain)
 	return true
 end
 
-local cleanup_challenge = function(self, primary_domain)
+local cleanup_challenge = function(self, primary_domain, domain)
 	local state = self.state[primary_domain]
-	local domain = self.state[primary_domain].domains[state.idx]
 
 	local provider_name = self:provider_by_domain(primary_domain)
 	local cfg = self.__config.providers[provider_name]
@@ -214,10 +225,6 @@ local cleanup_challenge = function(self, primary_domain)
 	end
 
 	state.challenges[domain] = "validated"
-	-- Move to next authorization if available
-	if state.idx < state.count then
-		state.idx = state.idx + 1
-	end
 
 	self.logger:log({
 		process = "acme",
@@ -256,6 +263,13 @@ local get_certificate = function(self, primary_domain)
 		self.logger:log({ process = "acme", msg = "certificate fetched", domain = primary_domain })
 		self.state[primary_domain] = nil
 		self.client:cleanup(primary_domain)
+		-- Let the manager know that servers should pick up the new certificate
+		local storage = require("reliw.store")
+		local store = storage.new(self.__srv_cfg)
+		if store then
+			store:send_ctl_msg("RELOAD")
+			store:close()
+		end
 	else
 		self.logger:log({ process = "acme", msg = "certificate fetch failed", domain = primary_domain, err = err })
 	end
@@ -273,6 +287,96 @@ local provider_by_domain = function(self, domain)
 	return nil
 end
 
+-- Advances a single challenge of an order one step further,
+-- and sets the challenge timer accordingly.
+local advance_challenge = function(self, primary_domain, domain)
+	local state = self.state[primary_domain]
+	local now = os.time()
+	local status = state.challenges[domain]
+	state.timers[domain] = now + self.__config.poll_interval
+	if status == "new" then
+		if self:solve_challenge(primary_domain, domain) then
+			local provider = self:provider_by_domain(primary_domain)
+			if provider:match("dns") then
+				local wait = self.__config.dns_propagation_time
+				self.logger:log({
+					process = "acme",
+					msg = "waiting for DNS to propagate",
+					primary_domain = primary_domain,
+					domain = domain,
+					duration = wait,
+				})
+				state.timers[domain] = now + wait
+			end
+		end
+	elseif status == "solved" then
+		self:mark_challenge_as_ready(primary_domain, domain)
+	elseif status == "marked" then
+		local auth = self.client:get_authorization(primary_domain, domain)
+		if auth and auth.status == "valid" then
+			self:cleanup_challenge(primary_domain, domain)
+		end
+	end
+end
+
+local drop_order = function(self, primary_domain)
+	self.state[primary_domain] = nil
+	self.client:cleanup(primary_domain)
+	self.backoff[primary_domain] = os.time() + self.__config.retry_failed
+end
+
+-- Processes an order if it's due, returns the time
+-- when the order should be processed next, or nil if it's done.
+local process_order = function(self, primary_domain)
+	local state = self.state[primary_domain]
+	local now = os.time()
+	if state.next_at > now then
+		return state.next_at
+	end
+	state.next_at = now + self.__config.poll_interval
+
+	local order = self.client:order_info(primary_domain)
+	if not order then
+		return state.next_at
+	end
+	if order.status == "pending" or order.status == "ready" then
+		for _, domain in ipairs(state.domains) do
+			local timer = state.timers[domain] or 0
+			if state.challenges[domain] ~= "validated" and timer <= now then
+				self:advance_challenge(primary_domain, domain)
+			end
+		end
+	end
+	if order.status == "ready" and self:all_challenges_solved(primary_domain) then
+		self:send_csr(primary_domain)
+	end
+	if order.status == "valid" then
+		if self:get_certificate(primary_domain) then
+			return nil
+		end
+	end
+	if order.status == "invalid" then
+		self.logger:log({ process = "acme", primary_domain = primary_domain, msg = "order is invalid" }, "error")
+		for _, url in ipairs(order.authorizations) do
+			self.logger:log({
+				process = "acme",
+				primary_domain = primary_domain,
+				msg = "order's auth",
+				auth = self.client:get_auth_by_url(url),
+			}, "debug")
+		end
+		self:drop_order(primary_domain)
+		return nil
+	end
+	-- Don't wait for the whole poll interval if some challenge timer fires earlier
+	for domain, timer in pairs(state.timers) do
+		if state.challenges[domain] ~= "validated" and timer < state.next_at then
+			state.next_at = timer
+		end
+	end
+	return state.next_at
+end
+
 local manage = function(self)
 	math.randomseed(os.time())
 
@@ -285,7 +389,7 @@ local manage = function(self)
 				self:place_order(cert.names)
 			else
 				local expires_in = cert.expires_at - os.time()
-				if expires_in <= self.__config.renew_time then
+				if expires_in <= self.__config.renew_time and not self.state[cert.names[1]] then
 					self.logger:log({
 						process = "acme",
 						msg = "certificate renewal",
@@ -298,62 +402,19 @@ local manage = function(self)
 		end
 
 		-- Process pending orders
-		for primary_domain, state in pairs(self.state) do
-			local order = self.client:order_info(primary_domain)
-			if order then
-				if order.status == "pending" or order.status == "ready" then
-					local domain = state.domains[state.idx]
-					local challenge_status = state.challenges[domain]
-					if challenge_status == "new" then
-						local provider = self:provider_by_domain(primary_domain)
-						if self:solve_challenge(primary_domain) then
-							if provider:match("dns") then
-								self.logger:log({
-									process = "acme",
-									msg = "waiting for DNS to propagate",
-									primary_domain = primary_domain,
-									domain = domain,
-									duration = 120,
-								})
-								std.sleep(120)
-							end
-						end
-					elseif challenge_status == "solved" then
-						self:mark_challenge_as_ready(primary_domain)
-					elseif challenge_status == "marked" then
-						local auth = self.client:get_authorization(primary_domain, domain)
-						if auth and auth.status == "valid" then
-							self:cleanup_challenge(primary_domain)
-						end
-					end
-				end
-				if order.status == "ready" and self:all_challenges_solved(primary_domain) then
-					self:send_csr(primary_domain)
-				end
-				if order.status == "valid" then
-					self:get_certificate(primary_domain)
-				end
-				if order.status == "invalid" then
-					self.logger:log(
-						{ process = "acme", primary_domain = primary_domain, msg = "order is invalid" },
-						"error"
-					)
-					for _, url in ipairs(order.authorizations) do
-						self.logger:log({
-							process = "acme",
-							primary_domain = primary_domain,
-							msg = "order's auth",
-							auth = self.client:get_auth_by_url(url),
-						}, "debug")
-					end
-					os.exit(-1)
-				end
+		local next_at
+		for primary_domain, _ in pairs(self.state) do
+			local order_next_at = self:process_order(primary_domain)
+			if order_next_at and (not next_at or order_next_at < next_at) then
+				next_at = order_next_at
 			end
 		end
 
 		-- Calculate sleep duration
 		local sleep_duration = math.random(10, 30)
-		if min_expire_time > 0 then
+		if next_at then
+			sleep_duration = math.max(1, next_at - os.time())
+		elseif min_expire_time > 0 then
 			local min = 1
 			local max = min_expire_time - self.__config.renew_time
 			if max > 0 then
@@ -362,7 +423,7 @@ local manage = function(self)
 			sleep_duration = math.random(min, max)
 		end
 
-		self.logger:log({ process = "acme", msg = "sleeping", duration = sleep_duration })
+		self.logger:log({ process = "acme", msg = "sleeping", duration = sleep_duration }, "debug")
 		std.sleep(sleep_duration)
 	end
 end
@@ -394,7 +455,14 @@ end
 local acme_manager_new = function(srv_cfg, logger)
 	local acme_dir = srv_cfg.data_dir .. "/.acme"
 	local account = srv_cfg.ssl.acme.account
-	local client, err = acme.le_prod(account, { plugin = "file", storage_dir = acme_dir })
+	local storage_cfg = { plugin = "file", storage_dir = acme_dir }
+	local client, err
+	-- A custom directory URL allows using a local ACME server, e.g. Pebble, for testing
+	if srv_cfg.ssl.acme.directory then
+		client, err = acme.new(account, srv_cfg.ssl.acme.directory, storage_cfg)
+	else
+		client, err = acme.le_prod(account, storage_cfg)
+	end
 	if not client then
 		return nil, "failed to initialize acme client: " .. err
 	end
@@ -405,9 +473,11 @@ local acme_manager_new = function(srv_cfg, logger)
 	local manager = {
 		__config = srv_cfg.ssl.acme,
 		__acme_dir = acme_dir,
+		__srv_cfg = srv_cfg,
 		__ready = 0,
 		logger = logger,
 		state = {},
+		backoff = {},
 		client = client,
 		get_certs_expire_time = get_certs_expire_time,
 		all_certs_present = all_certs_present,
@@ -419,6 +489,9 @@ local acme_manager_new = function(srv_cfg, logger)
 		send_csr = send_csr,
 		get_certificate = get_certificate,
 		provider_by_domain = provider_by_domain,
+		advance_challenge = advance_challenge,
+		process_order = process_order,
+		drop_order = drop_order,
 		manage = manage,
 		http_handle = http_handle,
 	}
@@ -427,6 +500,9 @@ local acme_manager_new = function(srv_cfg, logger)
 	end
 	manager.__config.providers["http.reliw"] = { redis = srv_cfg.redis }
 	manager.__config.renew_time = manager.__config.renew_time or 2592000 -- one month
+	manager.__config.poll_interval = manager.__config.poll_interval or 5
+	manager.__config.dns_propagation_time = manager.__config.dns_propagation_time or 120
+	manager.__config.retry_failed = manager.__config.retry_failed or 3600 -- retry invalid orders in an hour
 	return manager
 end
 
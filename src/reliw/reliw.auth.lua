@@ -1,5 +1,8 @@
+local std = require("std")
 local crypto = require("crypto")
 local web = require("web")
+local json = require("cjson.safe")
+local bit = require("bit")
 
 -- Set-Cookie: sessionToken=random_token; expires=Thu, 28 Jan 2022 00:00:00 UTC; path=/; domain=example.com; secure; HttpOnly
 -- local expires = os.date("%a, %d-%b-%Y %H:%M:%S GMT", os.time())
@@ -19,9 +22,101 @@ local login = function(store, host, user, pass)
 	return nil, "wrong login/pass"
 end
 
+--[[
+    With `sessions.mode` set to "token" in the server config, sessions are not
+    stored in Redis. Instead, the session cookie carries a signed token:
+
+        key_id.payload.signature
+
+    where `payload` is base64url encoded JSON with the user, host, expiration time
+    and token id, and `signature` is HMAC-SHA256 of `key_id.payload`
+    with the `sessions.keys[key_id]` secret. New tokens are signed with `sessions.key_id`,
+    other keys are only used to verify existing tokens, which allows key rotation.
+
+    Tokens are verified locally, so authorization needs no Redis calls at all.
+    Revoked token ids (i.e. logged out sessions) are kept in the `revoked` table,
+    which is synced in the server process via pub/sub by `watch_revocations`,
+    request processing forks get a copy of it. While it's not in sync (before the
+    subscription is up, or after it broke), each token is checked in Redis instead.
+]]
+local revoked = {}
+local revocations_synced = false
+
+local token_mode = function(store)
+	return store.sessions and store.sessions.mode == "token"
+end
+
+local sign_token = function(key, data)
+	return crypto.b64url_encode(crypto.hmac(key, data))
+end
+
+-- Compares signatures in constant time, so that the time it takes doesn't
+-- tell how many leading bytes of a forged one are right. The length is public.
+local same_signature = function(a, b)
+	if #a ~= #b then
+		return false
+	end
+	local diff = 0
+	for i = 1, #a do
+		diff = bit.bor(diff, bit.bxor(a:byte(i), b:byte(i)))
+	end
+	return diff == 0
+end
+
+local issue_token = function(cfg, host, user, ttl)
+	local key_id = tostring(cfg.key_id)
+	local key = cfg.keys and cfg.keys[key_id]
+	if not key then
+		return nil, "no session signing key"
+	end
+	local payload = crypto.b64url_encode_json({
+		u = user,
+		h = host,
+		e = os.time() + tonumber(ttl),
+		i = std.nanoid(12),
+	})
+	local data = key_id .. "." .. payload
+	return data .. "." .. sign_token(key, data)
+end
+
+local verify_token = function(cfg, host, token, store)
+	local key_id, payload, sig = token:match("^([%w_-]+)%.([%w_-]+)%.([%w_-]+)$")
+	if not key_id then
+		return nil, "malformed token"
+	end
+	local key = cfg.keys and cfg.keys[key_id]
+	if not key or not same_signature(sign_token(key, key_id .. "." .. payload), sig) then
+		return nil, "invalid signature"
+	end
+	local claims = json.decode(crypto.b64url_decode(payload) or "")
+	if type(claims) ~= "table" or claims.h ~= host then
+		return nil, "invalid claims"
+	end
+	if (tonumber(claims.e) or 0) < os.time() then
+		return nil, "expired"
+	end
+	if revoked[claims.i] then
+		return nil, "revoked"
+	end
+	if not revocations_synced and store then
+		local is_revoked, err = store:session_revoked(claims.i)
+		if is_revoked or err then
+			return nil, err or "revoked"
+		end
+	end
+	return claims
+end
+
 local start_session = function(store, host, user, ttl)
 	local host = host:match("^([^:]+)")
 	local ttl = ttl or "600"
+	if token_mode(store) then
+		local token, err = issue_token(store.sessions, host, user, ttl)
+		if token then
+			return "rlw_session_token=" .. token .. "; Max-Age=" .. ttl .. "; secure; HttpOnly"
+		end
+		return nil, err
+	end
 	local uuid, err = store:set_session_data(host, user, ttl)
 	if uuid then
 		return "rlw_session_token=" .. uuid .. "; secure; HttpOnly"
@@ -37,6 +132,13 @@ local get_session_user = function(store, headers)
 	if cookie then
 		token = cookie:match("rlw_session_token=([^%s;]+)")
 	end
+	if token_mode(store) then
+		local claims = verify_token(store.sessions, host, token or "", store)
+		if claims then
+			return claims.u
+		end
+		return nil
+	end
 	return store:fetch_session_user(host, token)
 end
 
@@ -49,7 +151,14 @@ local logout = function(store, headers)
 	if cookie then
 		token = cookie:match("rlw_session_token=([^%s;]+)") or ""
 	end
-	store:destroy_session(host, token)
+	if token_mode(store) then
+		local claims = verify_token(store.sessions, host, token, store)
+		if claims then
+			store:revoke_session_token(claims.i, claims.e)
+		end
+	else
+		store:destroy_session(host, token)
+	end
 	return "Logging out...",
 		303,
 		{
@@ -58,6 +167,108 @@ local logout = function(store, headers)
 		}
 end
 
+-- How often (in seconds) to retry the revocations subscription when it's down
+local RESUBSCRIBE_INTERVAL = 5
+
+--[[
+    To be used as a `web_server` watcher setup function: subscribes to
+    revocation messages, and then loads the currently revoked tokens on another
+    connection, so that nothing published in between is missed.
+    When the subscription fails or breaks, it's logged and retried every
+    `RESUBSCRIBE_INTERVAL` seconds, tokens are checked in Redis meanwhile.
+]]
+local watch_revocations = function(srv_cfg, logger)
+	local storage = require("reliw.store")
+	local sub, last_attempt
+
+	local subscribe = function()
+		last_attempt = os.time()
+		local store, err = storage.new(srv_cfg)
+		if not store then
+			return nil, err
+		end
+		local key = store.prefix .. ":SESSIONS:REVOKED"
+		local ok, err = store.red:cmd("SUBSCRIBE", key)
+		if not ok then
+			store:close(true)
+			return nil, err
+		end
+		local loader, err = storage.new(srv_cfg)
+		if not loader then
+			store:close(true)
+			return nil, err
+		end
+		local ids, err = loader:fetch_revoked_sessions()
+		loader:close(true)
+		if err then
+			store:close(true)
+			return nil, err
+		end
+		for id, expires in pairs(ids) do
+			revoked[id] = expires
+		end
+		sub = store
+		revocations_synced = true
+		return true
+	end
+
+	local resubscribe = function()
+		local ok, err = subscribe()
+		if ok then
+			logger:log({ msg = "revocations subscription restored", process = srv_cfg.process })
+		else
+			logger:log({ msg = "revocations subscription failed", process = srv_cfg.process, err = err }, "error")
+		end
+	end
+
+	local ok, err = subscribe()
+	if not ok then
+		logger:log({ msg = "revocations subscription failed", process = srv_cfg.process, err = err }, "error")
+	end
+	-- While the subscription is down, `getfd` is -1, and the server calls the handler
+	-- on each pass of its loop instead, see `server_watch` in web_server.lua
+	local watched = {
+		getfd = function()
+			return sub and sub.red.s:getfd() or -1
+		end,
+		dirty = function()
+			return sub ~= nil and sub.red.s:dirty()
+		end,
+	}
+	return watched,
+		function()
+			if not sub then
+				if os.time() - last_attempt >= RESUBSCRIBE_INTERVAL then
+					resubscribe()
+				end
+				return
+			end
+			repeat
+				local resp, err = sub.red:read()
+				if not resp then
+					sub:close(true)
+					sub = nil
+					revocations_synced = false
+					logger:log({ msg = "revocations subscription lost", process = srv_cfg.process, err = err }, "error")
+					resubscribe()
+					return
+				end
+				if type(resp.value) == "table" and resp.value[1] == "message" then
+					local id, expires = resp.value[3]:match("^(.+):(%d+)$")
+					if id then
+						revoked[id] = tonumber(expires)
+					end
+				end
+			until not sub.red.s:dirty()
+			local now = os.time()
+			for id, expires in pairs(revoked) do
+				if expires < now then
+					revoked[id] = nil
+				end
+			end
+		end
+end
+
 local authorized = function(store, headers, allowed_users)
 	local user = get_session_user(store, headers) or ""
 	for _, u in ipairs(allowed_users) do
@@ -111,5 +322,7 @@ local _M = {
 	get_session_user = get_session_user,
 	authenticated_as = get_session_user,
 	authorized = authorized,
+	verify_token = verify_token,
+	watch_revocations = watch_revocations,
 }
 return _M
@@ -0,0 +1,107 @@
+local shm = require("std.shm")
+local buffer = require("string.buffer")
+
+--[[
+    Cross-worker cache, kept in a shared memory segment.
+
+    The segment is created by the manager before it spawns the servers,
+    so it's shared by all the servers and their request processing forks,
+    and survives forks being recycled after `requests_per_fork` requests.
+
+    Values are serialized with `string.buffer`, so anything but functions,
+    userdata and such can be stored. `false` is a valid value, so it's
+    used to cache negative lookups.
+
+    Without the segment (`shm_cache.size` set to 0) all the calls are no-ops,
+    and `get` always misses.
+]]
+
+local segment
+
+local init = function(srv_cfg)
+	local cfg = srv_cfg.shm_cache
+	if segment or not cfg or not cfg.size or cfg.size == 0 then
+		return true
+	end
+	local seg, err = shm.new(cfg.size)
+	if not seg then
+		return nil, "failed to create shared memory cache: " .. tostring(err)
+	end
+	segment = seg
+	return true
+end
+
+local get = function(key)
+	if not segment then
+		return nil
+	end
+	local value = segment:get(key)
+	if value == nil or type(value) == "number" then
+		-- numbers are counters, maintained with `incr`
+		return value
+	end
+	return buffer.decode(value)
+end
+
+local set = function(key, value, ttl)
+	if not segment then
+		return nil, "no shared memory cache"
+	end
+	return segment:set(key, buffer.encode(value), ttl)
+end
+
+local delete = function(key)
+	if segment then
+		segment:delete(key)
+	end
+end
+
+local delete_prefix = function(prefix)
+	if segment then
+		return segment:delete_prefix(prefix)
+	end
+	return 0
+end
+
+local incr = function(key, delta, ttl)
+	if not segment then
+		return nil, "no shared memory cache"
+	end
+	return segment:incr(key, delta, 0, ttl)
+end
+
+-- Content entries of a host are keyed with its generation,
+-- so bumping it invalidates all of them at once.
+local generation = function(host)
+	return get("GEN:" .. host) or 0
+end
+
+local bump_generation = function(host)
+	return incr("GEN:" .. host, 1)
+end
+
+local flush = function()
+	if segment then
+		segment:flush()
+	end
+end
+
+local stats = function()
+	if segment then
+		return segment:stats()
+	end
+	return nil
+end
+
+return {
+	init = init,
+	get = get,
+	set = set,
+	delete = delete,
+	delete_prefix = delete_prefix,
+	incr = incr,
+	generation = generation,
+	bump_generation = bump_generation,
+	flush = flush,
+	stats = stats,
+}
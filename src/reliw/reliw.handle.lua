@@ -146,7 +146,7 @@ local handle = function(method, query, args, headers, body, ctx)
 		end
 	end
 
-	local content, hash, size, mime, title = api.get_content(store, host, query, metadata)
+	local content, hash, size, mime, title, html = api.get_content(store, host, query, metadata)
 	if not content then
 		local hit_count = metrics.update(store, host, method, query, 404)
 		return tmpls.error_page(404, hit_count, user_tmpl, err_img["404"]), 404, response_headers
@@ -191,7 +191,7 @@ local handle = function(method, query, args, headers, body, ctx)
 		if headers.accept and headers.accept:match("text/djot") then
 			response_headers["content-type"] = mime
 		else
-			content = tmpls.render_page(tmpls.djot_to_html(content), tmpl_vars, user_tmpl)
+			content = tmpls.render_page(html or tmpls.djot_to_html(content), tmpl_vars, user_tmpl)
 		end
 	else
 		response_headers["content-type"] = mime
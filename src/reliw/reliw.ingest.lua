@@ -0,0 +1,396 @@
+local std = require("std")
+local redis = require("redis")
+local crypto = require("crypto")
+local socket = require("socket")
+local tmpls = require("reliw.templates")
+
+--[[
+    Offline content ingestion, aka `reliw ingest`.
+
+    Walks the vhost directories in `data_dir`, and pushes the files
+    into the `RLW:FILES:vhost:filename` hashes, so that the servers
+    don't have to read & hash them on the first request after a deploy.
+
+    Along with the fields set by `store.fetch_content` we save the
+    file's `mtime` and the pre-rendered `html` for djot/markdown files.
+    Files with the same mtime and size are skipped without reading them,
+    files with the same hash only get their mtime updated.
+
+    Files are split between `workers` forks, each one sends its
+    Redis commands in pipelined batches of `batch` files.
+]]
+
+local default_opts = {
+	workers = 4,
+	batch = 200,
+	ttl = 0, -- ingested files don't expire by default
+	prune = true, -- remove the hashes of the files that are gone
+	reload = true, -- send RELOAD to the servers if anything has changed
+}
+
+-- Max amount of content to keep in a pending pipeline batch
+local max_batch_bytes = 8 * 1024 * 1024
+
+local parse_args = function(...)
+	local opts = std.tbl.copy(default_opts)
+	opts.hosts = {}
+	local args = { ... }
+	local i = 1
+	while i <= #args do
+		local arg = args[i]
+		if arg == "-w" or arg == "--workers" or arg == "-b" or arg == "--batch" or arg == "--ttl" then
+			local value = tonumber(args[i + 1])
+			if not value or value < 0 then
+				return nil, "option " .. arg .. " requires a number"
+			end
+			if arg == "--ttl" then
+				opts.ttl = value
+			elseif arg == "-w" or arg == "--workers" then
+				opts.workers = math.max(value, 1)
+			else
+				opts.batch = math.max(value, 1)
+			end
+			i = i + 1
+		elseif arg == "--no-prune" then
+			opts.prune = false
+		elseif arg == "--no-reload" then
+			opts.reload = false
+		elseif arg:match("^%-") then
+			return nil, "unknown option " .. arg
+		else
+			table.insert(opts.hosts, arg)
+		end
+		i = i + 1
+	end
+	return opts
+end
+
+local list_hosts = function(data_dir)
+	local items, err = std.fs.list_dir(data_dir)
+	if not items then
+		return nil, err
+	end
+	local hosts = {}
+	for _, item in ipairs(items) do
+		-- skip `.`, `..`, `.acme` and the shared `__` files
+		if not item:match("^%.") and not item:match("^__") and std.fs.dir_exists(data_dir .. "/" .. item) then
+			table.insert(hosts, item)
+		end
+	end
+	table.sort(hosts)
+	return hosts
+end
+
+local walk = function(root, host, files)
+	local entries, err = std.fs.walk(root, { recursive = true, hidden = false, threads = 4 })
+	if not entries then
+		return nil, err
+	end
+	for i = 1, entries.count do
+		if entries.mode[i] == "f" then
+			table.insert(
+				files,
+				{ host = host, name = "/" .. entries.path[i], size = entries.size[i], mtime = entries.mtime[i] }
+			)
+		end
+	end
+	return files
+end
+
+local extract_title = function(content)
+	return content:match("^%s*#%s+([^\n]+)") or content:match("\n#%s+([^\n]+)")
+end
+
+local ingest_batch = function(red, cfg, opts, batch, counts)
+	local prefix = cfg.redis.prefix
+	local cmds = {}
+	for _, file in ipairs(batch) do
+		table.insert(cmds, { "HMGET", prefix .. ":FILES:" .. file.host .. ":" .. file.name, "mtime", "size", "hash" })
+		table.insert(cmds, { "HGET", prefix .. ":TITLES:" .. file.host, file.name })
+	end
+	local known, err = red:pipeline(cmds)
+	if not known then
+		return nil, err
+	end
+	local writes = {}
+	local pending = 0
+	local flush = function()
+		if #writes > 0 then
+			local _, err = red:pipeline(writes)
+			if err and next(err) then
+				local _, msg = next(err)
+				return nil, msg
+			end
+		end
+		writes, pending = {}, 0
+		return true
+	end
+	local needs_read = function(i)
+		local file = batch[i]
+		local state = known[2 * i - 1] or {}
+		return (state[1] ~= tostring(file.mtime) or state[2] ~= tostring(file.size))
+			and file.size <= cfg.cache_max_size
+	end
+	-- Changed files are read in groups of up to `max_batch_bytes`,
+	-- with a single `std.fs.read_files` call per group.
+	local contents = {}
+	local read_ahead = function(from)
+		local paths, bytes = {}, 0
+		for j = from, #batch do
+			if needs_read(j) then
+				if #paths > 0 and bytes + batch[j].size > max_batch_bytes then
+					break
+				end
+				table.insert(paths, cfg.data_dir .. "/" .. batch[j].host .. batch[j].name)
+				bytes = bytes + batch[j].size
+			end
+		end
+		local errors
+		contents, errors = std.fs.read_files(paths)
+		for path, _ in pairs(errors or {}) do
+			contents[path] = false
+		end
+	end
+	for i, file in ipairs(batch) do
+		local key = prefix .. ":FILES:" .. file.host .. ":" .. file.name
+		local mtime = tostring(file.mtime)
+		local state = known[2 * i - 1] or {}
+		if state[1] == mtime and state[2] == tostring(file.size) then
+			counts.unchanged = counts.unchanged + 1
+		elseif file.size > cfg.cache_max_size then
+			-- the servers don't cache big files either
+			table.insert(writes, { "DEL", key })
+			counts.skipped = counts.skipped + 1
+		else
+			local path = cfg.data_dir .. "/" .. file.host .. file.name
+			if contents[path] == nil then
+				read_ahead(i)
+			end
+			local content = contents[path]
+			if not content then
+				counts.failed = counts.failed + 1
+			else
+				local hash = crypto.bin_to_hex(crypto.sha256(content))
+				if state[3] == hash then
+					table.insert(writes, { "HSET", key, "mtime", mtime })
+					counts.unchanged = counts.unchanged + 1
+				else
+					local mime = std.mime.type(file.name)
+					local title = known[2 * i]
+					local html
+					if mime == "text/djot" or mime == "text/markdown" then
+						title = title or extract_title(content)
+						html = tmpls.djot_to_html(content)
+					end
+					local cmd = { "HSET", key, "content", content, "hash", hash, "size", #content, "mime", mime }
+					table.insert(cmd, "title")
+					table.insert(cmd, title or "")
+					table.insert(cmd, "mtime")
+					table.insert(cmd, mtime)
+					if html then
+						table.insert(cmd, "html")
+						table.insert(cmd, html)
+					end
+					table.insert(writes, cmd)
+					if not html then
+						table.insert(writes, { "HDEL", key, "html" })
+					end
+					pending = pending + #content
+					counts.updated = counts.updated + 1
+				end
+				if opts.ttl > 0 then
+					table.insert(writes, { "EXPIRE", key, opts.ttl })
+				else
+					table.insert(writes, { "PERSIST", key })
+				end
+			end
+		end
+		if pending >= max_batch_bytes then
+			local ok, err = flush()
+			if not ok then
+				return nil, err
+			end
+		end
+	end
+	return flush()
+end
+
+local ingest_files = function(cfg, opts, files)
+	local counts = { updated = 0, unchanged = 0, skipped = 0, failed = 0 }
+	local red, err = redis.connect(cfg.redis)
+	if not red then
+		return nil, err
+	end
+	for i = 1, #files, opts.batch do
+		local ok, err = ingest_batch(red, cfg, opts, { unpack(files, i, math.min(i + opts.batch - 1, #files)) }, counts)
+		if not ok then
+			red:close(true)
+			return nil, err
+		end
+	end
+	red:close(true)
+	return counts
+end
+
+-- Each worker reports its counts back through a pipe as
+-- a single line: `updated unchanged skipped failed`, or `error: msg`
+local spawn_worker = function(cfg, opts, files)
+	local p, err = std.ps.pipe()
+	if not p then
+		return nil, err
+	end
+	local pid = std.ps.fork()
+	if pid < 0 then
+		return nil, "failed to fork"
+	end
+	if pid == 0 then
+		p:close_out()
+		local counts, err = ingest_files(cfg, opts, files)
+		if counts then
+			p:write(string.format("%d %d %d %d\n", counts.updated, counts.unchanged, counts.skipped, counts.failed))
+		else
+			p:write("error: " .. tostring(err) .. "\n")
+		end
+		p:close_inn()
+		os.exit(0)
+	end
+	p:close_inn()
+	return { pid = pid, pipe = p }
+end
+
+local prune = function(red, prefix, host, seen)
+	local pruned = 0
+	local cursor = "0"
+	local pattern = prefix .. ":FILES:" .. host .. ":*"
+	repeat
+		local resp, err = red:cmd("SCAN", cursor, "MATCH", pattern, "COUNT", 1000)
+		if not resp then
+			return nil, err
+		end
+		cursor = resp[1]
+		local stale = { "DEL" }
+		for _, key in ipairs(resp[2] or {}) do
+			local name = key:sub(#pattern)
+			if not seen[host .. ":" .. name] then
+				table.insert(stale, key)
+			end
+		end
+		if #stale > 1 then
+			red:cmd(unpack(stale))
+			pruned = pruned + #stale - 1
+		end
+	until cursor == "0"
+	return pruned
+end
+
+local run = function(cfg, opts)
+	local start = socket.gettime()
+	local hosts = opts.hosts
+	if not hosts or #hosts == 0 then
+		local err
+		hosts, err = list_hosts(cfg.data_dir)
+		if not hosts then
+			return nil, "failed to list " .. cfg.data_dir .. ": " .. tostring(err)
+		end
+	end
+	local files = {}
+	for _, host in ipairs(hosts) do
+		local ok, err = walk(cfg.data_dir .. "/" .. host, host, files)
+		if not ok then
+			return nil, "failed to walk " .. host .. ": " .. tostring(err)
+		end
+	end
+	-- Round robin, so that each worker gets a share of every vhost
+	local shares = {}
+	local workers = math.min(opts.workers, math.max(#files, 1))
+	for i = 1, workers do
+		shares[i] = {}
+	end
+	for i, file in ipairs(files) do
+		table.insert(shares[(i - 1) % workers + 1], file)
+	end
+	-- Workers must be spawned before we connect to Redis ourselves,
+	-- otherwise they would share the pooled connection with us.
+	local spawned = {}
+	for i = 1, workers do
+		local worker, err = spawn_worker(cfg, opts, shares[i])
+		if not worker then
+			return nil, "failed to spawn a worker: " .. tostring(err)
+		end
+		table.insert(spawned, worker)
+	end
+	local total = { updated = 0, unchanged = 0, skipped = 0, failed = 0, pruned = 0 }
+	local errors = {}
+	for _, worker in ipairs(spawned) do
+		local report = worker.pipe:read() or ""
+		worker.pipe:close_out()
+		std.ps.wait(worker.pid)
+		local updated, unchanged, skipped, failed = report:match("^(%d+) (%d+) (%d+) (%d+)")
+		if updated then
+			total.updated = total.updated + tonumber(updated)
+			total.unchanged = total.unchanged + tonumber(unchanged)
+			total.skipped = total.skipped + tonumber(skipped)
+			total.failed = total.failed + tonumber(failed)
+		else
+			table.insert(errors, report:match("^error: (.-)\n?$") or "worker died")
+		end
+	end
+	if #errors > 0 then
+		return nil, table.concat(errors, "; ")
+	end
+
+	local red, err = redis.connect(cfg.redis)
+	if not red then
+		return nil, err
+	end
+	if opts.prune then
+		local seen = {}
+		for _, file in ipairs(files) do
+			seen[file.host .. ":" .. file.name] = true
+		end
+		for _, host in ipairs(hosts) do
+			local pruned, err = prune(red, cfg.redis.prefix, host, seen)
+			if not pruned then
+				red:close(true)
+				return nil, "failed to prune " .. host .. ": " .. tostring(err)
+			end
+			total.pruned = total.pruned + pruned
+		end
+	end
+	-- The servers might have the old content in the shared memory cache
+	if opts.reload and (total.updated > 0 or total.pruned > 0) then
+		red:cmd("PUBLISH", cfg.redis.prefix .. ":CTL", "RELOAD")
+	end
+	red:close(true)
+	total.files = #files
+	total.hosts = #hosts
+	total.elapsed = socket.gettime() - start
+	return total
+end
+
+local cli = function(cfg, ...)
+	local opts, err = parse_args(...)
+	if not opts then
+		return nil, err
+	end
+	local total, err = run(cfg, opts)
+	if not total then
+		return nil, err
+	end
+	print(
+		string.format(
+			"%d files in %d vhosts: %d updated, %d unchanged, %d skipped, %d failed, %d pruned in %.2fs",
+			total.files,
+			total.hosts,
+			total.updated,
+			total.unchanged,
+			total.skipped,
+			total.failed,
+			total.pruned,
+			total.elapsed
+		)
+	)
+	return true
+end
+
+return { run = run, cli = cli, parse_args = parse_args }
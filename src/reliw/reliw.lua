@@ -2,26 +2,55 @@ local std = require("std")
 local ws = require("web_server")
 local json = require("cjson.safe")
 local handle = require("reliw.handle")
+local auth = require("reliw.auth")
 local acme_manager = require("reliw.acme")
 local storage = require("reliw.store")
+local cache = require("reliw.cache")
+
+local SIGTERM = 15
 
 local default_reliw_config = {
 	ip = "127.0.0.1",
 	port = 8080,
 	data_dir = "/www",
 	cache_max_size = 5242880, -- 5 megabyte by default
+	files_cache = {
+		watch = true, -- watch data_dir, and drop cached files as soon as they change
+		ttl = 86400, -- seconds to keep files in the caches while watching, otherwise it's an hour in Redis
+	},
+	shm_cache = {
+		size = 33554432, -- 32 megabytes of shared memory for the cross-worker cache, 0 disables it
+		ttl = 60, -- seconds to keep content and API entries in the cache
+	},
 	redis = {
 		host = "127.0.0.1",
 		port = 6379,
 		db = 13,
 		prefix = "RLW",
+		client_cache = false, -- drop changed keys from the caches right away, as Redis reports them (needs Redis 6+)
 	},
 	metrics = {
 		ip = "127.0.0.1",
 		port = 9101,
 	},
+	cpu = {}, -- placement of the processes on CPUs, see "CPU placement" in RELIW_README.md
 }
 
+-- Turns `cpu.servers` and `cpu.others` into arrays of CPU numbers
+local cpu_placement = function(cfg)
+	local placement = { others_nice = cfg.cpu.others_nice }
+	for _, key in ipairs({ "servers", "others" }) do
+		if cfg.cpu[key] then
+			local cpus, err = std.ps.cpu_list(cfg.cpu[key])
+			if not cpus or #cpus == 0 then
+				return nil, "cpu." .. key .. ": " .. tostring(err or "no CPUs")
+			end
+			placement[key] = cpus
+		end
+	end
+	return placement
+end
+
 local configure = function(srv_cfg)
 	local cfg = std.tbl.copy(default_reliw_config)
 	return std.tbl.merge(cfg, srv_cfg)
@@ -39,14 +68,6 @@ local get_server_config = function()
 	return configure(config)
 end
 
-local new_server = function(srv_cfg)
-	local srv, err = ws.new(srv_cfg, handle.func)
-	if not srv then
-		return nil, err
-	end
-	return srv
-end
-
 local ssl_config_from_acme = function(srv_cfg)
 	local certs_dir = srv_cfg.data_dir .. "/.acme/certs/"
 	local ssl = {}
@@ -67,6 +88,110 @@ local ssl_config_from_acme = function(srv_cfg)
 	return ssl
 end
 
+-- `primary` is set for one of the servers only, it runs the things
+-- that must be done once for all of them.
+local new_server = function(srv_cfg, primary)
+	local srv, err = ws.new(srv_cfg, handle.func)
+	if not srv then
+		return nil, err
+	end
+	if srv_cfg.sessions and srv_cfg.sessions.mode == "token" then
+		srv:watch(function()
+			return auth.watch_revocations(srv_cfg, srv.logger)
+		end)
+	end
+	if srv_cfg.metrics and srv_cfg.metrics.profiling then
+		local profile = require("reliw.profile")
+		srv.on_fork = profile.on_fork
+		srv.after_request = profile.after_request
+		srv.on_exit = profile.on_exit
+	end
+	-- The caches are shared, so one watcher is enough
+	if srv_cfg.files_cache.watch and primary then
+		srv:watch(function()
+			local watcher, handler = storage.watch_files(srv_cfg)
+			if not watcher then
+				srv.logger:log({
+					msg = "failed to watch data_dir, cached files expire after the default TTLs",
+					process = srv_cfg.process,
+					err = handler,
+				}, "error")
+			end
+			return watcher, handler
+		end)
+	end
+	if srv_cfg.redis.client_cache and srv_cfg.shm_cache.size > 0 and primary then
+		srv:watch(function()
+			local watcher, handler = storage.watch_invalidations(srv_cfg)
+			if not watcher then
+				srv.logger:log(
+					{ msg = "failed to track Redis invalidations", process = srv_cfg.process, err = handler },
+					"error"
+				)
+			end
+			return watcher, handler
+		end)
+	end
+	srv.reload_config = function()
+		local cfg, err = get_server_config()
+		if not cfg then
+			return nil, err
+		end
+		if cfg.ssl and cfg.ssl.acme then
+			cfg.ssl = ssl_config_from_acme(cfg)
+		end
+		-- Content, API and proxy entries might have changed too. The segment is shared,
+		-- so one server drops them for all, the rest of it (e.g. FILES_WATCHED) stays.
+		if primary then
+			cache.delete_prefix("CONTENT:")
+			cache.delete_prefix(srv_cfg.redis.prefix .. ":API:")
+			cache.delete_prefix(srv_cfg.redis.prefix .. ":PROXY:")
+		end
+		return cfg
+	end
+	-- Called by the server process itself, not a fork: pooling the connection here would
+	-- hand the same socket to every fork started afterwards.
+	srv.report_overload = function(process, stats)
+		local store = storage.new(srv_cfg)
+		if store then
+			store:update_overload_metrics(process, stats)
+			store:close(true)
+		end
+	end
+	srv.report_alloc = function(process, alloc)
+		local store = storage.new(srv_cfg)
+		if store then
+			store:update_alloc_metrics(process, alloc, ws.alloc_buckets)
+			store:close()
+		end
+	end
+	return srv
+end
+
+--[[
+    Prepares a process the manager has just forked: names it after its role,
+    makes it exit along with the manager, and places it on `cpus` with `nice`,
+    if these are given. With no IO priority set, it follows the nice value.
+]]
+local setup_child = function(self, process, cpus, nice)
+	-- the kernel keeps 15 bytes of it: reliw:ipv4@12, reliw:acme_http
+	local name = process:gsub("^server_", ""):gsub("_cpu", "@"):gsub("_manager$", "")
+	std.ps.setname("reliw:" .. name)
+	std.ps.pdeathsig(SIGTERM, self.pid)
+	if cpus then
+		local ok, err = std.ps.setaffinity(0, cpus)
+		if not ok then
+			self.logger:log({ msg = "failed to set CPU affinity", process = process, err = err }, "warn")
+		end
+	end
+	if nice then
+		local ok, err = std.ps.setpriority(0, nice)
+		if not ok then
+			self.logger:log({ msg = "failed to set nice value", process = process, err = err }, "warn")
+		end
+	end
+end
+
 local spawn_metrics_server = function(self)
 	local cfg, err = get_server_config()
 	if not cfg then
@@ -91,6 +216,7 @@ local spawn_metrics_server = function(self)
 		return nil
 	end
 	if metrics_pid == 0 then
+		self:setup_child("metrics", self.cpu.others, self.cpu.others_nice)
 		srv:serve()
 	end
 	self.logger:log({ msg = "metrics server spawned", process = "manager", pid = metrics_pid })
@@ -98,44 +224,59 @@ local spawn_metrics_server = function(self)
 	return true
 end
 
-local spawn_server = function(self, srv_cfg)
-	srv_cfg.process = "server_ipv4"
-	local reliw_srv, err = new_server(srv_cfg)
-	if not reliw_srv then
+local spawn_one_server = function(self, srv_cfg, process, cpu, primary)
+	srv_cfg.process = process
+	srv_cfg.incoming_cpu = cpu
+	local srv, err = new_server(srv_cfg, primary)
+	if not srv then
 		return nil, err
 	end
-	local reliw_pid = std.ps.fork()
-	if reliw_pid < 0 then
-		self.logger:log({ msg = "IPv4 server spawn failed", process = "manager" }, "error")
-		return nil
-	end
-	if reliw_pid == 0 then
-		reliw_srv:serve()
+	local pid = std.ps.fork()
+	if pid < 0 then
+		self.logger:log({ msg = "server spawn failed", process = "manager", server = process }, "error")
+		return nil, "failed to fork"
 	end
-	self.logger:log({ msg = "IPv4 server spawned", process = "manager", pid = reliw_pid })
-	self.reliw_pid = reliw_pid
-
-	if not srv_cfg.ipv6 then
-		return true
+	if pid == 0 then
+		self:setup_child(process, cpu and { cpu } or self.cpu.all)
+		srv:serve()
 	end
+	self.logger:log({ msg = "server spawned", process = "manager", server = process, pid = pid, cpu = cpu })
+	table.insert(self.server_pids, pid)
+	return pid
+end
 
-	local srv_cfg_ipv6 = std.tbl.copy(srv_cfg)
-	srv_cfg_ipv6.ip = srv_cfg_ipv6.ipv6
-	srv_cfg_ipv6.process = "server_ipv6"
-	local reliw6_srv, err = new_server(srv_cfg_ipv6)
-	if not reliw6_srv then
-		return nil, err
+--[[
+    Spawns the IPv4 server, and the IPv6 one if `ipv6` is set.
+    With `cpu.servers` there is a server per CPU (per address family) instead,
+    each one is pinned to its CPU, and so are its request processing forks.
+    They all listen on the same port with SO_REUSEPORT, and the kernel
+    hands a connection to the server on the CPU that processed it.
+]]
+local spawn_server = function(self, srv_cfg)
+	local cpus = self.cpu.servers or { false }
+	local pool = #cpus > 1
+	if pool and (srv_cfg.ip:match("^unix:") or (srv_cfg.ipv6 or ""):match("^unix:")) then
+		return nil, "a Unix domain socket can't be shared by several servers, use fd: or a single CPU"
 	end
-	local reliw6_pid = std.ps.fork()
-	if reliw6_pid < 0 then
-		self.logger:log({ msg = "IPv6 server spawn failed", process = "manager" }, "error")
-		return nil
+	self.server_pids = {}
+	local families = { { "ipv4", srv_cfg.ip } }
+	if srv_cfg.ipv6 then
+		table.insert(families, { "ipv6", srv_cfg.ipv6 })
 	end
-	if reliw6_pid == 0 then
-		reliw6_srv:serve()
+	for _, family in ipairs(families) do
+		for i, cpu in ipairs(cpus) do
+			local cfg = std.tbl.copy(srv_cfg)
+			cfg.ip = family[2]
+			local process = "server_" .. family[1] .. (pool and "_cpu" .. cpu or "")
+			local pid, err = spawn_one_server(self, cfg, process, cpu or nil, family[1] == "ipv4" and i == 1)
+			if not pid then
+				return nil, err
+			end
+			if family[1] == "ipv4" and i == 1 then
+				self.reliw_pid = pid
+			end
+		end
 	end
-	self.logger:log({ msg = "IPv6 server spawned", process = "manager", pid = reliw6_pid })
-	self.reliw6_pid = reliw6_pid
 	return true
 end
 
@@ -159,6 +300,7 @@ local spawn_acme_manager = function(self)
 		self.logger:log({ msg = "ACME manager spawn failed", process = "manager" }, "error")
 	end
 	if acme_pid == 0 then
+		self:setup_child("acme_manager", self.cpu.others, self.cpu.others_nice)
 		am:manage()
 	end
 	self.logger:log({ msg = "ACME manager spawned", process = "manager", pid = acme_pid })
@@ -169,6 +311,12 @@ local spawn_acme_manager = function(self)
 		if not cfg then
 			return nil, err
 		end
+		-- The solver can't share a Unix domain socket or an inherited one with the server
+		if cfg.ssl.acme.http_ip then
+			cfg.ip = cfg.ssl.acme.http_ip
+		elseif cfg.ip:match("^unix:") or cfg.ip:match("^fd:") then
+			return nil, "ssl.acme.http_ip must be set for the http.reliw provider"
+		end
 		cfg.port = 80
 		cfg.process = "acme_http"
 		cfg.ssl = nil
@@ -182,6 +330,7 @@ local spawn_acme_manager = function(self)
 			return nil
 		end
 		if acme_http_pid == 0 then
+			self:setup_child("acme_http", self.cpu.others, self.cpu.others_nice)
 			srv:serve()
 		end
 		self.logger:log({ msg = "ACME HTTP solver spawned", process = "manager", pid = acme_http_pid })
@@ -190,6 +339,17 @@ local spawn_acme_manager = function(self)
 	return true
 end
 
+-- Servers reload their config and SSL certificates on SIGHUP
+-- without closing the listening sockets, see `web_server.reload`.
+local reload_servers = function(self)
+	for _, pid in ipairs(self.server_pids) do
+		local ok, err = std.ps.kill(pid, 1)
+		if not ok then
+			self.logger:log({ msg = "server reload failed", process = "manager", pid = pid, err = err }, "error")
+		end
+	end
+end
+
 local run = function(self)
 	local cfg = self.cfg
 	if cfg.ssl and cfg.ssl.acme then
@@ -224,9 +384,8 @@ local run = function(self)
 		local resp, _ = self.store.red:read()
 		if resp and resp.value then
 			local msg = resp.value[3]
-			if msg == "RESTART" then
-				-- TO DO:
-				--
+			if msg == "RESTART" or msg == "RELOAD" then
+				self:reload_servers()
 			end
 		end
 	end
@@ -241,16 +400,39 @@ local new = function()
 	if not store then
 		return nil, "failed to init store: " .. err
 	end
+	-- Must be created before any server is spawned to be shared by all of them
+	local ok, err = cache.init(cfg)
+	if not ok then
+		return nil, err
+	end
+	local cpu, err = cpu_placement(cfg)
+	if not cpu then
+		return nil, err
+	end
+	-- The manager's children start on the same CPUs, servers
+	-- without a CPU of their own are moved back to all of them.
+	if cpu.others then
+		cpu.all = std.ps.getaffinity()
+		local ok, err = std.ps.setaffinity(0, cpu.others)
+		if not ok then
+			return nil, "failed to set CPU affinity: " .. err
+		end
+	end
 
 	return {
 		logger = std.logger.new(cfg.log_level),
 		cfg = cfg,
 		store = store,
+		pid = std.ps.getpid(),
+		cpu = cpu,
+		server_pids = {},
+		setup_child = setup_child,
 		run = run,
 		spawn_server = spawn_server,
+		reload_servers = reload_servers,
 		spawn_metrics_server = spawn_metrics_server,
 		spawn_acme_manager = spawn_acme_manager,
 	}
 end
 
-return { new = new }
+return { new = new, config = get_server_config }
@@ -7,6 +7,27 @@ local show = function(method, query, args, headers, body, ctx)
 	if query == "/metrics" and method == "GET" then
 		return store:fetch_metrics(), 200, { ["content-type"] = "text/plain" }
 	end
+	-- GET /profile?server=server_ipv4&seconds=10&interval=1&lines=1&format=summary
+	if query == "/profile" and method == "GET" and ctx.cfg.metrics.profiling then
+		store:close()
+		local params = {}
+		for key, value in (args or ""):gmatch("([^&=]+)=([^&]*)") do
+			params[key] = value
+		end
+		local profile = require("reliw.profile")
+		local result, err, busy = profile.collect(params.server or "server_ipv4", {
+			seconds = params.seconds,
+			interval = params.interval,
+			lines = params.lines == "1",
+		})
+		if not result then
+			return tostring(err), busy and 409 or 500, { ["content-type"] = "text/plain" }
+		end
+		if params.format == "summary" then
+			return result:summary(tonumber(params.top)), 200, { ["content-type"] = "text/plain" }
+		end
+		return result:folded(), 200, { ["content-type"] = "text/plain" }
+	end
 	return "Not Found", 404, { ["content-type"] = "text/plain" }
 end
 
@@ -0,0 +1,113 @@
+local std = require("std")
+local cache = require("reliw.cache")
+local profiler = require("std.profile")
+
+--[[
+    Profiling of a running server, on demand.
+
+    The metrics server (with `metrics.profiling` enabled) puts a request
+    for a server process into the shared memory cache, with a directory
+    for the results and the time the profiling ends. Request processing
+    forks of that server check for it when they start, and, if there is one,
+    run the sampling profiler, dumping the folded stacks into the directory
+    once, when the time is up or the fork exits, whichever comes first, so that
+    the dumping doesn't get into the profile. Then the metrics server merges them.
+
+    Only forks started during the profiling window are sampled, so
+    on a busy server with long keep-alive connections the picture is partial.
+]]
+
+local max_seconds = 120
+
+local request_key = function(process)
+	return "PROFILE:" .. process
+end
+
+-- Set in a fork that's being profiled
+local active
+
+local dump = function()
+	local result = active.prof.result
+	local path = active.dir .. "/" .. std.ps.getpid() .. ".folded"
+	-- The collector must never see a half written file
+	if std.fs.write_file(path .. ".tmp", result:folded()) then
+		os.rename(path .. ".tmp", path)
+	end
+end
+
+local on_fork = function(srv)
+	local req = cache.get(request_key(srv.__config.process))
+	if not req or os.time() >= req.ends then
+		return
+	end
+	local prof = profiler.start({ interval = req.interval, lines = req.lines })
+	if prof then
+		active = { prof = prof, dir = req.dir, ends = req.ends }
+	end
+end
+
+local finish = function()
+	active.prof:stop()
+	dump()
+	active = nil
+end
+
+local after_request = function(srv)
+	if active and os.time() >= active.ends then
+		finish()
+	end
+end
+
+local on_exit = function(srv)
+	if active then
+		finish()
+	end
+end
+
+--[[
+    Profiles the request processing forks of the `process` server for
+    `opts.seconds` seconds, returns the merged result, see `std.profile`.
+    Blocks for the whole time, it's meant to be called by the metrics server.
+    Only one profiling of a server can run at a time, otherwise it returns
+    nil, an error and `true`.
+]]
+local collect = function(process, opts)
+	local opts = opts or {}
+	if not cache.stats() then
+		return nil, "profiling needs the shared memory cache"
+	end
+	local seconds = math.min(math.max(tonumber(opts.seconds) or 10, 1), max_seconds)
+	-- Taken with an atomic increment, so that concurrent requests can't both go ahead
+	local lock = request_key(process) .. ":LOCK"
+	if cache.incr(lock, 1, seconds + 5) ~= 1 then
+		return nil, process .. " is being profiled already", true
+	end
+	local interval = math.max(tonumber(opts.interval) or 1, 1)
+	local dir = "/tmp/reliw-profile-" .. std.ps.getpid() .. "-" .. os.time()
+	local ok, err = std.fs.mkdir(dir, "0700")
+	if not ok then
+		cache.delete(lock)
+		return nil, "failed to create " .. dir .. ": " .. tostring(err)
+	end
+	local req = { dir = dir, ends = os.time() + seconds, interval = interval, lines = opts.lines }
+	ok, err = cache.set(request_key(process), req, seconds + 5)
+	if not ok then
+		cache.delete(lock)
+		std.fs.remove(dir, true)
+		return nil, err
+	end
+	-- one more second for the forks to dump what they've got
+	std.sleep(seconds + 1)
+	local merged = profiler.parse("", interval)
+	for _, name in ipairs(std.fs.list_dir(dir) or {}) do
+		if name:match("%.folded$") then
+			merged:merge(profiler.parse(std.fs.read_file(dir .. "/" .. name) or "", interval))
+		end
+	end
+	std.fs.remove(dir, true)
+	cache.delete(request_key(process))
+	cache.delete(lock)
+	return merged
+end
+
+return { collect = collect, on_fork = on_fork, after_request = after_request, on_exit = on_exit }
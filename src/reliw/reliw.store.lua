@@ -2,12 +2,40 @@ local std = require("std")
 local redis = require("redis")
 local json = require("cjson.safe")
 local crypto = require("crypto")
+local cache = require("reliw.cache")
+
+-- Set when `watch_files` is running, see the files' TTLs in `new`
+local FILES_WATCHED = "FILES_WATCHED"
+local files_watched = false
+
+--[[
+    Redis GET through the shared memory cache. Missing keys are cached too,
+    since each request checks for a proxy config, which most vhosts don't have.
+    With `redis.client_cache` on, entries are also dropped as soon as Redis
+    reports a change, see `watch_invalidations`.
+]]
+local cached_get = function(self, key)
+	local value = cache.get(key)
+	if value ~= nil then
+		if value == false then
+			return nil, "not found"
+		end
+		return value
+	end
+	local value, err = self.red:cmd("GET", key)
+	if value then
+		cache.set(key, value, self.shm_ttl)
+	elseif err == "not found" then
+		cache.set(key, false, self.shm_ttl)
+	end
+	return value, err
+end
 
 local fetch_proxy_config = function(self, host)
 	if not host or type(host) ~= "string" then
 		return nil, "no host/invalid type provided"
 	end
-	local config, err = self.red:cmd("GET", self.prefix .. ":PROXY:" .. host)
+	local config, err = cached_get(self, self.prefix .. ":PROXY:" .. host)
 	if err then
 		return nil, "proxy config not found"
 	end
@@ -18,7 +46,7 @@ local fetch_host_schema = function(self, host)
 	if not host or type(host) ~= "string" then
 		return nil, "no host/invalid type provided"
 	end
-	local paths, err = self.red:cmd("GET", self.prefix .. ":API:" .. host)
+	local paths, err = cached_get(self, self.prefix .. ":API:" .. host)
 	if err then
 		return nil, "API schema not found"
 	end
@@ -29,7 +57,7 @@ local fetch_entry_metadata = function(self, host, entry_id)
 	if not host or not entry_id then
 		return nil, "host or entry_id not provided"
 	end
-	local metadata, err = self.red:cmd("GET", self.prefix .. ":API:" .. host .. ":" .. entry_id)
+	local metadata, err = cached_get(self, self.prefix .. ":API:" .. host .. ":" .. entry_id)
 	if err then
 		return nil, "metadata: " .. tostring(err)
 	end
@@ -40,7 +68,7 @@ local fetch_userinfo = function(self, host, user)
 	if not host or not user then
 		return nil, "host/user not provided"
 	end
-	local user_info, err = self.red:cmd("HGET", self.prefix .. ":USERS:" .. host, user)
+	local user_info, err = self.tracked:cached("HGET", self.prefix .. ":USERS:" .. host, user)
 	if err then
 		return nil, err
 	end
@@ -51,9 +79,9 @@ local fetch_userdata = function(self, host, file)
 	if not host or not file then
 		return nil, "host/file not provided"
 	end
-	local userdata, err = self.red:cmd("GET", self.prefix .. ":DATA:" .. host .. ":" .. file)
+	local userdata, err = self.tracked:cached("GET", self.prefix .. ":DATA:" .. host .. ":" .. file)
 	if err then
-		userdata, err = self.red:cmd("GET", self.prefix .. ":DATA:__:" .. file)
+		userdata, err = self.tracked:cached("GET", self.prefix .. ":DATA:__:" .. file)
 	end
 	if not userdata then
 		return nil, "userdata not found"
@@ -71,6 +99,22 @@ local fetch_content = function(self, host, query, metadata)
 	if not host or not query then
 		return nil, "host/query not provided"
 	end
+	local cache_key = "CONTENT:"
+		.. host
+		.. ":"
+		.. cache.generation(host)
+		.. ":"
+		.. query
+		.. ":"
+		.. tostring(metadata.file)
+	local cached = cache.get(cache_key)
+	if cached then
+		local content = cached[1]
+		if cached[4] == "application/lua" then
+			content = load(content)()
+		end
+		return content, cached[2], cached[3], cached[4], cached[5], cached[6]
+	end
 	local filename = metadata.file
 	local prefix = self.data_dir .. "/" .. host
 	if not filename then
@@ -103,18 +147,46 @@ local fetch_content = function(self, host, query, metadata)
 			"hash",
 			"size",
 			"mime",
-			"title"
+			"title",
+			"html"
 		)
 		if resp then
 			local content = resp[1]
+			-- Files pushed by `reliw ingest` don't know about the entry's metadata,
+			-- and have the pre-rendered HTML for djot/markdown files
+			if resp[5] == "" or resp[5] == "NULL" then
+				resp[5] = metadata.title or ""
+			end
+			if resp[6] == "NULL" then
+				resp[6] = nil
+			end
+			cache.set(cache_key, resp, self.content_ttl)
 			if resp[4] == "application/lua" then
 				content = load(resp[1])()
 			end
-			return content, resp[2], resp[3], resp[4], resp[5]
+			return content, resp[2], resp[3], resp[4], resp[5], resp[6]
 		end
 		return nil, "something went wrong"
 	end
-	local content = std.fs.read_file(prefix .. filename) or std.fs.read_file(self.data_dir .. "/__" .. filename)
+	local path = prefix .. filename
+	local st = std.fs.stat(path)
+	if not st then
+		path = self.data_dir .. "/__" .. filename
+		st = std.fs.stat(path)
+	end
+	-- Files that are too big to be cached are sent straight from the disk
+	-- by the web server, unless they have to be rendered or run.
+	if
+		st
+		and st.mode == "f"
+		and st.size > self.cache_max_size
+		and mime_type ~= "application/lua"
+		and mime_type ~= "text/djot"
+		and mime_type ~= "text/markdown"
+	then
+		return { file = path }, string.format("%x-%x", st.mtime, st.size), st.size, mime_type, metadata.title or ""
+	end
+	local content = std.fs.read_file(path)
 	if not content then
 		return nil, filename .. " not found"
 	end
@@ -140,7 +212,8 @@ local fetch_content = function(self, host, query, metadata)
 			"title",
 			title
 		)
-		self.red:cmd("EXPIRE", self.prefix .. ":FILES:" .. host .. ":" .. filename, 3600)
+		self.red:cmd("EXPIRE", self.prefix .. ":FILES:" .. host .. ":" .. filename, self.files_ttl)
+		cache.set(cache_key, { content, hash, size, mime_type, title }, self.content_ttl)
 	end
 	if mime_type == "application/lua" then
 		content = load(content)()
@@ -167,8 +240,8 @@ local check_waf = function(self, host, query, headers)
 	if not host or not query then
 		return nil
 	end
-	local global = self.red:cmd("HGET", self.prefix .. ":WAF", "__")
-	local per_host = self.red:cmd("HGET", self.prefix .. ":WAF", host)
+	local global = self.tracked:cached("HGET", self.prefix .. ":WAF", "__")
+	local per_host = self.tracked:cached("HGET", self.prefix .. ":WAF", host)
 	if not global and not per_host then
 		return nil
 	end
@@ -285,13 +358,51 @@ local fetch_session_user = function(self, host, token)
 	if err then
 		return nil
 	end
-	local user = self.red:cmd("HEXISTS", self.prefix .. ":USERS:" .. host, session_user)
+	local user = self.tracked:cached("HEXISTS", self.prefix .. ":USERS:" .. host, session_user)
 	if not user or user <= 0 then
 		return nil
 	end
 	return session_user
 end
 
+local revoke_session_token = function(self, id, expires)
+	if not id or not expires then
+		return nil, "required args not provided"
+	end
+	local key = self.prefix .. ":SESSIONS:REVOKED"
+	self.red:cmd("ZREMRANGEBYSCORE", key, "-inf", os.time())
+	local ok, err = self.red:cmd("ZADD", key, expires, id)
+	if not ok then
+		return nil, err
+	end
+	return self.red:cmd("PUBLISH", key, id .. ":" .. expires)
+end
+
+local fetch_revoked_sessions = function(self)
+	local revoked = {}
+	local resp, err =
+		self.red:cmd("ZRANGEBYSCORE", self.prefix .. ":SESSIONS:REVOKED", os.time(), "+inf", "WITHSCORES")
+	if not resp then
+		return revoked, err
+	end
+	for i = 1, #resp, 2 do
+		revoked[resp[i]] = tonumber(resp[i + 1])
+	end
+	return revoked
+end
+
+-- Checks a single token id, for when the set of revoked ones is not in sync
+local session_revoked = function(self, id)
+	local expires, err = self.red:cmd("ZSCORE", self.prefix .. ":SESSIONS:REVOKED", id)
+	if expires then
+		return tonumber(expires) >= os.time()
+	end
+	if err == "not found" then
+		return false
+	end
+	return nil, err
+end
+
 local fetch_metrics = function(self)
 	local metrics_total = "# TYPE http_requests_total counter\n"
 	local metrics_by_method = "# TYPE http_requests_by_method counter\n"
@@ -327,7 +438,91 @@ local fetch_metrics = function(self)
 			end
 		end
 	end
-	return metrics_total .. metrics_by_method
+	local metrics_overload = "# TYPE http_connections_overload counter\n"
+	-- The peak number of forks is a high-water mark, not a counter
+	local metrics_peak_forks = "# TYPE http_connections_peak_forks gauge\n"
+	local processes, _ = self.red:cmd("KEYS", self.prefix .. ":METRICS:__overload:*")
+	if processes then
+		for _, p in ipairs(processes) do
+			local process_name = p:match(self.prefix .. ":METRICS:__overload:(.*)")
+			local values = self.red:cmd("HGETALL", p)
+			if values then
+				for i = 1, #values, 2 do
+					if values[i] == "peak_forks" then
+						metrics_peak_forks = metrics_peak_forks
+							.. [[http_connections_peak_forks{process="]]
+							.. process_name
+							.. [["} ]]
+							.. values[i + 1]
+							.. "\n"
+					else
+						metrics_overload = metrics_overload
+							.. [[http_connections_overload{process="]]
+							.. process_name
+							.. [[",counter="]]
+							.. values[i]
+							.. [["} ]]
+							.. values[i + 1]
+							.. "\n"
+					end
+				end
+			end
+		end
+	end
+	-- Buckets are kept as separate counters, and made cumulative here
+	local metrics_alloc = "# TYPE reliw_request_alloc_bytes histogram\n"
+	processes, _ = self.red:cmd("KEYS", self.prefix .. ":METRICS:__alloc:*")
+	if processes then
+		for _, p in ipairs(processes) do
+			local process_name = p:match(self.prefix .. ":METRICS:__alloc:(.*)")
+			local values = self.red:cmd("HGETALL", p)
+			if values then
+				local counters, buckets = {}, {}
+				for i = 1, #values, 2 do
+					local le = values[i]:match("^le_(%d+)$")
+					if le then
+						table.insert(buckets, { le = tonumber(le), count = tonumber(values[i + 1]) })
+					else
+						counters[values[i]] = tonumber(values[i + 1])
+					end
+				end
+				table.sort(buckets, function(a, b)
+					return a.le < b.le
+				end)
+				local labels = [[process="]] .. process_name .. [["]]
+				local cumulative = 0
+				for _, bucket in ipairs(buckets) do
+					cumulative = cumulative + bucket.count
+					metrics_alloc = metrics_alloc
+						.. string.format(
+							'reliw_request_alloc_bytes_bucket{%s,le="%d"} %d\n',
+							labels,
+							bucket.le * 1024,
+							cumulative
+						)
+				end
+				local requests = counters.requests or 0
+				metrics_alloc = metrics_alloc
+					.. string.format('reliw_request_alloc_bytes_bucket{%s,le="+Inf"} %d\n', labels, requests)
+					.. string.format("reliw_request_alloc_bytes_sum{%s} %d\n", labels, (counters.kb or 0) * 1024)
+					.. string.format("reliw_request_alloc_bytes_count{%s} %d\n", labels, requests)
+			end
+		end
+	end
+	local metrics_shm = ""
+	local shm_stats = cache.stats()
+	if shm_stats then
+		metrics_shm = "# TYPE reliw_shm_cache gauge\n"
+		for _, counter in ipairs({ "items", "hits", "misses", "sets", "evictions", "expired", "pages_used" }) do
+			metrics_shm = metrics_shm
+				.. [[reliw_shm_cache{counter="]]
+				.. counter
+				.. [["} ]]
+				.. string.format("%d", shm_stats[counter])
+				.. "\n"
+		end
+	end
+	return metrics_total .. metrics_by_method .. metrics_overload .. metrics_peak_forks .. metrics_alloc .. metrics_shm
 end
 
 local update_metrics = function(self, host, method, query, status)
@@ -337,24 +532,127 @@ local update_metrics = function(self, host, method, query, status)
 	return resp, err
 end
 
+local update_overload_metrics = function(self, process, stats)
+	return self.red:cmd(
+		"HSET",
+		self.prefix .. ":METRICS:__overload:" .. process,
+		"accepted",
+		stats.accepted,
+		"shed_fork_limit",
+		stats.shed_fork_limit,
+		"shed_per_ip",
+		stats.shed_per_ip,
+		"peak_forks",
+		stats.peak_forks
+	)
+end
+
+-- `alloc` is what web_server's `report_alloc` hook gets, `bounds` are
+-- the upper bounds of its buckets, in KB. The last bucket has no bound.
+local update_alloc_metrics = function(self, process, alloc, bounds)
+	local key = self.prefix .. ":METRICS:__alloc:" .. process
+	local cmds = {
+		{ "HINCRBY", key, "requests", tostring(alloc.requests) },
+		{ "HINCRBYFLOAT", key, "kb", string.format("%.3f", alloc.kb) },
+	}
+	-- empty buckets too, histograms are expected to have them all
+	for i, le in ipairs(bounds) do
+		table.insert(cmds, { "HINCRBY", key, "le_" .. le, tostring(alloc.buckets[i]) })
+	end
+	return self.red:pipeline(cmds)
+end
+
 local send_ctl_msg = function(self, msg)
 	local resp, err = self.red:cmd("PUBLISH", self.prefix .. ":CTL", msg)
 	return resp, err
 end
 
+local scan_delete = function(self, pattern)
+	local cursor = "0"
+	repeat
+		local resp, err = self.red:cmd("SCAN", cursor, "MATCH", pattern, "COUNT", 1000)
+		if not resp then
+			return nil, err
+		end
+		cursor = resp[1]
+		local keys = resp[2] or {}
+		if #keys > 0 then
+			self.red:cmd("DEL", unpack(keys))
+		end
+	until cursor == "0"
+	return true
+end
+
+--[[
+    Drops the cached copies of a file, `filename` is relative to the vhost dir.
+    For a directory everything below it is dropped. Files of the `__` dir
+    are shared by all vhosts, so they are dropped for all of them.
+]]
+local invalidate_files = function(self, host, filename, dir)
+	if host ~= "__" then
+		cache.bump_generation(host)
+		if not dir then
+			return self.red:cmd("DEL", self.prefix .. ":FILES:" .. host .. ":" .. filename)
+		end
+	else
+		for _, item in ipairs(std.fs.list_dir(self.data_dir) or {}) do
+			if not item:match("^%.") and std.fs.dir_exists(self.data_dir .. "/" .. item) then
+				cache.bump_generation(item)
+			end
+		end
+		host = "*"
+	end
+	local pattern = filename:gsub("[%*%?%[%]\\]", "\\%0")
+	if dir then
+		pattern = pattern .. "/*"
+	end
+	return scan_delete(self, self.prefix .. ":FILES:" .. host .. ":" .. pattern)
+end
+
 local new = function(srv_cfg)
 	local red, err = redis.connect(srv_cfg.redis)
 	if err then
 		return nil, err
 	end
+	-- Slowly changing keys (API schemas, proxy configs, WAF rules, users...)
+	-- are read through a separate connection with client side caching,
+	-- the main one stays RESP2.
+	local tracked = red
+	if srv_cfg.redis.client_cache then
+		local cfg = std.tbl.copy(srv_cfg.redis)
+		cfg.tracking = cfg.client_cache
+		local conn = redis.connect(cfg)
+		if conn and conn:cache_stats() then
+			tracked = conn
+		elseif conn then
+			conn:close(true)
+		end
+	end
+	-- While `data_dir` is watched (see `watch_files`), cached files are dropped
+	-- as soon as they change, so they are kept for longer. Only once the watcher
+	-- is actually running though, until then (or if it failed) the defaults stay.
+	local files_ttl, content_ttl = 3600, srv_cfg.shm_cache and srv_cfg.shm_cache.ttl
+	if srv_cfg.files_cache and srv_cfg.files_cache.watch and (files_watched or cache.get(FILES_WATCHED)) then
+		files_ttl = srv_cfg.files_cache.ttl
+		content_ttl = srv_cfg.files_cache.ttl
+	end
 	return {
 		prefix = srv_cfg.redis.prefix,
 		data_dir = srv_cfg.data_dir,
 		cache_max_size = srv_cfg.cache_max_size,
+		shm_ttl = srv_cfg.shm_cache and srv_cfg.shm_cache.ttl,
+		files_ttl = files_ttl,
+		content_ttl = content_ttl,
+		sessions = srv_cfg.sessions,
 		red = red,
-		close = function(self)
+		tracked = tracked,
+		-- With `no_keepalive` the connections are closed instead of going back to the pool
+		close = function(self, no_keepalive)
 			if self.red then
-				self.red:close()
+				self.red:close(no_keepalive)
+			end
+			if self.tracked and self.tracked ~= self.red then
+				self.tracked:close(no_keepalive)
 			end
 		end,
 		fetch_host_schema = fetch_host_schema,
@@ -365,6 +663,9 @@ local new = function(srv_cfg)
 		fetch_hash_and_size = fetch_hash_and_size,
 		fetch_userdata = fetch_userdata,
 		fetch_session_user = fetch_session_user,
+		fetch_revoked_sessions = fetch_revoked_sessions,
+		revoke_session_token = revoke_session_token,
+		session_revoked = session_revoked,
 		fetch_metrics = fetch_metrics,
 		check_rate_limit = check_rate_limit,
 		check_waf = check_waf,
@@ -375,8 +676,110 @@ local new = function(srv_cfg)
 		set_session_data = set_session_data,
 		destroy_session = destroy_session,
 		update_metrics = update_metrics,
+		update_overload_metrics = update_overload_metrics,
+		update_alloc_metrics = update_alloc_metrics,
 		send_ctl_msg = send_ctl_msg,
+		invalidate_files = invalidate_files,
 	}
 end
 
-return { new = new }
+--[[
+    To be used as a `web_server` watcher setup function:
+    watches `data_dir` and drops the cached copies of the files as soon as
+    they change, so that `files_cache.ttl` can be long.
+    When the inotify queue overflows, all the cached files are dropped.
+    It runs in the server process, so its connection never goes to the pool.
+]]
+local watch_files = function(srv_cfg)
+	local store, err = new(srv_cfg)
+	if not store then
+		return nil, err
+	end
+	local watcher, err = std.fs.watch(srv_cfg.data_dir, { recursive = true })
+	if not watcher then
+		store:close(true)
+		return nil, err
+	end
+	-- The request forks of this server inherit the flag, other servers see the shm marker
+	files_watched = true
+	cache.set(FILES_WATCHED, true)
+	local root = srv_cfg.data_dir:gsub("/+$", "")
+	return watcher,
+		function()
+			-- Let bursts of writes settle, to invalidate each file only once
+			local events, err = watcher:read(0.05)
+			if not events then
+				files_watched = false
+				cache.delete(FILES_WATCHED)
+				watcher:close()
+				store:close(true)
+				return false
+			end
+			for _, event in ipairs(events) do
+				if event.kind == "overflow" then
+					for _, item in ipairs(std.fs.list_dir(root) or {}) do
+						cache.bump_generation(item)
+					end
+					scan_delete(store, store.prefix .. ":FILES:*")
+				elseif event.path and (not event.dir or event.kind == "delete") then
+					-- files of new directories are reported one by one
+					local host, filename = event.path:sub(#root + 2):match("^([^/]+)(/.+)$")
+					if host then
+						store:invalidate_files(host, filename, event.dir)
+					end
+				end
+			end
+		end
+end
+
+--[[
+    To be used as a `web_server` watcher setup function: subscribes to
+    invalidations of API entries and proxy configs with `CLIENT TRACKING`
+    in broadcast mode, and drops them from the shared memory cache as soon
+    as they change. One connection serves all the workers, they share the cache.
+    It runs in the server process, so its connection never goes to the pool.
+]]
+local watch_invalidations = function(srv_cfg)
+	local cfg = std.tbl.copy(srv_cfg.redis)
+	cfg.tracking, cfg.client_cache = nil, nil
+	local red, err = redis.connect(cfg)
+	if not red then
+		return nil, err
+	end
+	local prefix = srv_cfg.redis.prefix
+	local ok, err = red:cmd("HELLO", "3")
+	if ok then
+		local api, proxy = prefix .. ":API:", prefix .. ":PROXY:"
+		ok, err = red:cmd("CLIENT", "TRACKING", "ON", "BCAST", "PREFIX", api, "PREFIX", proxy)
+	end
+	if not ok then
+		red:close(true)
+		return nil, err
+	end
+	return red.s,
+		function()
+			repeat
+				local resp, err = red:read()
+				if not resp then
+					red:close(true)
+					return false
+				end
+				if resp.type == "push" and type(resp.value) == "table" and resp.value[1] == "invalidate" then
+					local keys = resp.value[2]
+					-- NULL instead of keys means that the whole database was flushed
+					if type(keys) == "table" then
+						for _, key in ipairs(keys) do
+							cache.delete(key)
+						end
+					else
+						cache.flush()
+						if files_watched then
+							cache.set(FILES_WATCHED, true)
+						end
+					end
+				end
+			until not red.s:dirty()
+		end
+end
+
+return { new = new, watch_files = watch_files, watch_invalidations = watch_invalidations }
@@ -110,9 +110,7 @@ local error_page = function(code, hit_count, user_tmpl, img)
 end
 
 local djot_to_html = function(djot_content)
-	local doc = djot.parse(djot_content)
-	local html = djot.render_html(doc)
-	return html
+	return djot.to_html(djot_content)
 end
 
 local render_page = function(content, vars, user_tmpl)
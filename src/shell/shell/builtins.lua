@@ -12,6 +12,7 @@ local text = require("text")
 local argparser = require("argparser")
 local buffer = require("string.buffer")
 local style = require("term.tss")
+local profiler = require("std.profile")
 
 local set_term_title = function(title)
 	local term_title_prefix = os.getenv("LILUSH_TERM_TITLE_PREFIX") or ""
@@ -1308,18 +1309,56 @@ placement by using `{}` in place of one of the command's arguments:
 ```lsh
 files_matching .txt chmod 0640 {}
 ```
+
+Commands are run in parallel, as many at once as there are CPUs,
+unless `-j`{.flag} says otherwise. Output of each command is shown once it's done,
+in the order of the files (sorted by name), or as they finish with `-u`{.flag}.
+No new commands are started after a failure, unless `-k`{.flag} is given.
 ]]
+
+-- Flags shared by `files_matching` and `pargs`
+local parallel_flags = {
+	jobs = { kind = "num", default = 0, note = "Number of commands to run at once, 0 for the number of CPUs" },
+	unordered = { kind = "bool", note = "Show the output of each command as soon as it's done" },
+	keep = { kind = "bool", note = "Keep going after a failed command" },
+}
+
+local run_parallel = function(command, items, args)
+	local cmd = ""
+	for i, arg in ipairs(command) do
+		if arg:match("%s") then
+			cmd = cmd .. '"' .. arg .. '" '
+		else
+			cmd = cmd .. arg .. " "
+		end
+	end
+	local pipeline, err = utils.parse_pipeline(cmd, true)
+	if not pipeline then
+		return 33, err
+	end
+	local status, err = utils.run_parallel(
+		pipeline,
+		items,
+		_M,
+		{ jobs = args.jobs, unordered = args.unordered, fail_fast = not args.keep }
+	)
+	if status ~= 0 then
+		errmsg(err)
+	end
+	return status, err
+end
+
 local files_matching = function(cmd, args)
-	local parser = argparser.new({
-		pattern = { kind = "str", idx = 1, note = "literal pattern to match in a filename (not regex)" },
-		command = {
-			kind = "str",
-			idx = 2,
-			default = { "echo" },
-			multi = true,
-			note = "The command to execute, with all required arguments",
-		},
-	}, files_matching_help)
+	local schema = std.tbl.copy(parallel_flags)
+	schema.pattern = { kind = "str", idx = 1, note = "literal pattern to match in a filename (not regex)" }
+	schema.command = {
+		kind = "str",
+		idx = 2,
+		default = { "echo" },
+		multi = true,
+		note = "The command to execute, with all required arguments",
+	}
+	local parser = argparser.new(schema, files_matching_help)
 	local args, err, help = parser:parse(args)
 	if err then
 		if help then
@@ -1334,46 +1373,156 @@ local files_matching = function(cmd, args)
 		path = "."
 	end
 	local files = std.fs.list_files(path, pattern) or {}
+	local items = {}
 	for file, stat in pairs(files) do
-		local cmd = ""
-		local full_path
 		if path == "." then
-			full_path = file
+			table.insert(items, file)
+		elseif path:match("/$") then
+			table.insert(items, path .. file)
 		else
-			if path:match("/$") then
-				full_path = path .. file
-			else
-				full_path = path .. "/" .. file
-			end
+			table.insert(items, path .. "/" .. file)
 		end
-		for i, arg in ipairs(args.command) do
-			if arg:match("%s") then
-				cmd = cmd .. '"' .. arg .. '" '
-			else
-				cmd = cmd .. arg .. " "
-			end
-		end
-		local pipeline, err = utils.parse_pipeline(cmd, true)
-		if not pipeline then
-			return 33, err
+	end
+	table.sort(items)
+	return run_parallel(args.command, items, args)
+end
+
+local pargs_help = [[
+: pargs
+
+  Execute a given command for each line of stdin, like `xargs -P`.
+
+Each line is inserted as the first argument of the command,
+or in place of `{}`:
+
+```lsh
+kat list.txt | pargs -j 4 gzip {}
+```
+
+See `files_matching`{.cmd} for the rest of the flags.
+]]
+local parallel_args = function(cmd, args)
+	local schema = std.tbl.copy(parallel_flags)
+	schema.command = {
+		kind = "str",
+		idx = 1,
+		multi = true,
+		note = "The command to execute, with all required arguments",
+	}
+	local parser = argparser.new(schema, pargs_help)
+	local args, err, help = parser:parse(args)
+	if err then
+		if help then
+			helpmsg(err)
+			return 0
 		end
-		local replaced = false
-		for i, arg in ipairs(pipeline[1].args) do
-			if arg == "{}" then
-				pipeline[1].args[i] = full_path
-				replaced = true
-				break
-			end
+		errmsg(err)
+		return 127
+	end
+	local items = {}
+	for _, line in ipairs(std.txt.lines(io.stdin:read("*a") or "")) do
+		if line ~= "" then
+			table.insert(items, line)
 		end
-		if not replaced then
-			table.insert(pipeline[1].args, 1, full_path)
+	end
+	return run_parallel(args.command, items, args)
+end
+
+local profile_help = [[
+: profile
+
+  Run a Lua script under the sampling profiler.
+
+The script's stacks are sampled every `interval` milliseconds, and written
+to the `output` file as folded stacks, ready for `flamegraph.pl`,
+inferno or speedscope. The innermost frame of each stack is the state
+the VM was in: `[interpreted]`, `[compiled]`, `[gc]`, `[c]` or `[jit]`.
+A summary of the hottest functions is printed when the script is done.
+
+```lsh
+profile -o /tmp/report.folded report.lua --since yesterday
+```
+
+Arguments after the script's name are passed to the script.
+`lilush --profile script.lua` does the same.
+]]
+-- Flags of `profile` that take a value, the script's name is the first argument that's not one of them
+local profile_valued_flags = {
+	["-o"] = true,
+	["--output"] = true,
+	["-i"] = true,
+	["--interval"] = true,
+	["-d"] = true,
+	["--depth"] = true,
+	["-t"] = true,
+	["--top"] = true,
+}
+
+local run_profiled = function(cmd, args)
+	local own = {}
+	local i = 1
+	while args[i] and args[i]:match("^%-") do
+		table.insert(own, args[i])
+		if profile_valued_flags[args[i]] then
+			table.insert(own, args[i + 1])
+			i = i + 1
 		end
-		local status, err = utils.run_pipeline(pipeline, nil, _M, nil)
-		if status ~= 0 then
-			return status, err
+		i = i + 1
+	end
+	if args[i] then
+		table.insert(own, args[i])
+	end
+	local parser = argparser.new({
+		output = { kind = "str", default = "", note = "Where to write the folded stacks, `script.folded` by default" },
+		interval = { kind = "num", default = 1, note = "Sampling interval in milliseconds" },
+		depth = { kind = "num", default = 64, note = "Max number of frames to record" },
+		lines = { kind = "bool", note = "Record `module:line` frames instead of `module:function`" },
+		top = { kind = "num", default = 20, note = "Number of functions to show in the summary" },
+		script = { kind = "file", idx = 1 },
+	}, profile_help)
+	local parsed, err, help = parser:parse(own)
+	if err then
+		if help then
+			helpmsg(err)
+			return 0
 		end
+		errmsg(err)
+		return 127
 	end
-	return 0
+	local chunk, err = loadfile(parsed.script)
+	if not chunk then
+		errmsg(err)
+		return 33
+	end
+	local script_args = {}
+	for j = i + 1, #args do
+		table.insert(script_args, args[j])
+	end
+	_G.arg = script_args
+
+	local result, ret = profiler.run(
+		{ interval = parsed.interval, depth = parsed.depth, lines = parsed.lines },
+		chunk,
+		unpack(script_args)
+	)
+	if not result then
+		errmsg(ret)
+		return 34
+	end
+	local output = parsed.output
+	if output == "" then
+		output = parsed.script:gsub("%.lua$", "") .. ".folded"
+	end
+	local ok, err = std.fs.write_file(output, result:folded())
+	if not ok then
+		errmsg("failed to write " .. output .. ": " .. tostring(err))
+	end
+	io.stderr:write(result:summary(parsed.top), "folded stacks: " .. output .. "\n")
+	if not ret[1] then
+		errmsg(tostring(ret[2]))
+		return 1
+	end
+	return tonumber(ret[2]) or 0
 end
 
 local zx_help = [[
@@ -1478,6 +1627,8 @@ local builtins = {
 	["envlist"] = list_env,
 	["history"] = history,
 	["files_matching"] = files_matching,
+	["pargs"] = parallel_args,
+	["profile"] = run_profiled,
 	["setenv"] = setenv,
 	["export"] = setenv,
 	["unsetenv"] = unsetenv,
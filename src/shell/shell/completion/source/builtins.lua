@@ -34,6 +34,7 @@ local new = function()
 			cd = true,
 			mkdir = true,
 			files_matching = true,
+			pargs = true,
 			kat = true,
 			notify = true,
 			history = true,
@@ -185,33 +185,61 @@ local vault_login = function()
 	return true
 end
 
-local fetch_env_secrets = function(envs)
+local fetch_env_secrets = function(self, envs)
 	local store = storage.new()
 	local token = store:get_vault_token()
-	store:close()
-	local vc = vault.new(nil, token)
+	local cache = {
+		get = function(_, key)
+			return store:get_vault_cache(key)
+		end,
+		set = function(_, key, value, ttl)
+			return store:save_vault_cache(key, value, ttl)
+		end,
+	}
+	local vc = vault.new(nil, token, { cache = cache })
 	local ok, err = vc:healthy()
 	if not ok then
+		store:close()
 		return nil, err
 	end
+	local names, refs = {}, {}
 	for name, value in pairs(envs) do
 		local mount, path = value:match("^vault://([^/]+)/(.+)$")
 		if not mount or not path then
+			store:close()
 			return nil, "failed to parse vault reference"
 		end
 		if not path:match("#") then
 			path = path .. "#value"
 		end
-		local secret, err = vc:get_secret(path, mount)
-		if not secret then
-			return nil, err
-		end
-		std.ps.setenv(name, secret)
+		table.insert(names, name)
+		table.insert(refs, { path, mount })
 	end
+	local secrets, err = vc:get_secrets(refs)
+	store:close()
+	if not secrets then
+		vc:close()
+		return nil, err
+	end
+	for i, name in ipairs(names) do
+		std.ps.setenv(name, secrets[i])
+	end
+	-- Keep dynamic secrets' leases alive while they are in the env
+	if self.vault_renewer then
+		std.ps.kill(self.vault_renewer, 9)
+		std.ps.wait(self.vault_renewer) -- a blocking wait, waitpid would leave a zombie
+	end
+	self.vault_renewer = vc:spawn_renewer()
+	vc:close()
 	return true
 end
 
 local clear_env_secrets = function(self)
+	if self.vault_renewer then
+		std.ps.kill(self.vault_renewer, 9)
+		std.ps.wait(self.vault_renewer)
+		self.vault_renewer = nil
+	end
 	if self.vault_vars then
 		for name, value in pairs(self.vault_vars) do
 			std.ps.setenv(name, value)
@@ -251,7 +279,7 @@ local env_secrets_combo = function(self, combo)
 			selected_envs[name] = vault_vars[name]
 		end
 		self.vault_vars = vault_vars
-		if fetch_env_secrets(selected_envs) then
+		if fetch_env_secrets(self, selected_envs) then
 			self.input:prompt_set({ blocks = prompt_blocks, vault_status = "unlocked" })
 		else
 			self:clear_env_secrets()
@@ -102,6 +102,15 @@ local get_vault_token = function(self)
 	return self.redis:cmd("GET", self.prefix .. "vault_token" .. self.suffix)
 end
 
+-- Secrets are stored encrypted by the vault client, see `vault.new`
+local get_vault_cache = function(self, key)
+	return self.redis:cmd("GET", self.prefix .. "vault_cache/" .. key .. self.suffix)
+end
+
+local save_vault_cache = function(self, key, value, ttl)
+	return self.redis:cmd("SET", self.prefix .. "vault_cache/" .. key .. self.suffix, value, "EX", ttl)
+end
+
 local close = function(self, no_keepalive)
 	self.redis:close(no_keepalive)
 end
@@ -149,6 +158,8 @@ local new = function(options)
 		get_file = get_file,
 		get_vault_token = get_vault_token,
 		save_vault_token = save_vault_token,
+		get_vault_cache = get_vault_cache,
+		save_vault_cache = save_vault_cache,
 		save_llm_chat = save_llm_chat,
 		load_llm_chat = load_llm_chat,
 		list_llm_chats = list_llm_chats,
@@ -12,6 +12,7 @@ local style = require("term.tss")
 local input = require("term.input")
 local history = require("term.input.history")
 local wg = require("wireguard")
+local socket = require("socket")
 
 local zx_complete = function(args)
 	local candidates = {}
@@ -237,7 +238,10 @@ parse_pipeline = function(input, with_inlines)
 	return parsed_cmdlines
 end
 
-run_pipeline = function(pipeline, stdout, builtins, extra)
+-- Launches all the commands of a pipeline, returns the list of their pids.
+-- A builtin that must not be forked is run right away, then
+-- there are no pids, and its status & error are returned instead.
+local spawn_pipeline = function(pipeline, stdout, builtins, extra)
 	local builtins = builtins
 	local pipes = {}
 	local pids = {}
@@ -263,7 +267,7 @@ run_pipeline = function(pipeline, stdout, builtins, extra)
 			local builtin = builtins.get(cmd)
 			if builtin then
 				if builtin.fork == false then
-					return builtin.func(builtin.name, args)
+					return nil, builtin.func(builtin.name, args)
 				end
 				if builtin.needy then
 					builtin.extra = extra
@@ -279,6 +283,14 @@ run_pipeline = function(pipeline, stdout, builtins, extra)
 			core.close(stdout)
 		end
 	end
+	return pids
+end
+
+run_pipeline = function(pipeline, stdout, builtins, extra)
+	local pids, status, err = spawn_pipeline(pipeline, stdout, builtins, extra)
+	if not pids then
+		return status, err
+	end
 	for i, pid in ipairs(pids) do
 		if pid ~= 0 then
 			local ret, status = std.ps.wait(pids[i])
@@ -290,6 +302,204 @@ run_pipeline = function(pipeline, stdout, builtins, extra)
 	return 0
 end
 
+-- Returns a copy of the `template` pipeline with `{}` in the arguments
+-- and redirections replaced by `item`. If there are no `{}` at all,
+-- `item` is inserted as the first argument of the first command.
+local fill_pipeline = function(template, item)
+	local pipeline = {}
+	local replaced = false
+	local sub = item:gsub("%%", "%%%%")
+	local fill = function(str)
+		if not str then
+			return nil
+		end
+		local filled, count = str:gsub("{}", sub)
+		replaced = replaced or count > 0
+		return filled
+	end
+	for i, cmdline in ipairs(template) do
+		local args = {}
+		for j, arg in ipairs(cmdline.args) do
+			args[j] = fill(arg)
+		end
+		pipeline[i] = {
+			cmd = cmdline.cmd,
+			args = args,
+			input_file = fill(cmdline.input_file),
+			output_file = fill(cmdline.output_file),
+		}
+	end
+	if not replaced and pipeline[1] then
+		table.insert(pipeline[1].args, 1, item)
+	end
+	return pipeline
+end
+
+local SIGCHLD = 17
+local SIGTERM = 15
+
+--[[
+    Runs the `template` pipeline for each of the `items`, see `fill_pipeline`,
+    keeping up to `opts.jobs` of them running at once (the number of CPUs by default).
+    The template is parsed once by the caller, so are the `$()` inlines in it.
+
+    Children are reaped on SIGCHLD, which is waited for with `select`
+    together with the jobs' stdout pipes. Stdout of each job is collected
+    and written out once the job is done, so that outputs of different jobs
+    never get mixed, in the order of `items` unless `opts.unordered` is set.
+    Stderr is not captured.
+
+    With `opts.fail_fast` no new jobs are started after the first failure,
+    and the running ones get SIGTERM.
+
+    Returns 0, or the status of the first failed job and an error message.
+]]
+local run_parallel = function(template, items, builtins, opts)
+	local opts = opts or {}
+	local max_jobs = opts.jobs or 0
+	if max_jobs < 1 then
+		max_jobs = std.ps.cpu_count()
+	end
+	local write = opts.output or term.write
+	local sigchld, err = std.ps.signalfd(SIGCHLD)
+	if not sigchld then
+		return 255, err
+	end
+
+	local jobs, procs, readers = {}, {}, {}
+	local next_item, next_output, running = 1, 1, 0
+	local failed, failed_err, stopping
+
+	local emit = function(job)
+		if #job.out > 0 then
+			write(table.concat(job.out))
+		end
+		jobs[job.idx] = nil
+	end
+
+	local finish = function(job)
+		running = running - 1
+		job.done = true
+		local status = job.status or 0
+		for i = 1, job.stages do
+			if job.statuses[i] ~= 0 then
+				status = job.statuses[i]
+				break
+			end
+		end
+		if status ~= 0 and not failed then
+			failed = status
+			failed_err = job.err or ("`" .. job.cmd .. "` failed for `" .. job.item .. "`")
+			if opts.fail_fast then
+				stopping = true
+				for pid in pairs(procs) do
+					std.ps.kill(pid, SIGTERM)
+				end
+			end
+		end
+		if opts.unordered then
+			emit(job)
+			return
+		end
+		while jobs[next_output] and jobs[next_output].done do
+			emit(jobs[next_output])
+			next_output = next_output + 1
+		end
+	end
+
+	local start = function(idx)
+		local pipeline = fill_pipeline(template, items[idx])
+		local out = std.ps.pipe()
+		local job = { idx = idx, item = items[idx], cmd = pipeline[1].cmd, out = {}, statuses = {}, stages = 0 }
+		jobs[idx] = job
+		running = running + 1
+		local pids, status, err = spawn_pipeline(pipeline, out.inn, builtins, opts.extra)
+		if not pids then
+			-- a builtin that is not forked, it's done already
+			out:close_inn()
+			out:close_out()
+			job.status, job.err = status, err
+			finish(job)
+			return
+		end
+		for i, pid in ipairs(pids) do
+			procs[pid] = { job = job, stage = i }
+			job.stages = i
+		end
+		job.left = job.stages
+		job.reader = {
+			fd = out.out,
+			getfd = function(self)
+				return self.fd
+			end,
+			dirty = function(self)
+				return false
+			end,
+		}
+		readers[job.reader] = job
+	end
+
+	-- Only our own pids are waited for: other children of the shell
+	-- (background jobs, the vault renewer) are reaped by their owners.
+	local reap = function()
+		sigchld:read()
+		for pid, proc in pairs(procs) do
+			local reaped, status = core.waitpid(pid)
+			if reaped == pid then
+				procs[pid] = nil
+				local job = proc.job
+				job.statuses[proc.stage] = status or 255 -- killed by a signal
+				job.left = job.left - 1
+				if job.left == 0 and not job.reader then
+					finish(job)
+				end
+			end
+		end
+	end
+
+	local read_output = function(reader)
+		local job = readers[reader]
+		local data = core.read(reader.fd, 65536)
+		if data and #data > 0 then
+			table.insert(job.out, data)
+			return
+		end
+		core.close(reader.fd)
+		readers[reader] = nil
+		job.reader = nil
+		if job.left == 0 then
+			finish(job)
+		end
+	end
+
+	while true do
+		while not stopping and running < max_jobs and next_item <= #items do
+			start(next_item)
+			next_item = next_item + 1
+		end
+		if running == 0 then
+			break
+		end
+		local watched = { sigchld }
+		for reader in pairs(readers) do
+			table.insert(watched, reader)
+		end
+		local ready = socket.select(watched)
+		for _, sock in ipairs(ready or {}) do
+			if sock == sigchld then
+				reap()
+			else
+				read_output(sock)
+			end
+		end
+	end
+	sigchld:close()
+	if failed then
+		return failed, failed_err
+	end
+	return 0
+end
+
 --[[ 
         Pager methods below
 ]]
@@ -310,19 +520,37 @@ local pager_next_render_mode = function(self)
 	self:display()
 end
 
+--[[
+    In djot mode the content is parsed and styled only once, into
+    a layout (see `text.djot_layout`), which is then laid out lazily
+    for the current wrap width: only as many lines as are needed to
+    display the current page. Layouts for the widths we've been to are cached.
+]]
 local pager_set_render_mode = function(self, mode)
 	local mode = mode or self.__config.render_mode
 	self.__config.render_mode = mode
-	local rss = theme.renderer.kat
-	local conf = { global_indent = 0, wrap = self.__config.wrap, mode = mode, hide_links = self.__config.hide_links }
-	if mode == "raw" then
-		if not self.__config.wrap_in_raw then
-			conf.wrap = 0
+	if mode == "djot" then
+		if not self.content.layout then
+			self.content.layout =
+				text.djot_layout(self.content.raw, theme.renderer.kat, { hide_links = self.__config.hide_links })
 		end
-		rss = {}
+		self:layout_lines(self.__state.top_line + self.__window.capacity)
+		return
+	end
+	local conf = { global_indent = 0, wrap = self.__config.wrap, mode = mode }
+	if not self.__config.wrap_in_raw then
+		conf.wrap = 0
 	end
-	self.content.rendered = text.render(self.content.raw, rss, conf)
+	self.content.rendered = text.render(self.content.raw, {}, conf)
 	self.content.lines = std.txt.lines(self.content.rendered)
+	self.content.complete = true
+end
+
+-- Makes sure there are at least `count` lines laid out, or all of them when `count` is nil
+local pager_layout_lines = function(self, count)
+	if self.__config.render_mode == "djot" and self.content.layout then
+		self.content.lines, self.content.complete = self.content.layout:lines(self.__config.wrap, 0, count)
+	end
 end
 
 local pager_display_line_nums = function(self)
@@ -344,6 +572,7 @@ local pager_display_line_nums = function(self)
 end
 
 local pager_display = function(self)
+	self:layout_lines(self.__state.top_line + self.__window.capacity)
 	term.clear()
 	local count = 0
 	local indent = self.__config.indent + 1
@@ -375,6 +604,11 @@ local pager_display_status_line = function(self)
 	local file = self.__state.history[#self.__state.history]
 	local total_lines = #self.content.lines
 	local kb_size = string.format("%.2f KB", #self.content.raw / 1024)
+	-- Not laid out till the end yet
+	local lines_status = total_lines .. " lines"
+	if not self.content.complete then
+		lines_status = total_lines .. "+ lines"
+	end
 	local position_pct = ((self.__state.top_line + self.__window.capacity) / total_lines) * 100
 	if position_pct > 100 then
 		position_pct = 100.00
@@ -382,7 +616,7 @@ local pager_display_status_line = function(self)
 	local tss = style.new(theme.builtins.pager)
 	local position = string.format("%.2f", position_pct) .. "%"
 	local top_status = tss:apply("status_line.filename", file)
-		.. tss:apply("status_line.total_lines", total_lines .. " lines")
+		.. tss:apply("status_line.total_lines", lines_status)
 		.. tss:apply("status_line.size", kb_size)
 
 	local bottom_status = tss:apply("status_line.position", position)
@@ -428,6 +662,7 @@ local pager_exit = function(self)
 		self.__screen:done()
 	end
 	term.go(self.__window.l, 1)
+	self:layout_lines(self.__state.top_line + self.__window.capacity)
 	local till = self.__window.capacity
 	if self.__state.top_line > 1 then
 		till = self.__state.top_line + self.__window.capacity
@@ -460,6 +695,7 @@ local pager_line_up = function(self)
 end
 
 local pager_line_down = function(self)
+	self:layout_lines(self.__state.top_line + self.__window.capacity + 1)
 	if self.__state.top_line + self.__window.capacity < #self.content.lines then
 		self.__state.top_line = self.__state.top_line + 1
 		self:display()
@@ -475,6 +711,7 @@ local pager_page_up = function(self)
 end
 
 local pager_page_down = function(self)
+	self:layout_lines(self.__state.top_line + self.__window.capacity * 2)
 	self.__state.top_line = self.__state.top_line + self.__window.capacity
 	if self.__state.top_line > #self.content.lines - self.__window.capacity then
 		self.__state.top_line = #self.content.lines - self.__window.capacity
@@ -488,6 +725,7 @@ local pager_top_line = function(self)
 end
 
 local pager_bottom_line = function(self)
+	self:layout_lines()
 	local position = 1
 	if #self.content.lines > self.__window.capacity then
 		position = #self.content.lines - self.__window.capacity
@@ -530,6 +768,7 @@ end
 
 local pager_goto_line = function(self, line_num)
 	local line_num = line_num or 0
+	self:layout_lines(line_num)
 	if line_num > 0 and line_num <= #self.content.lines then
 		self.__state.top_line = line_num - 2
 		self.__state.cursor_line = line_num
@@ -571,6 +810,7 @@ local pager_search = function(self, combo)
 		pattern = self.__search.pattern
 	end
 	self.__search.pattern = pattern
+	self:layout_lines()
 	if combo == "n" or combo == "/" then
 		local start = self.__state.top_line
 		if combo == "n" then
@@ -604,6 +844,7 @@ local pager_search = function(self, combo)
 end
 
 local pager_page = function(self)
+	self:layout_lines(self.__window.capacity)
 	if #self.content.lines < self.__window.capacity and self.__config.exit_on_one_page then
 		return self:exit()
 	end
@@ -698,6 +939,7 @@ local pager_new = function(config)
 		set_content = pager_set_content,
 		next_render_mode = pager_next_render_mode,
 		set_render_mode = pager_set_render_mode,
+		layout_lines = pager_layout_lines,
 		line_up = pager_line_up,
 		line_down = pager_line_down,
 		top_line = pager_top_line,
@@ -787,6 +1029,7 @@ return {
 	parse_pipeline = parse_pipeline,
 	parse_cmdline = parse_cmdline,
 	run_pipeline = run_pipeline,
+	run_parallel = run_parallel,
 	wg_info = wg_info,
 	wg_apply = wg_apply,
 	wg_down = wg_down,
@@ -0,0 +1,383 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Table driven codecs for the web: percent encoding, HTML escaping
+ and application/x-www-form-urlencoded parsing.
+
+ All of them scan for the first byte that needs changing, and if there is none,
+ return the very string they were given, without allocating anything.
+ Otherwise unchanged runs are copied as a whole, not byte by byte.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+static const char hex_upper[] = "0123456789ABCDEF";
+
+/* Bytes `url_encode` leaves as they are: ALPHA / DIGIT / "-" / "." / "_" / "~" */
+static uint8_t url_safe[256];
+/* Values of hex digits, 0xff for the rest */
+static uint8_t hex_value[256];
+
+static void init_tables(void) {
+    memset(hex_value, 0xff, sizeof(hex_value));
+    for (int c = 0; c < 256; c++) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+            c == '_' || c == '~') {
+            url_safe[c] = 1;
+        }
+        if (c >= '0' && c <= '9') {
+            hex_value[c] = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            hex_value[c] = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            hex_value[c] = c - 'A' + 10;
+        }
+    }
+}
+
+/*
+ url_encode(s) -- application/x-www-form-urlencoded encoding: spaces become "+",
+ newlines are normalized to CRLF, and everything but ALPHA / DIGIT / "-._~" is percent encoded.
+*/
+static int codec_url_encode(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    size_t i         = 0;
+    while (i < len && url_safe[s[i]]) {
+        i++;
+    }
+    if (i == len) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, (const char *)s, i);
+    while (i < len) {
+        size_t run = i;
+        while (run < len && url_safe[s[run]]) {
+            run++;
+        }
+        luaL_addlstring(&b, (const char *)s + i, run - i);
+        if (run == len) {
+            break;
+        }
+        uint8_t c = s[run];
+        if (c == ' ') {
+            luaL_addchar(&b, '+');
+        } else if (c == '\n' && (run == 0 || s[run - 1] != '\r')) {
+            luaL_addlstring(&b, "%0D%0A", 6);
+        } else {
+            char esc[3] = {'%', hex_upper[c >> 4], hex_upper[c & 15]};
+            luaL_addlstring(&b, esc, 3);
+        }
+        i = run + 1;
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* Decodes `s` into the buffer, "%XX" sequences that are not valid are kept as they are */
+static void url_decode(luaL_Buffer *b, const uint8_t *s, size_t len, int plus) {
+    size_t i = 0;
+    while (i < len) {
+        size_t run = i;
+        while (run < len && s[run] != '%' && !(plus && s[run] == '+')) {
+            run++;
+        }
+        luaL_addlstring(b, (const char *)s + i, run - i);
+        if (run == len) {
+            break;
+        }
+        if (s[run] == '+') {
+            luaL_addchar(b, ' ');
+            i = run + 1;
+        } else if (run + 2 < len && hex_value[s[run + 1]] != 0xff && hex_value[s[run + 2]] != 0xff) {
+            luaL_addchar(b, (char)(hex_value[s[run + 1]] << 4 | hex_value[s[run + 2]]));
+            i = run + 3;
+        } else {
+            luaL_addchar(b, '%');
+            i = run + 1;
+        }
+    }
+}
+
+/* url_decode(s, plus) -- decodes percent encoded bytes, and with `plus` set, "+" as spaces */
+static int codec_url_decode(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    int plus         = lua_toboolean(L, 2);
+    if (memchr(s, '%', len) == NULL && !(plus && memchr(s, '+', len) != NULL)) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    url_decode(&b, s, len, plus);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* Escape sequences for the bytes `html_escape` can be asked to escape */
+static const char *html_entity(uint8_t c) {
+    switch (c) {
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '&':
+        return "&amp;";
+    case '"':
+        return "&quot;";
+    case '\'':
+        return "&#39;";
+    }
+    return NULL;
+}
+
+/* Escapes the bytes marked in `set` into the buffer */
+static void html_escape(luaL_Buffer *b, const uint8_t *s, size_t len, const uint8_t *set) {
+    size_t i = 0;
+    while (i < len) {
+        size_t run = i;
+        while (run < len && !set[s[run]]) {
+            run++;
+        }
+        luaL_addlstring(b, (const char *)s + i, run - i);
+        if (run == len) {
+            break;
+        }
+        luaL_addstring(b, html_entity(s[run]));
+        i = run + 1;
+    }
+}
+
+/* Fills `set` with the bytes of the `chars` argument, returns 0 if there are some `html_escape` can't escape */
+static int html_set(lua_State *L, int idx, uint8_t *set) {
+    size_t n;
+    const uint8_t *chars = (const uint8_t *)luaL_optlstring(L, idx, "<>&\"", &n);
+    memset(set, 0, 256);
+    for (size_t i = 0; i < n; i++) {
+        if (html_entity(chars[i]) == NULL) {
+            return 0;
+        }
+        set[chars[i]] = 1;
+    }
+    return 1;
+}
+
+/*
+ html_escape(s, chars) -- replaces the characters of `chars` (any of `<>&"'`,
+ `<>&"` by default) with entities.
+*/
+static int codec_html_escape(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    uint8_t set[256];
+    if (!html_set(L, 2, set)) {
+        return luaL_argerror(L, 2, "only <>&\"' can be escaped");
+    }
+    size_t i = 0;
+    while (i < len && !set[s[i]]) {
+        i++;
+    }
+    if (i == len) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    html_escape(&b, s, len, set);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static const struct {
+    const char *name;
+    uint32_t cp;
+} named_entities[] = {
+    {"amp",    '&'   },
+    {"lt",     '<'   },
+    {"gt",     '>'   },
+    {"quot",   '"'   },
+    {"apos",   '\''  },
+    {"nbsp",   0xa0  },
+    {"copy",   0xa9  },
+    {"reg",    0xae  },
+    {"laquo",  0xab  },
+    {"raquo",  0xbb  },
+    {"ndash",  0x2013},
+    {"mdash",  0x2014},
+    {"lsquo",  0x2018},
+    {"rsquo",  0x2019},
+    {"ldquo",  0x201c},
+    {"rdquo",  0x201d},
+    {"hellip", 0x2026},
+    {NULL,     0     }
+};
+
+static void add_utf8(luaL_Buffer *b, uint32_t cp) {
+    if (cp == 0 || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        cp = 0xfffd;
+    }
+    if (cp < 0x80) {
+        luaL_addchar(b, cp);
+    } else if (cp < 0x800) {
+        luaL_addchar(b, 0xc0 | (cp >> 6));
+        luaL_addchar(b, 0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        luaL_addchar(b, 0xe0 | (cp >> 12));
+        luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+        luaL_addchar(b, 0x80 | (cp & 0x3f));
+    } else {
+        luaL_addchar(b, 0xf0 | (cp >> 18));
+        luaL_addchar(b, 0x80 | ((cp >> 12) & 0x3f));
+        luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+        luaL_addchar(b, 0x80 | (cp & 0x3f));
+    }
+}
+
+/*
+ Decodes the entity at `s` (which points right after the "&"), returns
+ its length up to and including ";", or 0 if it's not one we know.
+*/
+static size_t decode_entity(const uint8_t *s, size_t len, uint32_t *cp) {
+    const uint8_t *semi = memchr(s, ';', len < 12 ? len : 12);
+    if (semi == NULL || semi == s) {
+        return 0;
+    }
+    size_t n = semi - s;
+    if (s[0] == '#') {
+        int base       = 10;
+        size_t start   = 1;
+        uint32_t value = 0;
+        if (n > 1 && (s[1] == 'x' || s[1] == 'X')) {
+            base  = 16;
+            start = 2;
+        }
+        if (start == n) {
+            return 0;
+        }
+        for (size_t i = start; i < n; i++) {
+            uint8_t d = hex_value[s[i]];
+            if (d == 0xff || d >= base) {
+                return 0;
+            }
+            value = value * base + d;
+            if (value > 0x10ffff) {
+                value = 0x110000;
+            }
+        }
+        *cp = value;
+        return n + 1;
+    }
+    for (int i = 0; named_entities[i].name != NULL; i++) {
+        if (strlen(named_entities[i].name) == n && memcmp(named_entities[i].name, s, n) == 0) {
+            *cp = named_entities[i].cp;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ html_unescape(s) -- decodes numeric character references and the common
+ named entities (`&amp;`, `&lt;`, `&gt;`, `&quot;`, `&apos;`, `&nbsp;` and a few
+ typographic ones) into UTF-8. Unknown entities are kept as they are.
+*/
+static int codec_html_unescape(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    const uint8_t *amp = memchr(s, '&', len);
+    if (amp == NULL) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    size_t i = 0;
+    while (amp != NULL) {
+        size_t pos = amp - s;
+        luaL_addlstring(&b, (const char *)s + i, pos - i);
+        uint32_t cp;
+        size_t n = decode_entity(s + pos + 1, len - pos - 1, &cp);
+        if (n > 0) {
+            add_utf8(&b, cp);
+            i = pos + 1 + n;
+        } else {
+            luaL_addchar(&b, '&');
+            i = pos + 1;
+        }
+        amp = memchr(s + i, '&', len - i);
+    }
+    luaL_addlstring(&b, (const char *)s + i, len - i);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/*
+ parse_query(s, chars) -- parses an application/x-www-form-urlencoded string
+ into a table, in one pass. Names and values are decoded, the last of repeated
+ names wins, names without "=" get an empty value. With `chars` given, values are
+ HTML escaped, see `html_escape`.
+*/
+static int codec_parse_query(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    uint8_t set[256];
+    int escape = !lua_isnoneornil(L, 2);
+    if (escape && !html_set(L, 2, set)) {
+        return luaL_argerror(L, 2, "only <>&\"' can be escaped");
+    }
+    lua_newtable(L);
+    size_t i = 0;
+    while (i < len) {
+        const uint8_t *amp = memchr(s + i, '&', len - i);
+        size_t end         = amp ? (size_t)(amp - s) : len;
+        if (end > i) {
+            const uint8_t *eq = memchr(s + i, '=', end - i);
+            size_t name_end   = eq ? (size_t)(eq - s) : end;
+            size_t value_pos  = eq ? name_end + 1 : end;
+            if (name_end > i) {
+                luaL_Buffer b;
+                luaL_buffinit(L, &b);
+                url_decode(&b, s + i, name_end - i, 1);
+                luaL_pushresult(&b);
+                luaL_buffinit(L, &b);
+                url_decode(&b, s + value_pos, end - value_pos, 1);
+                luaL_pushresult(&b);
+                if (escape) {
+                    size_t vlen;
+                    const uint8_t *value = (const uint8_t *)lua_tolstring(L, -1, &vlen);
+                    luaL_buffinit(L, &b);
+                    html_escape(&b, value, vlen, set);
+                    luaL_pushresult(&b);
+                    lua_remove(L, -2);
+                }
+                lua_rawset(L, -3);
+            }
+        }
+        i = end + 1;
+    }
+    return 1;
+}
+
+static luaL_Reg funcs[] = {
+    {"url_encode",    codec_url_encode   },
+    {"url_decode",    codec_url_decode   },
+    {"html_escape",   codec_html_escape  },
+    {"html_unescape", codec_html_unescape},
+    {"parse_query",   codec_parse_query  },
+    {NULL,            NULL               }
+};
+
+int luaopen_std_codec(lua_State *L) {
+    init_tables();
+    luaL_newlib(L, funcs);
+    return 1;
+}
@@ -0,0 +1,720 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Text layout for the terminal: wrapping, hanging indents, alignment and clipping
+ of UTF-8 strings with ANSI escape sequences in them, in one pass over the bytes.
+
+ Widths are display widths: East Asian wide and fullwidth characters and
+ emoji take two columns, combining marks and other zero width characters
+ take none, and so do escape sequences.
+
+ Characters are ASCII bytes, or lead bytes with all the continuation bytes
+ following them. Stray bytes and NULs are dropped, as `std.txt` always did.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define LAYOUT_SCRATCH_MT "LAYOUT:Scratch"
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} range;
+
+/* Zero width: combining marks, joiners, variation selectors, emoji modifiers and Hangul medial/final jamo */
+static const range zero_width[] = {
+    {0x0300,  0x036F }, {0x0483,  0x0489 }, {0x0591,  0x05BD }, {0x05BF,  0x05BF }, {0x05C1,  0x05C2 },
+    {0x05C4,  0x05C5 }, {0x05C7,  0x05C7 }, {0x0610,  0x061A }, {0x064B,  0x065F }, {0x0670,  0x0670 },
+    {0x06D6,  0x06DC }, {0x06DF,  0x06E4 }, {0x06E7,  0x06E8 }, {0x06EA,  0x06ED }, {0x0711,  0x0711 },
+    {0x0730,  0x074A }, {0x07A6,  0x07B0 }, {0x07EB,  0x07F3 }, {0x0816,  0x0819 }, {0x081B,  0x0823 },
+    {0x0825,  0x0827 }, {0x0829,  0x082D }, {0x0859,  0x085B }, {0x08D3,  0x08E1 }, {0x08E3,  0x0902 },
+    {0x093A,  0x093A }, {0x093C,  0x093C }, {0x0941,  0x0948 }, {0x094D,  0x094D }, {0x0951,  0x0957 },
+    {0x0962,  0x0963 }, {0x0981,  0x0981 }, {0x09BC,  0x09BC }, {0x09C1,  0x09C4 }, {0x09CD,  0x09CD },
+    {0x09E2,  0x09E3 }, {0x0A01,  0x0A02 }, {0x0A3C,  0x0A3C }, {0x0A41,  0x0A42 }, {0x0A47,  0x0A48 },
+    {0x0A4B,  0x0A4D }, {0x0A51,  0x0A51 }, {0x0A70,  0x0A71 }, {0x0A75,  0x0A75 }, {0x0A81,  0x0A82 },
+    {0x0ABC,  0x0ABC }, {0x0AC1,  0x0AC5 }, {0x0AC7,  0x0AC8 }, {0x0ACD,  0x0ACD }, {0x0AE2,  0x0AE3 },
+    {0x0B01,  0x0B01 }, {0x0B3C,  0x0B3C }, {0x0B3F,  0x0B3F }, {0x0B41,  0x0B44 }, {0x0B4D,  0x0B4D },
+    {0x0B56,  0x0B56 }, {0x0B62,  0x0B63 }, {0x0B82,  0x0B82 }, {0x0BC0,  0x0BC0 }, {0x0BCD,  0x0BCD },
+    {0x0C00,  0x0C00 }, {0x0C3E,  0x0C40 }, {0x0C46,  0x0C48 }, {0x0C4A,  0x0C4D }, {0x0C55,  0x0C56 },
+    {0x0C62,  0x0C63 }, {0x0C81,  0x0C81 }, {0x0CBC,  0x0CBC }, {0x0CBF,  0x0CBF }, {0x0CC6,  0x0CC6 },
+    {0x0CCC,  0x0CCD }, {0x0CE2,  0x0CE3 }, {0x0D00,  0x0D01 }, {0x0D41,  0x0D44 }, {0x0D4D,  0x0D4D },
+    {0x0D62,  0x0D63 }, {0x0DCA,  0x0DCA }, {0x0DD2,  0x0DD4 }, {0x0DD6,  0x0DD6 }, {0x0E31,  0x0E31 },
+    {0x0E34,  0x0E3A }, {0x0E47,  0x0E4E }, {0x0EB1,  0x0EB1 }, {0x0EB4,  0x0EBC }, {0x0EC8,  0x0ECD },
+    {0x0F18,  0x0F19 }, {0x0F35,  0x0F35 }, {0x0F37,  0x0F37 }, {0x0F39,  0x0F39 }, {0x0F71,  0x0F7E },
+    {0x0F80,  0x0F84 }, {0x0F86,  0x0F87 }, {0x0F8D,  0x0FBC }, {0x0FC6,  0x0FC6 }, {0x102D,  0x1030 },
+    {0x1032,  0x1037 }, {0x1039,  0x103A }, {0x103D,  0x103E }, {0x1058,  0x1059 }, {0x105E,  0x1060 },
+    {0x1071,  0x1074 }, {0x1082,  0x1082 }, {0x1085,  0x1086 }, {0x108D,  0x108D }, {0x109D,  0x109D },
+    {0x1160,  0x11FF }, {0x135D,  0x135F }, {0x1712,  0x1714 }, {0x1732,  0x1734 }, {0x1752,  0x1753 },
+    {0x1772,  0x1773 }, {0x17B4,  0x17B5 }, {0x17B7,  0x17BD }, {0x17C6,  0x17C6 }, {0x17C9,  0x17D3 },
+    {0x17DD,  0x17DD }, {0x180B,  0x180E }, {0x1885,  0x1886 }, {0x18A9,  0x18A9 }, {0x1920,  0x1922 },
+    {0x1927,  0x1928 }, {0x1932,  0x1932 }, {0x1939,  0x193B }, {0x1A17,  0x1A18 }, {0x1A1B,  0x1A1B },
+    {0x1A56,  0x1A56 }, {0x1A58,  0x1A5E }, {0x1A60,  0x1A60 }, {0x1A62,  0x1A62 }, {0x1A65,  0x1A6C },
+    {0x1A73,  0x1A7C }, {0x1A7F,  0x1A7F }, {0x1AB0,  0x1AFF }, {0x1B00,  0x1B03 }, {0x1B34,  0x1B34 },
+    {0x1B36,  0x1B3A }, {0x1B3C,  0x1B3C }, {0x1B42,  0x1B42 }, {0x1B6B,  0x1B73 }, {0x1B80,  0x1B81 },
+    {0x1BA2,  0x1BA5 }, {0x1BA8,  0x1BA9 }, {0x1BAB,  0x1BAD }, {0x1BE6,  0x1BE6 }, {0x1BE8,  0x1BE9 },
+    {0x1BED,  0x1BED }, {0x1BEF,  0x1BF1 }, {0x1C2C,  0x1C33 }, {0x1C36,  0x1C37 }, {0x1CD0,  0x1CD2 },
+    {0x1CD4,  0x1CE0 }, {0x1CE2,  0x1CE8 }, {0x1CED,  0x1CED }, {0x1CF4,  0x1CF4 }, {0x1CF8,  0x1CF9 },
+    {0x1DC0,  0x1DFF }, {0x200B,  0x200F }, {0x202A,  0x202E }, {0x2060,  0x2064 }, {0x20D0,  0x20F0 },
+    {0x2CEF,  0x2CF1 }, {0x2D7F,  0x2D7F }, {0x2DE0,  0x2DFF }, {0x302A,  0x302D }, {0x3099,  0x309A },
+    {0xA66F,  0xA672 }, {0xA674,  0xA67D }, {0xA69E,  0xA69F }, {0xA6F0,  0xA6F1 }, {0xA802,  0xA802 },
+    {0xA806,  0xA806 }, {0xA80B,  0xA80B }, {0xA825,  0xA826 }, {0xA8C4,  0xA8C5 }, {0xA8E0,  0xA8F1 },
+    {0xA8FF,  0xA8FF }, {0xA926,  0xA92D }, {0xA947,  0xA951 }, {0xA980,  0xA982 }, {0xA9B3,  0xA9B3 },
+    {0xA9B6,  0xA9B9 }, {0xA9BC,  0xA9BD }, {0xA9E5,  0xA9E5 }, {0xAA29,  0xAA2E }, {0xAA31,  0xAA32 },
+    {0xAA35,  0xAA36 }, {0xAA43,  0xAA43 }, {0xAA4C,  0xAA4C }, {0xAA7C,  0xAA7C }, {0xAAB0,  0xAAB0 },
+    {0xAAB2,  0xAAB4 }, {0xAAB7,  0xAAB8 }, {0xAABE,  0xAABF }, {0xAAC1,  0xAAC1 }, {0xAAEC,  0xAAED },
+    {0xAAF6,  0xAAF6 }, {0xABE5,  0xABE5 }, {0xABE8,  0xABE8 }, {0xABED,  0xABED }, {0xD7B0,  0xD7FF },
+    {0xFB1E,  0xFB1E }, {0xFE00,  0xFE0F }, {0xFE20,  0xFE2F }, {0xFEFF,  0xFEFF }, {0x101FD, 0x101FD},
+    {0x102E0, 0x102E0}, {0x10376, 0x1037A}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F}, {0x10AE5, 0x10AE6},
+    {0x10D24, 0x10D27}, {0x10F46, 0x10F50}, {0x11001, 0x11001}, {0x11038, 0x11046}, {0x1107F, 0x11081},
+    {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x11100, 0x11102}, {0x11127, 0x1112B}, {0x1112D, 0x11134},
+    {0x1D167, 0x1D169}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244},
+    {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F},
+    {0xE0100, 0xE01EF},
+};
+
+/* Two columns: East Asian Wide and Fullwidth, and emoji with the default emoji presentation */
+static const range double_width[] = {
+    {0x1100,  0x115F }, {0x231A,  0x231B }, {0x2329,  0x232A }, {0x23E9,  0x23EC }, {0x23F0,  0x23F0 },
+    {0x23F3,  0x23F3 }, {0x25FD,  0x25FE }, {0x2614,  0x2615 }, {0x2648,  0x2653 }, {0x267F,  0x267F },
+    {0x2693,  0x2693 }, {0x26A1,  0x26A1 }, {0x26AA,  0x26AB }, {0x26BD,  0x26BE }, {0x26C4,  0x26C5 },
+    {0x26CE,  0x26CE }, {0x26D4,  0x26D4 }, {0x26EA,  0x26EA }, {0x26F2,  0x26F3 }, {0x26F5,  0x26F5 },
+    {0x26FA,  0x26FA }, {0x26FD,  0x26FD }, {0x2705,  0x2705 }, {0x270A,  0x270B }, {0x2728,  0x2728 },
+    {0x274C,  0x274C }, {0x274E,  0x274E }, {0x2753,  0x2755 }, {0x2757,  0x2757 }, {0x2795,  0x2797 },
+    {0x27B0,  0x27B0 }, {0x27BF,  0x27BF }, {0x2B1B,  0x2B1C }, {0x2B50,  0x2B50 }, {0x2B55,  0x2B55 },
+    {0x2E80,  0x2E99 }, {0x2E9B,  0x2EF3 }, {0x2F00,  0x2FD5 }, {0x2FF0,  0x2FFB }, {0x3000,  0x303E },
+    {0x3041,  0x3096 }, {0x3099,  0x30FF }, {0x3105,  0x312F }, {0x3131,  0x318E }, {0x3190,  0x31E3 },
+    {0x31F0,  0x321E }, {0x3220,  0x3247 }, {0x3250,  0x4DBF }, {0x4E00,  0xA48C }, {0xA490,  0xA4C6 },
+    {0xA960,  0xA97C }, {0xAC00,  0xD7A3 }, {0xF900,  0xFAFF }, {0xFE10,  0xFE19 }, {0xFE30,  0xFE52 },
+    {0xFE54,  0xFE66 }, {0xFE68,  0xFE6B }, {0xFF01,  0xFF60 }, {0xFFE0,  0xFFE6 }, {0x16FE0, 0x16FE4},
+    {0x16FF0, 0x16FF1}, {0x17000, 0x187F7}, {0x18800, 0x18CD5}, {0x18D00, 0x18D08}, {0x1B000, 0x1B122},
+    {0x1B150, 0x1B152}, {0x1B164, 0x1B167}, {0x1B170, 0x1B2FB}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C},
+    {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+    {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+    {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC},
+    {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F978},
+    {0x1F97A, 0x1F9CB}, {0x1F9CD, 0x1F9FF}, {0x1FA70, 0x1FA74}, {0x1FA78, 0x1FA7A}, {0x1FA80, 0x1FA86},
+    {0x1FA90, 0x1FAA8}, {0x1FAB0, 0x1FAB6}, {0x1FAC0, 0x1FAC2}, {0x1FAD0, 0x1FAD6}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD},
+};
+
+static int in_ranges(uint32_t cp, const range *r, size_t n) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cp < r[mid].first) {
+            hi = mid;
+        } else if (cp > r[mid].last) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ Length of the character at `s`: one byte, or a lead byte with all the
+ continuation bytes that follow it. Zero for the bytes to drop.
+*/
+static size_t char_len(const uint8_t *s, const uint8_t *end) {
+    uint8_t b = s[0];
+    if (b == 0) {
+        return 0;
+    }
+    if (b < 0x80) {
+        return 1;
+    }
+    if (b < 0xC2 || b > 0xF4) {
+        return 0;
+    }
+    const uint8_t *p = s + 1;
+    while (p < end && (*p & 0xC0) == 0x80) {
+        p++;
+    }
+    return p - s;
+}
+
+/* Display width of the (multibyte) character at `s`, malformed ones count as one column */
+static int char_width(const uint8_t *s, size_t len) {
+    if (len == 1) {
+        return 1;
+    }
+    uint32_t cp;
+    size_t need;
+    if (s[0] >= 0xF0) {
+        cp   = s[0] & 0x07;
+        need = 4;
+    } else if (s[0] >= 0xE0) {
+        cp   = s[0] & 0x0F;
+        need = 3;
+    } else {
+        cp   = s[0] & 0x1F;
+        need = 2;
+    }
+    if (len < need) {
+        return 1;
+    }
+    for (size_t i = 1; i < need; i++) {
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    if (cp < 0x300) {
+        return 1;
+    }
+    if (in_ranges(cp, zero_width, sizeof(zero_width) / sizeof(range))) {
+        return 0;
+    }
+    if (in_ranges(cp, double_width, sizeof(double_width) / sizeof(range))) {
+        return 2;
+    }
+    return 1;
+}
+
+/*
+ Length of the escape sequence at `s` (which is ESC): CSI sequences run till
+ the final byte, other ones are ESC and one more character.
+*/
+static size_t escape_len(const uint8_t *s, const uint8_t *end) {
+    const uint8_t *p = s + 1;
+    if (p == end) {
+        return 1;
+    }
+    if (*p != '[') {
+        size_t n = char_len(p, end);
+        return 1 + (n ? n : 1);
+    }
+    p++;
+    while (p < end && (*p < 0x40 || *p > 0x7E)) {
+        p++;
+    }
+    return p < end ? p - s + 1 : p - s;
+}
+
+static size_t str_width(const uint8_t *s, size_t len) {
+    const uint8_t *p = s, *end = s + len;
+    size_t w = 0;
+    while (p < end) {
+        if (*p < 0x80 && *p != 0x1B) {
+            w += *p != 0;
+            p++;
+            continue;
+        }
+        if (*p == 0x1B) {
+            p += escape_len(p, end);
+            continue;
+        }
+        size_t n = char_len(p, end);
+        if (n == 0) {
+            p++;
+            continue;
+        }
+        w += char_width(p, n);
+        p += n;
+    }
+    return w;
+}
+
+/*
+ Scratch buffers of a call live in a userdata, so that they are freed
+ even if a Lua error interrupts it.
+*/
+typedef struct {
+    char *p;
+    size_t len;
+    size_t cap;
+} growbuf;
+
+typedef struct {
+    growbuf out;
+    growbuf esc;   /* escape sequences in effect */
+    growbuf words; /* optimal breaking: word offsets and widths */
+    growbuf cost;
+} scratch;
+
+static int scratch_gc(lua_State *L) {
+    scratch *sc = (scratch *)luaL_checkudata(L, 1, LAYOUT_SCRATCH_MT);
+    free(sc->out.p);
+    free(sc->esc.p);
+    free(sc->words.p);
+    free(sc->cost.p);
+    memset(sc, 0, sizeof(scratch));
+    return 0;
+}
+
+static scratch *new_scratch(lua_State *L) {
+    scratch *sc = (scratch *)lua_newuserdata(L, sizeof(scratch));
+    memset(sc, 0, sizeof(scratch));
+    luaL_getmetatable(L, LAYOUT_SCRATCH_MT);
+    lua_setmetatable(L, -2);
+    return sc;
+}
+
+static void reserve(lua_State *L, growbuf *b, size_t more) {
+    if (b->len + more <= b->cap) {
+        return;
+    }
+    size_t cap = b->cap ? b->cap * 2 : 256;
+    while (cap < b->len + more) {
+        cap *= 2;
+    }
+    char *p = realloc(b->p, cap);
+    if (p == NULL) {
+        luaL_error(L, "out of memory");
+    }
+    b->p   = p;
+    b->cap = cap;
+}
+
+static inline void put(lua_State *L, growbuf *b, const void *s, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    reserve(L, b, len);
+    memcpy(b->p + b->len, s, len);
+    b->len += len;
+}
+
+/* Remembers the escape sequence, forgets all of them at a reset */
+static void track_escape(lua_State *L, growbuf *esc, const uint8_t *s, size_t len) {
+    if ((len == 4 && memcmp(s, "\x1b[0m", 4) == 0) || (len == 3 && memcmp(s, "\x1b[m", 3) == 0)) {
+        esc->len = 0;
+        return;
+    }
+    put(L, esc, s, len);
+}
+
+static inline int is_space(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+typedef struct {
+    size_t width;
+    int force;
+    int squeeze;
+    int optimal;
+    size_t indent;
+    size_t first_indent;
+} wrap_opts;
+
+static void push_line(lua_State *L, const char *s, size_t len, size_t indent, int idx) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    if (indent > 0) {
+        luaL_addlstring(&b, "\x1b[0m", 4);
+        for (size_t i = 0; i < indent; i++) {
+            luaL_addchar(&b, ' ');
+        }
+    }
+    luaL_addlstring(&b, s, len);
+    luaL_pushresult(&b);
+    lua_rawseti(L, -2, idx);
+}
+
+/*
+ Pushes the lines of `out`, split the way `std.txt.lines` does it,
+ indented with the reset sequence followed by spaces, like `std.txt.indent_lines`.
+*/
+static void push_lines(lua_State *L, const char *out, size_t len, const wrap_opts *o) {
+    const char *p   = out;
+    const char *end = out + len;
+    const char *nl  = memchr(p, '\n', len);
+    int n           = 0;
+    lua_newtable(L);
+    if (nl == NULL) {
+        push_line(L, out, len, o->first_indent, 1);
+        return;
+    }
+    while (1) {
+        const char *line_end = nl;
+        if (nl == NULL) {
+            /* The tail after the last newline, unless it's empty or has a CR in it */
+            if (p == end || memchr(p, '\r', end - p) != NULL) {
+                break;
+            }
+            line_end = end;
+        } else if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+        push_line(L, p, line_end - p, n == 0 ? o->first_indent : o->indent, n + 1);
+        n++;
+        if (nl == NULL) {
+            break;
+        }
+        p  = nl + 1;
+        nl = p < end ? memchr(p, '\n', end - p) : NULL;
+    }
+}
+
+/*
+ Greedy breaking, the same as `std.txt.lines_of` always did it: once a line is
+ within 5% of the width, it's broken at the next space or after the next hyphen.
+ With `force`, lines are broken at exactly the width, at any character.
+ After a break, the escape sequences in effect are repeated.
+*/
+static void wrap_greedy(lua_State *L, scratch *sc, const uint8_t *s, size_t len, const wrap_opts *o) {
+    growbuf *out       = &sc->out;
+    growbuf *esc       = &sc->esc;
+    const uint8_t *end = s + len;
+    const uint8_t *p   = s;
+    size_t width       = o->width;
+    size_t margin      = (width * 5 + 99) / 100;
+    size_t count       = 0;
+    size_t last_space  = 0;
+    reserve(L, out, len + len / 8 + 16);
+    while (p < end) {
+        uint8_t c = *p;
+        if (c == 0x1B) {
+            size_t n = escape_len(p, end);
+            put(L, out, p, n);
+            track_escape(L, esc, p, n);
+            p += n;
+            continue;
+        }
+        size_t n = char_len(p, end);
+        if (n == 0) {
+            p++;
+            continue;
+        }
+        if (c == '\n') {
+            put(L, out, "\n", 1);
+            put(L, out, esc->p, esc->len);
+            count = 0;
+            p++;
+            continue;
+        }
+        int w = char_width(p, n);
+        if (w == 0) {
+            /* Combining characters stay with the one they combine with */
+            put(L, out, p, n);
+            p += n;
+            continue;
+        }
+        if (o->force && count > 0 && count + w > width) {
+            /* A wide character that doesn't fit goes to the next line */
+            put(L, out, "\n", 1);
+            put(L, out, esc->p, esc->len);
+            count = 0;
+        }
+        count += w;
+        int space = n == 1 && is_space(c);
+        if ((o->force && count >= width) || (count + margin >= width && (space || c == '-'))) {
+            if (!space) {
+                put(L, out, p, n);
+            }
+            put(L, out, "\n", 1);
+            put(L, out, esc->p, esc->len);
+            count = 0;
+        } else if (space) {
+            if (count - last_space == 1 && o->squeeze) {
+                count--;
+            } else {
+                last_space = count;
+                put(L, out, p, n);
+            }
+        } else {
+            last_space = 0;
+            put(L, out, p, n);
+        }
+        p += n;
+    }
+}
+
+typedef struct {
+    size_t start;     /* offset of the word in the input */
+    size_t len;
+    size_t width;
+    size_t esc_start; /* escape sequences in effect before it, in `sc->esc` */
+    size_t esc_len;
+} word;
+
+/*
+ Optimal (minimum raggedness) breaking of one paragraph, `words[0..n)`:
+ minimizes the sum of squares of the space left at the end of each line
+ but the last one. Words longer than the width get a line of their own.
+ Words made of escape sequences only take no room, not even for a separator.
+*/
+static void break_paragraph(lua_State *L, scratch *sc, const uint8_t *s, word *words, size_t n, size_t width,
+                            int first) {
+    reserve(L, &sc->cost, (n + 1) * 2 * sizeof(uint64_t));
+    uint64_t *cost = (uint64_t *)sc->cost.p;
+    uint64_t *next = cost + n + 1;
+    cost[n]        = 0;
+    for (size_t i = n; i-- > 0;) {
+        size_t line = 0;
+        cost[i]     = UINT64_MAX;
+        for (size_t j = i; j < n; j++) {
+            if (words[j].width > 0) {
+                line += words[j].width + (line > 0);
+            }
+            if (line > width && j > i) {
+                break;
+            }
+            uint64_t slack = line < width ? width - line : 0;
+            uint64_t c     = (j == n - 1 ? 0 : slack * slack) + cost[j + 1];
+            /* On ties the longer line wins, so trailing escapes stay where they were */
+            if (c <= cost[i]) {
+                cost[i] = c;
+                next[i] = j + 1;
+            }
+        }
+    }
+    growbuf *out = &sc->out;
+    for (size_t i = 0; i < n; i = next[i]) {
+        if (i > 0 || !first) {
+            put(L, out, "\n", 1);
+            put(L, out, sc->esc.p + words[i].esc_start, words[i].esc_len);
+        }
+        int visible = 0;
+        for (size_t j = i; j < next[i]; j++) {
+            if (words[j].width > 0) {
+                if (visible) {
+                    put(L, out, " ", 1);
+                }
+                visible = 1;
+            }
+            put(L, out, s + words[j].start, words[j].len);
+        }
+    }
+}
+
+/*
+ Optimal breaking: paragraphs are separated by newlines, words by whitespace.
+ Whitespace runs become single spaces. Escape sequences are kept with the
+ words they come with, the ones in effect are repeated at the start of each line.
+*/
+static void wrap_optimal(lua_State *L, scratch *sc, const uint8_t *s, size_t len, const wrap_opts *o) {
+    const uint8_t *end = s + len;
+    const uint8_t *p   = s;
+    size_t nwords      = 0;
+    size_t reset_pos   = 0; /* escape sequences since the last reset start here in `sc->esc` */
+    int first          = 1;
+    int in_word        = 0;
+    reserve(L, &sc->out, len + len / 8 + 16);
+    while (1) {
+        int at_end = p >= end;
+        if (at_end || *p == '\n') {
+            break_paragraph(L, sc, s, (word *)sc->words.p, nwords, o->width, first);
+            if (nwords == 0 && !first) {
+                put(L, &sc->out, "\n", 1);
+                put(L, &sc->out, sc->esc.p + reset_pos, sc->esc.len - reset_pos);
+            }
+            if (at_end) {
+                break;
+            }
+            first   = 0;
+            nwords  = 0;
+            in_word = 0;
+            p++;
+            continue;
+        }
+        size_t n;
+        int w   = 0;
+        int esc = *p == 0x1B;
+        if (esc) {
+            n = escape_len(p, end);
+        } else {
+            n = char_len(p, end);
+            if (n == 0) {
+                p++;
+                continue;
+            }
+            if (n == 1 && is_space(*p)) {
+                in_word = 0;
+                p++;
+                continue;
+            }
+            w = char_width(p, n);
+        }
+        if (!in_word) {
+            reserve(L, &sc->words, (nwords + 1) * sizeof(word));
+            word *wd      = (word *)sc->words.p + nwords++;
+            wd->start     = p - s;
+            wd->width     = 0;
+            wd->esc_start = reset_pos;
+            wd->esc_len   = sc->esc.len - reset_pos;
+            in_word       = 1;
+        }
+        word *wd = (word *)sc->words.p + nwords - 1;
+        wd->len  = p + n - s - wd->start;
+        wd->width += w;
+        if (esc) {
+            /* An append-only log, words remember the part of it that's in effect for them */
+            if ((n == 4 && memcmp(p, "\x1b[0m", 4) == 0) || (n == 3 && memcmp(p, "\x1b[m", 3) == 0)) {
+                reset_pos = sc->esc.len;
+            } else {
+                put(L, &sc->esc, p, n);
+            }
+        }
+        p += n;
+    }
+}
+
+/*
+ wrap(input, width, opts) -- splits `input` into lines of `width` display columns,
+ returns them in an array. `opts`:
+     force        -- break at exactly `width`, at any character
+     squeeze      -- drop whitespace that follows whitespace
+     optimal      -- minimum raggedness breaking instead of greedy
+     indent       -- hanging indent of all lines but the first one
+     first_indent -- indent of the first line, defaults to `indent`
+*/
+static int layout_wrap(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    lua_Integer width = luaL_optinteger(L, 2, 80);
+    wrap_opts o       = {.width = width > 0 ? (size_t)width : 0};
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "force");
+        o.force = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "squeeze");
+        o.squeeze = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "optimal");
+        o.optimal = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "indent");
+        lua_Integer indent = lua_tointeger(L, -1);
+        o.indent           = indent > 0 ? (size_t)indent : 0;
+        lua_getfield(L, 3, "first_indent");
+        if (lua_isnil(L, -1)) {
+            o.first_indent = o.indent;
+        } else {
+            lua_Integer first_indent = lua_tointeger(L, -1);
+            o.first_indent           = first_indent > 0 ? (size_t)first_indent : 0;
+        }
+        lua_pop(L, 5);
+    }
+    scratch *sc = new_scratch(L);
+    if (o.optimal) {
+        wrap_optimal(L, sc, s, len, &o);
+    } else {
+        wrap_greedy(L, sc, s, len, &o);
+    }
+    push_lines(L, sc->out.p ? sc->out.p : "", sc->out.len, &o);
+    return 1;
+}
+
+/* width(s) -- display width of `s` */
+static int layout_width(lua_State *L) {
+    size_t len;
+    const uint8_t *s = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    lua_pushinteger(L, str_width(s, len));
+    return 1;
+}
+
+static void add_spaces(luaL_Buffer *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        luaL_addchar(b, ' ');
+    }
+}
+
+/*
+ align(s, width, side) -- pads `s` with spaces to `width` columns,
+ `side` is "left" (default), "right" or "center".
+*/
+static int layout_align(lua_State *L) {
+    size_t len;
+    const char *s     = luaL_checklstring(L, 1, &len);
+    lua_Integer width = luaL_checkinteger(L, 2);
+    const char *side  = luaL_optstring(L, 3, "left");
+    lua_Integer w     = str_width((const uint8_t *)s, len);
+    if (w >= width) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    size_t pad = width - w;
+    size_t pre = 0;
+    if (strcmp(side, "right") == 0) {
+        pre = pad;
+    } else if (strcmp(side, "left") != 0) {
+        pre = pad - pad / 2;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    add_spaces(&b, pre);
+    luaL_addlstring(&b, s, len);
+    add_spaces(&b, pad - pre);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/*
+ clip(s, max, prefix) -- if `s` is wider than `max` columns, cuts out the middle of it:
+ keeps `prefix - 1` columns at the start, and `max - prefix - 1` at the end, with an ellipsis
+ in between. Escape sequences are all kept, so styles don't leak.
+*/
+static int layout_clip(lua_State *L) {
+    size_t len;
+    const uint8_t *s   = (const uint8_t *)luaL_checklstring(L, 1, &len);
+    lua_Integer max    = luaL_checkinteger(L, 2);
+    lua_Integer prefix = luaL_optinteger(L, 3, 1);
+    lua_Integer total  = str_width(s, len);
+    if (total <= max) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    lua_Integer head      = prefix - 1;
+    lua_Integer tail      = max - prefix - 1;
+    lua_Integer tail_from = total - (tail > 0 ? tail : 0);
+    const uint8_t *p = s, *end = s + len;
+    lua_Integer col = 0;
+    int ellipsis    = 0;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (p < end) {
+        if (*p == 0x1B) {
+            size_t n = escape_len(p, end);
+            luaL_addlstring(&b, (const char *)p, n);
+            p += n;
+            continue;
+        }
+        size_t n = char_len(p, end);
+        if (n == 0) {
+            p++;
+            continue;
+        }
+        int w = char_width(p, n);
+        if (col + w <= head && !ellipsis) {
+            luaL_addlstring(&b, (const char *)p, n);
+        } else {
+            if (!ellipsis) {
+                luaL_addstring(&b, "…");
+                ellipsis = 1;
+            }
+            if (col >= tail_from) {
+                luaL_addlstring(&b, (const char *)p, n);
+            }
+        }
+        col += w;
+        p += n;
+    }
+    if (!ellipsis) {
+        luaL_addstring(&b, "…");
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static luaL_Reg funcs[] = {
+    {"wrap",  layout_wrap },
+    {"width", layout_width},
+    {"align", layout_align},
+    {"clip",  layout_clip },
+    {NULL,    NULL        }
+};
+
+int luaopen_std_layout(lua_State *L) {
+    luaL_newmetatable(L, LAYOUT_SCRATCH_MT);
+    lua_pushcfunction(L, scratch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
@@ -0,0 +1,197 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Process placement & scheduling: CPU affinity, scheduling policy,
+ nice value, IO priority and a couple of prctl knobs.
+
+ All of them take a pid, 0 means the calling process. Affinity,
+ policies and priorities are inherited by forks, so setting them
+ in a server process before it starts serving covers all of
+ its request processing forks too.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define RETURN_ERR(L)                       \
+    do {                                    \
+        lua_pushnil(L);                     \
+        lua_pushstring(L, strerror(errno)); \
+        return 2;                           \
+    } while (0)
+
+/* ioprio_set has no glibc/musl wrapper, these are from linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+static const char *policy_names[] = {"other", "fifo", "rr", "batch", "idle", NULL};
+static const int policies[]       = {SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_BATCH, SCHED_IDLE};
+
+static const char *ioprio_classes[] = {"none", "rt", "be", "idle", NULL};
+
+/* setaffinity(pid, cpus) -- `cpus` is an array of CPU numbers */
+int deviant_setaffinity(lua_State *L) {
+    pid_t pid = luaL_checkint(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    size_t count = lua_objlen(L, 2);
+    if (count == 0) {
+        return luaL_argerror(L, 2, "no CPUs given");
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 1; i <= count; i++) {
+        lua_rawgeti(L, 2, i);
+        int cpu = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return luaL_argerror(L, 2, "CPU number out of range");
+        }
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(pid, sizeof(set), &set) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* getaffinity(pid) -- returns an array of the CPUs the process may run on */
+int deviant_getaffinity(lua_State *L) {
+    pid_t pid = luaL_optint(L, 1, 0);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(pid, sizeof(set), &set) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_createtable(L, CPU_COUNT(&set), 0);
+    int idx = 1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            lua_pushinteger(L, cpu);
+            lua_rawseti(L, -2, idx++);
+        }
+    }
+    return 1;
+}
+
+/*
+ setscheduler(pid, policy, priority) -- `policy` is one of
+ "other", "batch", "idle" (priority must be 0), "fifo" or "rr" (priority 1-99)
+*/
+int deviant_setscheduler(lua_State *L) {
+    pid_t pid  = luaL_checkint(L, 1);
+    int policy = policies[luaL_checkoption(L, 2, NULL, policy_names)];
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = luaL_optint(L, 3, 0);
+    /* musl's sched_setscheduler is a stub returning ENOSYS, so the syscall is used directly */
+    if (syscall(SYS_sched_setscheduler, pid, policy, &param) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* getscheduler(pid) -- returns the policy name and the priority */
+int deviant_getscheduler(lua_State *L) {
+    pid_t pid  = luaL_optint(L, 1, 0);
+    int policy = syscall(SYS_sched_getscheduler, pid);
+    if (policy == -1) {
+        RETURN_ERR(L);
+    }
+    struct sched_param param;
+    if (syscall(SYS_sched_getparam, pid, &param) == -1) {
+        RETURN_ERR(L);
+    }
+    const char *name = "unknown";
+    for (int i = 0; policy_names[i] != NULL; i++) {
+        /* SCHED_RESET_ON_FORK might be or'ed in */
+        if (policies[i] == (policy & ~SCHED_RESET_ON_FORK)) {
+            name = policy_names[i];
+        }
+    }
+    lua_pushstring(L, name);
+    lua_pushinteger(L, param.sched_priority);
+    return 2;
+}
+
+/* setpriority(pid, nice) -- nice is from -20 to 19 */
+int deviant_setpriority(lua_State *L) {
+    pid_t pid = luaL_checkint(L, 1);
+    int nice  = luaL_checkint(L, 2);
+    if (setpriority(PRIO_PROCESS, pid, nice) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+int deviant_getpriority(lua_State *L) {
+    pid_t pid = luaL_optint(L, 1, 0);
+    errno     = 0;
+    int nice  = getpriority(PRIO_PROCESS, pid);
+    if (nice == -1 && errno != 0) {
+        RETURN_ERR(L);
+    }
+    lua_pushinteger(L, nice);
+    return 1;
+}
+
+/* ioprio_set(pid, class, level) -- `class` is "rt", "be" or "idle", level is from 0 (highest) to 7 */
+int deviant_ioprio_set(lua_State *L) {
+    pid_t pid = luaL_checkint(L, 1);
+    int class = luaL_checkoption(L, 2, NULL, ioprio_classes);
+    int level = luaL_optint(L, 3, class == 3 ? 0 : 4);
+    if (level < 0 || level > 7) {
+        return luaL_argerror(L, 3, "level must be from 0 to 7");
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, IOPRIO_PRIO_VALUE(class, level)) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* setname(name) -- name of the calling thread, as seen in `ps` & `top`, truncated to 15 bytes */
+int deviant_setname(lua_State *L) {
+    const char *name = luaL_checkstring(L, 1);
+    char comm[16];
+    strncpy(comm, name, sizeof(comm) - 1);
+    comm[sizeof(comm) - 1] = '\0';
+    if (prctl(PR_SET_NAME, comm, 0, 0, 0) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ pdeathsig(signal, parent) -- the calling process gets `signal` when its parent exits, 0 disables it.
+ If `parent` pid is given and it's no longer the parent, i.e. it's exited before this call,
+ the signal is sent right away.
+*/
+int deviant_pdeathsig(lua_State *L) {
+    int sig      = luaL_checkint(L, 1);
+    pid_t parent = luaL_optint(L, 2, 0);
+    if (prctl(PR_SET_PDEATHSIG, sig, 0, 0, 0) == -1) {
+        RETURN_ERR(L);
+    }
+    if (sig != 0 && parent > 0 && getppid() != parent) {
+        kill(getpid(), sig);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
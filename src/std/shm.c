@@ -0,0 +1,611 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Shared memory key/value cache.
+
+ The segment is an anonymous MAP_SHARED mapping, so it must be created
+ before forking: all the children inherit it, and see each other's changes.
+
+ Memory is split into 1Mb pages, which are assigned to slab classes on demand.
+ Each class has chunks of a fixed size (powers of two from 64 bytes to 1Mb),
+ and its own LRU list. When a class runs out of chunks and there are no free
+ pages left, the least recently used item of the class is evicted. If the class
+ has no items at all, a page is taken away from another class (round robin),
+ evicting everything stored in it.
+
+ Values are strings or numbers. Each item can have a TTL.
+
+ All operations take a single process-shared robust mutex. Forks may die at any
+ moment (and they do, after `requests_per_fork` requests or on a signal),
+ so if the owner of the lock dies while holding it, the cache is flushed,
+ as it might have been left in an inconsistent state.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define SHM_MT        "STD:Shm"
+#define SHM_MAGIC     0x314d48534853494cULL
+#define SHM_PAGE_SIZE (1024 * 1024)
+#define SHM_MIN_CHUNK 64
+#define SHM_CLASSES   15 // 64 << 14 == SHM_PAGE_SIZE
+#define SHM_MIN_SIZE  (2 * SHM_PAGE_SIZE)
+#define SHM_MAX_PAGES 4096
+#define SHM_MAX_SIZE  (SHM_MAX_PAGES * (uint64_t)SHM_PAGE_SIZE - 1) // offsets are 32 bit
+
+enum {
+    SHM_FREE   = 0,
+    SHM_STRING = 1,
+    SHM_NUMBER = 2,
+};
+
+typedef struct {
+    uint32_t h_next; // next item in the hash chain, or in the free list
+    uint32_t prev;   // LRU list of the slab class, head is the most recently used item
+    uint32_t next;
+    uint32_t hash;
+    uint32_t key_len;
+    uint32_t value_len;
+    int64_t expires; // CLOCK_MONOTONIC milliseconds, 0 means never
+    uint8_t type;
+    uint8_t cls;
+    char data[]; // key, followed by value
+} shm_item;
+
+typedef struct {
+    uint32_t chunk_size;
+    uint32_t free;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t items;
+} shm_class;
+
+typedef struct {
+    uint64_t magic;
+    pthread_mutex_t lock;
+    uint64_t size;
+    uint64_t pages_off;
+    uint32_t npages;
+    uint32_t pages_used;
+    uint32_t nbuckets;
+    uint32_t reclaim_next;
+    uint8_t page_class[SHM_MAX_PAGES];
+    shm_class classes[SHM_CLASSES];
+    uint64_t items;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t sets;
+    uint64_t evictions;
+    uint64_t expired;
+    uint32_t buckets[];
+} shm_header;
+
+typedef struct {
+    shm_header *hdr;
+    size_t size;
+} shm_t;
+
+#define ITEM(h, off) ((shm_item *)((char *)(h) + (off)))
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_key(const char *key, size_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void shm_reset(shm_header *h) {
+    memset(h->buckets, 0, h->nbuckets * sizeof(uint32_t));
+    for (int i = 0; i < SHM_CLASSES; i++) {
+        h->classes[i].chunk_size = SHM_MIN_CHUNK << i;
+        h->classes[i].free       = 0;
+        h->classes[i].head       = 0;
+        h->classes[i].tail       = 0;
+        h->classes[i].items      = 0;
+    }
+    h->pages_used   = 0;
+    h->reclaim_next = 0;
+    h->items        = 0;
+}
+
+static void shm_lock(shm_header *h) {
+    if (pthread_mutex_lock(&h->lock) == EOWNERDEAD) {
+        shm_reset(h);
+        pthread_mutex_consistent(&h->lock);
+    }
+}
+
+static void shm_unlock(shm_header *h) { pthread_mutex_unlock(&h->lock); }
+
+static void lru_unlink(shm_header *h, uint32_t off) {
+    shm_item *it  = ITEM(h, off);
+    shm_class *cl = &h->classes[it->cls];
+    if (it->prev) {
+        ITEM(h, it->prev)->next = it->next;
+    } else {
+        cl->head = it->next;
+    }
+    if (it->next) {
+        ITEM(h, it->next)->prev = it->prev;
+    } else {
+        cl->tail = it->prev;
+    }
+    it->prev = it->next = 0;
+}
+
+static void lru_push(shm_header *h, uint32_t off) {
+    shm_item *it  = ITEM(h, off);
+    shm_class *cl = &h->classes[it->cls];
+    it->prev      = 0;
+    it->next      = cl->head;
+    if (cl->head) {
+        ITEM(h, cl->head)->prev = off;
+    }
+    cl->head = off;
+    if (!cl->tail) {
+        cl->tail = off;
+    }
+}
+
+// Removes the item from the hash table and the LRU list, and returns its chunk to the free list
+static void item_free(shm_header *h, uint32_t off) {
+    shm_item *it     = ITEM(h, off);
+    uint32_t *cursor = &h->buckets[it->hash & (h->nbuckets - 1)];
+    while (*cursor && *cursor != off) {
+        cursor = &ITEM(h, *cursor)->h_next;
+    }
+    if (*cursor) {
+        *cursor = it->h_next;
+    }
+    lru_unlink(h, off);
+    shm_class *cl = &h->classes[it->cls];
+    cl->items--;
+    h->items--;
+    it->type   = SHM_FREE;
+    it->h_next = cl->free;
+    cl->free   = off;
+}
+
+static uint32_t item_find(shm_header *h, const char *key, size_t key_len, uint32_t hash) {
+    uint32_t off = h->buckets[hash & (h->nbuckets - 1)];
+    while (off) {
+        shm_item *it = ITEM(h, off);
+        if (it->hash == hash && it->key_len == key_len && memcmp(it->data, key, key_len) == 0) {
+            if (it->expires && it->expires <= now_ms()) {
+                item_free(h, off);
+                h->expired++;
+                return 0;
+            }
+            return off;
+        }
+        off = it->h_next;
+    }
+    return 0;
+}
+
+static uint64_t page_offset(shm_header *h, uint32_t page) { return h->pages_off + (uint64_t)page * SHM_PAGE_SIZE; }
+
+// Splits the page into chunks of the class, and puts them into the free list
+static void page_carve(shm_header *h, uint32_t page, int cls) {
+    shm_class *cl  = &h->classes[cls];
+    uint64_t start = page_offset(h, page);
+    for (uint64_t off = start + SHM_PAGE_SIZE; off > start;) {
+        off -= cl->chunk_size;
+        ITEM(h, off)->type   = SHM_FREE;
+        ITEM(h, off)->h_next = cl->free;
+        cl->free             = off;
+    }
+    h->page_class[page] = cls;
+}
+
+// Takes a page away from some other class, returns 0 if there is none
+static int page_reclaim(shm_header *h, int cls) {
+    for (uint32_t tries = 0; tries < h->npages; tries++) {
+        uint32_t page = h->reclaim_next++ % h->npages;
+        int victim    = h->page_class[page];
+        if (victim == cls) {
+            continue;
+        }
+        shm_class *vc  = &h->classes[victim];
+        uint64_t start = page_offset(h, page);
+        uint64_t end   = start + SHM_PAGE_SIZE;
+        for (uint64_t off = start; off < end; off += vc->chunk_size) {
+            if (ITEM(h, off)->type != SHM_FREE) {
+                item_free(h, off);
+                h->evictions++;
+            }
+        }
+        uint32_t *cursor = &vc->free;
+        while (*cursor) {
+            if (*cursor >= start && *cursor < end) {
+                *cursor = ITEM(h, *cursor)->h_next;
+            } else {
+                cursor = &ITEM(h, *cursor)->h_next;
+            }
+        }
+        page_carve(h, page, cls);
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t chunk_alloc(shm_header *h, int cls) {
+    shm_class *cl = &h->classes[cls];
+    if (!cl->free && h->pages_used < h->npages) {
+        page_carve(h, h->pages_used, cls);
+        h->pages_used++;
+    }
+    if (!cl->free && cl->tail) {
+        item_free(h, cl->tail);
+        h->evictions++;
+    }
+    if (!cl->free) {
+        page_reclaim(h, cls);
+    }
+    uint32_t off = cl->free;
+    if (off) {
+        cl->free = ITEM(h, off)->h_next;
+    }
+    return off;
+}
+
+static int class_for(size_t size) {
+    for (int i = 0; i < SHM_CLASSES; i++) {
+        if (size <= (size_t)(SHM_MIN_CHUNK << i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Must be called with the lock held, returns NULL on success or an error message
+static const char *item_store(shm_header *h, const char *key, size_t key_len, uint32_t hash, uint8_t type,
+                              const void *value, size_t value_len, int64_t expires) {
+    int cls = class_for(sizeof(shm_item) + key_len + value_len);
+    if (cls < 0) {
+        return "value is too large";
+    }
+    uint32_t old = item_find(h, key, key_len, hash);
+    if (old) {
+        item_free(h, old);
+    }
+    uint32_t off = chunk_alloc(h, cls);
+    if (!off) {
+        return "out of memory";
+    }
+    shm_item *it  = ITEM(h, off);
+    it->hash      = hash;
+    it->key_len   = key_len;
+    it->value_len = value_len;
+    it->expires   = expires;
+    it->type      = type;
+    it->cls       = cls;
+    memcpy(it->data, key, key_len);
+    memcpy(it->data + key_len, value, value_len);
+    uint32_t *bucket = &h->buckets[hash & (h->nbuckets - 1)];
+    it->h_next       = *bucket;
+    *bucket          = off;
+    lru_push(h, off);
+    h->classes[cls].items++;
+    h->items++;
+    h->sets++;
+    return NULL;
+}
+
+static int64_t expires_at(lua_State *L, int idx) {
+    lua_Number ttl = luaL_optnumber(L, idx, 0);
+    if (ttl <= 0) {
+        return 0;
+    }
+    return now_ms() + (int64_t)(ttl * 1000);
+}
+
+/*-------------------------------- Lua API ---------------------------------*/
+
+static shm_header *check_shm(lua_State *L) {
+    shm_t *shm = (shm_t *)luaL_checkudata(L, 1, SHM_MT);
+    if (!shm->hdr) {
+        luaL_error(L, "shared memory segment is closed");
+    }
+    return shm->hdr;
+}
+
+/* Creates a new segment of `size` bytes (16Mb by default) */
+static int shm_new(lua_State *L) {
+    size_t size = luaL_optinteger(L, 1, 16 * SHM_PAGE_SIZE);
+    if (size < SHM_MIN_SIZE || size > SHM_MAX_SIZE) {
+        lua_pushnil(L);
+        lua_pushstring(L, "invalid segment size");
+        return 2;
+    }
+    shm_t *shm = (shm_t *)lua_newuserdata(L, sizeof(shm_t));
+    shm->hdr   = NULL;
+    luaL_getmetatable(L, SHM_MT);
+    lua_setmetatable(L, -2);
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    shm_header *h = (shm_header *)mem;
+    uint32_t nbuckets = 1024;
+    while (nbuckets < size / 512) {
+        nbuckets <<= 1;
+    }
+    h->size      = size;
+    h->nbuckets  = nbuckets;
+    h->pages_off = (sizeof(shm_header) + nbuckets * sizeof(uint32_t) + 4095) & ~4095ULL;
+    h->npages    = (size - h->pages_off) / SHM_PAGE_SIZE;
+    if (h->npages > SHM_MAX_PAGES) {
+        h->npages = SHM_MAX_PAGES;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0 || h->npages == 0) {
+        munmap(mem, size);
+        lua_pushnil(L);
+        lua_pushstring(L, rc != 0 ? strerror(rc) : "segment is too small");
+        return 2;
+    }
+    shm_reset(h);
+    h->magic  = SHM_MAGIC;
+    shm->hdr  = h;
+    shm->size = size;
+    return 1;
+}
+
+/* Returns the value (a string or a number), or nil if there is no such key */
+static int shm_get(lua_State *L) {
+    shm_header *h = check_shm(L);
+    size_t key_len;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    uint32_t hash   = hash_key(key, key_len);
+
+    char *copy   = NULL;
+    size_t len   = 0;
+    double num   = 0;
+    uint8_t type = 0;
+    int oom      = 0;
+    shm_lock(h);
+    uint32_t off = item_find(h, key, key_len, hash);
+    if (off) {
+        shm_item *it = ITEM(h, off);
+        type         = it->type;
+        len          = it->value_len;
+        if (type == SHM_NUMBER) {
+            memcpy(&num, it->data + key_len, sizeof(double));
+        } else {
+            // Copy the value out, so that no Lua API call (which may throw) happens under the lock
+            copy = malloc(len ? len : 1);
+            if (copy) {
+                memcpy(copy, it->data + key_len, len);
+            } else {
+                oom = 1;
+            }
+        }
+        lru_unlink(h, off);
+        lru_push(h, off);
+        h->hits++;
+    } else {
+        h->misses++;
+    }
+    shm_unlock(h);
+
+    if (oom) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    if (!off) {
+        lua_pushnil(L);
+        return 1;
+    }
+    if (type == SHM_NUMBER) {
+        lua_pushnumber(L, num);
+        return 1;
+    }
+    lua_pushlstring(L, copy, len);
+    free(copy);
+    return 1;
+}
+
+/* Stores a string or a number, with an optional TTL in seconds */
+static int shm_set(lua_State *L) {
+    shm_header *h = check_shm(L);
+    size_t key_len, value_len;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    const void *value;
+    uint8_t type;
+    double num;
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        num       = lua_tonumber(L, 3);
+        value     = &num;
+        value_len = sizeof(double);
+        type      = SHM_NUMBER;
+    } else {
+        value = luaL_checklstring(L, 3, &value_len);
+        type  = SHM_STRING;
+    }
+    int64_t expires = expires_at(L, 4);
+    uint32_t hash   = hash_key(key, key_len);
+
+    shm_lock(h);
+    const char *err = item_store(h, key, key_len, hash, type, value, value_len, expires);
+    shm_unlock(h);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* Atomically increments a number by `delta` (1 by default). A missing key is
+   initialized with `init` (0 by default) and the optional TTL before incrementing. */
+static int shm_incr(lua_State *L) {
+    shm_header *h = check_shm(L);
+    size_t key_len;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    double delta    = luaL_optnumber(L, 3, 1);
+    double init     = luaL_optnumber(L, 4, 0);
+    int64_t expires = expires_at(L, 5);
+    uint32_t hash   = hash_key(key, key_len);
+
+    const char *err = NULL;
+    double result;
+    shm_lock(h);
+    uint32_t off = item_find(h, key, key_len, hash);
+    if (off) {
+        shm_item *it = ITEM(h, off);
+        if (it->type != SHM_NUMBER) {
+            err = "not a number";
+        } else {
+            memcpy(&result, it->data + key_len, sizeof(double));
+            result += delta;
+            memcpy(it->data + key_len, &result, sizeof(double));
+            lru_unlink(h, off);
+            lru_push(h, off);
+        }
+    } else {
+        result = init + delta;
+        err    = item_store(h, key, key_len, hash, SHM_NUMBER, &result, sizeof(double), expires);
+    }
+    shm_unlock(h);
+    if (err) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+    lua_pushnumber(L, result);
+    return 1;
+}
+
+/* Deletes a key, returns true if it existed */
+static int shm_delete(lua_State *L) {
+    shm_header *h = check_shm(L);
+    size_t key_len;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    uint32_t hash   = hash_key(key, key_len);
+    shm_lock(h);
+    uint32_t off = item_find(h, key, key_len, hash);
+    if (off) {
+        item_free(h, off);
+    }
+    shm_unlock(h);
+    lua_pushboolean(L, off != 0);
+    return 1;
+}
+
+/* Deletes all the keys starting with `prefix`, returns how many there were */
+static int shm_delete_prefix(lua_State *L) {
+    shm_header *h = check_shm(L);
+    size_t prefix_len;
+    const char *prefix = luaL_checklstring(L, 2, &prefix_len);
+    lua_Number deleted = 0;
+    shm_lock(h);
+    for (int i = 0; i < SHM_CLASSES; i++) {
+        uint32_t off = h->classes[i].head;
+        while (off) {
+            shm_item *it  = ITEM(h, off);
+            uint32_t next = it->next;
+            if (it->key_len >= prefix_len && memcmp(it->data, prefix, prefix_len) == 0) {
+                item_free(h, off);
+                deleted++;
+            }
+            off = next;
+        }
+    }
+    shm_unlock(h);
+    lua_pushnumber(L, deleted);
+    return 1;
+}
+
+static int shm_flush(lua_State *L) {
+    shm_header *h = check_shm(L);
+    shm_lock(h);
+    shm_reset(h);
+    shm_unlock(h);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int shm_stats(lua_State *L) {
+    shm_header *h = check_shm(L);
+    shm_lock(h);
+    uint64_t counters[] = {h->items, h->hits,   h->misses,   h->sets,
+                           h->evictions, h->expired, h->npages, h->pages_used};
+    shm_unlock(h);
+    const char *names[] = {"items", "hits", "misses", "sets", "evictions", "expired", "pages", "pages_used"};
+    lua_createtable(L, 0, 9);
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        lua_pushnumber(L, counters[i]);
+        lua_setfield(L, -2, names[i]);
+    }
+    lua_pushnumber(L, h->size);
+    lua_setfield(L, -2, "size");
+    return 1;
+}
+
+static int shm_gc(lua_State *L) {
+    shm_t *shm = (shm_t *)luaL_checkudata(L, 1, SHM_MT);
+    if (shm->hdr) {
+        munmap(shm->hdr, shm->size);
+        shm->hdr = NULL;
+    }
+    return 0;
+}
+
+static luaL_Reg methods[] = {
+    {"get",           shm_get          },
+    {"set",           shm_set          },
+    {"incr",          shm_incr         },
+    {"delete",        shm_delete       },
+    {"delete_prefix", shm_delete_prefix},
+    {"flush",         shm_flush        },
+    {"stats",         shm_stats        },
+    {"close",         shm_gc           },
+    {NULL,            NULL             }
+};
+
+static luaL_Reg funcs[] = {
+    {"new", shm_new},
+    {NULL,  NULL   }
+};
+
+int luaopen_std_shm(lua_State *L) {
+    luaL_newmetatable(L, SHM_MT);
+    lua_pushcfunction(L, shm_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
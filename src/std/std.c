@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -54,6 +55,52 @@ static int deviant_remove_signal_handler(lua_State *L) {
     return 0;
 }
 
+/* Blocks the given signal and returns a non-blocking signalfd
+   for it, so that the signal can be waited on with `select`
+   alongside sockets instead of being handled asynchronously. */
+static int deviant_signalfd(lua_State *L) {
+    int signum = luaL_checkinteger(L, 1);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signum);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        RETURN_ERR(L);
+    }
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+// Drains a signalfd, returns the number of signals read
+static int deviant_signalfd_read(lua_State *L) {
+    int fd = luaL_checkinteger(L, 1);
+    struct signalfd_siginfo info;
+    int count = 0;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        count++;
+    }
+    if (count == 0 && errno != EAGAIN) {
+        RETURN_ERR(L);
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int deviant_unblock_signal(lua_State *L) {
+    int signum = luaL_checkinteger(L, 1);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signum);
+    if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 int deviant_clockticks(lua_State *L) {
     int clk_tck = sysconf(_SC_CLK_TCK);
     lua_pushinteger(L, clk_tck);
@@ -376,6 +423,17 @@ int deviant_mkdir(lua_State *L) {
     return 1;
 }
 
+int deviant_chmod(lua_State *L) {
+    const char *pathname = luaL_checkstring(L, 1);
+    const char *mode_str = luaL_checkstring(L, 2);
+    mode_t mode          = strtol(mode_str, NULL, 8);
+    if (chmod(pathname, mode) == -1) {
+        RETURN_ERR(L);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 int deviant_symlink(lua_State *L) {
     const char *source = luaL_checkstring(L, 1);
     const char *dest   = luaL_checkstring(L, 2);
@@ -456,63 +514,23 @@ static int deviant_list_dir(lua_State *L) {
     return 1; /* table is already on top */
 }
 
-/*
- The code below, so called `fast_list_dir` is
- taken from https://github.com/aidenbell/getdents, mutatis mutandis.
-
- I did not see any significant difference in performance
- time between this code and the regular `list_dir` above
- when tested on a dir with 30k files, but maybe we need more
- files to actually notice it.
-
- For now I'm gonna stash the code here just in case...
-*/
-struct linux_dirent {
-    long d_ino;
-    off_t d_off;
-    unsigned short d_reclen;
-    char d_name[];
-};
-
-#define FLSD_BUF_SIZE 1024 * 1024 * 5
-
-static int deviant_fast_list_dir(lua_State *L) {
-
-    const char *path = luaL_checkstring(L, 1);
-    int fd, nread;
-    char buf[FLSD_BUF_SIZE];
-    struct linux_dirent *d;
-    int bpos;
-    char d_type;
-
-    /* open directory */
-    fd = open(path, O_RDONLY | O_DIRECTORY);
-    if (fd == -1) {
-        RETURN_ERR(L);
-    }
-    /* create result table */
-    lua_newtable(L);
-    for (;;) {
-        nread = syscall(SYS_getdents, fd, buf, FLSD_BUF_SIZE);
-        if (nread == -1) {
-            RETURN_ERR(L);
-        }
-        if (nread == 0)
-            break;
-
-        for (bpos = 0; bpos < nread;) {
-            d      = (struct linux_dirent *)(buf + bpos);
-            d_type = *(buf + bpos + d->d_reclen - 1);
-            if (d->d_ino != 0) {
-                lua_pushstring(L, d->d_name); /* push key */
-                lua_pushnumber(L, d_type);    /* push value */
-                lua_settable(L, -3);
-            }
-            bpos += d->d_reclen;
-        }
-    }
-    return 1; /* table is already on top */
-}
+/* getdents64 based listing & walking, see walk.c */
+int deviant_fast_list_dir(lua_State *L);
+int deviant_walk(lua_State *L);
+/* recursive remove/copy & mkdir -p, see tree.c */
+int deviant_remove_tree(lua_State *L);
+int deviant_copy_tree(lua_State *L);
+int deviant_mkdir_p(lua_State *L);
+/* affinity, scheduling & prctl, see sched.c */
+int deviant_setaffinity(lua_State *L);
+int deviant_getaffinity(lua_State *L);
+int deviant_setscheduler(lua_State *L);
+int deviant_getscheduler(lua_State *L);
+int deviant_setpriority(lua_State *L);
+int deviant_getpriority(lua_State *L);
+int deviant_ioprio_set(lua_State *L);
+int deviant_setname(lua_State *L);
+int deviant_pdeathsig(lua_State *L);
 
 static int deviant_stat(lua_State *L) {
 
@@ -563,6 +581,9 @@ static int deviant_stat(lua_State *L) {
     lua_pushstring(L, "atime");
     lua_pushnumber(L, st.st_atime);
     lua_settable(L, -3);
+    lua_pushstring(L, "mtime");
+    lua_pushnumber(L, st.st_mtime);
+    lua_settable(L, -3);
     lua_pushstring(L, "uid");
     lua_pushnumber(L, st.st_uid);
     lua_settable(L, -3);
@@ -609,7 +630,19 @@ static luaL_Reg funcs[] = {
     {"waitpid",         deviant_waitpid                },
     {"register_signal", deviant_register_signal_handler},
     {"remove_signal",   deviant_remove_signal_handler  },
+    {"signalfd",        deviant_signalfd               },
+    {"signalfd_read",   deviant_signalfd_read          },
+    {"unblock_signal",  deviant_unblock_signal         },
     {"wait",            deviant_wait                   },
+    {"setaffinity",     deviant_setaffinity            },
+    {"getaffinity",     deviant_getaffinity            },
+    {"setscheduler",    deviant_setscheduler           },
+    {"getscheduler",    deviant_getscheduler           },
+    {"setpriority",     deviant_setpriority            },
+    {"getpriority",     deviant_getpriority            },
+    {"ioprio_set",      deviant_ioprio_set             },
+    {"setname",         deviant_setname                },
+    {"pdeathsig",       deviant_pdeathsig              },
     {"exec",            deviant_exec                   },
     {"sleep",           deviant_sleep                  },
     {"sleep_ms",        deviant_sleep_ms               },
@@ -618,12 +651,17 @@ static luaL_Reg funcs[] = {
     {"environ",         deviant_environ                },
     {"chdir",           deviant_chdir                  },
     {"mkdir",           deviant_mkdir                  },
+    {"mkdir_p",         deviant_mkdir_p                },
+    {"chmod",           deviant_chmod                  },
     {"cwd",             deviant_cwd                    },
     {"list_dir",        deviant_list_dir               },
     {"fast_list_dir",   deviant_fast_list_dir          },
+    {"walk",            deviant_walk                   },
     {"stat",            deviant_stat                   },
     {"readlink",        deviant_readlink               },
     {"remove",          deviant_file_remove            },
+    {"remove_tree",     deviant_remove_tree            },
+    {"copy_tree",       deviant_copy_tree              },
     {"symlink",         deviant_symlink                },
     {NULL,              NULL                           }
 };
@@ -1,6 +1,8 @@
 -- SPDX-FileCopyrightText: © 2023 Vladimir Zorin <vladimir@deviant.guru>
 -- SPDX-License-Identifier: GPL-3.0-or-later
 local core = require("std.core")
+local inotify = require("std.watch")
+local uring = require("std.uring")
 
 local function symlink(src, dst)
 	return core.symlink(src, dst)
@@ -18,6 +20,11 @@ local function readlink(pathname)
 	return core.readlink(pathname)
 end
 
+-- `mode` is an octal string, e.g. "0660"
+local function chmod(pathname, mode)
+	return core.chmod(pathname, mode)
+end
+
 local split_path_by_dir = function(pathname)
 	local dirs = {}
 	local path, last_dir = pathname:match("^(.-)/?([^/]-)$")
@@ -35,22 +42,7 @@ end
 
 local function mkdir(pathname, mode, recursive)
 	if recursive then
-		local dirs = split_path_by_dir(pathname)
-		local prefix = ""
-		if pathname:match("^/") then
-			prefix = "/"
-		end
-		for i, _ in ipairs(dirs) do
-			local dir = prefix .. table.concat(dirs, "/", 1, i)
-			local st = stat(dir)
-			if not st then
-				local s, err = core.mkdir(dir, mode)
-				if not s then
-					return nil, err
-				end
-			end
-		end
-		return true
+		return core.mkdir_p(pathname, mode)
 	end
 	return core.mkdir(pathname, mode)
 end
@@ -90,60 +82,80 @@ local function non_empty_dir(path)
 	return not r
 end
 
-local function remove(path, recursive)
+--[[
+    With `recursive` works like `rm -rf` and returns the number of removed entries,
+    `opts` are passed to `remove_tree` in tree.c: `threads`, `progress`, `progress_step`.
+]]
+local function remove(path, recursive, opts)
 	if recursive then
-		local st = core.stat(path)
-		if st and st.mode == "d" then
-			local items, err = list_dir(path)
-			if not items then
-				return nil, err
-			end
-			for _, f in ipairs(items) do
-				if f ~= "." and f ~= ".." then
-					local s, err = remove(path .. "/" .. f, true)
-					if not s then
-						return nil, err
-					end
-				end
-			end
-			return core.remove(path)
-		end
+		return core.remove_tree(path, opts)
 	end
 	return core.remove(path)
 end
 
+--[[
+    Works like `cp -r`, `dst` is the path of the copy. Returns the number
+    of copied entries and bytes. See `copy_tree` in tree.c for the `opts`.
+]]
+local function copy(src, dst, opts)
+	return core.copy_tree(src, dst, opts)
+end
+
+--[[
+    Returns a table of arrays: `path`, `mode`, `size`, `perms`, `uid`, `gid`,
+    `atime`, `mtime` and `target` (with `resolve_links`), with `count` entries.
+    See `deviant_walk` in walk.c for the options, e.g.
+    `walk("/usr", { recursive = true, pattern = "%.so$", threads = 4 })`
+]]
+local function walk(dir, opts)
+	return core.walk(dir, opts)
+end
+
+--[[
+    Returns an inotify watcher of `paths` (a path or an array of them),
+    directories are watched recursively with `opts.recursive`.
+    Use its fd (`getfd`) with `socket.select`, and `read` the coalesced events
+    when it's readable, see watch.c for the details.
+]]
+local function watch(paths, opts)
+	local opts = opts or {}
+	local paths = type(paths) == "table" and paths or { paths }
+	local w, err = inotify.new(opts)
+	if not w then
+		return nil, err
+	end
+	for _, path in ipairs(paths) do
+		local ok, err = w:add(path, opts.recursive)
+		if not ok then
+			w:close()
+			return nil, path .. ": " .. err
+		end
+	end
+	return w
+end
+
 local function list_files(dir, pattern, mode, resolve_links)
-	local resolve_links = resolve_links or false
-	local files = {}
 	local mode = mode or "f"
-	local items, err = list_dir(dir)
-	if items then
-		local pattern = pattern or "^.*"
-		for _, f in ipairs(items) do
-			if f ~= "." and f ~= ".." then
-				if f:match(pattern) then
-					local st = core.stat(dir .. "/" .. f)
-					if st and st.mode:match(mode) then
-						local target
-						if st.mode == "l" and resolve_links then
-							target = readlink(dir .. "/" .. f)
-						end
-						files[f] = {
-							mode = st.mode,
-							size = st.size,
-							perms = st.perms,
-							uid = st.uid,
-							gid = st.gid,
-							target = target,
-							atime = st.atime,
-						}
-					end
-				end
-			end
+	local entries, err = walk(dir, { pattern = pattern, resolve_links = resolve_links })
+	if not entries then
+		return nil, err
+	end
+	local files = {}
+	for i = 1, entries.count do
+		if entries.mode[i]:match(mode) then
+			files[entries.path[i]] = {
+				mode = entries.mode[i],
+				size = entries.size[i],
+				perms = entries.perms[i],
+				uid = entries.uid[i],
+				gid = entries.gid[i],
+				target = entries.target and entries.target[i],
+				atime = entries.atime[i],
+				mtime = entries.mtime[i],
+			}
 		end
-		return files
 	end
-	return nil, err
+	return files
 end
 
 local function dir_exists(filename)
@@ -173,6 +185,58 @@ local function read_file(filename)
 	return nil, err
 end
 
+--[[
+    Reads a bunch of files at once, returns a table of their contents keyed
+    by path, and a table of errors, if some of them could not be read.
+    Goes through io_uring (see uring.c) when it's available.
+]]
+local function read_files(paths)
+	local ring = uring.shared()
+	if ring then
+		local contents, errors = ring:read_files(paths)
+		if contents then
+			return contents, errors
+		end
+	end
+	local contents, errors = {}, nil
+	for _, path in ipairs(paths) do
+		local content, err = read_file(path)
+		if content then
+			contents[path] = content
+		else
+			errors = errors or {}
+			errors[path] = err
+		end
+	end
+	return contents, errors
+end
+
+--[[
+    Returns a function, which returns the next `chunk_size` bytes of the file
+    (64Kb by default) on each call, and nil at the end, and the size of the file.
+    It can be used as a response producer in `web_server` handlers.
+]]
+local function file_chunks(filename, chunk_size)
+	local chunk_size = chunk_size or 65536
+	local f, err = io.open(filename, "rb")
+	if not f then
+		return nil, err
+	end
+	local size = f:seek("end")
+	f:seek("set")
+	return function()
+		if not f then
+			return nil
+		end
+		local chunk = f:read(chunk_size)
+		if not chunk then
+			f:close()
+			f = nil
+		end
+		return chunk
+	end, size
+end
+
 local function write_file(filename, text)
 	local f, err = io.open(filename, "w+")
 	if f then
@@ -187,17 +251,23 @@ local fs = {
 	cwd = cwd,
 	stat = stat,
 	read_file = read_file,
+	read_files = read_files,
+	file_chunks = file_chunks,
 	write_file = write_file,
 	dir_exists = dir_exists,
 	empty_dir = empty_dir,
 	mkdir = mkdir,
+	chmod = chmod,
 	chdir = core.chdir,
 	non_empty_dir = non_empty_dir,
 	symlink = symlink,
 	readlink = readlink,
 	remove = remove,
+	copy = copy,
 	file_exists = file_exists,
 	list_files = list_files,
+	walk = walk,
+	watch = watch,
 	list_dir = list_dir,
 	fast_list_dir = fast_list_dir,
 	split_path_by_dir = split_path_by_dir,
@@ -11,6 +11,7 @@ local txt = require("std.txt")
 local conv = require("std.conv")
 local mime = require("std.mime")
 local logger = require("std.logger")
+local shm = require("std.shm")
 
 local function sleep(seconds)
 	core.sleep(seconds)
@@ -152,6 +153,7 @@ local std = {
 	conv = conv,
 	mime = mime,
 	logger = logger,
+	shm = shm,
 	txt = txt,
 	environ = environ,
 	clockticks = core.clockticks,
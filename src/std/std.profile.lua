@@ -0,0 +1,175 @@
+-- SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+-- SPDX-License-Identifier: GPL-3.0-or-later
+local jp = require("jit.profile")
+
+--[[
+    Sampling profiler on top of LuaJIT's `jit.profile`.
+
+        local prof = profile.start({ interval = 1, depth = 64, lines = false })
+        ...
+        local result = prof:stop()
+        io.write(result:folded())
+
+    Every `interval` milliseconds the VM is interrupted and the current Lua stack
+    is recorded, together with the state the VM was in: interpreting bytecode,
+    running compiled (JITted) code, collecting garbage, running C code or compiling
+    a trace. Stacks are kept folded, i.e. as a `;` separated string of frames
+    from the outermost to the innermost, with the VM state as the last frame:
+
+        script.lua:main;std.fs:read_file;[interpreted] 42
+
+    That's the format Brendan Gregg's `flamegraph.pl` (and inferno, speedscope & co)
+    take as is. With `lines` set, frames are `module:line` instead of `module:function`.
+
+    Only one profiler can run at a time in a Lua state, and samples are taken only
+    while Lua code runs: time spent blocked in a syscall (`select`, `read` & such) is not seen.
+]]
+
+local vmstates = {
+	N = "compiled",
+	I = "interpreted",
+	C = "c",
+	G = "gc",
+	J = "jit",
+}
+
+local running = nil
+
+local result_folded = function(self)
+	local lines = {}
+	for stack, count in pairs(self.stacks) do
+		table.insert(lines, stack .. " " .. count)
+	end
+	table.sort(lines)
+	return table.concat(lines, "\n") .. (#lines > 0 and "\n" or "")
+end
+
+-- Returns `n` frames with the most samples in them (self time),
+-- as an array of `{ frame = "module:function", samples = 10 }`
+local result_top = function(self, n)
+	local frames = {}
+	for stack, count in pairs(self.stacks) do
+		local frame = stack:match("([^;]+);[^;]+$") or "[unknown]"
+		frames[frame] = (frames[frame] or 0) + count
+	end
+	local top = {}
+	for frame, samples in pairs(frames) do
+		table.insert(top, { frame = frame, samples = samples })
+	end
+	table.sort(top, function(a, b)
+		if a.samples == b.samples then
+			return a.frame < b.frame
+		end
+		return a.samples > b.samples
+	end)
+	for i = #top, (n or 20) + 1, -1 do
+		top[i] = nil
+	end
+	return top
+end
+
+-- Human readable summary: the VM state breakdown and the top frames
+local result_summary = function(self, n)
+	local lines = { string.format("%d samples, %dms interval", self.samples, self.interval) }
+	if self.samples == 0 then
+		return lines[1] .. "\n"
+	end
+	local states = {}
+	for state, count in pairs(self.vmstates) do
+		table.insert(states, string.format("%s %.1f%%", state, count * 100 / self.samples))
+	end
+	table.sort(states)
+	table.insert(lines, table.concat(states, ", "))
+	for _, entry in ipairs(self:top(n)) do
+		table.insert(lines, string.format("%6.1f%%  %s", entry.samples * 100 / self.samples, entry.frame))
+	end
+	return table.concat(lines, "\n") .. "\n"
+end
+
+-- Adds the stacks of another result, e.g. parsed with `profile.parse`
+local result_merge = function(self, other)
+	for stack, count in pairs(other.stacks) do
+		self.stacks[stack] = (self.stacks[stack] or 0) + count
+	end
+	for state, count in pairs(other.vmstates) do
+		self.vmstates[state] = (self.vmstates[state] or 0) + count
+	end
+	self.samples = self.samples + other.samples
+	return self
+end
+
+local new_result = function(interval)
+	return {
+		interval = interval,
+		samples = 0,
+		stacks = {},
+		vmstates = {},
+		folded = result_folded,
+		top = result_top,
+		summary = result_summary,
+		merge = result_merge,
+	}
+end
+
+local stop = function(self)
+	if running == self then
+		jp.stop()
+		running = nil
+	end
+	return self.result
+end
+
+local start = function(opts)
+	local opts = opts or {}
+	if running then
+		return nil, "profiler is already running"
+	end
+	local interval = math.max(1, math.floor(tonumber(opts.interval) or 1))
+	local depth = tonumber(opts.depth) or 64
+	local fmt = opts.lines and "lZ;" or "FZ;"
+	local result = new_result(interval)
+	local stacks, states = result.stacks, result.vmstates
+	local cb = function(thread, samples, vmstate)
+		local state = vmstates[vmstate] or vmstate
+		-- negative depth makes it start from the outermost frame
+		local stack = jp.dumpstack(thread, fmt, -depth)
+		if stack == "" then
+			stack = "[unknown]"
+		end
+		stack = stack .. ";[" .. state .. "]"
+		stacks[stack] = (stacks[stack] or 0) + samples
+		states[state] = (states[state] or 0) + samples
+		result.samples = result.samples + samples
+	end
+	local prof = { result = result, stop = stop }
+	running = prof
+	jp.start("i" .. interval, cb)
+	return prof
+end
+
+-- Runs `func` with the profiler on, returns the result and whatever `func` returned, packed
+local run = function(opts, func, ...)
+	local prof, err = start(opts)
+	if not prof then
+		return nil, err
+	end
+	local ret = { pcall(func, ...) }
+	return prof:stop(), ret
+end
+
+-- Parses folded stacks back into a result, to merge profiles of several processes
+local parse = function(folded, interval)
+	local result = new_result(interval or 1)
+	for stack, count in folded:gmatch("([^\n]+) (%d+)\n?") do
+		count = tonumber(count)
+		result.stacks[stack] = (result.stacks[stack] or 0) + count
+		local state = stack:match(";%[([%a]+)%]$")
+		if state then
+			result.vmstates[state] = (result.vmstates[state] or 0) + count
+		end
+		result.samples = result.samples + count
+	end
+	return result
+end
+
+return { start = start, run = run, parse = parse }
@@ -72,6 +72,9 @@ local function launch(cmd, stdin, stdout, stderr, ...)
 		return nil, "failed to fork"
 	end
 	if pid == 0 then --child
+		-- The parent might be waiting for SIGCHLD with a signalfd,
+		-- the blocked mask must not leak into the launched command
+		core.unblock_signal(17)
 		if stdin then
 			dup2(stdin, 0)
 			core.close(stdin)
@@ -102,6 +105,51 @@ local function wait(pid)
 	return core.wait(pid)
 end
 
+-- Returns an object wrapping a signalfd for the `signum` signal.
+-- The signal gets blocked for the process, and the object can
+-- be passed to `socket.select` as any other socket.
+-- Don't forget to call `close` in forked children, otherwise
+-- they inherit the blocked signal mask.
+local function signalfd(signum)
+	local fd, err = core.signalfd(signum)
+	if not fd then
+		return nil, err
+	end
+	local sfd = { fd = fd, signum = signum }
+	setmetatable(sfd, {
+		__index = {
+			getfd = function(self)
+				return self.fd
+			end,
+			dirty = function(self)
+				return false
+			end,
+			read = function(self)
+				return core.signalfd_read(self.fd)
+			end,
+			close = function(self)
+				core.close(self.fd)
+				return core.unblock_signal(self.signum)
+			end,
+		},
+	})
+	return sfd
+end
+
+-- Reaps all exited children without blocking,
+-- returns a list of their pids.
+local function reap()
+	local pids = {}
+	while true do
+		local pid = core.waitpid(-1)
+		if not pid or pid <= 0 then
+			break
+		end
+		table.insert(pids, pid)
+	end
+	return pids
+end
+
 local exec_simple = function(cmd, nowait)
 	local args = {}
 	for arg in cmd:gmatch("%S+") do
@@ -141,6 +189,97 @@ local exec_one_line = function(cmd)
 	return ""
 end
 
+-- Number of online CPUs, 1 if we can't tell
+local cpu_count = function()
+	local online = fs.read_file("/sys/devices/system/cpu/online") or ""
+	local count = 0
+	for range in online:gmatch("[%d%-]+") do
+		local first, last = range:match("^(%d+)%-(%d+)$")
+		if first then
+			count = count + tonumber(last) - tonumber(first) + 1
+		else
+			count = count + 1
+		end
+	end
+	return math.max(count, 1)
+end
+
+-- Parses a CPU list in the kernel's format, e.g. "0-3,8,10-11",
+-- into an array of CPU numbers. Arrays are returned as is.
+local cpu_list = function(cpus)
+	if type(cpus) == "table" then
+		return cpus
+	end
+	local list = {}
+	for range in tostring(cpus):gmatch("[^,%s]+") do
+		local first, last = range:match("^(%d+)%-(%d+)$")
+		first = tonumber(first or range)
+		if not first then
+			return nil, "invalid CPU list: " .. tostring(cpus)
+		end
+		for cpu = first, tonumber(last) or first do
+			table.insert(list, cpu)
+		end
+	end
+	return list
+end
+
+--[[
+    Process placement & scheduling, `pid` 0 (or nil) is the calling process.
+    All of these are inherited by forks.
+
+        setaffinity(pid, cpus)             -- `cpus` is an array or a list like "0-3,8"
+        getaffinity(pid)                   -- array of CPUs
+        setscheduler(pid, policy, prio)    -- "other", "batch", "idle", "fifo" or "rr"
+        getscheduler(pid)                  -- policy name and priority
+        setpriority(pid, nice)             -- nice value, from -20 to 19
+        getpriority(pid)
+        ioprio_set(pid, class, level)      -- "rt", "be" or "idle", level from 0 (highest) to 7
+]]
+local setaffinity = function(pid, cpus)
+	local list, err = cpu_list(cpus)
+	if not list then
+		return nil, err
+	end
+	return core.setaffinity(pid or 0, list)
+end
+
+local getaffinity = function(pid)
+	return core.getaffinity(pid or 0)
+end
+
+local setscheduler = function(pid, policy, priority)
+	return core.setscheduler(pid or 0, policy, priority or 0)
+end
+
+local getscheduler = function(pid)
+	return core.getscheduler(pid or 0)
+end
+
+local setpriority = function(pid, nice)
+	return core.setpriority(pid or 0, nice)
+end
+
+local getpriority = function(pid)
+	return core.getpriority(pid or 0)
+end
+
+local ioprio_set = function(pid, class, level)
+	return core.ioprio_set(pid or 0, class, level)
+end
+
+-- Sets the process name shown by `ps` and `top`, at most 15 bytes
+local setname = function(name)
+	return core.setname(name)
+end
+
+-- Makes the calling process receive `signal` when its parent exits.
+-- Pass the parent's pid, as seen before the fork, to catch the case
+-- when the parent is already gone.
+local pdeathsig = function(signal, parent)
+	return core.pdeathsig(signal, parent)
+end
+
 local find_by_inode = function(inode)
 	local pids = fs.list_files("/proc", "^%d", "d") or {}
 	for pid, _ in pairs(pids) do
@@ -172,7 +311,20 @@ local ps = {
 	launch = launch,
 	waitpid = waitpid,
 	wait = wait,
+	reap = reap,
+	signalfd = signalfd,
 	getpid = getpid,
 	find_by_inode = find_by_inode,
+	cpu_count = cpu_count,
+	cpu_list = cpu_list,
+	setaffinity = setaffinity,
+	getaffinity = getaffinity,
+	setscheduler = setscheduler,
+	getscheduler = getscheduler,
+	setpriority = setpriority,
+	getpriority = getpriority,
+	ioprio_set = ioprio_set,
+	setname = setname,
+	pdeathsig = pdeathsig,
 }
 return ps
@@ -202,12 +202,12 @@ local calc_table_maxes = function(headers, tbl)
 	local tbl = tbl or {}
 	for i, header in ipairs(headers) do
 		local h_name, h_align = parse_pipe_table_header(header)
-		maxes[h_name] = utf.len(h_name)
+		maxes[h_name] = txt.width(h_name)
 	end
 	for i, row in ipairs(tbl) do
 		for j, col in ipairs(row) do
 			if headers[j] then
-				local len = utf.len(tostring(col))
+				local len = txt.width(tostring(col))
 				local h_name = parse_pipe_table_header(headers[j])
 				if len > maxes[h_name] then
 					maxes[h_name] = len
@@ -1,8 +1,8 @@
 -- SPDX-FileCopyrightText: © 2023 Vladimir Zorin <vladimir@deviant.guru>
 -- SPDX-License-Identifier: GPL-3.0-or-later
-local buffer = require("string.buffer")
 local utf = require("std.utf")
 local core = require("std.core")
+local layout = require("std.layout")
 
 local ascii_printable = function(filename)
 	local f = io.open(filename)
@@ -129,85 +129,18 @@ end
     When `remove_extra_spaces` is true (default is false), all
     occurences of consecutive spaces will be replaced by a single space.
 
+    Lengths are display widths: escape sequences and combining
+    characters take no room, wide characters take two columns.
+    See `wrap` (`std.layout.wrap`) for the optimal breaking and hanging indents.
+
 ]]
 --
 local lines_of = function(input, width, force_split, remove_extra_spaces)
-	local input = input or ""
-	local width = tonumber(width) or 80
-	local margin = math.ceil(width * 0.05)
-	local buf = buffer.new()
-	local state = {
-		count = 0,
-		esc = false,
-		last_esc = "",
-		last_space = 0,
-	}
-	for char in input:gmatch(utf.patterns.glob) do
-		if state.esc then
-			buf:put(char)
-			if char == "m" then
-				state.esc = false
-			end
-			state.last_esc = state.last_esc .. char
-			if state.last_esc:match("\027%[0m$") then
-				state.last_esc = ""
-			end
-		else
-			if char == "\27" then
-				state.esc = true
-				state.last_esc = state.last_esc .. char
-				buf:put(char)
-			else
-				state.count = state.count + 1
-				if char == "\n" then
-					buf:put("\n")
-					if state.last_esc ~= "" then
-						buf:put(state.last_esc)
-					end
-					state.count = 0
-				else
-					if
-						(state.count == width and force_split)
-						or (state.count >= width - margin and char:match("[%s-]"))
-					then
-						if char:match("%s") then
-							char = "\n"
-						else
-							char = char .. "\n"
-						end
-						if state.last_esc ~= "" then
-							char = char .. state.last_esc
-						end
-						state.count = 0
-					else
-						if char:match("^%s") then
-							if state.count - state.last_space == 1 and remove_extra_spaces then
-								char = ""
-								state.count = state.count - 1
-							else
-								state.last_space = state.count
-							end
-						else
-							state.last_space = 0
-						end
-					end
-					buf:put(char)
-				end
-			end
-		end
-	end
-	return lines(buf:get())
+	return layout.wrap(input or "", tonumber(width) or 80, { force = force_split, squeeze = remove_extra_spaces })
 end
 
 local limit = function(str, max, prefix)
-	local prefix = prefix or 1
-	local utf_len = utf.len(str)
-	if utf_len > max then
-		local extra = utf_len - max
-		local s = utf.sub(str, 1, prefix - 1) .. "…" .. utf.sub(str, extra + prefix + 2)
-		return s
-	end
-	return str
+	return layout.clip(str, max, prefix)
 end
 
 local find_all_positions = function(input, pattern)
@@ -255,27 +188,14 @@ local split_by = function(input, pattern, ltrim, rtrim)
 end
 
 local align = function(text, max, side)
-	local side = side or "left"
-	local text = tostring(text)
-	if side == "left" then
-		local suf = max - utf.len(text)
-		return text .. string.rep(" ", suf)
-	end
-	if side == "right" then
-		local pre = max - utf.len(text)
-		return string.rep(" ", pre) .. text
-	end
-	local pre, frac = math.modf((max - utf.len(text)) / 2)
-	local suf = pre
-	if frac == 0.5 then
-		pre = pre + 1
-	end
-	return string.rep(" ", pre) .. text .. string.rep(" ", suf)
+	return layout.align(tostring(text), max, side)
 end
 
 local txt = {
 	lines = lines,
 	lines_of = lines_of,
+	wrap = layout.wrap,
+	width = layout.width,
 	limit = limit,
 	indent = indent,
 	align = align,
@@ -0,0 +1,789 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Recursive remove, copy & `mkdir -p`.
+
+ Like the walker in walk.c, everything is done relative to directory fds
+ (openat/unlinkat/mkdirat/fstatat), so no full paths are built
+ for the kernel to resolve over and over again.
+
+ Directories are processed as jobs from a shared queue, by one or more threads.
+ Each directory is a node with a reference count: one for the node itself
+ while its entries are being processed, plus one for each subdirectory queued.
+ When it drops to zero the directory is finished: removed (rmdir) or,
+ for copies, gets its final permissions and timestamps (it's created
+ writable for the owner, so that we could fill it).
+
+ Errors don't stop the operation: the first one is reported once
+ everything else is done, just like `rm -rf` and `cp -r` do.
+
+ The `progress` callback is only ever called from the calling thread,
+ every `progress_step` entries, with the number of entries and bytes processed.
+ If it returns `false` the operation is cancelled.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#include "walk.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define TREE_REMOVE        0
+#define TREE_COPY          1
+#define TREE_PROGRESS_STEP 1000
+#define TREE_CHUNK_SIZE    (1024 * 1024 * 1024)
+
+enum { TREE_OK, TREE_CANCELLED, TREE_OOM, TREE_CALLBACK_ERROR };
+
+typedef struct tree_node tree_node_t;
+struct tree_node {
+    tree_node_t *parent;
+    char *path; /* relative to the root, "." for the root itself */
+    size_t refs;
+    mode_t mode;
+    struct timespec times[2];
+};
+
+typedef struct {
+    int op;
+    const char *root; /* for error messages */
+    int src_fd;
+    int dst_fd;
+    dev_t dst_dev;
+    ino_t dst_ino;
+    int reflink;
+    int preserve;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    tree_node_t **jobs;
+    size_t jobs_count;
+    size_t jobs_cap;
+    size_t pending;
+    size_t done;
+    uint64_t bytes;
+    int stop; /* one of TREE_CANCELLED, TREE_OOM, TREE_CALLBACK_ERROR */
+    int err;  /* errno of the first failure */
+    char err_path[PATH_MAX];
+    /* progress reporting, calling thread only */
+    lua_State *L;
+    int progress_idx;
+    size_t progress_step;
+    size_t reported;
+} tree_ctx_t;
+
+typedef struct {
+    tree_ctx_t *ctx;
+    char *dents;
+    char *data;
+    int is_main;
+    pthread_t thread;
+} tree_thread_t;
+
+static void tree_error(tree_ctx_t *ctx, const char *prefix, const char *name, int err) {
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->err == 0) {
+        ctx->err = err;
+        if (name == NULL || strcmp(name, ".") == 0) {
+            snprintf(ctx->err_path, sizeof(ctx->err_path), "%s", ctx->root);
+        } else if (prefix == NULL || strcmp(prefix, ".") == 0) {
+            snprintf(ctx->err_path, sizeof(ctx->err_path), "%s/%s", ctx->root, name);
+        } else {
+            snprintf(ctx->err_path, sizeof(ctx->err_path), "%s/%s/%s", ctx->root, prefix, name);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void tree_stop(tree_ctx_t *ctx, int reason) {
+    __atomic_store_n(&ctx->stop, reason, __ATOMIC_RELAXED);
+}
+
+static int tree_stopped(tree_ctx_t *ctx) {
+    return __atomic_load_n(&ctx->stop, __ATOMIC_RELAXED);
+}
+
+static tree_node_t *node_new(tree_node_t *parent, const char *prefix, const char *name, const struct stat *st) {
+    tree_node_t *node = calloc(1, sizeof(tree_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+    if (prefix == NULL || strcmp(prefix, ".") == 0) {
+        node->path = strdup(name);
+    } else {
+        size_t prefix_len = strlen(prefix);
+        size_t name_len   = strlen(name);
+        node->path        = malloc(prefix_len + name_len + 2);
+        if (node->path != NULL) {
+            memcpy(node->path, prefix, prefix_len);
+            node->path[prefix_len] = '/';
+            memcpy(node->path + prefix_len + 1, name, name_len + 1);
+        }
+    }
+    if (node->path == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->parent   = parent;
+    node->refs     = 1;
+    node->mode     = st->st_mode & 07777;
+    node->times[0] = st->st_atim;
+    node->times[1] = st->st_mtim;
+    return node;
+}
+
+static int queue_push(tree_ctx_t *ctx, tree_node_t *node) {
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->jobs_count == ctx->jobs_cap) {
+        size_t cap         = ctx->jobs_cap ? ctx->jobs_cap * 2 : 256;
+        tree_node_t **jobs = realloc(ctx->jobs, cap * sizeof(tree_node_t *));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            return 0;
+        }
+        ctx->jobs     = jobs;
+        ctx->jobs_cap = cap;
+    }
+    ctx->jobs[ctx->jobs_count++] = node;
+    ctx->pending++;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 1;
+}
+
+static void finish_dir(tree_ctx_t *ctx, tree_node_t *node) {
+    if (tree_stopped(ctx)) {
+        return;
+    }
+    if (ctx->op == TREE_REMOVE) {
+        /* the root is removed by the caller, once its fd is closed */
+        if (node->parent != NULL) {
+            if (unlinkat(ctx->src_fd, node->path, AT_REMOVEDIR) == -1 && errno != ENOENT) {
+                tree_error(ctx, NULL, node->path, errno);
+                return;
+            }
+            __atomic_add_fetch(&ctx->done, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    if (fchmodat(ctx->dst_fd, node->path, node->mode, 0) == -1) {
+        tree_error(ctx, NULL, node->path, errno);
+        return;
+    }
+    if (ctx->preserve && utimensat(ctx->dst_fd, node->path, node->times, 0) == -1) {
+        tree_error(ctx, NULL, node->path, errno);
+        return;
+    }
+    __atomic_add_fetch(&ctx->done, 1, __ATOMIC_RELAXED);
+}
+
+static void node_release(tree_ctx_t *ctx, tree_node_t *node) {
+    while (node != NULL) {
+        pthread_mutex_lock(&ctx->lock);
+        size_t refs = --node->refs;
+        pthread_mutex_unlock(&ctx->lock);
+        if (refs > 0) {
+            return;
+        }
+        tree_node_t *parent = node->parent;
+        finish_dir(ctx, node);
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+}
+
+static void tree_progress(tree_ctx_t *ctx, int last) {
+    if (ctx->progress_idx == 0 || ctx->stop == TREE_CALLBACK_ERROR) {
+        return;
+    }
+    size_t done = __atomic_load_n(&ctx->done, __ATOMIC_RELAXED);
+    if (done == ctx->reported || (!last && done - ctx->reported < ctx->progress_step)) {
+        return;
+    }
+    ctx->reported = done;
+    lua_State *L  = ctx->L;
+    lua_pushvalue(L, ctx->progress_idx);
+    lua_pushnumber(L, done);
+    lua_pushnumber(L, __atomic_load_n(&ctx->bytes, __ATOMIC_RELAXED));
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        /* the error message is left on the stack for `tree_result` */
+        tree_stop(ctx, TREE_CALLBACK_ERROR);
+        return;
+    }
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        tree_stop(ctx, TREE_CANCELLED);
+    }
+    lua_pop(L, 1);
+}
+
+static int copy_data(tree_ctx_t *ctx, int in, int out, char *buf) {
+    if (ctx->reflink && ioctl(out, FICLONE, in) == 0) {
+        struct stat st;
+        if (fstat(out, &st) == 0) {
+            __atomic_add_fetch(&ctx->bytes, st.st_size, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+    for (;;) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, TREE_CHUNK_SIZE, 0);
+        if (n == 0) {
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+                break; /* not supported here, carry on with read & write from the current offsets */
+            }
+            return -1;
+        }
+        __atomic_add_fetch(&ctx->bytes, n, __ATOMIC_RELAXED);
+    }
+    for (;;) {
+        ssize_t n = read(in, buf, WALK_DENTS_BUF_SIZE);
+        if (n == 0) {
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out, buf + written, n - written);
+            if (w == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            written += w;
+        }
+        __atomic_add_fetch(&ctx->bytes, n, __ATOMIC_RELAXED);
+    }
+}
+
+static int copy_file(tree_ctx_t *ctx, int src_dir, const char *src, int dst_dir, const char *dst,
+                     const struct stat *st, char *buf) {
+    int in = openat(src_dir, src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1) {
+        return -1;
+    }
+    int out = openat(dst_dir, dst, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, st->st_mode & 07777);
+    if (out == -1) {
+        int err = errno;
+        close(in);
+        errno = err;
+        return -1;
+    }
+    int ret = copy_data(ctx, in, out, buf);
+    if (ret == 0) {
+        /* the file might have existed with other permissions */
+        ret = fchmod(out, st->st_mode & 07777);
+    }
+    if (ret == 0 && ctx->preserve) {
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        ret                      = futimens(out, times);
+    }
+    int err = errno;
+    close(in);
+    close(out);
+    errno = err;
+    return ret;
+}
+
+static int copy_link(int src_dir, const char *src, int dst_dir, const char *dst) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(src_dir, src, target, sizeof(target) - 1);
+    if (len == -1) {
+        return -1;
+    }
+    target[len] = '\0';
+    if (symlinkat(target, dst_dir, dst) == -1) {
+        if (errno != EEXIST || unlinkat(dst_dir, dst, 0) == -1) {
+            return -1;
+        }
+        return symlinkat(target, dst_dir, dst);
+    }
+    return 0;
+}
+
+/* Copies anything but a directory */
+static int copy_entry(tree_ctx_t *ctx, int src_dir, const char *src, int dst_dir, const char *dst,
+                      const struct stat *st, char *buf) {
+    int ret;
+    switch (st->st_mode & S_IFMT) {
+    case S_IFREG:
+        return copy_file(ctx, src_dir, src, dst_dir, dst, st, buf);
+    case S_IFLNK:
+        ret = copy_link(src_dir, src, dst_dir, dst);
+        break;
+    case S_IFIFO:
+    case S_IFCHR:
+    case S_IFBLK:
+        ret = mknodat(dst_dir, dst, st->st_mode, st->st_rdev);
+        if (ret == -1 && errno == EEXIST) {
+            ret = 0;
+        }
+        break;
+    default:
+        return 0; /* sockets can't be copied */
+    }
+    if (ret == 0 && ctx->preserve) {
+        struct timespec times[2] = {st->st_atim, st->st_mtim};
+        ret                      = utimensat(dst_dir, dst, times, AT_SYMLINK_NOFOLLOW);
+    }
+    return ret;
+}
+
+static void tree_dir(tree_thread_t *t, tree_node_t *node) {
+    tree_ctx_t *ctx = t->ctx;
+    int fd          = openat(ctx->src_fd, node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        tree_error(ctx, NULL, node->path, errno);
+        node_release(ctx, node);
+        return;
+    }
+    int dst = -1;
+    if (ctx->op == TREE_COPY) {
+        dst = openat(ctx->dst_fd, node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dst == -1) {
+            tree_error(ctx, NULL, node->path, errno);
+            close(fd);
+            node_release(ctx, node);
+            return;
+        }
+    }
+
+    while (!tree_stopped(ctx)) {
+        long nread = syscall(SYS_getdents64, fd, t->dents, WALK_DENTS_BUF_SIZE);
+        if (nread == -1) {
+            tree_error(ctx, NULL, node->path, errno);
+        }
+        if (nread <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread && !tree_stopped(ctx);) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(t->dents + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (IS_DOT_OR_DOTDOT(name)) {
+                continue;
+            }
+            struct stat st;
+            int is_dir = d->d_type == DT_DIR;
+            if (ctx->op == TREE_COPY || d->d_type == DT_UNKNOWN) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    if (errno != ENOENT) {
+                        tree_error(ctx, node->path, name, errno);
+                    }
+                    continue;
+                }
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            if (is_dir) {
+                if (ctx->op == TREE_COPY) {
+                    if (st.st_dev == ctx->dst_dev && st.st_ino == ctx->dst_ino) {
+                        continue; /* copying a dir into itself */
+                    }
+                    if (mkdirat(dst, name, (st.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST) {
+                        tree_error(ctx, node->path, name, errno);
+                        continue;
+                    }
+                } else {
+                    memset(&st, 0, sizeof(st));
+                }
+                tree_node_t *child = node_new(node, node->path, name, &st);
+                if (child == NULL) {
+                    tree_stop(ctx, TREE_OOM);
+                    break;
+                }
+                pthread_mutex_lock(&ctx->lock);
+                node->refs++;
+                pthread_mutex_unlock(&ctx->lock);
+                if (!queue_push(ctx, child)) {
+                    tree_stop(ctx, TREE_OOM);
+                    node_release(ctx, child);
+                    break;
+                }
+                continue; /* counted once it's finished */
+            }
+            if (ctx->op == TREE_REMOVE) {
+                if (unlinkat(fd, name, 0) == -1 && errno != ENOENT) {
+                    tree_error(ctx, node->path, name, errno);
+                    continue;
+                }
+            } else if (copy_entry(ctx, fd, name, dst, name, &st, t->data) == -1) {
+                tree_error(ctx, node->path, name, errno);
+                continue;
+            }
+            __atomic_add_fetch(&ctx->done, 1, __ATOMIC_RELAXED);
+            if (t->is_main) {
+                tree_progress(ctx, 0);
+            }
+        }
+    }
+    close(fd);
+    if (dst != -1) {
+        close(dst);
+    }
+    node_release(ctx, node);
+}
+
+static void *tree_worker(void *arg) {
+    tree_thread_t *t = (tree_thread_t *)arg;
+    tree_ctx_t *ctx  = t->ctx;
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->jobs_count == 0 && ctx->pending > 0) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->jobs_count == 0) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        tree_node_t *node = ctx->jobs[--ctx->jobs_count];
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (tree_stopped(ctx)) {
+            node_release(ctx, node);
+        } else {
+            tree_dir(t, node);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->pending--;
+        if (ctx->pending == 0) {
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+static void tree_init(lua_State *L, tree_ctx_t *ctx, int op, const char *root, int opts_idx) {
+    memset(ctx, 0, sizeof(tree_ctx_t));
+    ctx->op            = op;
+    ctx->root          = root;
+    ctx->src_fd        = -1;
+    ctx->dst_fd        = -1;
+    ctx->reflink       = 1;
+    ctx->L             = L;
+    ctx->progress_step = TREE_PROGRESS_STEP;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    if (!lua_istable(L, opts_idx)) {
+        return;
+    }
+    lua_getfield(L, opts_idx, "reflink");
+    if (!lua_isnil(L, -1)) {
+        ctx->reflink = lua_toboolean(L, -1);
+    }
+    lua_getfield(L, opts_idx, "preserve");
+    ctx->preserve = lua_toboolean(L, -1);
+    lua_getfield(L, opts_idx, "progress_step");
+    if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+        ctx->progress_step = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 3);
+    lua_getfield(L, opts_idx, "progress");
+    if (lua_isfunction(L, -1)) {
+        ctx->progress_idx = lua_gettop(L); /* stays on the stack until we return */
+    } else {
+        lua_pop(L, 1);
+    }
+}
+
+static int tree_threads(lua_State *L, int opts_idx) {
+    int threads = 1;
+    if (lua_istable(L, opts_idx)) {
+        lua_getfield(L, opts_idx, "threads");
+        if (lua_isnumber(L, -1)) {
+            threads = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    return threads > WALK_MAX_THREADS ? WALK_MAX_THREADS : threads;
+}
+
+static void tree_run(tree_ctx_t *ctx, tree_node_t *root, int threads) {
+    tree_thread_t workers[WALK_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    int ready = 0;
+    for (; ready < threads; ready++) {
+        workers[ready].ctx   = ctx;
+        workers[ready].dents = malloc(WALK_DENTS_BUF_SIZE);
+        workers[ready].data  = ctx->op == TREE_COPY ? malloc(WALK_DENTS_BUF_SIZE) : NULL;
+        if (workers[ready].dents == NULL || (ctx->op == TREE_COPY && workers[ready].data == NULL)) {
+            free(workers[ready].dents);
+            free(workers[ready].data);
+            break;
+        }
+    }
+    if (ready == 0 || !queue_push(ctx, root)) {
+        tree_stop(ctx, TREE_OOM);
+        free(root->path);
+        free(root);
+    } else {
+        workers[0].is_main = 1;
+        int started        = 0;
+        for (int i = 1; i < ready; i++) {
+            if (pthread_create(&workers[i].thread, NULL, tree_worker, &workers[i]) != 0) {
+                break;
+            }
+            started = i;
+        }
+        tree_worker(&workers[0]);
+        for (int i = 1; i <= started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    for (int i = 0; i < ready; i++) {
+        free(workers[i].dents);
+        free(workers[i].data);
+    }
+}
+
+/* Releases what `tree_init` and the run have set up, on every way out */
+static void tree_free(tree_ctx_t *ctx) {
+    free(ctx->jobs);
+    ctx->jobs = NULL;
+    if (ctx->src_fd != -1) {
+        close(ctx->src_fd);
+    }
+    if (ctx->dst_fd != -1) {
+        close(ctx->dst_fd);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+}
+
+static int tree_result(lua_State *L, tree_ctx_t *ctx) {
+    switch (ctx->stop) {
+    case TREE_CALLBACK_ERROR:
+        lua_pushnil(L);
+        lua_insert(L, -2); /* the error message from the callback */
+        return 2;
+    case TREE_CANCELLED:
+        lua_pushnil(L);
+        lua_pushstring(L, "cancelled");
+        return 2;
+    case TREE_OOM:
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    if (ctx->err != 0) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", ctx->err_path, strerror(ctx->err));
+        return 2;
+    }
+    tree_progress(ctx, 1);
+    if (ctx->stop == TREE_CALLBACK_ERROR) {
+        return tree_result(L, ctx);
+    }
+    lua_pushnumber(L, ctx->done);
+    lua_pushnumber(L, ctx->bytes);
+    return 2;
+}
+
+static int remove_dir_tree(lua_State *L, tree_ctx_t *ctx, const char *path, struct stat *st, int threads) {
+    ctx->src_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (ctx->src_fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    tree_node_t *root = node_new(NULL, NULL, ".", st);
+    if (root == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    tree_run(ctx, root, threads);
+    if (!ctx->stop && ctx->err == 0) {
+        if (rmdir(path) == -1) {
+            tree_error(ctx, NULL, NULL, errno);
+        } else {
+            ctx->done++;
+        }
+    }
+    tree_result(L, ctx);
+    if (!lua_isnil(L, -2)) {
+        lua_pop(L, 1); /* just the count, no bytes */
+        return 1;
+    }
+    return 2;
+}
+
+/*
+ remove_tree(path, opts) -- `rm -rf`, opts: threads, progress, progress_step.
+ Returns the number of removed entries.
+*/
+int deviant_remove_tree(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    int threads      = tree_threads(L, 2);
+
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        lua_pushnumber(L, 1);
+        return 1;
+    }
+
+    tree_ctx_t ctx;
+    tree_init(L, &ctx, TREE_REMOVE, path, 2);
+    int ret = remove_dir_tree(L, &ctx, path, &st, threads);
+    tree_free(&ctx);
+    return ret;
+}
+
+static int copy_any_tree(lua_State *L, tree_ctx_t *ctx, const char *src, const char *dst, struct stat *st,
+                         int threads) {
+    if (!S_ISDIR(st->st_mode)) {
+        char *buf = malloc(WALK_DENTS_BUF_SIZE);
+        if (buf == NULL) {
+            tree_stop(ctx, TREE_OOM);
+        } else if (copy_entry(ctx, AT_FDCWD, src, AT_FDCWD, dst, st, buf) == -1) {
+            ctx->err = errno;
+            snprintf(ctx->err_path, sizeof(ctx->err_path), "%s", dst);
+        } else {
+            ctx->done = 1;
+        }
+        free(buf);
+        return tree_result(L, ctx);
+    }
+
+    if (mkdir(dst, (st->st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", dst, strerror(errno));
+        return 2;
+    }
+    ctx->src_fd = open(src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    ctx->dst_fd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat dst_st;
+    if (ctx->src_fd == -1 || ctx->dst_fd == -1 || fstat(ctx->dst_fd, &dst_st) == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", ctx->src_fd == -1 ? src : dst, strerror(errno));
+        return 2;
+    }
+    ctx->dst_dev      = dst_st.st_dev;
+    ctx->dst_ino      = dst_st.st_ino;
+    tree_node_t *root = node_new(NULL, NULL, ".", st);
+    if (root == NULL) {
+        tree_stop(ctx, TREE_OOM);
+    } else {
+        tree_run(ctx, root, threads);
+    }
+    return tree_result(L, ctx);
+}
+
+/*
+ copy_tree(src, dst, opts) -- `cp -r`, opts: threads, progress, progress_step,
+ reflink (try FICLONE first, default true), preserve (timestamps, default false).
+
+ `dst` is the path of the copy, not the directory to put it into;
+ if it's an existing directory, `src` contents are merged into it.
+ Files are copied with copy_file_range, falling back to read/write.
+ Returns the number of copied entries and bytes.
+*/
+int deviant_copy_tree(lua_State *L) {
+    const char *src = luaL_checkstring(L, 1);
+    const char *dst = luaL_checkstring(L, 2);
+    int threads     = tree_threads(L, 3);
+
+    struct stat st;
+    if (lstat(src, &st) == -1) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", src, strerror(errno));
+        return 2;
+    }
+    tree_ctx_t ctx;
+    tree_init(L, &ctx, TREE_COPY, src, 3);
+    int ret = copy_any_tree(L, &ctx, src, dst, &st, threads);
+    tree_free(&ctx);
+    return ret;
+}
+
+/*
+ mkdir_p(path, mode) -- `mkdir -p`, mode is an octal string, "0777" by default.
+ Each component is created and opened relative to the previous one.
+*/
+int deviant_mkdir_p(lua_State *L) {
+    const char *path     = luaL_checkstring(L, 1);
+    const char *mode_str = luaL_optstring(L, 2, "0777");
+    mode_t mode          = strtol(mode_str, NULL, 8);
+
+    char buf[PATH_MAX];
+    if (strlen(path) >= sizeof(buf)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENAMETOOLONG));
+        return 2;
+    }
+    strcpy(buf, path);
+    int fd = AT_FDCWD;
+    if (buf[0] == '/') {
+        fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    }
+    char *save = NULL;
+    for (char *name = strtok_r(buf, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+        int next = -1;
+        if (mkdirat(fd, name, mode) == 0 || errno == EEXIST) {
+            next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        int err = errno;
+        if (fd != AT_FDCWD) {
+            close(fd);
+        }
+        if (next == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(err));
+            return 2;
+        }
+        fd = next;
+    }
+    if (fd != AT_FDCWD) {
+        close(fd);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
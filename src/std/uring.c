@@ -0,0 +1,1162 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ io_uring based I/O.
+
+ There is no liburing in the build, so the ring is set up with the raw
+ syscalls. `new` returns nil and an error when io_uring is not available
+ (old kernels, or it's disabled by seccomp or `kernel.io_uring_disabled`),
+ callers are expected to fall back to the plain syscalls then.
+
+ Async primitives: `read`, `write`, `recv`, `send`, `accept`, `splice` and `poll`
+ queue a request and return its id. Queued requests are submitted in one go
+ by `submit` or `wait`, and `wait` returns the completions as an array of
+ `{ id = id, res = res, data = data }` tables, where `res` is the syscall's
+ result (a negative errno on failure, `err` has the message then), and `data`
+ is what `read` or `recv` got.
+
+ With `opts.buffers` the ring registers that many fixed buffers of
+ `opts.buffer_size` bytes, reads that fit in one use them instead of
+ allocating a buffer per request.
+
+ Two batched operations are built on top of it:
+
+ * `read_files(paths)` opens, stats, reads and closes a bunch of files,
+   with three `io_uring_enter` calls per batch of files instead of
+   a handful of syscalls per file.
+
+ * `send_file(fd, path)` sends a file to a socket with `splice` through a pipe,
+   so the content never gets copied to the user space. Each chunk of up to
+   the pipe's size is a linked `splice -> poll -> splice` chain, i.e. a single
+   `io_uring_enter` call. The poll can be limited with a linked timeout,
+   so that a client which stops reading doesn't keep it waiting forever.
+
+ These two need the ring to be idle: there must be no async requests in flight.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define URING_MT              "STD:Uring"
+#define URING_DEFAULT_ENTRIES 256
+#define URING_MAX_ENTRIES     4096
+#define URING_DEFAULT_BUFSIZE (64 * 1024)
+#define URING_MAX_BUFFERS     1024
+#define URING_PIPE_SIZE       (1024 * 1024)
+
+enum {
+    OP_FREE = 0,
+    OP_READ,
+    OP_WRITE,
+    OP_RECV,
+    OP_SEND,
+    OP_ACCEPT,
+    OP_SPLICE,
+    OP_POLL,
+};
+
+typedef struct {
+    uint8_t op;
+    int32_t buf_index; /* fixed buffer, or -1 */
+    char *buf;         /* data of the request, NULL for a fixed buffer */
+    uint32_t next_free;
+} uring_req;
+
+typedef struct {
+    int fd;
+    unsigned features;
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned pending; /* queued, but not submitted yet */
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* async requests */
+    uring_req *reqs;
+    uint32_t nreqs;
+    uint32_t free_req;
+    uint32_t inflight;
+    /* fixed buffers */
+    char *fixed;
+    size_t fixed_size;
+    uint32_t nfixed;
+    int32_t *fixed_free; /* stack of free fixed buffers */
+    uint32_t fixed_top;
+    /* stats */
+    uint64_t enters;
+    uint64_t submitted;
+    uint64_t completed;
+} uring_t;
+
+/*------------------------------ the ring ----------------------------------*/
+
+static int sys_enter(uring_t *r, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    r->enters++;
+    return (int)syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* Submits the queued requests, and waits for `wait_nr` completions */
+static int ring_submit(uring_t *r, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int ret = sys_enter(r, r->pending, wait_nr, flags, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        r->submitted += ret;
+        r->pending -= (unsigned)ret < r->pending ? (unsigned)ret : r->pending;
+        return ret;
+    }
+}
+
+static struct io_uring_sqe *ring_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail;
+    if (tail - head >= *r->sq_entries) {
+        if (ring_submit(r, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= *r->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned idx             = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+static struct io_uring_cqe *ring_peek(uring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_advance(uring_t *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+    r->completed++;
+}
+
+/* Waits for a completion, returns it or NULL on error, which is in errno */
+static struct io_uring_cqe *ring_wait(uring_t *r) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = ring_peek(r)) == NULL) {
+        int ret = ring_submit(r, 1);
+        if (ret < 0) {
+            errno = -ret;
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+static void ring_free(uring_t *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->reqs) {
+        for (uint32_t i = 0; i < r->nreqs; i++) {
+            free(r->reqs[i].buf);
+        }
+        free(r->reqs);
+    }
+    free(r->fixed);
+    free(r->fixed_free);
+    memset(r, 0, sizeof(uring_t));
+    r->fd = -1;
+}
+
+static int ring_init(uring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+    r->features = p.features;
+    r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        return -errno;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr =
+            mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            return -errno;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return -errno;
+    }
+    char *sq      = r->sq_ptr;
+    char *cq      = r->cq_ptr;
+    r->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* there can't be more requests in flight than the CQ has room for */
+    r->nreqs = p.cq_entries;
+    r->reqs  = calloc(r->nreqs, sizeof(uring_req));
+    if (r->reqs == NULL) {
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < r->nreqs; i++) {
+        r->reqs[i].next_free = i + 1;
+        r->reqs[i].buf_index = -1;
+    }
+    r->free_req = 0;
+    return 0;
+}
+
+static int ring_register_buffers(uring_t *r, uint32_t count, size_t size) {
+    r->fixed      = aligned_alloc(4096, ((count * size + 4095) / 4096) * 4096);
+    r->fixed_free = malloc(count * sizeof(int32_t));
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    if (r->fixed == NULL || r->fixed_free == NULL || iov == NULL) {
+        free(iov);
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].iov_base  = r->fixed + i * size;
+        iov[i].iov_len   = size;
+        r->fixed_free[i] = count - 1 - i;
+    }
+    int ret = (int)syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, count);
+    free(iov);
+    if (ret < 0) {
+        return -errno;
+    }
+    r->nfixed     = count;
+    r->fixed_size = size;
+    r->fixed_top  = count;
+    return 0;
+}
+
+static int32_t fixed_get(uring_t *r, size_t len) {
+    if (r->fixed_top == 0 || len > r->fixed_size) {
+        return -1;
+    }
+    return r->fixed_free[--r->fixed_top];
+}
+
+static void fixed_put(uring_t *r, int32_t idx) {
+    if (idx >= 0) {
+        r->fixed_free[r->fixed_top++] = idx;
+    }
+}
+
+/*---------------------------- async requests ------------------------------*/
+
+static uring_t *check_uring(lua_State *L) {
+    uring_t *r = (uring_t *)luaL_checkudata(L, 1, URING_MT);
+    if (r->fd < 0) {
+        luaL_error(L, "ring is closed");
+    }
+    return r;
+}
+
+static int push_errno(lua_State *L, int err) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+}
+
+/*
+ Takes a request slot and an SQE for it, pushes nothing on success,
+ returns NULL with nil and an error pushed otherwise.
+*/
+static struct io_uring_sqe *req_start(lua_State *L, uring_t *r, uint8_t op, uint32_t *id) {
+    if (r->free_req >= r->nreqs) {
+        lua_pushnil(L);
+        lua_pushstring(L, "too many requests in flight");
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    if (sqe == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, "submission queue is full");
+        return NULL;
+    }
+    *id              = r->free_req;
+    uring_req *req   = &r->reqs[*id];
+    r->free_req      = req->next_free;
+    req->op          = op;
+    req->buf         = NULL;
+    req->buf_index   = -1;
+    sqe->user_data   = *id;
+    r->inflight++;
+    return sqe;
+}
+
+static void req_done(uring_t *r, uint32_t id) {
+    uring_req *req = &r->reqs[id];
+    free(req->buf);
+    fixed_put(r, req->buf_index);
+    req->buf       = NULL;
+    req->buf_index = -1;
+    req->op        = OP_FREE;
+    req->next_free = r->free_req;
+    r->free_req    = id;
+    r->inflight--;
+}
+
+static int push_id(lua_State *L, uint32_t id) {
+    lua_pushinteger(L, id + 1);
+    return 1;
+}
+
+/* Reads (or receives, with `op` == OP_RECV) up to `size` bytes */
+static int queue_read(lua_State *L, uint8_t op) {
+    uring_t *r  = check_uring(L);
+    int fd      = luaL_checkinteger(L, 2);
+    size_t size = luaL_optinteger(L, 3, URING_DEFAULT_BUFSIZE);
+    int64_t off = luaL_optnumber(L, 4, -1);
+    uint32_t id;
+    struct io_uring_sqe *sqe = req_start(L, r, op, &id);
+    if (sqe == NULL) {
+        return 2;
+    }
+    uring_req *req = &r->reqs[id];
+    char *buf;
+    if (op == OP_READ && (req->buf_index = fixed_get(r, size)) >= 0) {
+        buf            = r->fixed + (size_t)req->buf_index * r->fixed_size;
+        sqe->opcode    = IORING_OP_READ_FIXED;
+        sqe->buf_index = req->buf_index;
+    } else {
+        buf = req->buf = malloc(size > 0 ? size : 1);
+        if (buf == NULL) {
+            /* the SQE is already queued, make it a no-op */
+            sqe->opcode = IORING_OP_NOP;
+            lua_pushnil(L);
+            lua_pushstring(L, "out of memory");
+            return 2;
+        }
+        sqe->opcode = op == OP_RECV ? IORING_OP_RECV : IORING_OP_READ;
+    }
+    sqe->fd   = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len  = size;
+    sqe->off  = op == OP_RECV ? 0 : (uint64_t)off;
+    return push_id(L, id);
+}
+
+/* Writes (or sends, with `op` == OP_SEND) `data` */
+static int queue_write(lua_State *L, uint8_t op) {
+    uring_t *r       = check_uring(L);
+    int fd           = luaL_checkinteger(L, 2);
+    size_t len       = 0;
+    const char *data = luaL_checklstring(L, 3, &len);
+    int64_t off      = luaL_optnumber(L, 4, -1);
+    uint32_t id;
+    struct io_uring_sqe *sqe = req_start(L, r, op, &id);
+    if (sqe == NULL) {
+        return 2;
+    }
+    uring_req *req = &r->reqs[id];
+    req->buf       = malloc(len > 0 ? len : 1);
+    if (req->buf == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    memcpy(req->buf, data, len);
+    sqe->opcode = op == OP_SEND ? IORING_OP_SEND : IORING_OP_WRITE;
+    sqe->fd     = fd;
+    sqe->addr   = (uint64_t)(uintptr_t)req->buf;
+    sqe->len    = len;
+    sqe->off    = op == OP_SEND ? 0 : (uint64_t)off;
+    if (op == OP_SEND) {
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    return push_id(L, id);
+}
+
+/* read(fd, size, offset) -- `offset` defaults to the current file position */
+static int uring_read(lua_State *L) { return queue_read(L, OP_READ); }
+
+/* recv(fd, size) */
+static int uring_recv(lua_State *L) { return queue_read(L, OP_RECV); }
+
+/* write(fd, data, offset) */
+static int uring_write(lua_State *L) { return queue_write(L, OP_WRITE); }
+
+/* send(fd, data) */
+static int uring_send(lua_State *L) { return queue_write(L, OP_SEND); }
+
+/* accept(fd) -- the result is the accepted fd */
+static int uring_accept(lua_State *L) {
+    uring_t *r = check_uring(L);
+    int fd     = luaL_checkinteger(L, 2);
+    uint32_t id;
+    struct io_uring_sqe *sqe = req_start(L, r, OP_ACCEPT, &id);
+    if (sqe == NULL) {
+        return 2;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return push_id(L, id);
+}
+
+/* splice(fd_in, off_in, fd_out, off_out, len) -- offsets are -1 for pipes and sockets */
+static int uring_splice(lua_State *L) {
+    uring_t *r      = check_uring(L);
+    int fd_in       = luaL_checkinteger(L, 2);
+    int64_t off_in  = luaL_checknumber(L, 3);
+    int fd_out      = luaL_checkinteger(L, 4);
+    int64_t off_out = luaL_checknumber(L, 5);
+    size_t len      = luaL_checkinteger(L, 6);
+    uint32_t id;
+    struct io_uring_sqe *sqe = req_start(L, r, OP_SPLICE, &id);
+    if (sqe == NULL) {
+        return 2;
+    }
+    sqe->opcode        = IORING_OP_SPLICE;
+    sqe->splice_fd_in  = fd_in;
+    sqe->splice_off_in = (uint64_t)off_in;
+    sqe->fd            = fd_out;
+    sqe->off           = (uint64_t)off_out;
+    sqe->len           = len;
+    sqe->splice_flags  = SPLICE_F_MOVE;
+    return push_id(L, id);
+}
+
+/* poll(fd, "r"|"w") -- completes when the fd is readable or writable */
+static int uring_poll(lua_State *L) {
+    uring_t *r       = check_uring(L);
+    int fd           = luaL_checkinteger(L, 2);
+    const char *mode = luaL_optstring(L, 3, "r");
+    uint32_t id;
+    struct io_uring_sqe *sqe = req_start(L, r, OP_POLL, &id);
+    if (sqe == NULL) {
+        return 2;
+    }
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = fd;
+    sqe->poll_events = mode[0] == 'w' ? POLLOUT : POLLIN;
+    return push_id(L, id);
+}
+
+/* submit() -- submits the queued requests without waiting, returns their number */
+static int uring_submit(lua_State *L) {
+    uring_t *r = check_uring(L);
+    int ret    = ring_submit(r, 0);
+    if (ret < 0) {
+        return push_errno(L, -ret);
+    }
+    lua_pushinteger(L, ret);
+    return 1;
+}
+
+/*
+ wait(min, timeout) -- submits the queued requests, waits for at least `min`
+ completions (1 by default, 0 just collects what's there) for up to `timeout`
+ seconds (no limit by default), and returns all the available ones.
+*/
+static int uring_wait(lua_State *L) {
+    uring_t *r         = check_uring(L);
+    unsigned min       = luaL_optinteger(L, 2, 1);
+    lua_Number timeout = luaL_optnumber(L, 3, -1);
+    if (min > r->inflight) {
+        min = r->inflight;
+    }
+    int ret;
+    if (timeout >= 0 && min > 0 && (r->features & IORING_FEAT_EXT_ARG)) {
+        struct __kernel_timespec ts = {
+            .tv_sec  = (int64_t)timeout,
+            .tv_nsec = (int64_t)((timeout - (int64_t)timeout) * 1e9),
+        };
+        struct io_uring_getevents_arg arg = {.ts = (uint64_t)(uintptr_t)&ts};
+        do {
+            ret = sys_enter(r, r->pending, min, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        } while (ret < 0 && errno == EINTR);
+        if (ret >= 0) {
+            r->submitted += ret;
+            r->pending -= (unsigned)ret < r->pending ? (unsigned)ret : r->pending;
+        } else if (errno != ETIME) {
+            return push_errno(L, errno);
+        }
+    } else {
+        ret = ring_submit(r, min);
+        if (ret < 0) {
+            return push_errno(L, -ret);
+        }
+    }
+
+    lua_newtable(L);
+    int n = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = ring_peek(r)) != NULL) {
+        uint32_t id = (uint32_t)cqe->user_data;
+        int res     = cqe->res;
+        ring_advance(r);
+        if (id >= r->nreqs || r->reqs[id].op == OP_FREE) {
+            continue;
+        }
+        uring_req *req = &r->reqs[id];
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, id + 1);
+        lua_setfield(L, -2, "id");
+        lua_pushinteger(L, res);
+        lua_setfield(L, -2, "res");
+        if (res < 0) {
+            lua_pushstring(L, strerror(-res));
+            lua_setfield(L, -2, "err");
+        } else if (req->op == OP_READ || req->op == OP_RECV) {
+            const char *buf = req->buf ? req->buf : r->fixed + (size_t)req->buf_index * r->fixed_size;
+            lua_pushlstring(L, buf, res);
+            lua_setfield(L, -2, "data");
+        }
+        lua_rawseti(L, -2, ++n);
+        req_done(r, id);
+    }
+    return 1;
+}
+
+/*---------------------------- batched helpers -----------------------------*/
+
+typedef struct {
+    const char *path;
+    int fd;
+    int err;
+    size_t size;
+    char *buf;
+    int32_t buf_index;
+    struct statx stx;
+} file_job;
+
+/*
+ Reads the rest of a file with pread, after a short read, or when the file
+ has no size, like procfs ones do. `job->buf` has the first `done` bytes.
+*/
+static int read_rest(file_job *job, size_t done) {
+    size_t cap = job->size > done ? job->size : done + 4096;
+    char *buf  = realloc(job->buf, cap);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    job->buf = buf;
+    for (;;) {
+        if (done == cap) {
+            buf = realloc(job->buf, cap * 2);
+            if (buf == NULL) {
+                return ENOMEM;
+            }
+            job->buf = buf;
+            cap *= 2;
+        }
+        ssize_t n = pread(job->fd, job->buf + done, cap - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    job->size = done;
+    return 0;
+}
+
+static int read_batch(uring_t *r, file_job *jobs, size_t count) {
+    /* 1. open & stat */
+    for (size_t i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = ring_sqe(r);
+        sqe->opcode              = IORING_OP_OPENAT;
+        sqe->fd                  = AT_FDCWD;
+        sqe->addr                = (uint64_t)(uintptr_t)jobs[i].path;
+        sqe->open_flags          = O_RDONLY | O_CLOEXEC;
+        sqe->user_data           = 2 * i;
+        sqe                      = ring_sqe(r);
+        sqe->opcode              = IORING_OP_STATX;
+        sqe->fd                  = AT_FDCWD;
+        sqe->addr                = (uint64_t)(uintptr_t)jobs[i].path;
+        sqe->len                 = STATX_SIZE | STATX_TYPE;
+        sqe->off                 = (uint64_t)(uintptr_t)&jobs[i].stx;
+        sqe->user_data           = 2 * i + 1;
+    }
+    int ret = ring_submit(r, 2 * count);
+    if (ret < 0) {
+        return -ret;
+    }
+    for (size_t done = 0; done < 2 * count; done++) {
+        struct io_uring_cqe *cqe = ring_wait(r);
+        if (cqe == NULL) {
+            return errno;
+        }
+        file_job *job = &jobs[cqe->user_data / 2];
+        if (cqe->user_data % 2 == 0) {
+            if (cqe->res < 0) {
+                job->err = -cqe->res;
+            } else {
+                job->fd = cqe->res;
+            }
+        } else if (cqe->res < 0) {
+            job->err = -cqe->res;
+        }
+        ring_advance(r);
+    }
+
+    /* 2. read, each read is linked with the close of its file */
+    unsigned queued = 0;
+    for (size_t i = 0; i < count; i++) {
+        file_job *job = &jobs[i];
+        if (job->fd < 0) {
+            continue;
+        }
+        if (!job->err && S_ISDIR(job->stx.stx_mode)) {
+            job->err = EISDIR;
+        }
+        job->size = job->stx.stx_size;
+        if (job->err || job->size == 0) {
+            /* closed below, files without size are read with pread */
+            continue;
+        }
+        struct io_uring_sqe *sqe = ring_sqe(r);
+        job->buf_index           = fixed_get(r, job->size);
+        if (job->buf_index >= 0) {
+            sqe->opcode    = IORING_OP_READ_FIXED;
+            sqe->buf_index = job->buf_index;
+            sqe->addr      = (uint64_t)(uintptr_t)(r->fixed + (size_t)job->buf_index * r->fixed_size);
+        } else {
+            job->buf = malloc(job->size);
+            if (job->buf == NULL) {
+                job->err    = ENOMEM;
+                sqe->opcode = IORING_OP_NOP;
+            } else {
+                sqe->opcode = IORING_OP_READ;
+                sqe->addr   = (uint64_t)(uintptr_t)job->buf;
+            }
+        }
+        sqe->fd        = job->fd;
+        sqe->len       = job->size;
+        sqe->off       = 0;
+        sqe->flags     = IOSQE_IO_LINK;
+        sqe->user_data = 2 * i;
+        sqe            = ring_sqe(r);
+        sqe->opcode    = IORING_OP_CLOSE;
+        sqe->fd        = job->fd;
+        sqe->user_data = 2 * i + 1;
+        queued += 2;
+    }
+    ret = ring_submit(r, queued);
+    if (ret < 0) {
+        return -ret;
+    }
+    for (unsigned done = 0; done < queued; done++) {
+        struct io_uring_cqe *cqe = ring_wait(r);
+        if (cqe == NULL) {
+            return errno;
+        }
+        file_job *job = &jobs[cqe->user_data / 2];
+        if (cqe->user_data % 2 == 0) {
+            if (cqe->res < 0) {
+                job->err = -cqe->res;
+            } else if ((size_t)cqe->res < job->size) {
+                /* the file has changed since statx, the close is canceled then */
+                if (job->buf_index >= 0) {
+                    job->buf = malloc(cqe->res > 0 ? cqe->res : 1);
+                    if (job->buf) {
+                        memcpy(job->buf, r->fixed + (size_t)job->buf_index * r->fixed_size, cqe->res);
+                    }
+                    fixed_put(r, job->buf_index);
+                    job->buf_index = -1;
+                }
+                job->err = job->buf ? read_rest(job, cqe->res) : ENOMEM;
+            }
+        } else if (cqe->res == 0) {
+            job->fd = -1;
+        }
+        ring_advance(r);
+    }
+
+    /* 3. whatever is still open: failed, canceled or empty files */
+    for (size_t i = 0; i < count; i++) {
+        file_job *job = &jobs[i];
+        if (job->fd < 0) {
+            continue;
+        }
+        if (!job->err && job->size == 0) {
+            job->err = read_rest(job, 0);
+        }
+        close(job->fd);
+        job->fd = -1;
+    }
+    return 0;
+}
+
+/*
+ read_files(paths) -- reads the files, returns a table of their contents
+ keyed by path, and a table of errors for the files that failed, if any.
+*/
+static int uring_read_files(lua_State *L) {
+    uring_t *r = check_uring(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (r->inflight > 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "ring is busy");
+        return 2;
+    }
+    size_t total = lua_objlen(L, 2);
+    size_t batch = *r->sq_entries / 2;
+    if (batch > total) {
+        batch = total;
+    }
+    file_job *jobs = calloc(batch > 0 ? batch : 1, sizeof(file_job));
+    if (jobs == NULL) {
+        return push_errno(L, ENOMEM);
+    }
+    lua_settop(L, 2);
+    lua_createtable(L, 0, total); /* 3: contents */
+    lua_newtable(L);              /* 4: errors */
+    int failed = 0;
+    for (size_t first = 1; first <= total; first += batch) {
+        size_t count = total - first + 1 < batch ? total - first + 1 : batch;
+        for (size_t i = 0; i < count; i++) {
+            lua_rawgeti(L, 2, first + i);
+            /* the strings are kept alive by the `paths` table */
+            jobs[i].path      = luaL_checkstring(L, -1);
+            jobs[i].fd        = -1;
+            jobs[i].err       = 0;
+            jobs[i].size      = 0;
+            jobs[i].buf       = NULL;
+            jobs[i].buf_index = -1;
+            lua_pop(L, 1);
+        }
+        int err = read_batch(r, jobs, count);
+        for (size_t i = 0; i < count; i++) {
+            file_job *job = &jobs[i];
+            if (job->fd >= 0) {
+                close(job->fd);
+            }
+            if (err || job->err) {
+                lua_pushstring(L, strerror(err ? err : job->err));
+                lua_setfield(L, 4, job->path);
+                failed = 1;
+            } else {
+                const char *buf = job->buf_index >= 0 ? r->fixed + (size_t)job->buf_index * r->fixed_size : job->buf;
+                lua_pushlstring(L, buf ? buf : "", job->size);
+                lua_setfield(L, 3, job->path);
+            }
+            fixed_put(r, job->buf_index);
+            free(job->buf);
+        }
+        if (err) {
+            break;
+        }
+    }
+    free(jobs);
+    if (!failed) {
+        lua_pop(L, 1);
+        return 1;
+    }
+    return 2;
+}
+
+/* Reaps the completions of a chain, `res` gets the results by user_data */
+static int reap_chain(uring_t *r, unsigned count, int *res) {
+    int ret = ring_submit(r, count);
+    if (ret < 0) {
+        return -ret;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_cqe *cqe = ring_wait(r);
+        if (cqe == NULL) {
+            return errno;
+        }
+        if (cqe->user_data < count) {
+            res[cqe->user_data] = cqe->res;
+        }
+        ring_advance(r);
+    }
+    return 0;
+}
+
+static void queue_splice(uring_t *r, int fd_in, int64_t off_in, int fd_out, unsigned len, uint64_t id, int link) {
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode              = IORING_OP_SPLICE;
+    sqe->splice_fd_in        = fd_in;
+    sqe->splice_off_in       = (uint64_t)off_in;
+    sqe->fd                  = fd_out;
+    sqe->off                 = (uint64_t)-1;
+    sqe->len                 = len;
+    sqe->splice_flags        = SPLICE_F_MOVE;
+    sqe->flags               = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data           = id;
+}
+
+static void queue_pollout(uring_t *r, int fd, uint64_t id) {
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode              = IORING_OP_POLL_ADD;
+    sqe->fd                  = fd;
+    sqe->poll_events         = POLLOUT;
+    sqe->flags               = IOSQE_IO_LINK;
+    sqe->user_data           = id;
+}
+
+/*
+ Queues the poll and its timeout: when the client doesn't take more data
+ for `ts`, the poll and the rest of the chain are canceled. Without `ts`
+ the poll waits for as long as it takes.
+*/
+static unsigned queue_timed_pollout(uring_t *r, int fd, uint64_t id, struct __kernel_timespec *ts, uint64_t ts_id) {
+    queue_pollout(r, fd, id);
+    if (ts == NULL) {
+        return 1;
+    }
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode              = IORING_OP_LINK_TIMEOUT;
+    sqe->fd                  = -1;
+    sqe->addr                = (uint64_t)(uintptr_t)ts;
+    sqe->len                 = 1;
+    sqe->flags               = IOSQE_IO_LINK;
+    sqe->user_data           = ts_id;
+    return 2;
+}
+
+/* Moves `len` bytes, which are already in the pipe, to the socket */
+static int drain_pipe(uring_t *r, int pipe_out, int sock, size_t len, struct __kernel_timespec *ts) {
+    while (len > 0) {
+        int res[3]     = {0, 0, 0};
+        unsigned count = 1 + queue_timed_pollout(r, sock, 0, ts, 2);
+        queue_splice(r, pipe_out, -1, sock, len, 1, 0);
+        int err = reap_chain(r, count, res);
+        if (err) {
+            return err;
+        }
+        if (res[2] == -ETIME) {
+            return ETIMEDOUT;
+        }
+        if (res[0] < 0 && res[0] != -ECANCELED) {
+            return -res[0];
+        }
+        if (res[1] < 0 && res[1] != -EAGAIN && res[1] != -ECANCELED) {
+            return -res[1];
+        }
+        if (res[0] > 0 && (res[0] & (POLLERR | POLLHUP))) {
+            return EPIPE;
+        }
+        if (res[1] > 0) {
+            len -= res[1];
+        }
+    }
+    return 0;
+}
+
+/*
+ send_file(fd, path, offset, len, timeout) -- sends the file (or `len` bytes
+ of it from `offset`) to the socket `fd`, returns the number of bytes sent.
+ With `timeout` it fails when the client doesn't take any data for that many
+ seconds, otherwise it waits for a slow client for as long as it takes.
+*/
+static int uring_send_file(lua_State *L) {
+    uring_t *r         = check_uring(L);
+    int sock           = luaL_checkinteger(L, 2);
+    const char *path   = luaL_checkstring(L, 3);
+    int64_t offset     = luaL_optnumber(L, 4, 0);
+    int64_t len        = luaL_optnumber(L, 5, -1);
+    lua_Number timeout = luaL_optnumber(L, 6, -1);
+
+    struct __kernel_timespec ts = {
+        .tv_sec  = (int64_t)timeout,
+        .tv_nsec = (int64_t)((timeout - (int64_t)timeout) * 1e9),
+    };
+    struct __kernel_timespec *pts = timeout >= 0 ? &ts : NULL;
+    if (r->inflight > 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "ring is busy");
+        return 2;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return push_errno(L, errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return push_errno(L, err);
+    }
+    if (len < 0 || offset + len > st.st_size) {
+        len = st.st_size > offset ? st.st_size - offset : 0;
+    }
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        int err = errno;
+        close(fd);
+        return push_errno(L, err);
+    }
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    if (pipe_size <= 0) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+    if (pipe_size <= 0) {
+        pipe_size = 65536;
+    }
+
+    int err      = 0;
+    int64_t sent = 0;
+    while (sent < len) {
+        unsigned chunk = len - sent < pipe_size ? (unsigned)(len - sent) : (unsigned)pipe_size;
+        int res[4]     = {0, 0, 0, 0};
+        queue_splice(r, fd, offset + sent, pipefd[1], chunk, 0, 1);
+        unsigned count = 2 + queue_timed_pollout(r, sock, 1, pts, 3);
+        queue_splice(r, pipefd[0], -1, sock, chunk, 2, 0);
+        if ((err = reap_chain(r, count, res)) != 0) {
+            break;
+        }
+        if (res[3] == -ETIME) {
+            err = ETIMEDOUT;
+            break;
+        }
+        if (res[0] <= 0) {
+            err = res[0] < 0 ? -res[0] : EIO; /* EOF: the file has been truncated */
+            break;
+        }
+        if (res[1] > 0 && (res[1] & (POLLERR | POLLHUP))) {
+            err = EPIPE;
+            break;
+        }
+        int out = res[2] > 0 ? res[2] : 0;
+        if (res[2] < 0 && res[2] != -EAGAIN && res[2] != -ECANCELED) {
+            err = -res[2];
+            break;
+        }
+        /* short splices and the canceled rest of the chain */
+        if (out < res[0] && (err = drain_pipe(r, pipefd[0], sock, res[0] - out, pts)) != 0) {
+            break;
+        }
+        sent += res[0];
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(fd);
+    if (err) {
+        return push_errno(L, err);
+    }
+    lua_pushnumber(L, sent);
+    return 1;
+}
+
+/*------------------------------- the rest ---------------------------------*/
+
+/*
+ new(entries, opts) -- creates a ring with `entries` submission queue entries
+ (256 by default). `opts.buffers` and `opts.buffer_size` set up fixed buffers.
+*/
+static int uring_new(lua_State *L) {
+    unsigned entries = luaL_optinteger(L, 1, URING_DEFAULT_ENTRIES);
+    if (entries < 2 || entries > URING_MAX_ENTRIES) {
+        return luaL_argerror(L, 1, "invalid number of entries");
+    }
+    lua_Integer buffers = 0;
+    lua_Integer bufsize = URING_DEFAULT_BUFSIZE;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "buffers");
+        buffers = luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 2, "buffer_size");
+        bufsize = luaL_optinteger(L, -1, URING_DEFAULT_BUFSIZE);
+        lua_pop(L, 2);
+    }
+    if (buffers < 0 || buffers > URING_MAX_BUFFERS || bufsize <= 0) {
+        return luaL_argerror(L, 2, "invalid fixed buffers config");
+    }
+    uring_t *r = (uring_t *)lua_newuserdata(L, sizeof(uring_t));
+    memset(r, 0, sizeof(uring_t));
+    r->fd = -1;
+    luaL_getmetatable(L, URING_MT);
+    lua_setmetatable(L, -2);
+    int err = ring_init(r, entries);
+    if (err == 0 && buffers > 0) {
+        err = ring_register_buffers(r, buffers, bufsize);
+    }
+    if (err) {
+        ring_free(r);
+        return push_errno(L, -err);
+    }
+    return 1;
+}
+
+/*
+ shared() -- returns the ring of the current process, which is created
+ on the first call, or nil and an error if io_uring is not available.
+ Rings must not be used across forks, so each process gets its own one.
+ It's meant for the batched operations, don't leave async requests in it.
+ There are no fixed buffers in it: `send_file` doesn't use them, and `read_files`
+ copies the data out of them anyway, so they'd just pin 4Mb in every process.
+*/
+static int uring_shared(lua_State *L) {
+    static pid_t owner = 0;
+    pid_t pid          = getpid();
+    lua_getfield(L, LUA_REGISTRYINDEX, URING_MT ":shared");
+    if (owner == pid && !lua_isnil(L, -1)) {
+        if (lua_isstring(L, -1)) {
+            lua_pushnil(L);
+            lua_insert(L, -2);
+            return 2;
+        }
+        return 1;
+    }
+    lua_pop(L, 1);
+    lua_settop(L, 0);
+    lua_pushinteger(L, URING_DEFAULT_ENTRIES);
+    int n = uring_new(L);
+    /* the ring, or the error: there is no point in trying again after a failure */
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, URING_MT ":shared");
+    owner = pid;
+    return n;
+}
+
+/* available() -- tells if io_uring can be used */
+static int uring_available(lua_State *L) {
+    uring_t r;
+    memset(&r, 0, sizeof(r));
+    int err = ring_init(&r, 2);
+    ring_free(&r);
+    lua_pushboolean(L, err == 0);
+    if (err) {
+        lua_pushstring(L, strerror(-err));
+        return 2;
+    }
+    return 1;
+}
+
+static int uring_stats(lua_State *L) {
+    uring_t *r = check_uring(L);
+    lua_createtable(L, 0, 5);
+    lua_pushnumber(L, r->enters);
+    lua_setfield(L, -2, "enters");
+    lua_pushnumber(L, r->submitted);
+    lua_setfield(L, -2, "submitted");
+    lua_pushnumber(L, r->completed);
+    lua_setfield(L, -2, "completed");
+    lua_pushinteger(L, r->inflight);
+    lua_setfield(L, -2, "inflight");
+    lua_pushinteger(L, r->nfixed);
+    lua_setfield(L, -2, "buffers");
+    return 1;
+}
+
+static int uring_getfd(lua_State *L) {
+    uring_t *r = (uring_t *)luaL_checkudata(L, 1, URING_MT);
+    lua_pushinteger(L, r->fd);
+    return 1;
+}
+
+static int uring_gc(lua_State *L) {
+    uring_t *r = (uring_t *)luaL_checkudata(L, 1, URING_MT);
+    if (r->fd >= 0) {
+        ring_free(r);
+    }
+    return 0;
+}
+
+static luaL_Reg methods[] = {
+    {"read",       uring_read      },
+    {"write",      uring_write     },
+    {"recv",       uring_recv      },
+    {"send",       uring_send      },
+    {"accept",     uring_accept    },
+    {"splice",     uring_splice    },
+    {"poll",       uring_poll      },
+    {"submit",     uring_submit    },
+    {"wait",       uring_wait      },
+    {"read_files", uring_read_files},
+    {"send_file",  uring_send_file },
+    {"stats",      uring_stats     },
+    {"getfd",      uring_getfd     },
+    {"close",      uring_gc        },
+    {NULL,         NULL            }
+};
+
+static luaL_Reg funcs[] = {
+    {"new",       uring_new      },
+    {"shared",    uring_shared   },
+    {"available", uring_available},
+    {NULL,        NULL           }
+};
+
+int luaopen_std_uring(lua_State *L) {
+    luaL_newmetatable(L, URING_MT);
+    lua_pushcfunction(L, uring_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
@@ -0,0 +1,557 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Directory walker for `std.fs.walk` & co.
+
+ Entries are read with getdents64 and stat'ed with fstatat relative
+ to the directory's fd, so there are no full path lookups in the kernel,
+ and no Lua calls per entry: the results are collected in C first, and then
+ returned as a handful of column arrays instead of a table per entry.
+ With `stat = false` only the d_type from getdents is used, when the
+ filesystem provides it.
+
+ In recursive mode directories are put into a queue, which can be
+ processed by several threads, each one collecting its own entries.
+
+ `fast_list_dir` lives here too, since it's the same getdents loop.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#include "walk.h"
+
+#define NO_TARGET SIZE_MAX
+
+typedef struct {
+    size_t path;   /* offset of the path in the arena */
+    size_t target; /* offset of the link target in the arena, or NO_TARGET */
+    char mode;
+    mode_t perms;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+} walk_entry_t;
+
+typedef struct {
+    walk_entry_t *items;
+    size_t count;
+    size_t cap;
+    char *arena; /* NUL terminated paths and link targets */
+    size_t arena_len;
+    size_t arena_cap;
+} walk_vec_t;
+
+typedef struct {
+    char *path;
+    int depth;
+} walk_job_t;
+
+typedef struct {
+    int root_fd;
+    int do_stat;
+    int hidden;
+    int resolve_links;
+    int recursive;
+    int max_depth;
+    int oom;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    walk_job_t *jobs;
+    size_t jobs_count;
+    size_t jobs_cap;
+    size_t pending; /* queued and in progress jobs */
+} walk_ctx_t;
+
+typedef struct {
+    walk_ctx_t *ctx;
+    walk_vec_t vec;
+    char *buf;
+    pthread_t thread;
+} walk_thread_t;
+
+static char walk_mode_from_stat(mode_t st_mode) {
+    switch (st_mode & S_IFMT) {
+    case S_IFREG:
+        return 'f';
+    case S_IFDIR:
+        return 'd';
+    case S_IFLNK:
+        return 'l';
+    case S_IFSOCK:
+        return 's';
+    case S_IFBLK:
+        return 'b';
+    case S_IFCHR:
+        return 'c';
+    case S_IFIFO:
+        return 'p';
+    }
+    return 'u';
+}
+
+static char walk_mode_from_dtype(unsigned char d_type) {
+    switch (d_type) {
+    case DT_REG:
+        return 'f';
+    case DT_DIR:
+        return 'd';
+    case DT_LNK:
+        return 'l';
+    case DT_SOCK:
+        return 's';
+    case DT_BLK:
+        return 'b';
+    case DT_CHR:
+        return 'c';
+    case DT_FIFO:
+        return 'p';
+    }
+    return 0;
+}
+
+/* Appends `prefix/name` (or just `name` with an empty prefix) to the arena,
+   returns its offset, or NO_TARGET if we're out of memory. */
+static size_t arena_put(walk_vec_t *vec, const char *prefix, size_t prefix_len, const char *name, size_t name_len) {
+    size_t need = prefix_len + name_len + 2;
+    if (vec->arena_len + need > vec->arena_cap) {
+        size_t cap = vec->arena_cap ? vec->arena_cap * 2 : 64 * 1024;
+        while (cap < vec->arena_len + need) {
+            cap *= 2;
+        }
+        char *arena = realloc(vec->arena, cap);
+        if (arena == NULL) {
+            return NO_TARGET;
+        }
+        vec->arena     = arena;
+        vec->arena_cap = cap;
+    }
+    size_t offset = vec->arena_len;
+    char *dst     = vec->arena + offset;
+    if (prefix_len > 0) {
+        memcpy(dst, prefix, prefix_len);
+        dst[prefix_len] = '/';
+        dst += prefix_len + 1;
+    }
+    memcpy(dst, name, name_len);
+    dst[name_len] = '\0';
+    vec->arena_len += (prefix_len > 0 ? prefix_len + 1 : 0) + name_len + 1;
+    return offset;
+}
+
+static walk_entry_t *vec_push(walk_vec_t *vec) {
+    if (vec->count == vec->cap) {
+        size_t cap          = vec->cap ? vec->cap * 2 : 1024;
+        walk_entry_t *items = realloc(vec->items, cap * sizeof(walk_entry_t));
+        if (items == NULL) {
+            return NULL;
+        }
+        vec->items = items;
+        vec->cap   = cap;
+    }
+    return &vec->items[vec->count++];
+}
+
+static void vec_free(walk_vec_t *vec) {
+    free(vec->items);
+    free(vec->arena);
+}
+
+static void queue_push(walk_ctx_t *ctx, char *path, int depth) {
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->jobs_count == ctx->jobs_cap) {
+        size_t cap       = ctx->jobs_cap ? ctx->jobs_cap * 2 : 256;
+        walk_job_t *jobs = realloc(ctx->jobs, cap * sizeof(walk_job_t));
+        if (jobs == NULL) {
+            ctx->oom = 1;
+            pthread_mutex_unlock(&ctx->lock);
+            free(path);
+            return;
+        }
+        ctx->jobs     = jobs;
+        ctx->jobs_cap = cap;
+    }
+    ctx->jobs[ctx->jobs_count].path  = path;
+    ctx->jobs[ctx->jobs_count].depth = depth;
+    ctx->jobs_count++;
+    ctx->pending++;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void walk_dir(walk_ctx_t *ctx, walk_vec_t *vec, walk_job_t *job, char *buf) {
+    int fd = openat(ctx->root_fd, job->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return; /* unreadable subdirectories are skipped */
+    }
+    const char *prefix = job->path;
+    size_t prefix_len  = strcmp(prefix, ".") == 0 ? 0 : strlen(prefix);
+    int descend        = ctx->recursive && (ctx->max_depth == 0 || job->depth + 1 < ctx->max_depth);
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, fd, buf, WALK_DENTS_BUF_SIZE);
+        if (nread <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (IS_DOT_OR_DOTDOT(name)) {
+                continue;
+            }
+            if (!ctx->hidden && name[0] == '.') {
+                continue;
+            }
+            struct stat st;
+            char mode = walk_mode_from_dtype(d->d_type);
+            if (ctx->do_stat || mode == 0) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue; /* gone already */
+                }
+                mode = walk_mode_from_stat(st.st_mode);
+            }
+            size_t name_len = strlen(name);
+            size_t offset   = arena_put(vec, prefix, prefix_len, name, name_len);
+            walk_entry_t *e = offset == NO_TARGET ? NULL : vec_push(vec);
+            if (e == NULL) {
+                ctx->oom = 1;
+                close(fd);
+                return;
+            }
+            e->path   = offset;
+            e->target = NO_TARGET;
+            e->mode   = mode;
+            if (ctx->do_stat) {
+                e->perms = st.st_mode & 0777;
+                e->uid   = st.st_uid;
+                e->gid   = st.st_gid;
+                e->size  = st.st_size;
+                e->atime = st.st_atime;
+                e->mtime = st.st_mtime;
+            }
+            if (mode == 'l' && ctx->resolve_links) {
+                char target[PATH_MAX];
+                ssize_t len = readlinkat(fd, name, target, sizeof(target) - 1);
+                if (len >= 0) {
+                    e->target = arena_put(vec, NULL, 0, target, len);
+                }
+            }
+            if (mode == 'd' && descend) {
+                char *path = strdup(vec->arena + offset);
+                if (path == NULL) {
+                    ctx->oom = 1;
+                } else {
+                    queue_push(ctx, path, job->depth + 1);
+                }
+            }
+        }
+    }
+    close(fd);
+}
+
+static void *walk_worker(void *arg) {
+    walk_thread_t *t = (walk_thread_t *)arg;
+    walk_ctx_t *ctx  = t->ctx;
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->jobs_count == 0 && ctx->pending > 0) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->jobs_count == 0) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        walk_job_t job = ctx->jobs[--ctx->jobs_count];
+        pthread_mutex_unlock(&ctx->lock);
+
+        walk_dir(ctx, &t->vec, &job, t->buf);
+        free(job.path);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->pending--;
+        if (ctx->pending == 0) {
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+static int opt_boolean(lua_State *L, int idx, const char *name, int def) {
+    int value = def;
+    if (lua_istable(L, idx)) {
+        lua_getfield(L, idx, name);
+        if (!lua_isnil(L, -1)) {
+            value = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return value;
+}
+
+static int opt_integer(lua_State *L, int idx, const char *name, int def) {
+    int value = def;
+    if (lua_istable(L, idx)) {
+        lua_getfield(L, idx, name);
+        if (lua_isnumber(L, -1)) {
+            value = lua_tointeger(L, -1);
+        }
+        lua_pop(L, 1);
+    }
+    return value;
+}
+
+/*
+ walk(path, opts) -- opts are all optional:
+    recursive     -- descend into subdirectories, default false
+    max_depth     -- 1 means only the entries of `path`, 0 is unlimited
+    stat          -- fstatat every entry, default true; without it only `path` & `mode` are returned
+    hidden        -- include dot files, default true
+    resolve_links -- return link targets
+    pattern       -- Lua pattern to filter the entries by name (directories are still walked)
+    threads       -- number of threads for the recursive walk, default 1
+
+ Returns a table of arrays: `path` (relative to `path`), `mode`, and with `stat`:
+ `size`, `perms`, `uid`, `gid`, `atime`, `mtime`, and `target` (sparse) with `resolve_links`.
+ The number of entries is in the `count` field.
+ Entries are in the getdents order, which is arbitrary when `threads` > 1.
+*/
+int deviant_walk(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+
+    walk_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.recursive     = opt_boolean(L, 2, "recursive", 0);
+    ctx.max_depth     = opt_integer(L, 2, "max_depth", 0);
+    ctx.do_stat       = opt_boolean(L, 2, "stat", 1);
+    ctx.hidden        = opt_boolean(L, 2, "hidden", 1);
+    ctx.resolve_links = opt_boolean(L, 2, "resolve_links", 0);
+    int threads       = opt_integer(L, 2, "threads", 1);
+    if (threads < 1 || !ctx.recursive) {
+        threads = 1;
+    }
+    if (threads > WALK_MAX_THREADS) {
+        threads = WALK_MAX_THREADS;
+    }
+
+    ctx.root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx.root_fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    walk_thread_t workers[WALK_MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].buf = malloc(WALK_DENTS_BUF_SIZE);
+        if (workers[i].buf == NULL) {
+            threads = i;
+            break;
+        }
+    }
+    char *root = strdup(".");
+    if (threads == 0 || root == NULL) {
+        free(root);
+        ctx.oom = 1;
+    } else {
+        queue_push(&ctx, root, 0);
+        /* The calling thread is the first worker */
+        for (int i = 1; i < threads; i++) {
+            if (pthread_create(&workers[i].thread, NULL, walk_worker, &workers[i]) == 0) {
+                started = i;
+            } else {
+                break;
+            }
+        }
+        walk_worker(&workers[0]);
+        for (int i = 1; i <= started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    close(ctx.root_fd);
+    free(ctx.jobs);
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.cond);
+
+    if (ctx.oom) {
+        for (int i = 0; i < WALK_MAX_THREADS; i++) {
+            vec_free(&workers[i].vec);
+            free(workers[i].buf);
+        }
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < threads; i++) {
+        total += workers[i].vec.count;
+    }
+
+    int has_pattern = lua_istable(L, 2);
+    if (has_pattern) {
+        lua_getfield(L, 2, "pattern");
+        has_pattern = lua_isstring(L, -1);
+        if (!has_pattern) {
+            lua_pop(L, 1);
+        }
+    }
+    int pattern_idx = 0, find_idx = 0;
+    if (has_pattern) {
+        pattern_idx = lua_gettop(L);
+        lua_getglobal(L, "string");
+        lua_getfield(L, -1, "find");
+        lua_remove(L, -2);
+        find_idx = lua_gettop(L);
+    }
+
+    /* result table and its columns */
+    int columns = ctx.do_stat ? 8 : 2;
+    if (ctx.do_stat && ctx.resolve_links) {
+        columns++;
+    }
+    static const char *column_names[] = {"path", "mode", "size", "perms", "uid", "gid", "atime", "mtime", "target"};
+    lua_createtable(L, 0, columns + 1);
+    int result_idx = lua_gettop(L);
+    for (int c = 0; c < columns; c++) {
+        lua_createtable(L, c == 8 ? 0 : total, 0);
+    }
+    int col = result_idx + 1;
+
+    size_t n = 0;
+    char perms[8];
+    for (int i = 0; i < threads; i++) {
+        walk_vec_t *vec = &workers[i].vec;
+        for (size_t j = 0; j < vec->count; j++) {
+            walk_entry_t *e  = &vec->items[j];
+            const char *name = vec->arena + e->path;
+            if (has_pattern) {
+                const char *base = strrchr(name, '/');
+                base             = base ? base + 1 : name;
+                lua_pushvalue(L, find_idx);
+                lua_pushstring(L, base);
+                lua_pushvalue(L, pattern_idx);
+                /* a malformed pattern raises an error, the walk results must be freed then */
+                if (lua_pcall(L, 2, 1, 0) != 0) {
+                    for (int k = i; k < threads; k++) {
+                        vec_free(&workers[k].vec);
+                        free(workers[k].buf);
+                    }
+                    lua_pushnil(L);
+                    lua_insert(L, -2);
+                    return 2;
+                }
+                int matched = !lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if (!matched) {
+                    continue;
+                }
+            }
+            n++;
+            lua_pushstring(L, name);
+            lua_rawseti(L, col, n);
+            lua_pushlstring(L, &e->mode, 1);
+            lua_rawseti(L, col + 1, n);
+            if (!ctx.do_stat) {
+                continue;
+            }
+            lua_pushnumber(L, e->size);
+            lua_rawseti(L, col + 2, n);
+            snprintf(perms, sizeof(perms), "%o", (unsigned int)e->perms);
+            lua_pushstring(L, perms);
+            lua_rawseti(L, col + 3, n);
+            lua_pushnumber(L, e->uid);
+            lua_rawseti(L, col + 4, n);
+            lua_pushnumber(L, e->gid);
+            lua_rawseti(L, col + 5, n);
+            lua_pushnumber(L, e->atime);
+            lua_rawseti(L, col + 6, n);
+            lua_pushnumber(L, e->mtime);
+            lua_rawseti(L, col + 7, n);
+            if (ctx.resolve_links && e->target != NO_TARGET) {
+                lua_pushstring(L, vec->arena + e->target);
+                lua_rawseti(L, col + 8, n);
+            }
+        }
+        vec_free(vec);
+        free(workers[i].buf);
+    }
+    for (int c = columns - 1; c >= 0; c--) {
+        lua_setfield(L, result_idx, column_names[c]);
+    }
+    lua_pushnumber(L, n);
+    lua_setfield(L, result_idx, "count");
+    return 1;
+}
+
+/*
+ Returns a table of `name = d_type` for the entries of a directory,
+ `.` and `..` included, like `list_dir` does.
+*/
+int deviant_fast_list_dir(lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    char *buf = malloc(WALK_DENTS_BUF_SIZE);
+    if (buf == NULL) {
+        close(fd);
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    lua_newtable(L);
+    for (;;) {
+        long nread = syscall(SYS_getdents64, fd, buf, WALK_DENTS_BUF_SIZE);
+        if (nread == -1) {
+            int err = errno;
+            free(buf);
+            close(fd);
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(err));
+            return 2;
+        }
+        if (nread == 0) {
+            break;
+        }
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            if (d->d_ino != 0) {
+                lua_pushstring(L, d->d_name);
+                lua_pushnumber(L, d->d_type);
+                lua_settable(L, -3);
+            }
+            pos += d->d_reclen;
+        }
+    }
+    free(buf);
+    close(fd);
+    return 1;
+}
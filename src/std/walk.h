@@ -0,0 +1,24 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef DEVIANT_WALK_H
+#define DEVIANT_WALK_H
+
+#include <stdint.h>
+
+/* Shared by walk.c and tree.c, both read directories with getdents64 directly */
+
+#define WALK_DENTS_BUF_SIZE (64 * 1024)
+#define WALK_MAX_THREADS    64
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define IS_DOT_OR_DOTDOT(name) ((name)[0] == '.' && ((name)[1] == '\0' || ((name)[1] == '.' && (name)[2] == '\0')))
+
+#endif
@@ -0,0 +1,601 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ File system watcher, built on inotify.
+
+ A watcher is an inotify instance in the non blocking mode. Its fd
+ is available via the `getfd` method, so a watcher can be passed to
+ `socket.select` or registered with `web_server.watch`, and `read`
+ is called once it becomes readable.
+
+ Directories can be watched recursively: subdirectories are watched
+ when they appear, and files created in them before the watch was set up
+ are reported as created. Moved away directories are no longer watched.
+
+ `read` drains all the pending events and coalesces them by path,
+ so that a burst of writes to a file is reported as a single event.
+ With the `settle` argument it keeps on reading until no new events come
+ for that many seconds, but no longer than `WATCH_SETTLE_MAX` times that,
+ so a steady writer doesn't keep it reading forever. Each event is a table `{ path = "...", kind = "..." }`,
+ where kind is one of "create", "modify", "delete" or "attrib", and `dir` is set
+ for directories. When the kernel queue overflows, there is a single event
+ of the "overflow" kind, without a path: consumers must assume that
+ anything could have changed. Recursive watches are rescanned in this case,
+ so new subdirectories are not missed.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define WATCH_MT        "STD:Watch"
+#define WATCH_BUF_SIZE  (64 * 1024)
+#define WATCH_MIN_SLOTS 64
+/* `read` settles for at most this many `settle` periods in total */
+#define WATCH_SETTLE_MAX 4
+
+#define WATCH_DIR_MASK                                                                                      \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |         \
+     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define WATCH_FILE_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+enum {
+    WATCH_DIR       = 1,
+    WATCH_RECURSIVE = 2,
+    WATCH_ROOT      = 4,
+};
+
+typedef struct watch_node {
+    int wd;
+    int flags;
+    char *path;
+    struct watch_node *next;
+} watch_node;
+
+typedef struct {
+    int fd;
+    int hidden;
+    size_t count;
+    size_t nslots;
+    watch_node **slots; /* wd -> node hash table */
+} watch_t;
+
+/*------------------------------ wd table ----------------------------------*/
+
+static watch_node *node_find(watch_t *w, int wd) {
+    for (watch_node *n = w->slots[(unsigned)wd & (w->nslots - 1)]; n; n = n->next) {
+        if (n->wd == wd) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+static int table_grow(watch_t *w) {
+    size_t nslots      = w->nslots * 2;
+    watch_node **slots = calloc(nslots, sizeof(watch_node *));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < w->nslots; i++) {
+        watch_node *n = w->slots[i];
+        while (n) {
+            watch_node *next = n->next;
+            size_t s         = (unsigned)n->wd & (nslots - 1);
+            n->next          = slots[s];
+            slots[s]         = n;
+            n                = next;
+        }
+    }
+    free(w->slots);
+    w->slots  = slots;
+    w->nslots = nslots;
+    return 0;
+}
+
+/* Adds or updates the node of `wd`, inotify returns the same wd for the same inode */
+static int node_set(watch_t *w, int wd, const char *path, int flags) {
+    watch_node *n = node_find(w, wd);
+    char *copy    = strdup(path);
+    if (copy == NULL) {
+        return -1;
+    }
+    if (n) {
+        free(n->path);
+        n->path  = copy;
+        n->flags = flags | (n->flags & WATCH_ROOT);
+        return 0;
+    }
+    if (w->count >= w->nslots && table_grow(w) != 0) {
+        free(copy);
+        return -1;
+    }
+    n = malloc(sizeof(watch_node));
+    if (n == NULL) {
+        free(copy);
+        return -1;
+    }
+    size_t s    = (unsigned)wd & (w->nslots - 1);
+    n->wd       = wd;
+    n->flags    = flags;
+    n->path     = copy;
+    n->next     = w->slots[s];
+    w->slots[s] = n;
+    w->count++;
+    return 0;
+}
+
+static void node_drop(watch_t *w, int wd) {
+    watch_node **p = &w->slots[(unsigned)wd & (w->nslots - 1)];
+    while (*p) {
+        if ((*p)->wd == wd) {
+            watch_node *n = *p;
+            *p            = n->next;
+            free(n->path);
+            free(n);
+            w->count--;
+            return;
+        }
+        p = &(*p)->next;
+    }
+}
+
+/* Stops watching `path` and everything below it */
+static void drop_tree(watch_t *w, const char *path) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < w->nslots; i++) {
+        watch_node *n = w->slots[i];
+        while (n) {
+            watch_node *next = n->next;
+            if (strncmp(n->path, path, len) == 0 && (n->path[len] == '\0' || n->path[len] == '/')) {
+                inotify_rm_watch(w->fd, n->wd);
+                node_drop(w, n->wd);
+            }
+            n = next;
+        }
+    }
+}
+
+/*------------------------------ events ------------------------------------*/
+
+/*
+ Merges an event into the results: `res` is the array of events,
+ `seen` maps paths to the events already in `res`.
+*/
+static void emit(lua_State *L, int res, int seen, const char *path, uint32_t mask) {
+    const char *kind = NULL;
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        kind = "create";
+    } else if (mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        kind = "delete";
+    } else if (mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+        kind = "modify";
+    } else if (mask & IN_ATTRIB) {
+        kind = "attrib";
+    } else {
+        return;
+    }
+    lua_getfield(L, seen, path);
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "kind");
+        const char *prev = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        if (strcmp(kind, "create") == 0 && strcmp(prev, "delete") == 0) {
+            kind = "modify"; /* replaced, e.g. saved via a rename */
+        } else if (strcmp(kind, "delete") != 0 && strcmp(prev, "attrib") != 0) {
+            kind = prev; /* creation or deletion is what matters */
+        }
+        lua_pushstring(L, kind);
+        lua_setfield(L, -2, "kind");
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, kind);
+    lua_setfield(L, -2, "kind");
+    if (mask & IN_ISDIR) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "dir");
+    }
+    lua_pushvalue(L, -1);
+    lua_setfield(L, seen, path);
+    lua_rawseti(L, res, lua_objlen(L, res) + 1);
+}
+
+static int is_dir_entry(int dfd, struct dirent *de) {
+    if (de->d_type != DT_UNKNOWN) {
+        return de->d_type == DT_DIR;
+    }
+    struct stat st;
+    return fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ Watches `path` and, if `flags` has WATCH_RECURSIVE, all of its subdirectories.
+ When `L` is not NULL, everything found is reported as created: these are the
+ contents of a directory that has just appeared.
+ Returns 0 on success, or errno of the first failed `inotify_add_watch`.
+*/
+static int add_tree(watch_t *w, const char *path, int flags, lua_State *L, int res, int seen) {
+    int wd = inotify_add_watch(w->fd, path, WATCH_DIR_MASK);
+    if (wd < 0) {
+        return errno;
+    }
+    if (node_set(w, wd, path, flags | WATCH_DIR) != 0) {
+        return ENOMEM;
+    }
+    if (!(flags & WATCH_RECURSIVE) && L == NULL) {
+        return 0;
+    }
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        /* might be gone already, it's not an error */
+        return 0;
+    }
+    int err   = 0;
+    size_t pl = strlen(path);
+    char child[PATH_MAX];
+    struct dirent *de;
+    while (err == 0 && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (de->d_name[0] == '.' && !w->hidden) {
+            continue;
+        }
+        if (pl + strlen(de->d_name) + 2 > sizeof(child)) {
+            continue;
+        }
+        memcpy(child, path, pl);
+        child[pl] = '/';
+        strcpy(child + pl + 1, de->d_name);
+        int is_dir = is_dir_entry(dirfd(d), de);
+        if (L) {
+            emit(L, res, seen, child, IN_CREATE | (is_dir ? IN_ISDIR : 0));
+        }
+        if (is_dir && (flags & WATCH_RECURSIVE)) {
+            err = add_tree(w, child, flags & ~WATCH_ROOT, L, res, seen);
+        }
+    }
+    closedir(d);
+    return err;
+}
+
+/* Rescans the recursive watches, new subdirectories might have been missed */
+static void rescan(watch_t *w) {
+    size_t count = 0;
+    watch_node **roots = malloc(w->count * sizeof(watch_node *));
+    if (roots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < w->nslots; i++) {
+        for (watch_node *n = w->slots[i]; n; n = n->next) {
+            if ((n->flags & WATCH_ROOT) && (n->flags & WATCH_RECURSIVE)) {
+                roots[count++] = n;
+            }
+        }
+    }
+    /* add_tree only updates the nodes of known wds, so the roots stay valid */
+    for (size_t i = 0; i < count; i++) {
+        char *path = strdup(roots[i]->path);
+        if (path) {
+            add_tree(w, path, roots[i]->flags, NULL, 0, 0);
+            free(path);
+        }
+    }
+    free(roots);
+}
+
+static void handle_event(watch_t *w, lua_State *L, int res, int seen, struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        /* reported once per read, the watcher itself is the key in `seen` */
+        lua_pushlightuserdata(L, w);
+        lua_rawget(L, seen);
+        if (lua_isnil(L, -1)) {
+            lua_createtable(L, 0, 1);
+            lua_pushstring(L, "overflow");
+            lua_setfield(L, -2, "kind");
+            lua_rawseti(L, res, lua_objlen(L, res) + 1);
+            lua_pushlightuserdata(L, w);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, seen);
+        }
+        lua_pop(L, 1);
+        rescan(w);
+        return;
+    }
+    watch_node *n = node_find(w, ev->wd);
+    if (n == NULL) {
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        node_drop(w, ev->wd);
+        return;
+    }
+    if (ev->len == 0 || ev->name[0] == '\0') {
+        /* event on the watched path itself: directories report their entries' events instead */
+        if (!(n->flags & WATCH_DIR) || ((n->flags & WATCH_ROOT) && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)))) {
+            emit(L, res, seen, n->path, ev->mask);
+        }
+        if ((n->flags & WATCH_ROOT) && (ev->mask & IN_MOVE_SELF)) {
+            char *path = strdup(n->path);
+            if (path) {
+                drop_tree(w, path);
+                free(path);
+            }
+        }
+        return;
+    }
+    if (ev->name[0] == '.' && !w->hidden) {
+        return;
+    }
+    char path[PATH_MAX];
+    size_t pl = strlen(n->path);
+    if (pl + strlen(ev->name) + 2 > sizeof(path)) {
+        return;
+    }
+    memcpy(path, n->path, pl);
+    path[pl] = '/';
+    strcpy(path + pl + 1, ev->name);
+    emit(L, res, seen, path, ev->mask);
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & IN_MOVED_FROM) {
+            drop_tree(w, path);
+        } else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (n->flags & WATCH_RECURSIVE)) {
+            add_tree(w, path, n->flags & ~WATCH_ROOT, L, res, seen);
+        }
+    }
+}
+
+/* Reads all the pending events, returns the number of bytes read, or -1 */
+static ssize_t drain(watch_t *w, lua_State *L, int res, int seen) {
+    char buf[WATCH_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t total = 0;
+    for (;;) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return total;
+            }
+            return -1;
+        }
+        if (len == 0) {
+            return total;
+        }
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            handle_event(w, L, res, seen, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        total += len;
+    }
+}
+
+/*-------------------------------- Lua API ---------------------------------*/
+
+static watch_t *check_watch(lua_State *L) {
+    watch_t *w = (watch_t *)luaL_checkudata(L, 1, WATCH_MT);
+    if (w->fd < 0) {
+        luaL_error(L, "watcher is closed");
+    }
+    return w;
+}
+
+/* new(opts) -- `opts.hidden` enables events for dot files */
+static int watch_new(lua_State *L) {
+    int hidden = 0;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "hidden");
+        hidden = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    watch_t *w = (watch_t *)lua_newuserdata(L, sizeof(watch_t));
+    memset(w, 0, sizeof(watch_t));
+    w->fd = -1;
+    luaL_getmetatable(L, WATCH_MT);
+    lua_setmetatable(L, -2);
+
+    w->slots = calloc(WATCH_MIN_SLOTS, sizeof(watch_node *));
+    if (w->slots == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    w->nslots = WATCH_MIN_SLOTS;
+    w->hidden = hidden;
+    w->fd     = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    return 1;
+}
+
+/* add(path, recursive) -- watches a file or a directory */
+static int watch_add(lua_State *L) {
+    watch_t *w       = check_watch(L);
+    size_t len       = 0;
+    const char *arg  = luaL_checklstring(L, 2, &len);
+    int recursive    = lua_toboolean(L, 3);
+    char path[PATH_MAX];
+    if (len >= sizeof(path)) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENAMETOOLONG));
+        return 2;
+    }
+    /* events' paths are joined with `/` */
+    while (len > 1 && arg[len - 1] == '/') {
+        len--;
+    }
+    memcpy(path, arg, len);
+    path[len] = '\0';
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    int err = 0;
+    if (S_ISDIR(st.st_mode)) {
+        err = add_tree(w, path, WATCH_ROOT | (recursive ? WATCH_RECURSIVE : 0), NULL, 0, 0);
+    } else {
+        int wd = inotify_add_watch(w->fd, path, WATCH_FILE_MASK);
+        if (wd < 0) {
+            err = errno;
+        } else if (node_set(w, wd, path, WATCH_ROOT) != 0) {
+            err = ENOMEM;
+        }
+    }
+    if (err) {
+        lua_pushnil(L);
+        if (err == ENOSPC) {
+            lua_pushstring(L, "inotify watch limit reached, see fs.inotify.max_user_watches");
+        } else {
+            lua_pushstring(L, strerror(err));
+        }
+        return 2;
+    }
+    lua_pushinteger(L, w->count);
+    return 1;
+}
+
+/* remove(path) -- stops watching the path and everything below it */
+static int watch_remove(lua_State *L) {
+    watch_t *w       = check_watch(L);
+    const char *path = luaL_checkstring(L, 2);
+    drop_tree(w, path);
+    lua_pushinteger(L, w->count);
+    return 1;
+}
+
+static lua_Number monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ read(settle) -- returns an array of coalesced events, which is empty
+ if there are none. With `settle` (in seconds) keeps on reading
+ till there are no new events for that long, or `WATCH_SETTLE_MAX`
+ times that has passed. Events that come later are left for the next call.
+*/
+static int watch_read(lua_State *L) {
+    watch_t *w          = check_watch(L);
+    lua_Number settle   = luaL_optnumber(L, 2, 0);
+    lua_Number deadline = monotonic_now() + settle * WATCH_SETTLE_MAX;
+    lua_settop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    int res  = 2;
+    int seen = 3;
+    for (;;) {
+        ssize_t got = drain(w, L, res, seen);
+        if (got < 0) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        if (settle <= 0 || (got == 0 && lua_objlen(L, res) == 0)) {
+            break;
+        }
+        lua_Number left = deadline - monotonic_now();
+        if (left <= 0) {
+            break;
+        }
+        struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+        int ret;
+        do {
+            ret = poll(&pfd, 1, (int)((left < settle ? left : settle) * 1000));
+        } while (ret < 0 && errno == EINTR);
+        if (ret <= 0) {
+            break;
+        }
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+static int watch_getfd(lua_State *L) {
+    watch_t *w = (watch_t *)luaL_checkudata(L, 1, WATCH_MT);
+    lua_pushinteger(L, w->fd);
+    return 1;
+}
+
+/* Number of watched paths */
+static int watch_count(lua_State *L) {
+    watch_t *w = check_watch(L);
+    lua_pushinteger(L, w->count);
+    return 1;
+}
+
+static int watch_gc(lua_State *L) {
+    watch_t *w = (watch_t *)luaL_checkudata(L, 1, WATCH_MT);
+    if (w->slots) {
+        for (size_t i = 0; i < w->nslots; i++) {
+            watch_node *n = w->slots[i];
+            while (n) {
+                watch_node *next = n->next;
+                free(n->path);
+                free(n);
+                n = next;
+            }
+        }
+        free(w->slots);
+        w->slots = NULL;
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    w->count = 0;
+    return 0;
+}
+
+static luaL_Reg methods[] = {
+    {"add",    watch_add   },
+    {"remove", watch_remove},
+    {"read",   watch_read  },
+    {"getfd",  watch_getfd },
+    {"count",  watch_count },
+    {"close",  watch_gc    },
+    {NULL,     NULL        }
+};
+
+static luaL_Reg funcs[] = {
+    {"new", watch_new},
+    {NULL,  NULL     }
+};
+
+int luaopen_std_watch(lua_State *L) {
+    luaL_newmetatable(L, WATCH_MT);
+    lua_pushcfunction(L, watch_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
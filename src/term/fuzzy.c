@@ -0,0 +1,335 @@
+// SPDX-FileCopyrightText: © 2024 Vladimir Zorin <vladimir@deviant.guru>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+/*
+ Fuzzy filter for the chooser widget.
+
+ Options are copied into C once, when the filter is created.
+ A query matches an option if all of its bytes appear in the option
+ in the same order; the match is case insensitive, unless the query
+ has upper case letters in it.
+
+ Matches are ranked like fzf's v1 algorithm does: find the first
+ occurrence of the query, then walk back from its end to get the
+ shortest window, and score it. Consecutive characters and characters
+ at word boundaries (after `/`, `-`, `_`, `.`, `:`, space or a camelCase hump)
+ get bonuses, gaps cost points. Ties go to shorter options, then
+ to the original order.
+
+ Results of the previous queries are kept on a stack: when a character
+ is appended to the query, only the options that matched the shorter query
+ are checked, and when it's removed, the previous results are still there.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lauxlib.h>
+#include <lua.h>
+
+#define FUZZY_MT         "TERM:Fuzzy"
+#define FUZZY_MAX_QUERY  256
+#define FUZZY_MAX_LEVELS 64
+
+#define SCORE_MATCH       16
+#define SCORE_BOUNDARY    10
+#define SCORE_FIRST_CHAR  8
+#define SCORE_CONSECUTIVE 6
+#define SCORE_GAP_START   -3
+#define SCORE_GAP         -1
+
+typedef struct {
+    uint32_t *idx; /* ranked indices of the matched options */
+    size_t count;
+    size_t query_len;
+} fuzzy_level_t;
+
+typedef struct {
+    char *data; /* all the options, one after another */
+    uint32_t *offsets;
+    uint32_t *lens;
+    size_t count;
+    char query[FUZZY_MAX_QUERY];
+    fuzzy_level_t levels[FUZZY_MAX_LEVELS];
+    int depth;
+} fuzzy_t;
+
+typedef struct {
+    int32_t score;
+    uint32_t len;
+    uint32_t idx;
+} fuzzy_match_t;
+
+static inline unsigned char fold(unsigned char c, int icase) {
+    return icase && c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static inline int is_boundary(unsigned char prev, unsigned char c) {
+    if (prev == '/' || prev == '-' || prev == '_' || prev == '.' || prev == ' ' || prev == ':') {
+        return 1;
+    }
+    return prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z';
+}
+
+/* Returns the score of the best window, or INT32_MIN if there is no match */
+static int32_t fuzzy_score(const unsigned char *s, size_t n, const unsigned char *q, size_t m, int icase) {
+    size_t qi = 0, end = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fold(s[i], icase) == q[qi]) {
+            if (++qi == m) {
+                end = i;
+                break;
+            }
+        }
+    }
+    if (qi < m) {
+        return INT32_MIN;
+    }
+    size_t start = end;
+    for (size_t i = end + 1; i-- > 0;) {
+        if (fold(s[i], icase) == q[qi - 1]) {
+            if (--qi == 0) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    int32_t score    = start == 0 ? SCORE_FIRST_CHAR : 0;
+    int consecutive  = 0;
+    int in_gap       = 0;
+    for (size_t i = start; i <= end && qi < m; i++) {
+        if (fold(s[i], icase) == q[qi]) {
+            score += SCORE_MATCH;
+            if (i == 0 || is_boundary(s[i - 1], s[i])) {
+                score += SCORE_BOUNDARY;
+            }
+            if (consecutive > 0) {
+                score += SCORE_CONSECUTIVE * consecutive;
+            }
+            consecutive++;
+            in_gap = 0;
+            qi++;
+        } else {
+            score += in_gap ? SCORE_GAP : SCORE_GAP_START;
+            consecutive = 0;
+            in_gap      = 1;
+        }
+    }
+    return score;
+}
+
+static int match_cmp(const void *a, const void *b) {
+    const fuzzy_match_t *x = (const fuzzy_match_t *)a;
+    const fuzzy_match_t *y = (const fuzzy_match_t *)b;
+    if (x->score != y->score) {
+        return x->score > y->score ? -1 : 1;
+    }
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    return x->idx < y->idx ? -1 : 1;
+}
+
+static fuzzy_t *check_fuzzy(lua_State *L) {
+    fuzzy_t *fz = (fuzzy_t *)luaL_checkudata(L, 1, FUZZY_MT);
+    if (fz->data == NULL) {
+        luaL_error(L, "fuzzy filter is closed");
+    }
+    return fz;
+}
+
+/* new(options) -- `options` is an array of strings */
+static int fuzzy_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t count = lua_objlen(L, 1);
+
+    fuzzy_t *fz = (fuzzy_t *)lua_newuserdata(L, sizeof(fuzzy_t));
+    memset(fz, 0, sizeof(fuzzy_t));
+    luaL_getmetatable(L, FUZZY_MT);
+    lua_setmetatable(L, -2);
+
+    size_t total = 0;
+    for (size_t i = 1; i <= count; i++) {
+        lua_rawgeti(L, 1, i);
+        size_t len = 0;
+        if (lua_isstring(L, -1)) {
+            lua_tolstring(L, -1, &len);
+        }
+        total += len;
+        lua_pop(L, 1);
+    }
+    if (total > UINT32_MAX || count > UINT32_MAX) {
+        lua_pushnil(L);
+        lua_pushstring(L, "too many options");
+        return 2;
+    }
+    fz->data            = malloc(total + 1);
+    fz->offsets         = malloc((count + 1) * sizeof(uint32_t));
+    fz->lens            = malloc((count + 1) * sizeof(uint32_t));
+    fz->levels[0].idx   = malloc((count + 1) * sizeof(uint32_t));
+    if (!fz->data || !fz->offsets || !fz->lens || !fz->levels[0].idx) {
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        size_t len      = 0;
+        const char *str = lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) : "";
+        memcpy(fz->data + offset, str, len);
+        fz->offsets[i]       = offset;
+        fz->lens[i]          = len;
+        fz->levels[0].idx[i] = i;
+        offset += len;
+        lua_pop(L, 1);
+    }
+    fz->count           = count;
+    fz->levels[0].count = count;
+    fz->depth           = 1;
+    return 1;
+}
+
+/*
+ filter(query) -- returns the number of matching options,
+ use `range` to get them. An empty query matches everything,
+ in the original order.
+*/
+static int fuzzy_filter(lua_State *L) {
+    fuzzy_t *fz   = check_fuzzy(L);
+    size_t qlen   = 0;
+    const char *q = luaL_checklstring(L, 2, &qlen);
+    if (qlen >= FUZZY_MAX_QUERY) {
+        return luaL_argerror(L, 2, "query is too long");
+    }
+
+    /* drop the results of queries that are not prefixes of this one */
+    while (fz->depth > 1) {
+        fuzzy_level_t *top = &fz->levels[fz->depth - 1];
+        if (top->query_len <= qlen && memcmp(fz->query, q, top->query_len) == 0) {
+            break;
+        }
+        free(top->idx);
+        top->idx = NULL;
+        fz->depth--;
+    }
+    fuzzy_level_t *base = &fz->levels[fz->depth - 1];
+    if (base->query_len == qlen) {
+        lua_pushinteger(L, base->count);
+        return 1;
+    }
+
+    int icase = 1;
+    unsigned char query[FUZZY_MAX_QUERY];
+    for (size_t i = 0; i < qlen; i++) {
+        if (q[i] >= 'A' && q[i] <= 'Z') {
+            icase = 0;
+        }
+    }
+    for (size_t i = 0; i < qlen; i++) {
+        query[i] = fold(q[i], icase);
+    }
+
+    fuzzy_match_t *matches = malloc((base->count + 1) * sizeof(fuzzy_match_t));
+    uint32_t *idx          = malloc((base->count + 1) * sizeof(uint32_t));
+    if (matches == NULL || idx == NULL) {
+        free(matches);
+        free(idx);
+        lua_pushnil(L);
+        lua_pushstring(L, "out of memory");
+        return 2;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < base->count; i++) {
+        uint32_t option = base->idx[i];
+        const unsigned char *s = (const unsigned char *)fz->data + fz->offsets[option];
+        int32_t score          = fuzzy_score(s, fz->lens[option], query, qlen, icase);
+        if (score != INT32_MIN) {
+            matches[count].score = score;
+            matches[count].len   = fz->lens[option];
+            matches[count].idx   = option;
+            count++;
+        }
+    }
+    qsort(matches, count, sizeof(fuzzy_match_t), match_cmp);
+    for (size_t i = 0; i < count; i++) {
+        idx[i] = matches[i].idx;
+    }
+    free(matches);
+
+    /* when the stack is full, the top one is replaced */
+    if (fz->depth == FUZZY_MAX_LEVELS) {
+        fz->depth--;
+        free(fz->levels[fz->depth].idx);
+    }
+    fuzzy_level_t *level = &fz->levels[fz->depth++];
+    level->idx           = idx;
+    level->count         = count;
+    level->query_len     = qlen;
+    memcpy(fz->query, q, qlen);
+
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/* range(first, last) -- indices of the options ranked from `first` to `last` by the last `filter` */
+static int fuzzy_range(lua_State *L) {
+    fuzzy_t *fz           = check_fuzzy(L);
+    fuzzy_level_t *level  = &fz->levels[fz->depth - 1];
+    lua_Integer first     = luaL_optinteger(L, 2, 1);
+    lua_Integer last      = luaL_optinteger(L, 3, level->count);
+    if (first < 1) {
+        first = 1;
+    }
+    if (last > (lua_Integer)level->count) {
+        last = level->count;
+    }
+    lua_createtable(L, last >= first ? last - first + 1 : 0, 0);
+    for (lua_Integer i = first; i <= last; i++) {
+        lua_pushinteger(L, level->idx[i - 1] + 1);
+        lua_rawseti(L, -2, i - first + 1);
+    }
+    return 1;
+}
+
+static int fuzzy_gc(lua_State *L) {
+    fuzzy_t *fz = (fuzzy_t *)luaL_checkudata(L, 1, FUZZY_MT);
+    for (int i = 0; i < FUZZY_MAX_LEVELS; i++) {
+        free(fz->levels[i].idx);
+        fz->levels[i].idx = NULL;
+    }
+    free(fz->data);
+    free(fz->offsets);
+    free(fz->lens);
+    fz->data    = NULL;
+    fz->offsets = NULL;
+    fz->lens    = NULL;
+    fz->depth   = 0;
+    return 0;
+}
+
+static luaL_Reg methods[] = {
+    {"filter", fuzzy_filter},
+    {"range",  fuzzy_range },
+    {"close",  fuzzy_gc    },
+    {NULL,     NULL        }
+};
+
+static luaL_Reg funcs[] = {
+    {"new", fuzzy_new},
+    {NULL,  NULL     }
+};
+
+int luaopen_term_fuzzy(lua_State *L) {
+    luaL_newmetatable(L, FUZZY_MT);
+    lua_pushcfunction(L, fuzzy_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, funcs);
+    return 1;
+}
@@ -110,11 +110,11 @@ local apply = function(self, elements, content, position)
 	if props.indent > 0 then
 		text = string.rep(" ", props.indent) .. text
 	end
-	local ulen = std.utf.len(text)
+	local ulen = std.txt.width(text)
 	if props.w ~= 0 then
 		if obj.fill then
 			text = string.rep(text, props.w)
-			ulen = std.utf.len(text)
+			ulen = std.txt.width(text)
 		end
 		if props.clip == 0 then
 			props.clip = props.w
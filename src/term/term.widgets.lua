@@ -4,6 +4,7 @@ local std = require("std")
 local term = require("term")
 local style = require("term.tss")
 local input = require("term.input")
+local fuzzy = require("term.fuzzy")
 
 local default_rss = {
 	align = "center",
@@ -96,10 +97,15 @@ local cleanup = function(self)
 	end
 end
 
-local render_chooser_option = function(self, idx)
-	local option = self.content[idx]
-	term.go(self.l + (self.title ~= "" and 3 or 1) + idx - 1, self.c + 1)
-
+-- `row` is the row in the chooser's window, the option shown
+-- there is the `self.top + row - 1`th of the filtered ones.
+local render_chooser_option = function(self, row)
+	local option = self.content[self.visible[row]]
+	term.go(self.l + (self.title ~= "" and 3 or 1) + row - 1, self.c + 1)
+	if not option then
+		term.write(string.rep(" ", self.w))
+		return
+	end
 	if self.kind == "chooser_multi" then
 		term.move("left", 1)
 		if self.selected[option] then
@@ -108,13 +114,50 @@ local render_chooser_option = function(self, idx)
 			term.write(self.tss:apply("borders.v", nil, self.c))
 		end
 	end
-	if idx == self.idx then
+	if self.top + row - 1 == self.idx then
 		term.write(self.tss:apply("option.selected", option))
 	else
 		term.write(self.tss:apply("option", option))
 	end
 end
 
+local render_chooser_window = function(self)
+	self.visible = self.filter:range(self.top, self.top + self.h - 1)
+	for row = 1, self.h do
+		self:render_chooser_option(row)
+	end
+end
+
+-- Moves the selection to the `idx`th filtered option,
+-- scrolling the window if needed.
+local chooser_select = function(self, idx)
+	if self.count == 0 then
+		return
+	end
+	idx = math.max(1, math.min(idx, self.count))
+	local prev = self.idx
+	self.idx = idx
+	if idx < self.top then
+		self.top = idx
+	elseif idx > self.top + self.h - 1 then
+		self.top = idx - self.h + 1
+	else
+		self:render_chooser_option(prev - self.top + 1)
+		self:render_chooser_option(idx - self.top + 1)
+		return
+	end
+	self:render_chooser_window()
+end
+
+local chooser_search = function(self, query)
+	self.label = query
+	self.count = self.filter:filter(query)
+	self.idx = 1
+	self.top = 1
+	self:draw_top_border()
+	self:render_chooser_window()
+end
+
 local goto_field = function(self, idx, to_input)
 	local label = self.tss:apply("form.label", self.content[idx])
 	local c = self.c + 1
@@ -161,11 +204,19 @@ local new_widget = function(opts)
 	widget.draw_borders = draw_borders
 	widget.draw_top_border = draw_top_border
 	widget.render_chooser_option = render_chooser_option
+	widget.render_chooser_window = render_chooser_window
+	widget.chooser_select = chooser_select
+	widget.chooser_search = chooser_search
 	widget.render_form_field = render_form_field
 	widget.goto_field = goto_field
 	return widget
 end
 
+--[[
+    Only the visible window of options is rendered, the widget is never
+    taller than the terminal. Typing filters the options with a fuzzy matcher
+    (see term/fuzzy.c), BACKSPACE & ESC edit and reset the filter.
+]]
 local chooser = function(content, opts)
 	local opts = opts or {}
 	local content = content or {}
@@ -177,8 +228,9 @@ local chooser = function(content, opts)
 	if std.utf.len(title) > max then
 		max = std.utf.len(title)
 	end
-	opts.w = max + 4 -- Add some space for indentation
-	opts.h = #content
+	local win_y, win_x = term.window_size()
+	opts.w = math.min(max + 4, win_x - 4) -- Add some space for indentation
+	opts.h = math.max(1, math.min(#content, win_y - (title ~= "" and 6 or 4)))
 	local w = new_widget(opts)
 	w.content = content
 	w.kind = "chooser"
@@ -186,22 +238,26 @@ local chooser = function(content, opts)
 		w.kind = "chooser_multi"
 		w.selected = {}
 	end
+	w.filter = fuzzy.new(content)
+	w.count = #content
 	w.idx = 1
+	w.top = 1
+	w.label = ""
 	w:init()
 	w:draw_borders()
-	for i, _ in ipairs(content) do
-		w:render_chooser_option(i)
+	w:render_chooser_window()
+	local done = function(result)
+		w.filter:close()
+		w:cleanup()
+		return result
 	end
-	w.label = ""
 	while true do
 		local key = input.simple_get()
 		if key == "ESC" then
 			if w.label ~= "" then
-				w.label = ""
-				w:draw_top_border()
+				w:chooser_search("")
 			else
-				w:cleanup()
-				return w.kind == "chooser_multi" and {} or ""
+				return done(w.kind == "chooser_multi" and {} or "")
 			end
 		elseif key == "ENTER" then
 			if w.kind == "chooser_multi" then
@@ -211,42 +267,34 @@ local chooser = function(content, opts)
 						table.insert(result, option)
 					end
 				end
-				w:cleanup()
-				return result
-			else
-				w:cleanup()
-				return w.content[w.idx]
+				return done(result)
+			elseif w.count > 0 then
+				return done(w.content[w.filter:range(w.idx, w.idx)[1]])
 			end
 		elseif key == " " and w.kind == "chooser_multi" then
-			local option = w.content[w.idx]
-			w.selected[option] = not w.selected[option]
-			w:render_chooser_option(w.idx)
-		elseif key == "UP" then
-			if w.idx > 1 then
-				w.idx = w.idx - 1
-				w:render_chooser_option(w.idx)
-				w:render_chooser_option(w.idx + 1)
+			if w.count > 0 then
+				local option = w.content[w.filter:range(w.idx, w.idx)[1]]
+				w.selected[option] = not w.selected[option]
+				w:render_chooser_option(w.idx - w.top + 1)
 			end
+		elseif key == "UP" then
+			w:chooser_select(w.idx - 1)
 		elseif key == "DOWN" then
-			if w.idx < #w.content then
-				w.idx = w.idx + 1
-				w:render_chooser_option(w.idx)
-				w:render_chooser_option(w.idx - 1)
+			w:chooser_select(w.idx + 1)
+		elseif key == "PAGE_UP" then
+			w:chooser_select(w.idx - w.h)
+		elseif key == "PAGE_DOWN" then
+			w:chooser_select(w.idx + w.h)
+		elseif key == "HOME" then
+			w:chooser_select(1)
+		elseif key == "END" then
+			w:chooser_select(w.count)
+		elseif key == "BACKSPACE" then
+			if w.label ~= "" then
+				w:chooser_search(std.utf.sub(w.label, 1, std.utf.len(w.label) - 1))
 			end
 		elseif key and key ~= "" and std.utf.len(key) < 2 then
-			w.label = w.label .. key
-			w:draw_top_border()
-			for i, option in ipairs(w.content) do
-				if option:match(w.label) then
-					if w.idx ~= i then
-						local prev_idx = w.idx
-						w.idx = i
-						w:render_chooser_option(w.idx)
-						w:render_chooser_option(prev_idx)
-						break
-					end
-				end
-			end
+			w:chooser_search(w.label .. key)
 		end
 	end
 end
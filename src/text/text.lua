@@ -103,16 +103,26 @@ local typographics = {
 	["left_double_quote"] = "“",
 }
 
+--[[
+    Elements whose rendering depends on the wrap width (paragraphs,
+    code blocks and thematic breaks) are not rendered right away: a function
+    that renders the element for a given width is added to `jobs`, and a placeholder
+    with the job's index is returned instead, see `djot_layout` below.
+]]
+local defer = function(jobs, job)
+	table.insert(jobs, job)
+	return "\0" .. #jobs .. "\0"
+end
+
 local render_djot_element
-render_djot_element = function(el, tss, wrap, parent, list_item_idx)
-	local wrap = wrap or 0
+render_djot_element = function(el, tss, jobs, parent, list_item_idx)
 	local codeblock_wrap = tss.__style.codeblock_wrap
 	local parent = parent or "str"
 	local list_item_idx = list_item_idx or 1
 	local get_children = function(children, p)
 		local out = ""
 		for i, child in ipairs(children) do
-			out = out .. render_djot_element(child, tss, wrap, p, i)
+			out = out .. render_djot_element(child, tss, jobs, p, i)
 		end
 		return out
 	end
@@ -184,8 +194,13 @@ render_djot_element = function(el, tss, wrap, parent, list_item_idx)
 		return tss:apply({ "link.title", unpack(elements) }, title) .. tss:apply("link.url", target)
 	end
 	if el.tag == "thematic_break" then
-		tss.__style.w = wrap
-		return tss:apply(el.tag, el.text) .. "\n"
+		return defer(jobs, function(wrap)
+			local w = tss.__style.w
+			tss.__style.w = wrap
+			local out = tss:apply(el.tag, el.text) .. "\n"
+			tss.__style.w = w
+			return out
+		end)
 	end
 	if el.tag == "heading" then
 		tss.__style.header.level.w = el.level
@@ -200,45 +215,49 @@ render_djot_element = function(el, tss, wrap, parent, list_item_idx)
 			indent = list_indent
 			out = "\n"
 		end
-		if wrap > 0 then
-			tss.__style.codeblock.w = wrap + indent + padding * 2
-			tss.__style.codeblock.border.w = wrap + indent + padding * 2
-		end
 		local elements = get_classes(el, "codeblock")
-		local top_line = tss:apply("codeblock.border.top_line")
-		if el.lang and el.lang ~= "" then
-			local lang = tss:apply("codeblock.lang", el.lang)
-			local st = tss:apply(
-				"codeblock.border",
-				tss.__style.codeblock.border.top_line.before .. tss.__style.codeblock.border.top_line.content
-			)
-			local lang_len = std.utf.len(lang)
-			st = st
-				.. lang
-				.. tss:apply(
-					"codeblock.border",
-					string.rep(
-						tss.__style.codeblock.border.top_line.content,
-						wrap + indent + padding * 2 - lang_len - 1
-					) .. tss.__style.codeblock.border.top_line.after
-				)
-			top_line = st
-		end
-		local content = std.txt.lines(el.text)
-		if wrap > 0 and codeblock_wrap then
-			content = std.txt.lines_of(table.concat(content, "\n"), wrap, true)
-		end
-		out = out .. string.rep(" ", indent) .. top_line .. "\n"
-		for _, l in ipairs(content) do
-			out = out
-				.. string.rep(" ", indent)
-				.. tss:apply("codeblock.border.v")
-				.. tss:apply({ "codeblock", unpack(elements) }, l)
-				.. tss:apply("codeblock.border.v")
-				.. "\n"
-		end
-		out = out .. string.rep(" ", indent) .. tss:apply("codeblock.border.bottom_line") .. "\n"
-		return out .. "\n"
+		-- Borders are shared with tables, which set their width while rendering
+		local codeblock = tss.__style.codeblock
+		local w, border_w = codeblock.w, codeblock.border.w
+		return defer(jobs, function(wrap)
+			if wrap > 0 then
+				codeblock.w = wrap + indent + padding * 2
+				codeblock.border.w = wrap + indent + padding * 2
+			else
+				codeblock.w, codeblock.border.w = w, border_w
+			end
+			local out = out
+			local top_line = tss:apply("codeblock.border.top_line")
+			if el.lang and el.lang ~= "" then
+				local lang = tss:apply("codeblock.lang", el.lang)
+				local st = tss:apply("codeblock.border", codeblock.border.top_line.before .. codeblock.border.top_line.content)
+				local lang_len = std.txt.width(lang)
+				st = st
+					.. lang
+					.. tss:apply(
+						"codeblock.border",
+						string.rep(codeblock.border.top_line.content, wrap + indent + padding * 2 - lang_len - 1)
+							.. codeblock.border.top_line.after
+					)
+				top_line = st
+			end
+			local content = std.txt.lines(el.text)
+			if wrap > 0 and codeblock_wrap then
+				content = std.txt.lines_of(table.concat(content, "\n"), wrap, true)
+			end
+			out = out .. string.rep(" ", indent) .. top_line .. "\n"
+			for _, l in ipairs(content) do
+				out = out
+					.. string.rep(" ", indent)
+					.. tss:apply("codeblock.border.v")
+					.. tss:apply({ "codeblock", unpack(elements) }, l)
+					.. tss:apply("codeblock.border.v")
+					.. "\n"
+			end
+			out = out .. string.rep(" ", indent) .. tss:apply("codeblock.border.bottom_line") .. "\n"
+			codeblock.w, codeblock.border.w = w, border_w
+			return out .. "\n"
+		end)
 	end
 	if el.tag == "div" then
 		local elements = get_classes(el, el.tag)
@@ -254,17 +273,14 @@ render_djot_element = function(el, tss, wrap, parent, list_item_idx)
 			trailing_newline = "\n"
 			indent = list_indent
 		end
-		if wrap > 0 then
-			if list_item_idx == 1 then
-				return table.concat(
-					std.txt.indent_all_lines_but_first(std.txt.lines_of(content, wrap, false, true), indent),
-					"\n"
-				) .. trailing_newline
+		return defer(jobs, function(wrap)
+			if wrap > 0 then
+				local first_indent = list_item_idx == 1 and 0 or indent
+				local lines = std.txt.wrap(content, wrap, { squeeze = true, indent = indent, first_indent = first_indent })
+				return table.concat(lines, "\n") .. trailing_newline
 			end
-			return table.concat(std.txt.indent_lines(std.txt.lines_of(content, wrap, false, true), indent), "\n")
-				.. trailing_newline
-		end
-		return content .. trailing_newline
+			return content .. trailing_newline
+		end)
 	end
 	if el.tag == "definition_list_item" then
 		local level, list_indent, list_style = get_list_info(parent)
@@ -275,7 +291,7 @@ render_djot_element = function(el, tss, wrap, parent, list_item_idx)
 			def = get_children(el.children[2].children, parent)
 		end
 		out = out .. string.rep(" ", list_indent) .. tss:apply("list.definition.term", def_term) .. "\n"
-		tss.__style.list.definition.suffix.w = std.utf.len(def_term)
+		tss.__style.list.definition.suffix.w = std.txt.width(def_term)
 		out = out .. string.rep(" ", list_indent) .. tss:apply("list.definition.suffix") .. "\n\n"
 		out = out .. string.rep(" ", list_indent) .. tss:apply("list.definition.def", def) .. "\n"
 		return out
@@ -372,32 +388,129 @@ render_djot_element = function(el, tss, wrap, parent, list_item_idx)
 	return "\n"
 end
 
-local render_djot = function(raw, rss, conf)
+--[[
+    Returns the layout state for the given wrap width and global indent.
+    States are cached, so going back to a width someone has already
+    looked at costs nothing.
+]]
+local djot_layout_get = function(self, width, indent)
+	local width = width or self.__wrap
+	local indent = indent or self.__indent
+	local key = width .. ":" .. indent
+	local cached = self.__cache[key]
+	if cached then
+		return cached
+	end
+	if self.__cached >= 16 then
+		self.__cache = {}
+		self.__cached = 0
+	end
+	local prefix = ""
+	if indent > 0 then
+		prefix = "\027[0m" .. string.rep(" ", indent)
+	end
+	cached = { width = width, indent = indent, prefix = prefix, lines = {}, block = 0, tail = "" }
+	self.__cache[key] = cached
+	self.__cached = self.__cached + 1
+	return cached
+end
+
+--[[
+    Returns the lines of the document laid out for the given wrap width
+    and global indent, and whether that's all of them: top level blocks are
+    laid out one by one till there are at least `count` lines (or all of them,
+    when `count` is nil). The lines array grows in place on subsequent calls.
+]]
+local djot_layout_lines = function(self, width, indent, count)
+	local state = self:get(width, indent)
+	local lines = state.lines
+	local expand = function(job)
+		return self.__jobs[tonumber(job)](state.width)
+	end
+	while not state.done and (not count or #lines < count) do
+		local template = self.__blocks[state.block + 1]
+		if template then
+			state.block = state.block + 1
+			local out = state.tail .. template:gsub("%z(%d+)%z", expand)
+			local pos = 1
+			local nl = out:find("\n", pos, true)
+			while nl do
+				lines[#lines + 1] = state.prefix .. out:sub(pos, nl - 1):gsub("\r$", "")
+				pos = nl + 1
+				nl = out:find("\n", pos, true)
+			end
+			state.tail = out:sub(pos)
+			state.split = state.split or pos > 1
+		else
+			-- Same as `std.txt.indent` followed by `std.txt.lines` would do
+			if not state.split or (state.tail ~= "" and not state.tail:find("\r", 1, true)) then
+				lines[#lines + 1] = state.prefix .. state.tail
+			end
+			if state.indent == 0 and #lines > 1 and lines[#lines] == "" then
+				lines[#lines] = nil
+				state.newline = true
+			end
+			state.tail = nil
+			state.done = true
+		end
+	end
+	return lines, state.done == true
+end
+
+local djot_layout_render = function(self, width, indent)
+	local lines = self:lines(width, indent)
+	local out = table.concat(lines, "\r\n")
+	if self:get(width, indent).newline then
+		return out .. "\r\n"
+	end
+	return out
+end
+
+--[[
+    Parses and styles a djot document once, and returns the layout object,
+    which renders it for any wrap width and global indent:
+
+        local layout = text.djot_layout(raw, rss, conf)
+        local rendered = layout:render() -- with the width and indent from `conf` or `rss`
+        local lines, all = layout:lines(100, 0, 50) -- at least 50 lines, if there are that many
+
+    Only paragraphs, code blocks and thematic breaks have to be
+    laid out again for a new width, everything else is reused.
+]]
+local djot_layout = function(raw, rss, conf)
 	local tss = style.merge(default_djot_rss, rss)
 	local conf = conf or {}
 	local wrap = conf.wrap or tss.__style.wrap or 0
 	local g_indent = conf.global_indent or tss.__style.global_indent or 0
-	if g_indent == 0 then
-		if conf.global_indent then
-			g_indent = conf.global_indent
-		end
-	end
 	if conf.hide_links ~= nil then
 		tss.__style.hide_links = conf.hide_links
 	end
 
 	local raw = raw or ""
-	raw = raw:gsub("\t", "    ")
+	-- NUL bytes would be taken for job placeholders
+	raw = raw:gsub("\t", "    "):gsub("%z", "")
 
 	local doc = djot.parse(raw) or { children = {} }
-	local out = ""
-	if not doc or not doc.children then
-		return ""
+	local jobs = {}
+	local blocks = {}
+	for i, el in ipairs(doc.children or {}) do
+		blocks[i] = render_djot_element(el, tss, jobs, "doc", i)
 	end
-	for i, el in ipairs(doc.children) do
-		out = out .. render_djot_element(el, tss, wrap, "doc", i)
-	end
-	return std.txt.indent(out, g_indent)
+	return {
+		__blocks = blocks,
+		__jobs = jobs,
+		__wrap = wrap,
+		__indent = g_indent,
+		__cache = {},
+		__cached = 0,
+		get = djot_layout_get,
+		render = djot_layout_render,
+		lines = djot_layout_lines,
+	}
+end
+
+local render_djot = function(raw, rss, conf)
+	return djot_layout(raw, rss, conf):render()
 end
 
 local render = function(raw, rss, conf)
@@ -415,5 +528,6 @@ end
 return {
 	render_text = render_text,
 	render_djot = render_djot,
+	djot_layout = djot_layout,
 	render = render,
 }
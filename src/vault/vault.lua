@@ -1,16 +1,216 @@
-local web = require("web")
+local std = require("std")
+local socket = require("socket")
+local ssl = require("ssl")
 local json = require("cjson.safe")
+local crypto = require("crypto")
+
+local parse_addr = function(addr)
+	local scheme, host, port = addr:match("^(https?)://([^:/]+):?(%d*)")
+	if not scheme then
+		scheme = "http"
+		host, port = addr:match("^([^:/]+):?(%d*)")
+	end
+	if not port or port == "" then
+		port = scheme == "https" and 443 or 80
+	end
+	return { scheme = scheme, host = host, port = tonumber(port) }
+end
+
+--[[
+    All requests go through a single keep-alive connection, which is
+    opened on the first request and reused until Vault closes it.
+]]
+local disconnect = function(self)
+	if self.conn then
+		self.conn:close()
+		self.conn = nil
+	end
+end
+
+local connect = function(self)
+	if self.conn then
+		return self.conn
+	end
+	local addr = parse_addr(self.vault_addr)
+	if not addr.host then
+		return nil, "invalid vault address: " .. self.vault_addr
+	end
+	local tcp = socket.tcp()
+	tcp:settimeout(self.timeout)
+	local ok, err = tcp:connect(addr.host, addr.port)
+	if not ok then
+		tcp:close()
+		return nil, err
+	end
+	local conn = tcp
+	if addr.scheme == "https" then
+		conn, err = ssl.wrap(tcp, { server_name = addr.host })
+		if not conn then
+			tcp:close()
+			return nil, err
+		end
+		conn:settimeout(self.timeout)
+		ok, err = conn:dohandshake()
+		if not ok then
+			conn:close()
+			return nil, err
+		end
+	end
+	self.conn = conn
+	self.host = addr.host
+	return conn
+end
+
+local build_request = function(self, req)
+	local body = req.body or ""
+	local lines = {
+		req.method .. " /v1/" .. req.path .. " HTTP/1.1",
+		"host: " .. self.host,
+		"content-length: " .. #body,
+	}
+	for name, value in pairs(self.headers) do
+		table.insert(lines, name .. ": " .. value)
+	end
+	return table.concat(lines, "\r\n") .. "\r\n\r\n" .. body
+end
+
+local read_response = function(conn)
+	local line, err = conn:receive("*l")
+	if not line then
+		return nil, err
+	end
+	local status = tonumber(line:match("^HTTP/%d%.%d (%d%d%d)"))
+	if not status then
+		return nil, "invalid status line: " .. line
+	end
+	local headers = {}
+	while true do
+		line, err = conn:receive("*l")
+		if not line then
+			return nil, err
+		end
+		if line == "" then
+			break
+		end
+		local name, value = line:match("^([^:]+):%s*(.*)$")
+		if name then
+			headers[name:lower()] = value
+		end
+	end
+	local resp = { status = status, headers = headers, body = "" }
+	if headers["transfer-encoding"] and headers["transfer-encoding"]:match("chunked") then
+		local chunks = {}
+		while true do
+			line, err = conn:receive("*l")
+			if not line then
+				return nil, err
+			end
+			local size = tonumber(line:match("^%x+") or "", 16)
+			if not size then
+				return nil, "invalid chunk size"
+			end
+			if size == 0 then
+				repeat -- skip trailers
+					line, err = conn:receive("*l")
+				until not line or line == ""
+				break
+			end
+			local chunk, err = conn:receive(size)
+			if not chunk then
+				return nil, err
+			end
+			table.insert(chunks, chunk)
+			conn:receive("*l")
+		end
+		resp.body = table.concat(chunks)
+	elseif headers["content-length"] then
+		local size = tonumber(headers["content-length"]) or 0
+		if size > 0 then
+			resp.body, err = conn:receive(size)
+			if not resp.body then
+				return nil, err
+			end
+		end
+	elseif status ~= 204 and status ~= 304 then
+		resp.body = conn:receive("*a") or ""
+		resp.close = true
+	end
+	if headers["connection"] and headers["connection"]:lower() == "close" then
+		resp.close = true
+	end
+	return resp
+end
+
+--[[
+    Sends all the `requests` (tables with `method`, `path` and optional `body`)
+    at once, and then reads the responses in order: a batch costs one roundtrip
+    instead of one per request. If the connection breaks (e.g. Vault has closed
+    an idle one), the unanswered requests are resent on a new connection.
+]]
+local batch = function(self, requests)
+	local responses = {}
+	local first = 1
+	local retried = false
+	while first <= #requests do
+		local conn, err = connect(self)
+		if not conn then
+			return nil, "request failed: " .. tostring(err)
+		end
+		local payload = {}
+		for i = first, #requests do
+			table.insert(payload, build_request(self, requests[i]))
+		end
+		local answered = first
+		local ok
+		ok, err = conn:send(table.concat(payload))
+		if ok then
+			while answered <= #requests do
+				local resp
+				resp, err = read_response(conn)
+				if not resp then
+					break
+				end
+				responses[answered] = resp
+				answered = answered + 1
+				if resp.close then
+					break
+				end
+			end
+		end
+		if answered <= #requests then
+			disconnect(self)
+			if answered == first then
+				if retried then
+					return nil, "request failed: " .. tostring(err)
+				end
+				retried = true
+			else
+				retried = false
+			end
+		end
+		first = answered
+	end
+	return responses
+end
+
+local request = function(self, method, path, body)
+	local responses, err = batch(self, { { method = method, path = path, body = body } })
+	if not responses then
+		return nil, err
+	end
+	return responses[1]
+end
 
 local handle_response = function(resp, err)
 	if not resp then
-		return nil, "request failed: " .. err
+		return nil, err
 	end
 	if resp.status == 204 then
 		return true
 	end
 	local response, err = json.decode(resp.body)
 	if not response then
-		return nil, "failed to parse response body: " .. err
+		return nil, "failed to parse response body: " .. tostring(err)
 	end
 	if resp.status == 200 then
 		return response
@@ -30,10 +230,8 @@ local login = function(self, user, pass, mount)
 	if not pass or type(pass) ~= "string" then
 		return nil, "password must be provided"
 	end
-	local url = self.vault_addr .. "/v1/" .. mount .. "/login/" .. user
 	local body = { password = pass }
-	local response, err =
-		handle_response(web.request(url, { method = "POST", body = json.encode(body), headers = self.headers }))
+	local response, err = handle_response(request(self, "POST", mount .. "/login/" .. user, json.encode(body)))
 	if not response then
 		return nil, err
 	end
@@ -53,24 +251,204 @@ local set_token = function(self, token)
 	return true
 end
 
-local get_secret = function(self, path, mount)
-	local mount = mount or "secret"
-	if not path or type(path) ~= "string" then
-		return nil, "secret path not provided"
+--[[
+    Secrets cache.
+
+    If the client is created with a `cache` object (anything with
+    `get(key)` and `set(key, value, ttl)` methods, e.g. backed by Redis),
+    secrets are kept there for their `lease_duration`, but no longer
+    than `max_cache_ttl` seconds. Cached secrets are encrypted with
+    AES-GCM, the key is derived from the Vault token, so they can only
+    be read with the same token, and a new login invalidates them.
+]]
+local cache_key = function(mount, secret)
+	return mount .. "/" .. secret
+end
+
+local cipher_key = function(self)
+	local token = self.headers["x-vault-token"]
+	if not token then
+		return nil
+	end
+	return crypto.hmac(token, "lilush vault cache")
+end
+
+local cache_get = function(self, key)
+	local key_material = cipher_key(self)
+	if not self.cache or not key_material then
+		return nil
+	end
+	local blob = self.cache:get(key)
+	if not blob then
+		return nil
+	end
+	local plain = crypto.aes_gcm_decrypt(key_material, blob, key)
+	if not plain then
+		return nil
+	end
+	return json.decode(plain)
+end
+
+local cache_set = function(self, key, response)
+	local key_material = cipher_key(self)
+	local ttl = math.min(tonumber(response.lease_duration) or 0, self.max_cache_ttl)
+	if not self.cache or not key_material or ttl <= 0 then
+		return nil
 	end
+	local blob = crypto.aes_gcm_encrypt(key_material, json.encode({ data = response.data }), key)
+	if blob then
+		self.cache:set(key, blob, ttl)
+	end
+end
+
+-- Dynamic secrets come with renewable leases, see `renew_leases`
+local track_lease = function(self, response)
+	if response.lease_id and response.lease_id ~= "" and response.renewable then
+		self.leases[response.lease_id] = {
+			duration = response.lease_duration,
+			expires = os.time() + response.lease_duration,
+		}
+	end
+end
+
+local parse_ref = function(path, mount)
 	local secret, field = path:match("^([^#]+)#([^#]+)$")
 	if not secret then
 		secret = path
 	end
-	local url = self.vault_addr .. "/v1/" .. mount .. "/" .. secret
-	local response, err = handle_response(web.request(url, { method = "GET", headers = self.headers }))
-	if not response then
+	return mount or "secret", secret, field
+end
+
+--[[
+    Fetches several secrets at once: `refs` is a list of `{ path, mount }` pairs,
+    where `path` may have a `#field` suffix, just like in `get_secret`.
+    Cached secrets are taken from the cache, the rest are fetched in one batch,
+    each secret only once, no matter how many of its fields are requested.
+    Returns a list of values in the same order as `refs`.
+]]
+local get_secrets = function(self, refs)
+	local results = {}
+	local fetched = {}
+	local requests, request_keys = {}, {}
+	for _, ref in ipairs(refs) do
+		if not ref[1] or type(ref[1]) ~= "string" then
+			return nil, "secret path not provided"
+		end
+		local mount, secret = parse_ref(ref[1], ref[2])
+		local key = cache_key(mount, secret)
+		if fetched[key] == nil then
+			local cached = cache_get(self, key)
+			if cached then
+				fetched[key] = cached.data
+			else
+				fetched[key] = false
+				table.insert(requests, { method = "GET", path = mount .. "/" .. secret })
+				table.insert(request_keys, key)
+			end
+		end
+	end
+	if #requests > 0 then
+		local responses, err = batch(self, requests)
+		if not responses then
+			return nil, err
+		end
+		for i, resp in ipairs(responses) do
+			local response, err = handle_response(resp)
+			if not response then
+				return nil, request_keys[i] .. ": " .. tostring(err)
+			end
+			fetched[request_keys[i]] = response.data
+			cache_set(self, request_keys[i], response)
+			track_lease(self, response)
+		end
+	end
+	for i, ref in ipairs(refs) do
+		local mount, secret, field = parse_ref(ref[1], ref[2])
+		local data = fetched[cache_key(mount, secret)]
+		if field and data and data[field] then
+			results[i] = data[field]
+		else
+			results[i] = data
+		end
+	end
+	return results
+end
+
+local get_secret = function(self, path, mount)
+	if not path or type(path) ~= "string" then
+		return nil, "secret path not provided"
+	end
+	local results, err = get_secrets(self, { { path, mount } })
+	if not results then
 		return nil, err
 	end
-	if field and response.data[field] then
-		return response.data[field]
+	return results[1]
+end
+
+--[[
+    Renews the tracked leases that expire within `margin` seconds
+    (a third of the lease duration by default) in one batch.
+    Leases that can't be renewed are forgotten. Returns the number of
+    leases still tracked.
+]]
+local renew_leases = function(self, margin)
+	local now = os.time()
+	local requests, ids = {}, {}
+	for id, lease in pairs(self.leases) do
+		local lease_margin = margin or math.floor(lease.duration / 3)
+		if lease.expires - now <= lease_margin then
+			local body = json.encode({ lease_id = id, increment = lease.duration })
+			table.insert(requests, { method = "PUT", path = "sys/leases/renew", body = body })
+			table.insert(ids, id)
+		end
+	end
+	if #requests > 0 then
+		local responses, err = batch(self, requests)
+		if not responses then
+			return nil, err
+		end
+		for i, resp in ipairs(responses) do
+			local response = handle_response(resp)
+			if response and tonumber(response.lease_duration) and response.lease_duration > 0 then
+				self.leases[ids[i]].expires = os.time() + response.lease_duration
+			else
+				self.leases[ids[i]] = nil
+			end
+		end
+	end
+	local count = 0
+	for _ in pairs(self.leases) do
+		count = count + 1
+	end
+	return count
+end
+
+-- Forks a process that keeps renewing the tracked leases every `interval` seconds,
+-- until there are none left, or the parent process is gone. Returns its pid.
+local spawn_renewer = function(self, interval)
+	if not next(self.leases) then
+		return nil, "no renewable leases"
+	end
+	local interval = interval or 60
+	local parent = std.ps.getpid()
+	-- The child must not share our TLS session
+	disconnect(self)
+	local pid = std.ps.fork()
+	if pid < 0 then
+		return nil, "failed to fork"
+	end
+	if pid == 0 then
+		while std.ps.kill(parent, 0) do
+			std.sleep(interval)
+			local count = renew_leases(self)
+			if count == 0 then
+				break
+			end
+		end
+		disconnect(self)
+		os.exit(0)
 	end
-	return response.data
+	return pid
 end
 
 local list_secrets = function(self, path, mount)
@@ -78,8 +456,7 @@ local list_secrets = function(self, path, mount)
 	if not path or type(path) ~= "string" then
 		return nil, "secret path not provided"
 	end
-	local url = self.vault_addr .. "/v1/" .. mount .. "/" .. path
-	local response, err = handle_response(web.request(url, { method = "LIST", headers = self.headers }))
+	local response, err = handle_response(request(self, "LIST", mount .. "/" .. path))
 	if not response then
 		return nil, err
 	end
@@ -87,8 +464,7 @@ local list_secrets = function(self, path, mount)
 end
 
 local healthy = function(self)
-	local url = self.vault_addr .. "/v1/sys/health"
-	local response, err = handle_response(web.request(url, { method = "GET", headers = self.headers }))
+	local response, err = handle_response(request(self, "GET", "sys/health"))
 	if not response then
 		return nil, err
 	end
@@ -101,18 +477,27 @@ local healthy = function(self)
 	return nil, "vault is not initialized"
 end
 
-local new = function(vault_addr, token)
+local new = function(vault_addr, token, options)
+	local options = options or {}
 	local client = {
 		vault_addr = vault_addr or os.getenv("VAULT_ADDR") or "127.0.0.1:8200",
 		headers = {
 			["content-type"] = "application/json",
 			["x-vault-token"] = nil,
 		},
+		timeout = options.timeout or 5,
+		cache = options.cache,
+		max_cache_ttl = options.max_cache_ttl or 3600,
+		leases = {},
 		healthy = healthy,
 		login = login,
 		set_token = set_token,
 		get_secret = get_secret,
+		get_secrets = get_secrets,
 		list_secrets = list_secrets,
+		renew_leases = renew_leases,
+		spawn_renewer = spawn_renewer,
+		close = disconnect,
 	}
 	client:set_token(token)
 	return client